@@ -0,0 +1,39 @@
+# Fails the build if a traversal kernel object defines a weak symbol outside of its own namespace.
+# Inline functions shared with the rest of the program are emitted as weak symbols when they are
+# not inlined, e.g. in Debug builds, and the linker keeps whichever copy it sees first. A copy
+# built for a newer instruction set would crash on older CPUs. See FORCE_INLINE in rt_defs.h.
+#
+# Run with cmake -DNM=<nm> -DOBJECT=<kernel object> -DNAMESPACE=<kernel namespace> -P
+
+execute_process(
+    COMMAND ${NM} --defined-only ${OBJECT}
+    OUTPUT_VARIABLE symbols
+    RESULT_VARIABLE result)
+
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "Could not list the symbols of ${OBJECT}")
+endif()
+
+string(REPLACE "\n" ";" symbols "${symbols}")
+
+# Mangled names of everything in the namespace start with _ZN, then the namespace's length and name
+string(LENGTH "${NAMESPACE}" length)
+set(prefix "_ZN${length}${NAMESPACE}")
+
+set(shared "")
+
+foreach(symbol ${symbols})
+    if (symbol MATCHES " [WVu] (.*)$")
+        set(name "${CMAKE_MATCH_1}")
+
+        if (NOT name MATCHES "^${prefix}")
+            set(shared "${shared}\n    ${name}")
+        endif()
+    endif()
+endforeach()
+
+if (NOT shared STREQUAL "")
+    message(FATAL_ERROR "${OBJECT} defines weak symbols outside of ${NAMESPACE}, which the "
+        "linker may pick over the baseline copies. Make them FORCE_INLINE. Names are mangled, "
+        "see c++filt:${shared}")
+endif()
@@ -0,0 +1,404 @@
+/**
+ * @file core/raybuffer.h
+ *
+ * @brief Buffer of rays which are traced together in SIMD packets
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __RAYBUFFER_H
+#define __RAYBUFFER_H
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <kdtree/kdtree.h>
+#include <math/ray.h>
+#include <rt_defs.h>
+#include <util/vector.h>
+
+// TODO: specialized version which doesn't take max distance
+
+/**
+ * @brief Buffer of rays which belong to a wavefront of paths. Rays are appended as they are
+ * generated, then binned by direction octant and traced in SIMD packets or ray streams when
+ * the buffer is flushed. The hit and miss functions are template parameters, so they are inlined into the
+ * packet loop instead of being called through a type-erased function object for every ray.
+ * The packet loop is instantiated for each supported SIMD width, and the width is chosen when
+ * the buffer is created.
+ */
+class RT_EXPORT RayBuffer {
+private:
+
+    const KDTree *tree;
+
+    // Rays in the order they were pushed
+    util::vector<unsigned int, 16> paths;
+    util::vector<float3, 16>       weights;
+    util::vector<float, 16>        origins[3];
+    util::vector<float, 16>        directions[3];
+    util::vector<float, 16>        maxDists;
+    util::vector<uint8_t, 16>      octants;
+
+    // Rays sorted by direction octant, so that every packet has the same direction signs.
+    // Each octant starts on a multiple of the packet width so packets can be loaded directly.
+    util::vector<unsigned int, 16> sortedPaths;
+    util::vector<float3, 16>       sortedWeights;
+    util::vector<float, SIMD_MAX * 4> sortedOrigins[3];
+    util::vector<float, SIMD_MAX * 4> sortedDirections[3];
+    util::vector<float, SIMD_MAX * 4> sortedMaxDists;
+
+    size_t                         capacity;
+    int                            width;    //!< Number of rays in each packet
+    size_t                         begin[8]; //!< First sorted ray in each octant
+    size_t                         end[8];   //!< One past the last sorted ray in each octant
+
+    KDStreamScratch               *streamScratch; //!< Allocated by the first stream flush
+    KDLaneStats                    laneStats;
+
+    /**
+     * @brief Bin the pushed rays by octant into the sorted arrays and clear the pushed rays.
+     * The last packet of each octant is padded with copies of its last ray, so that it can be
+     * traced like a full packet and the extra lanes masked off afterwards.
+     */
+    void sort();
+
+    /**
+     * @brief Trace the sorted rays in packets of N rays. See flush().
+     */
+    template<unsigned int N, typename HitFunc, typename MissFunc>
+    size_t flushPackets(bool anyCollision, HitFunc && hitFunc, MissFunc && missFunc);
+
+    /**
+     * @brief Trace the sorted rays in streams, N rays at a time. See flush().
+     */
+    template<unsigned int N, typename HitFunc, typename MissFunc>
+    size_t flushStreams(bool anyCollision, HitFunc && hitFunc, MissFunc && missFunc);
+
+    /**
+     * @brief Trace the sorted rays in packets of N rays with occlusion queries. See
+     * flushOcclusion().
+     */
+    template<unsigned int N, typename HitFunc, typename MissFunc>
+    size_t flushOcclusionPackets(HitFunc && hitFunc, MissFunc && missFunc);
+
+public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param[in] tree     Tree to trace rays against
+     * @param[in] capacity Maximum number of rays pushed between flushes
+     * @param[in] width    Number of rays in each packet. Must be 4, 8 or 16, and supported by
+     *                     the active traversal kernels. See kdtree/kdkernels.h.
+     */
+    RayBuffer(const KDTree & tree, size_t capacity, int width = SIMD);
+
+    ~RayBuffer();
+
+    RayBuffer(const RayBuffer & copy) = delete;
+    RayBuffer & operator=(const RayBuffer & copy) = delete;
+
+    /**
+     * @brief Change the tree rays are traced against. Must not be called during a flush.
+     */
+    inline void setTree(const KDTree & tree) {
+        this->tree = &tree;
+    }
+
+    /**
+     * @brief Get the number of rays waiting to be traced
+     */
+    inline size_t size() const {
+        return paths.size();
+    }
+
+    /**
+     * @brief Get the SIMD lane utilisation of triangle tests since the last call to
+     * clearLaneStats()
+     */
+    inline const KDLaneStats & getLaneStats() const {
+        return laneStats;
+    }
+
+    inline void clearLaneStats() {
+        laneStats = KDLaneStats();
+    }
+
+    /**
+     * @brief Add a ray to the buffer
+     *
+     * @param[in] ray     Ray
+     * @param[in] path    Index of the path the ray belongs to
+     * @param[in] weight  Path throughput
+     * @param[in] maxDist Maximum intersection distance
+     */
+    inline void push(const Ray & ray, unsigned int path, const float3 & weight, float maxDist) {
+        assert(paths.size() < capacity);
+
+        int c = (signbit(ray.direction.x) << 2) | (signbit(ray.direction.y) << 1) | (signbit(ray.direction.z) << 0);
+
+        paths.push_back_inbounds(path);
+        weights.push_back_inbounds(weight);
+        octants.push_back_inbounds((uint8_t)c);
+
+        origins[0].push_back_inbounds(ray.origin.x);
+        origins[1].push_back_inbounds(ray.origin.y);
+        origins[2].push_back_inbounds(ray.origin.z);
+
+        directions[0].push_back_inbounds(ray.direction.x);
+        directions[1].push_back_inbounds(ray.direction.y);
+        directions[2].push_back_inbounds(ray.direction.z);
+
+        maxDists.push_back_inbounds(maxDist);
+    }
+
+    /**
+     * @brief Trace every ray in the buffer and empty it. The hit and miss functions may push
+     * new rays into this buffer, which are traced by the next flush.
+     *
+     * @param[in] anyCollision Whether any collision is enough, e.g. for shadow rays
+     * @param[in] stream       Whether to trace streams of up to KD_STREAM_MAX_RAYS rays with
+     *                         KDTree::intersectStream() instead of fixed packets. Streams
+     *                         suit incoherent rays.
+     * @param[in] hitFunc      Called as hitFunc(ray, path, weight, maxDist, collision)
+     * @param[in] missFunc     Called as missFunc(ray, path, weight, maxDist)
+     *
+     * @return Number of packets or streams traced
+     */
+    template<typename HitFunc, typename MissFunc>
+    size_t flush(bool anyCollision, bool stream, HitFunc && hitFunc, MissFunc && missFunc);
+
+    /**
+     * @brief Trace every ray in the buffer with KDTree::occludedPacket() and empty it. Only
+     * whether each ray is blocked is found, which is cheaper than finding the closest hit and
+     * is all that opaque shadow rays need. The hit and miss functions may push new rays into
+     * this buffer, which are traced by the next flush.
+     *
+     * @param[in] hitFunc  Called as hitFunc(ray, path, weight, maxDist, occluder) for blocked
+     *                     rays, where occluder is the ID of a triangle blocking the ray
+     * @param[in] missFunc Called as missFunc(ray, path, weight, maxDist) for visible rays
+     *
+     * @return Number of packets traced
+     */
+    template<typename HitFunc, typename MissFunc>
+    size_t flushOcclusion(HitFunc && hitFunc, MissFunc && missFunc);
+};
+
+template<typename HitFunc, typename MissFunc>
+size_t RayBuffer::flush(bool anyCollision, bool stream, HitFunc && hitFunc, MissFunc && missFunc) {
+    sort();
+
+    if (stream) {
+        if (!streamScratch)
+            streamScratch = new KDStreamScratch();
+
+        switch (width) {
+        case 16:
+            return flushStreams<16>(anyCollision, hitFunc, missFunc);
+        case 8:
+            return flushStreams<8>(anyCollision, hitFunc, missFunc);
+        default:
+            return flushStreams<4>(anyCollision, hitFunc, missFunc);
+        }
+    }
+
+    switch (width) {
+    case 16:
+        return flushPackets<16>(anyCollision, hitFunc, missFunc);
+    case 8:
+        return flushPackets<8>(anyCollision, hitFunc, missFunc);
+    default:
+        return flushPackets<4>(anyCollision, hitFunc, missFunc);
+    }
+}
+
+template<unsigned int N, typename HitFunc, typename MissFunc>
+size_t RayBuffer::flushPackets(bool anyCollision, HitFunc && hitFunc, MissFunc && missFunc) {
+    size_t numPackets = 0;
+
+    // Note: rays now have same sign bits in each direction
+
+    for (int i = 0; i < 8; i++) {
+        for (size_t j = begin[i]; j < end[i]; j += N) {
+            PacketCollision<N> result;
+
+            const vector<float, N> (&origin)[3] = {
+                *(vector<float, N> *)&sortedOrigins[0][j],
+                *(vector<float, N> *)&sortedOrigins[1][j],
+                *(vector<float, N> *)&sortedOrigins[2][j]
+            };
+
+            const vector<float, N> (&direction)[3] = {
+                *(vector<float, N> *)&sortedDirections[0][j],
+                *(vector<float, N> *)&sortedDirections[1][j],
+                *(vector<float, N> *)&sortedDirections[2][j]
+            };
+
+            // Max dist is unused for primary rays
+            const vector<float, N> & maxDist = *(vector<float, N> *)&sortedMaxDists[j]; // TODO: does passing these as args work better?
+
+            vector<bmask, N> hit = tree->intersectPacket(
+                origin, direction, maxDist, anyCollision, result, laneStats);
+
+            numPackets++;
+
+            // Lanes past the end of the octant are padding
+            int active = (int)std::min((size_t)N, end[i] - j);
+
+            for (int k = 0; k < active; k++) {
+                Ray ray;
+
+                ray.origin[0] = sortedOrigins[0][j + k];
+                ray.origin[1] = sortedOrigins[1][j + k];
+                ray.origin[2] = sortedOrigins[2][j + k];
+
+                ray.direction[0] = sortedDirections[0][j + k];
+                ray.direction[1] = sortedDirections[1][j + k];
+                ray.direction[2] = sortedDirections[2][j + k];
+
+                float maxDist = sortedMaxDists[j + k];
+                unsigned int path = sortedPaths[j + k];
+                float3 weight = sortedWeights[j + k];
+
+                if (hit[k]) {
+                    Collision collision;
+
+                    collision.beta = result.beta[k];
+                    collision.gamma = result.gamma[k];
+                    collision.distance = result.distance[k];
+                    collision.triangle_id = result.triangle_id[k];
+
+                    hitFunc(ray, path, weight, maxDist, collision);
+                }
+                else {
+                    missFunc(ray, path, weight, maxDist);
+                }
+            }
+        }
+    }
+
+    return numPackets;
+}
+
+template<unsigned int N, typename HitFunc, typename MissFunc>
+size_t RayBuffer::flushStreams(bool anyCollision, HitFunc && hitFunc, MissFunc && missFunc) {
+    size_t numStreams = 0;
+
+    bool hit[KD_STREAM_MAX_RAYS];
+    Collision result[KD_STREAM_MAX_RAYS];
+
+    // Each octant is split into streams. Padding is not needed, because streams gather their
+    // own SIMD vectors.
+    for (int i = 0; i < 8; i++) {
+        for (size_t j = begin[i]; j < end[i]; j += KD_STREAM_MAX_RAYS) {
+            KDRayStream stream;
+
+            for (int k = 0; k < 3; k++) {
+                stream.origin[k] = &sortedOrigins[k][j];
+                stream.direction[k] = &sortedDirections[k][j];
+            }
+
+            stream.maxDist = &sortedMaxDists[j];
+            stream.count = (int)std::min((size_t)KD_STREAM_MAX_RAYS, end[i] - j);
+
+            tree->intersectStream<N>(stream, anyCollision, *streamScratch, hit, result, laneStats);
+
+            numStreams++;
+
+            for (int k = 0; k < stream.count; k++) {
+                Ray ray;
+
+                ray.origin[0] = sortedOrigins[0][j + k];
+                ray.origin[1] = sortedOrigins[1][j + k];
+                ray.origin[2] = sortedOrigins[2][j + k];
+
+                ray.direction[0] = sortedDirections[0][j + k];
+                ray.direction[1] = sortedDirections[1][j + k];
+                ray.direction[2] = sortedDirections[2][j + k];
+
+                float maxDist = sortedMaxDists[j + k];
+                unsigned int path = sortedPaths[j + k];
+                float3 weight = sortedWeights[j + k];
+
+                if (hit[k])
+                    hitFunc(ray, path, weight, maxDist, result[k]);
+                else
+                    missFunc(ray, path, weight, maxDist);
+            }
+        }
+    }
+
+    return numStreams;
+}
+
+template<typename HitFunc, typename MissFunc>
+size_t RayBuffer::flushOcclusion(HitFunc && hitFunc, MissFunc && missFunc) {
+    sort();
+
+    switch (width) {
+    case 16:
+        return flushOcclusionPackets<16>(hitFunc, missFunc);
+    case 8:
+        return flushOcclusionPackets<8>(hitFunc, missFunc);
+    default:
+        return flushOcclusionPackets<4>(hitFunc, missFunc);
+    }
+}
+
+template<unsigned int N, typename HitFunc, typename MissFunc>
+size_t RayBuffer::flushOcclusionPackets(HitFunc && hitFunc, MissFunc && missFunc) {
+    size_t numPackets = 0;
+
+    for (int i = 0; i < 8; i++) {
+        for (size_t j = begin[i]; j < end[i]; j += N) {
+            const vector<float, N> (&origin)[3] = {
+                *(vector<float, N> *)&sortedOrigins[0][j],
+                *(vector<float, N> *)&sortedOrigins[1][j],
+                *(vector<float, N> *)&sortedOrigins[2][j]
+            };
+
+            const vector<float, N> (&direction)[3] = {
+                *(vector<float, N> *)&sortedDirections[0][j],
+                *(vector<float, N> *)&sortedDirections[1][j],
+                *(vector<float, N> *)&sortedDirections[2][j]
+            };
+
+            const vector<float, N> & maxDist = *(vector<float, N> *)&sortedMaxDists[j];
+
+            vector<int, N> occluder;
+
+            vector<bmask, N> hit = tree->occludedPacket(origin, direction, maxDist, occluder, laneStats);
+
+            numPackets++;
+
+            // Lanes past the end of the octant are padding
+            int active = (int)std::min((size_t)N, end[i] - j);
+
+            for (int k = 0; k < active; k++) {
+                Ray ray;
+
+                ray.origin[0] = sortedOrigins[0][j + k];
+                ray.origin[1] = sortedOrigins[1][j + k];
+                ray.origin[2] = sortedOrigins[2][j + k];
+
+                ray.direction[0] = sortedDirections[0][j + k];
+                ray.direction[1] = sortedDirections[1][j + k];
+                ray.direction[2] = sortedDirections[2][j + k];
+
+                float maxDist = sortedMaxDists[j + k];
+                unsigned int path = sortedPaths[j + k];
+                float3 weight = sortedWeights[j + k];
+
+                if (hit[k])
+                    hitFunc(ray, path, weight, maxDist, (unsigned int)occluder[k]);
+                else
+                    missFunc(ray, path, weight, maxDist);
+            }
+        }
+    }
+
+    return numPackets;
+}
+
+#endif
@@ -10,11 +10,15 @@
 #define __RAYTRACER_H
 
 #include <atomic>
+#include <condition_variable>
 #include <core/raytracersettings.h>
+#include <core/samplegenerator.h>
+#include <core/tilescheduler.h>
 #include <core/scene.h>
 #include <image/image.h>
 #include <kdtree/kdsahbuilder.h>
 #include <kdtree/kdtree.h>
+#include <mutex>
 #include <rt_defs.h>
 #include <thread>
 #include <util/timer.h>
@@ -69,9 +73,43 @@ static const char *RaytracerStatNames[] = {
 	"Stat Count"
 };
 
-// TODO: align this to prevent false sharing, add option to turn it off
+enum RaytracerCounter {
+	RaytracerCounterPrimaryRays,
+	RaytracerCounterSecondaryRays,
+	RaytracerCounterShadowRays,
+	RaytracerCounterPackets,
+	RaytracerCounterStreams,
+	RaytracerCounterLeafTests,
+	RaytracerCounterLanes,
+	RaytracerCounterActiveLanes,
+	RaytracerCounterTiles,
+	RaytracerCounterCount
+};
+
+static const char *RaytracerCounterNames[] = {
+	"Primary Rays",
+	"Secondary Rays",
+	"Shadow Rays",
+	"Packets",
+	"Streams",
+	"Leaf Tests",
+	"Lanes",
+	"Active Lanes",
+	"Tiles",
+	"Counter Count"
+};
+
 struct RaytracerStats {
 	uint64_t stat[RaytracerStatCount];
+	uint64_t counter[RaytracerCounterCount];
+};
+
+/**
+ * @brief Statistics for one worker thread, padded to a cache line so that workers updating
+ * their own statistics do not invalidate each other's cache lines
+ */
+struct ALIGN(CACHE_LINE) WorkerStats {
+	RaytracerStats stats;
 };
 
 struct StatTimer {
@@ -104,27 +142,95 @@ private:
     util::vector<Triangle, 16> triangles;
     std::vector<Material *> materials;
 
-    Image<float, 4>         *output;
+    Image<float, 4>         *output;          //!< Resolved image, updated as tiles finish
+    Image<float, 4>         *accumulation;    //!< Sum of sample radiance, with sample count in W
+    Image<float, 2>         *moments;         //!< Running mean and sum of squared deviations of sample luminance
+    std::atomic<uint32_t>   *blockVersions;   //!< Seqlock version of each block of the output, odd while being written
+    int                      blocksW;         //!< Number of output blocks horizontally
+    int                      blocksH;         //!< Number of output blocks vertically
     KDTree                   tree;            //!< Ray/triangle intersection acceleration tree
+    KDTree                   previewTree;     //!< Median split tree traced while the tree is built
+    std::atomic<const KDTree *> activeTree;   //!< Tree workers trace against, read at the start of each wavefront
+    std::thread              treeBuilder;     //!< Builds the tree in the background, when rendering progressively
     KDTreeStats  _treeStats;           //!< Tree statistics
     Scene                   *scene;           //!< Scene to render
-    int                      nBlocks;         //!< Total number of blocks to render
-    int                      nBlocksW;        //!< Number of blocks horizontally
-    int                      nBlocksH;        //!< Number of blocks vertically
+    TileScheduler           *scheduler;       //!< Hands out tiles to worker threads
     bool                     shouldShutdown;  //!< Whether to stop rendering
     std::atomic_int          numThreadsAlive; //!< Number of worker threads running
-    std::atomic_int          currBlockID;     //!< ID of next block to render
+    int                      numWorkers;      //!< Number of worker threads started
+    int                      numPasses;       //!< Number of progressive passes
+    std::atomic_int          passesCompleted; //!< Number of passes finished by every worker
+    std::mutex               passLock;        //!< Protects the pass barrier
+    std::condition_variable  passCond;        //!< Signalled when a pass finishes
+    int                      passArrived;     //!< Number of workers waiting for the pass to end
+    int                      passGeneration;  //!< Incremented each time the barrier opens
+    int                      passSamples;     //!< Number of samples per pixel in the current pass
+    bool                     passAdaptive;    //!< Whether the current pass only samples active pixels
+    bool                     morePasses;      //!< Whether there is another pass to render
+    std::vector<uint8_t>     pixelActive;     //!< Whether each pixel is sampled in an adaptive pass
+    int64_t                  adaptiveBudget;  //!< Number of samples the adaptive passes may still add
     threadVector             workers;         //!< Worker threads
     RaytracerSettings        settings;        //!< Raytracing settings
-	std::vector<RaytracerStats> workerStats;
+    SampleGenerator         *sampleGenerator; //!< Generates per-pixel sample values
+    WorkerStats             *workerStats;     //!< Statistics for each worker thread
+    Timer                    renderTimer;     //!< Started when the worker threads start
+    float                    renderSeconds;   //!< Time taken by the worker threads, once finished
 
     /**
      * @brief Entry point for a worker thread
      */
     void worker_thread(int idx, int numThreads, RaytracerStats *stats);
 
+    /**
+     * @brief Wait for every worker to finish the current pass, then start the next one
+     *
+     * @return Whether there is another pass to render
+     */
+    bool endPass();
+
+    /**
+     * @brief Get the number of regular passes, which split the samples evenly
+     */
+    int getNumPasses() const;
+
+    /**
+     * @brief Get the most samples one pixel can take, if it is chosen by every adaptive pass.
+     * Sample generators precompute this many samples.
+     */
+    int getMaxPixelSamples() const;
+
+    /**
+     * @brief Decide which samples to take in a pass and hand out its tiles. Must not be
+     * called while workers are rendering.
+     *
+     * @param[in] pass Pass index. Adaptive passes follow the regular passes.
+     *
+     * @return False if there is nothing left to render
+     */
+    bool preparePass(int pass);
+
+    /**
+     * @brief Copy a resolved tile into the output image. Each block of the output is locked
+     * while it is written, so snapshot() never sees a partially written block.
+     *
+     * @param[in] tile   Tile
+     * @param[in] pixels Resolved pixels of the tile, in scanline order
+     */
+    void publishTile(const Tile & tile, const float4 *pixels);
+
     void addMeshesFromScene();
 
+    /**
+     * @brief Pick the KD-tree builder parameters which trace a fixed sample of camera and
+     * diffuse bounce rays fastest on this machine, and store them in the settings. Searches
+     * one parameter at a time, keeping the best value of each. If a cache directory is set,
+     * the result is saved there and reused for the same scene and starting parameters.
+     *
+     * @return True if the tree was built while tuning and is left in the tree member, or
+     *         false if the parameters came from the cache and the tree still has to be built
+     */
+    bool autotuneKDParams();
+
 public:
 
     /**
@@ -149,13 +255,57 @@ public:
      */
     bool finished();
 
+    /**
+     * @brief Get the number of progressive passes that have completed. The output image
+     * contains the resolved result of at least this many passes.
+     */
+    int getPassesCompleted();
+
+    /**
+     * @brief Get the time the worker threads took to render, not including building the
+     * tree. Only valid once rendering has finished.
+     */
+    float getRenderSeconds();
+
+    /**
+     * @brief Get the number of rays traced together in each packet
+     */
+    int getSIMDWidth();
+
+    /**
+     * @brief Build the scene's KD-tree with several builders, and print their build times,
+     * tree SAH costs, and whether they produced the same tree as the first builder. If
+     * clipping is enabled, each builder is also run with clipping, and compared against its
+     * own unclipped tree. Does not affect the tree used for rendering.
+     */
+    void compareKDBuilders(const std::vector<KDBuilderType> & types);
+
+    /**
+     * @brief Build the scene's KD-tree with each node layout, and trace one camera ray per
+     * pixel through it on the calling thread. Prints the ray throughput, and the node and
+     * triangle cache lines each ray reads and misses in a model of an L1 cache. See
+     * kdtree/kdbenchmark.h. Does not affect the tree used for rendering.
+     */
+    void benchmarkKDTraversal();
+
+    /**
+     * @brief Copy the output image while rendering is in progress. Does not block workers,
+     * and never copies a partially published tile.
+     *
+     * @param[out] image Image the same size as the output
+     */
+    void snapshot(Image<float, 4> *image);
+
     /**
      * @brief Shutdown the raytracer
      *
-     * @param[in] waitUntilFinished Whether to wait until the raytracer has finished rendering
-     *                              (true) or to abort immediately (false)
+     * @param[in]  waitUntilFinished Whether to wait until the raytracer has finished rendering
+     *                               (true) or to abort immediately (false)
+     * @param[out] stats             If not null, statistics summed over every worker
+     * @param[out] threadStats       If not null, statistics for each worker
      */
-    void shutdown(bool waitUntilFinished, RaytracerStats *stats = NULL);
+    void shutdown(bool waitUntilFinished, RaytracerStats *stats = NULL,
+        std::vector<RaytracerStats> *threadStats = NULL);
 
     bool intersect(float2 uv, Collision & result);
 };
@@ -164,6 +314,18 @@ inline bool Raytracer::finished() {
     return numThreadsAlive == 0;
 }
 
+inline int Raytracer::getPassesCompleted() {
+    return passesCompleted;
+}
+
+inline float Raytracer::getRenderSeconds() {
+    return renderSeconds;
+}
+
+inline int Raytracer::getSIMDWidth() {
+    return settings.simdWidth;
+}
+
 #endif
 
 #if 0
@@ -9,7 +9,11 @@
 #ifndef __RAYTRACERSETTINGS_H
 #define __RAYTRACERSETTINGS_H
 
+#include <core/samplegenerator.h>
+#include <core/tilescheduler.h>
+#include <kdtree/kdbuilder.h>
 #include <rt_defs.h>
+#include <string>
 
 #define MAX_SHADOW_SAMPLES 64
 #define MAX_AO_SAMPLES     64
@@ -24,12 +28,103 @@ struct RT_EXPORT RaytracerSettings {
     /** @brief Square root of number of samples to take per pixel */
     int pixelSamples;
 
+    /**
+     * @brief Number of progressive passes. Each pass adds a subset of the samples to every
+     * pixel and updates the output image, so a complete (noisy) image is available after the
+     * first pass.
+     */
+    int numPasses;
+
+    /**
+     * @brief Maximum number of adaptive passes to render after the regular passes. Each one
+     * adds samples only to pixels whose estimated relative error is above adaptiveThreshold,
+     * and only renders tiles that contain such pixels.
+     */
+    int adaptivePasses;
+
+    /**
+     * @brief Relative error (standard error of the mean luminance over the mean luminance)
+     * below which a pixel is considered converged
+     */
+    float adaptiveThreshold;
+
+    /**
+     * @brief Total number of samples the adaptive passes may add, as a fraction of the
+     * samples taken by the regular passes. When there is not enough budget left for every
+     * unconverged pixel, the pixels with the largest error are sampled first.
+     */
+    float adaptiveBudget;
+
     /** @brief Maximum recursion depth */
     int maxDepth;
 
     /** @brief Number of threads to use, or 0 to use all available hardware threads */
     int numThreads;
 
+    /** @brief Seed for random number generation. Renders with the same seed are identical. */
+    unsigned int seed;
+
+    /** @brief Sample generator used for pixel, lens, light, and bounce samples */
+    SampleGeneratorType sampler;
+
+    /** @brief Width and height of the tiles handed out to worker threads */
+    int tileSize;
+
+    /**
+     * @brief Number of paths each worker traces together. Workers gather tiles until their
+     * wavefront is full, then trace each generation of rays for all of them at once, so the
+     * later generations still form large batches.
+     */
+    int waveSize;
+
+    /** @brief Order in which tiles are rendered */
+    TileOrder tileOrder;
+
+    /** @brief Whether to pin each worker thread to its own logical CPU */
+    bool pinThreads;
+
+    /** @brief Number of rays traced together in each packet: 4, 8 or 16, up to the traversal kernels' maxWidth */
+    int simdWidth;
+
+    /**
+     * @brief Whether to trace secondary and shadow rays as streams, which are split at each
+     * KD-tree node and compacted into full SIMD vectors, instead of as fixed packets. Primary
+     * rays are coherent and always use packets. See KDTree::intersectStream().
+     */
+    bool streamTraversal;
+
+    /**
+     * @brief Whether shadow rays are traced with occlusion queries, which stop at the first hit
+     * instead of finding the closest one. Rays blocked by a triangle which might let light
+     * through are traced again to find the closest hit. Enabled by default. See
+     * KDTree::occludedPacket().
+     */
+    bool occlusionQueries;
+
+    /** @brief Algorithm used to build the KD-tree */
+    KDBuilderType kdBuilder;
+
+    /** @brief Parameters for the KD-tree builder */
+    KDBuilderParams kdParams;
+
+    /**
+     * @brief Whether to pick the KD-tree builder parameters by timing traversal of a sample
+     * of rays before rendering. The result is cached in kdCacheDir, if it is set.
+     */
+    bool kdAutotune;
+
+    /**
+     * @brief Whether to start rendering with a quickly built median split KD-tree, and switch
+     * to the tree built by kdBuilder once it is finished in the background
+     */
+    bool kdProgressive;
+
+    /**
+     * @brief Directory to cache built KD-trees in, keyed by the scene's triangles and the
+     * builder settings. Empty to always build the tree.
+     */
+    std::string kdCacheDir;
+
     RaytracerSettings();
 };
 
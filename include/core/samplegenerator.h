@@ -0,0 +1,223 @@
+/**
+ * @file core/samplegenerator.h
+ *
+ * @brief Sample generators which hand out per-pixel, per-dimension sample values. Low
+ * discrepancy generators converge to a given noise level with fewer samples per pixel than
+ * independent random samples.
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __SAMPLEGENERATOR_H
+#define __SAMPLEGENERATOR_H
+
+#include <math/random.h>
+#include <rt_defs.h>
+#include <vector>
+
+// TODO: Blue noise (pmj02bn) variant of the PMJ02 tables
+// TODO: Sobol dimensions beyond the first two could use real higher dimensional direction
+//       numbers instead of independently shuffled 2D patterns
+
+enum SampleGeneratorType {
+    SampleGeneratorRandom,
+    SampleGeneratorSobol,
+    SampleGeneratorPMJ02,
+    SampleGeneratorTypeCount
+};
+
+static const char *SampleGeneratorTypeNames[] = {
+    "random",
+    "sobol",
+    "pmj02",
+    "Type Count"
+};
+
+/**
+ * @brief Base class for sample generators. A sample is identified by a pixel, a sample index
+ * within that pixel, and a dimension. Samples are a pure function of those values and the
+ * seed, so generators are immutable after construction and can be shared between threads.
+ *
+ * Dimensions are scalar: a 1D sample consumes one dimension and a 2D sample consumes two.
+ * Each 1D or 2D sample is drawn from an independently scrambled pattern, so only values
+ * requested together as one 2D sample are stratified jointly.
+ */
+class RT_EXPORT SampleGenerator {
+protected:
+
+    uint32_t seed; //!< Seed mixed into every sample
+
+    /**
+     * @brief Hash the pixel, dimension and seed into a 32-bit pattern seed
+     */
+    inline uint32_t hashPattern(const int2 & pixel, uint32_t dimension) const {
+        uint64_t key = hash64(((uint64_t)(uint32_t)pixel.x << 32) | (uint32_t)pixel.y,
+            ((uint64_t)dimension << 32) | seed);
+
+        return (uint32_t)(key >> 32);
+    }
+
+    /**
+     * @brief Convert a 32-bit fixed point value to a float in [0, 1)
+     */
+    static inline float toFloat(uint32_t x) {
+        return (float)(x >> 8) * (1.0f / 16777216.0f);
+    }
+
+public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param[in] seed Seed mixed into every sample
+     */
+    SampleGenerator(uint32_t seed);
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~SampleGenerator();
+
+    /**
+     * @brief Get a 1D sample in [0, 1)
+     *
+     * @param[in] pixel     Pixel coordinates
+     * @param[in] index     Sample index within the pixel
+     * @param[in] dimension First dimension of the sample
+     */
+    virtual float get1D(const int2 & pixel, uint32_t index, uint32_t dimension) const = 0;
+
+    /**
+     * @brief Get a 2D sample in [0, 1)^2
+     *
+     * @param[in] pixel     Pixel coordinates
+     * @param[in] index     Sample index within the pixel
+     * @param[in] dimension First dimension of the sample
+     */
+    virtual float2 get2D(const int2 & pixel, uint32_t index, uint32_t dimension) const = 0;
+
+    /**
+     * @brief Create a sample generator
+     *
+     * @param[in] type            Generator type
+     * @param[in] seed            Seed mixed into every sample
+     * @param[in] samplesPerPixel Number of samples that will be taken per pixel. Generators
+     *                            may precompute this many samples.
+     */
+    static SampleGenerator *create(SampleGeneratorType type, uint32_t seed, int samplesPerPixel);
+};
+
+/**
+ * @brief Independent random samples. Useful as a reference for the other generators.
+ */
+class RT_EXPORT RandomSampleGenerator : public SampleGenerator {
+public:
+
+    RandomSampleGenerator(uint32_t seed);
+
+    virtual float get1D(const int2 & pixel, uint32_t index, uint32_t dimension) const override;
+
+    virtual float2 get2D(const int2 & pixel, uint32_t index, uint32_t dimension) const override;
+};
+
+/**
+ * @brief Owen scrambled Sobol samples, using the hash based scrambling and shuffling from
+ * Burley, "Practical Hash-based Owen Scrambling" (2020). Every power of two prefix of each 2D
+ * pattern is a (0, m, 2)-net, and there is no limit on the number of samples per pixel.
+ */
+class RT_EXPORT SobolSampleGenerator : public SampleGenerator {
+public:
+
+    SobolSampleGenerator(uint32_t seed);
+
+    virtual float get1D(const int2 & pixel, uint32_t index, uint32_t dimension) const override;
+
+    virtual float2 get2D(const int2 & pixel, uint32_t index, uint32_t dimension) const override;
+};
+
+/**
+ * @brief Progressive multi-jittered (0, 2) samples, from Christensen et al., "Progressive
+ * Multi-Jittered Sample Sequences" (2018). A number of independent sequences are generated up
+ * front. Each pixel and dimension picks one of them and randomizes it with a per-bit XOR
+ * scramble, which preserves the stratification. Samples past the end of the tables fall back
+ * to independent random values.
+ */
+class RT_EXPORT PMJ02SampleGenerator : public SampleGenerator {
+private:
+
+    int                   numSamples; //!< Number of samples in each table, a power of two
+    std::vector<uint32_t> tables;     //!< Interleaved 32-bit fixed point X and Y values
+
+    /**
+     * @brief Look up a scrambled table entry as 32-bit fixed point values
+     */
+    void lookup(const int2 & pixel, uint32_t index, uint32_t dimension, uint32_t & x, uint32_t & y) const;
+
+public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param[in] seed       Seed used to generate the tables and mixed into every sample
+     * @param[in] numSamples Minimum number of samples per table. Tables hold at most
+     *                       PMJ02_MAX_SAMPLES (4096) samples. Later samples are independent random
+     *                       values, which are not stratified.
+     */
+    PMJ02SampleGenerator(uint32_t seed, int numSamples);
+
+    virtual float get1D(const int2 & pixel, uint32_t index, uint32_t dimension) const override;
+
+    virtual float2 get2D(const int2 & pixel, uint32_t index, uint32_t dimension) const override;
+};
+
+/**
+ * @brief Samples for one segment of a path. Dimensions are given relative to a base
+ * dimension, so each bounce of a path can use a fixed layout of dimensions offset by a
+ * per-bounce base.
+ */
+class PathSampler {
+private:
+
+    const SampleGenerator *generator;
+    int2                   pixel;
+    uint32_t               index;
+    uint32_t               base;
+
+public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param[in] generator Sample generator
+     * @param[in] pixel     Pixel coordinates
+     * @param[in] index     Sample index within the pixel
+     * @param[in] base      First dimension used by this path segment
+     */
+    PathSampler(const SampleGenerator *generator, const int2 & pixel, uint32_t index, uint32_t base)
+        : generator(generator),
+          pixel(pixel),
+          index(index),
+          base(base)
+    {
+    }
+
+    inline float get1D(uint32_t dimension) const {
+        return generator->get1D(pixel, index, base + dimension);
+    }
+
+    inline float2 get2D(uint32_t dimension) const {
+        return generator->get2D(pixel, index, base + dimension);
+    }
+
+    /**
+     * @brief Get a 3D sample, made of a 2D sample followed by a 1D sample
+     */
+    inline float3 get3D(uint32_t dimension) const {
+        float2 xy = get2D(dimension);
+        float z = get1D(dimension + 2);
+
+        return float3(xy.x, xy.y, z);
+    }
+};
+
+#endif
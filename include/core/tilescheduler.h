@@ -0,0 +1,143 @@
+/**
+ * @file core/tilescheduler.h
+ *
+ * @brief Work-stealing scheduler which hands out image tiles to worker threads
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __TILESCHEDULER_H
+#define __TILESCHEDULER_H
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <rt_defs.h>
+#include <util/align.h>
+#include <vector>
+
+// TODO: Use measured per-tile cost from a previous pass to decide which tiles to split
+// TODO: Lock-free deques, if locking ever shows up in profiles
+
+enum TileOrder {
+    TileOrderScanline,
+    TileOrderMorton,
+    TileOrderHilbert,
+    TileOrderCount
+};
+
+static const char *TileOrderNames[] = {
+    "scanline",
+    "morton",
+    "hilbert",
+    "Order Count"
+};
+
+/**
+ * @brief Rectangle of pixels [x0, x1) x [y0, y1)
+ */
+struct Tile {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+/**
+ * @brief Tile scheduler. Tiles are sorted along a space filling curve and split into one
+ * contiguous run per worker, so each worker renders a compact region of the image and
+ * neighboring tiles stay on the same thread. Workers take tiles from the front of their own
+ * deque. When a deque runs dry, the worker steals from the back of another worker's deque,
+ * trying its neighbors first. Stolen tiles are split into quadrants, which are pushed onto the
+ * thief's deque, so the work at the end of the frame gets finer and the load stays balanced even
+ * when tile costs vary a lot.
+ */
+class RT_EXPORT TileScheduler {
+private:
+
+    struct ALIGN(CACHE_LINE) WorkerQueue {
+        std::mutex       lock;
+        std::deque<Tile> tiles;
+    };
+
+    std::vector<Tile>  tiles;       //!< All tiles, sorted along the curve
+    WorkerQueue       *queues;      //!< Tile deque for each worker
+    int                numWorkers;  //!< Number of workers
+    int                minTileSize; //!< Tiles are not split below this size
+    std::atomic_int    numSteals;   //!< Number of tiles stolen
+    std::atomic_int    numSplits;   //!< Number of tiles split
+
+    bool steal(int worker, Tile & tile);
+
+public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param[in] width      Image width
+     * @param[in] height     Image height
+     * @param[in] tileSize   Initial tile width and height
+     * @param[in] order      Order in which to visit tiles
+     * @param[in] numWorkers Number of worker threads
+     */
+    TileScheduler(int width, int height, int tileSize, TileOrder order, int numWorkers);
+
+    /**
+     * @brief Destructor
+     */
+    ~TileScheduler();
+
+    /**
+     * @brief Get the next tile for a worker
+     *
+     * @param[in]  worker Worker index
+     * @param[out] tile   Tile to render
+     *
+     * @return False if there are no tiles left
+     */
+    bool next(int worker, Tile & tile);
+
+    /**
+     * @brief Hand out every tile again, e.g. for another pass over the image. Must not be
+     * called while workers are taking tiles.
+     */
+    void reset();
+
+    /**
+     * @brief Hand out a subset of the tiles again, e.g. for an adaptive pass. Must not be
+     * called while workers are taking tiles.
+     *
+     * @param[in] active Whether to include each tile, indexed like getTile()
+     */
+    void reset(const std::vector<bool> & active);
+
+    /**
+     * @brief Get the number of tiles the image was divided into, before any splitting
+     */
+    int getNumTiles() const {
+        return (int)tiles.size();
+    }
+
+    /**
+     * @brief Get one of the tiles the image was divided into, in curve order
+     */
+    const Tile & getTile(int i) const {
+        return tiles[i];
+    }
+
+    /**
+     * @brief Get the number of tiles stolen from another worker
+     */
+    int getNumSteals() const {
+        return numSteals;
+    }
+
+    /**
+     * @brief Get the number of tiles split after being stolen
+     */
+    int getNumSplits() const {
+        return numSplits;
+    }
+};
+
+#endif
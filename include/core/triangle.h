@@ -11,6 +11,7 @@
 #define __TRIANGLE_H
 
 #include <rt_defs.h>
+#include <math/aabb.h>
 #include <math/ray.h>
 #include <util/vector.h>
 
@@ -86,11 +87,16 @@ struct Triangle {
 };
 
 #if !GPU
-int clip(float3 *input,
-         float3 *output,
-         float   plane,
-         int     axis,
-         int     keep);
+/**
+ * @brief Find the bounds of the part of a triangle inside a box
+ *
+ * @param[in]  tri    Triangle to clip
+ * @param[in]  box    Box to clip against
+ * @param[out] bounds Bounds of the clipped triangle, which are inside the box
+ *
+ * @return False if the triangle does not touch the box
+ */
+bool clipBounds(const Triangle & tri, const AABB & box, AABB & bounds);
 #endif
 
 /**
@@ -116,37 +122,43 @@ struct PacketCollision {
 	vector<float, N> beta;
 	vector<float, N> gamma;
 	vector<int, N> triangle_id;
+
+	FORCE_INLINE PacketCollision() {
+	}
 };
 
+// Number of triangles in a SetupTriangleBlock. Kept at the narrowest single ray test width, so
+// that the layout does not depend on the instruction set, and small leaves carry little padding.
+#define TRIANGLE_BLOCK_SIZE 4
+
 /**
- * @brief Minimal triangle data struct optimized for performance of ray/triangle
- * intersection tests.
+ * @brief Triangle data optimized for ray/triangle intersection tests, for a block of
+ * triangles stored as structures of arrays, so that one ray can be tested against several
+ * triangles at once. Leaves are padded to whole blocks with triangles that are never hit.
+ *
+ * Triangles are stored in Wald's projected form, expanded to three dimensions: the plane
+ * normal is scaled so that its component along the projection axis k is one, and the line
+ * equations have a zero component along k. Packet tests read the two projected components
+ * of a single triangle, and single ray tests use all three components of one block, or of two
+ * consecutive blocks of a leaf for 8 wide tests.
  */
-struct SetupTriangle {
+struct ALIGN(32) SetupTriangleBlock {
 #if defined(WALD_INTERSECTION)
-    float n_u;                //  4 normal.u / normal.k
-    float n_v;                //  4 normal.v / normal.h
-    float n_d;                //  4 constant of plane equation
-    int k;                    //  4 projection axis
+    float        n[3][TRIANGLE_BLOCK_SIZE];        // Normal / normal.k
+    float        n_d[TRIANGLE_BLOCK_SIZE];         // Constant of plane equation
 
     // line equation AC
-    float b_nu;               //  4
-    float b_nv;               //  4
-    float b_d;                //  4
+    float        b[3][TRIANGLE_BLOCK_SIZE];
+    float        b_d[TRIANGLE_BLOCK_SIZE];
 
     // line equation AB
-    float c_nu;               //  4
-    float c_nv;               //  4
-    float c_d;                //  4
-
-    unsigned int triangle_id; //  4
-                              // 44
-#elif defined(MOLLER_TRUMBORE_INTERSECTION)
-    float3    v[0];               // 12
-    float3    e1;               // 12
-    float3    e2;               // 12
-    unsigned int triangle_id; //  4
-                              // 40
+    float        c[3][TRIANGLE_BLOCK_SIZE];
+    float        c_d[TRIANGLE_BLOCK_SIZE];
+
+    int          k[TRIANGLE_BLOCK_SIZE];           // Projection axis
+    unsigned int triangle_id[TRIANGLE_BLOCK_SIZE];
+#else
+#error "Triangle blocks only support WALD_INTERSECTION"
 #endif
 };
 
@@ -204,52 +216,31 @@ inline Vertex Triangle::interpolate(float beta, float gamma) const GLOBAL {
         v[0].uv       * alpha + v[1].uv       * beta + v[2].uv       * gamma);
 }
 
-/**
- * @brief Check for collision between an array of packed triangles and a
- * ray. Returns the closest collision, unless @ref anyCollision is true, in
- * which case returns the first collision (useful for shadow rays).
- *
- * TODO: min and max distance
- *
- * @param[in]  ray          Ray to test against
- * @param[in]  data         Array of packed triangles to test
- * @param[in]  count        Number of triangles to test
- * @param[in]  anyCollision Whether to return the first collision
- * @param[in]  min          Minimum collision distance
- * @param[in]  max          Maximum collision distance
- * @param[out] result       Information about collision, if there was one
- *
- * @return True if there was a collision, or false otherwise
- */
-bool intersects(
-	Ray                    ray, // TODO ref
-	GLOBAL SetupTriangle * data,
-	int                    count,
-	float                  min,
-	float                  max,
-	THREAD Collision     & result);
-
-template<unsigned int N>
-vector<bmask, N> intersectsPacket(
-	THREAD const vector<float, N> (&origin)[3],
-	THREAD const vector<float, N> (&direction)[3],
-	GLOBAL SetupTriangle * data,
-	int                    count,
-	const vector<float, N> & min,
-	const vector<float, N> & max,
-	bool occlusionOnly,
-	THREAD PacketCollision<N>     & result);
+// The ray-triangle intersection kernels live in triangle.inl. See kdtree/kdkernels.h.
 
 #if !GPU
 /**
- * @brief Pack triangle data into setup triangle data
+ * @brief Pack triangle data into setup triangle blocks. The last block is padded.
  *
  * @param[in] triangles     An array of pointers to unpacked triangles
  * @param[in] num_triangles Number of triangles to pack
  */
 void setupTriangles(
-    const util::vector<Triangle, 16> & triangles, 
-    util::vector<SetupTriangle, 16>  & setupTriangles);
+    const util::vector<Triangle, 16>       & triangles,
+    util::vector<SetupTriangleBlock, 32>   & setupTriangles);
+
+/**
+ * @brief Pack a subset of the triangles into setup triangle blocks. The last block is padded.
+ *
+ * @param[in] triangles     Unpacked triangles
+ * @param[in] indices       Indices of the triangles to pack
+ * @param[in] num_indices   Number of triangles to pack
+ */
+void setupTriangles(
+    const util::vector<Triangle, 16>       & triangles,
+    const uint32_t                         * indices,
+    uint32_t                                 num_indices,
+    util::vector<SetupTriangleBlock, 32>   & setupTriangles);
 #endif
 
 #endif
@@ -1,17 +1,52 @@
 #ifndef __TRIANGLE_INL_H
 #define __TRIANGLE_INL_H
 
+// Triangles tested against one ray at a time. Wider tests span consecutive blocks of a leaf.
+#if defined(__AVX__)
+#define TRIANGLE_SIMD 8
+#else
+#define TRIANGLE_SIMD 4
+#endif
+
+static_assert(TRIANGLE_SIMD % TRIANGLE_BLOCK_SIZE == 0, "SIMD vectors must hold whole triangle blocks");
+
+// Stands in for the block after the last one of a leaf. Its normals are zero, so it never hits.
+static const SetupTriangleBlock emptyTriangleBlock = SetupTriangleBlock();
+
 /**
- * @brief Check for collision between an array of packed triangles and a
- * ray. Returns the closest collision, unless @ref anyCollision is true, in
- * which case returns the first collision (useful for shadow rays).
- *
- * TODO: min and max distance
+ * @brief Load the same lane array, e.g. n[0], of two consecutive blocks into one vector. Only
+ * the first block is read when a vector holds one block.
+ */
+#if TRIANGLE_SIMD == 8
+FORCE_INLINE vector<float, 8> loadTriangleLanes(GLOBAL const float *first, GLOBAL const float *second) {
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(first)), _mm_load_ps(second), 1);
+}
+#else
+FORCE_INLINE vector<float, 4> loadTriangleLanes(GLOBAL const float *first, GLOBAL const float *second) {
+	return *(GLOBAL const vector<float, 4> *)first;
+}
+#endif
+
+/**
+ * @brief Get the block following a leaf's block at triangle i, for the upper lanes of a
+ * single ray test
+ */
+FORCE_INLINE GLOBAL const SetupTriangleBlock & nextTriangleBlock(GLOBAL const SetupTriangleBlock *data,
+	int i, int count)
+{
+	if (TRIANGLE_SIMD > TRIANGLE_BLOCK_SIZE && i + TRIANGLE_BLOCK_SIZE < count)
+		return data[i / TRIANGLE_BLOCK_SIZE + 1];
+
+	return emptyTriangleBlock;
+}
+
+/**
+ * @brief Check for collision between an array of packed triangles and a ray. Tests
+ * TRIANGLE_SIMD triangles at a time, and returns the closest collision.
  *
  * @param[in]  ray          Ray to test against
- * @param[in]  data         Array of packed triangles to test
+ * @param[in]  data         Blocks of packed triangles to test
  * @param[in]  count        Number of triangles to test
- * @param[in]  anyCollision Whether to return the first collision
  * @param[in]  min          Minimum collision distance
  * @param[in]  max          Maximum collision distance
  * @param[out] result       Information about collision, if there was one
@@ -19,157 +54,93 @@
  * @return True if there was a collision, or false otherwise
  */
 bool intersects(
-                Ray                    ray,
-                GLOBAL SetupTriangle * data,
-                int                    count,
-                float                  min,
-                float                  max,
-                THREAD Collision     & result)
+                Ray                         ray,
+                GLOBAL SetupTriangleBlock * data,
+                int                         count,
+                float                       min,
+                float                       max,
+                THREAD Collision          & result)
 {
-#if defined(WALD_INTERSECTION)
-	// TODO: go back to early exit version
-#if 0
-    // http://www.sci.utah.edu/~wald/PhD/wald_phd.pdf
-    bool found = false;
-    const int mod_table[5] = { 0, 1, 2, 0, 1 };
-    
-    for (int i = 0; i < count; i++) {
-        GLOBAL const SetupTriangle & tri = data[i];
-        
-        int u = mod_table[tri.k + 1];
-        int v = mod_table[tri.k + 2];
-        
-        float dot = (ray.direction[tri.k] + tri.n_u * ray.direction[u] + tri.n_v *
-                     ray.direction[v]);
-        
-        // TODO: necessary?
-        if (dot == 0.0f)
-            continue;
-        
-        float nd = 1.0f / dot;
-        float t_plane = (tri.n_d - ray.origin[tri.k]
-                         - tri.n_u * ray.origin[u] - tri.n_v * ray.origin[v]) * nd;
-        
-        // Behind camera or further
-        if ((found && t_plane >= result.distance) || t_plane < min || t_plane > max)
-            continue;
-        
-        float hu = ray.origin[u] + t_plane * ray.direction[u];
-        float hv = ray.origin[v] + t_plane * ray.direction[v];
-        
-        float beta = (hu * tri.b_nu + hv * tri.b_nv + tri.b_d);
-        if (beta < 0.0f)
-            continue;
-        
-        float gamma = (hu * tri.c_nu + hv * tri.c_nv + tri.c_d);
-        if (gamma < 0.0f)
-            continue;
-        
-        if (beta + gamma > 1.0f)
-            continue;
-        
-        result.distance = t_plane;
-        result.beta = beta;
-        result.gamma = gamma;
-        result.triangle_id = tri.triangle_id;
-
-        found = true;
-
-		// TODO: Could break here, but SIMD
-    }
-    
-    return found;
-#else
 	// http://www.sci.utah.edu/~wald/PhD/wald_phd.pdf
-	bool found = false; // TODO: pass in found?
-	const int mod_table[5] = { 0, 1, 2, 0, 1 };
+	typedef vector<float, TRIANGLE_SIMD> floatN;
+	typedef vector<bmask, TRIANGLE_SIMD> bmaskN;
 
-	for (int i = 0; i < count; i++) {
-		GLOBAL const SetupTriangle & tri = data[i];
+	floatN origin[3] = { floatN(ray.origin.x), floatN(ray.origin.y), floatN(ray.origin.z) };
+	floatN direction[3] = { floatN(ray.direction.x), floatN(ray.direction.y), floatN(ray.direction.z) };
 
-		int u = mod_table[tri.k + 1];
-		int v = mod_table[tri.k + 2];
+	floatN t_min(min);
+	floatN t_max(max);
+	floatN t_nearest(INFINITY);
 
-		float dot = (ray.direction[tri.k] + tri.n_u * ray.direction[u] + tri.n_v *
-			ray.direction[v]);
+	float nearest = INFINITY;
+	bool found = false;
 
-		// TODO: necessary?
-		bool hit = (dot != 0.0f);
+	for (int i = 0; i < count; i += TRIANGLE_SIMD) {
+		GLOBAL const SetupTriangleBlock & block = data[i / TRIANGLE_BLOCK_SIZE];
+		GLOBAL const SetupTriangleBlock & next = nextTriangleBlock(data, i, count);
 
-		float nd = 1.0f / dot;
-		float t_plane = (tri.n_d - ray.origin[tri.k]
-			- tri.n_u * ray.origin[u] - tri.n_v * ray.origin[v]) * nd;
+		// Lanes past the end of the leaf hold padding, which never hits
+		floatN n[3], b[3], c[3];
 
-		// Behind camera or further
-		hit = hit && !((found && t_plane >= result.distance) || t_plane < min || t_plane > max);
+		for (int j = 0; j < 3; j++) {
+			n[j] = loadTriangleLanes(block.n[j], next.n[j]);
+			b[j] = loadTriangleLanes(block.b[j], next.b[j]);
+			c[j] = loadTriangleLanes(block.c[j], next.c[j]);
+		}
+
+		floatN dot = n[0] * direction[0] + n[1] * direction[1] + n[2] * direction[2];
 
-		float hu = ray.origin[u] + t_plane * ray.direction[u];
-		float hv = ray.origin[v] + t_plane * ray.direction[v];
+		bmaskN hit = (dot != floatN(0.0f));
 
-		float beta = (hu * tri.b_nu + hv * tri.b_nv + tri.b_d);
-		hit = hit && beta >= 0.0f;
+		if (none(hit))
+			continue;
 
-		float gamma = (hu * tri.c_nu + hv * tri.c_nv + tri.c_d);
-		hit = hit && gamma >= 0.0f;
+		floatN n_d = loadTriangleLanes(block.n_d, next.n_d);
 
-		hit = hit && beta + gamma <= 1.0f;
+		floatN t_plane = (n_d - n[0] * origin[0] - n[1] * origin[1] - n[2] * origin[2]) * (floatN(1.0f) / dot);
 
-		result.distance = hit ? t_plane : result.distance;
-		result.beta = hit ? beta : result.beta;
-		result.gamma = hit ? gamma : result.gamma;
-		result.triangle_id = hit ? tri.triangle_id : result.triangle_id;
+		// Behind camera, further, or behind an earlier hit
+		hit = hit & ~((t_plane >= t_nearest) | (t_plane < t_min) | (t_plane > t_max));
 
-		found = found || hit;
-}
+		if (none(hit))
+			continue;
+
+		// The line equations are zero along the projection axis, so this is the 2D test
+		floatN h[3] = {
+			origin[0] + t_plane * direction[0],
+			origin[1] + t_plane * direction[1],
+			origin[2] + t_plane * direction[2]
+		};
+
+		floatN beta = h[0] * b[0] + h[1] * b[1] + h[2] * b[2] + loadTriangleLanes(block.b_d, next.b_d);
+		floatN gamma = h[0] * c[0] + h[1] * c[1] + h[2] * c[2] + loadTriangleLanes(block.c_d, next.c_d);
+
+		hit = hit & (beta >= floatN(0.0f)) & (gamma >= floatN(0.0f)) & (beta + gamma <= floatN(1.0f));
+
+		int mask = laneMask(hit);
+
+		if (!mask)
+			continue;
+
+		// Ties go to the earlier triangle, as if they were tested one at a time
+		for (int k = 0; k < TRIANGLE_SIMD; k++) {
+			if (!(mask & (1 << k)) || t_plane[k] >= nearest)
+				continue;
+
+			nearest = t_plane[k];
+
+			result.distance = t_plane[k];
+			result.beta = beta[k];
+			result.gamma = gamma[k];
+			result.triangle_id = k < TRIANGLE_BLOCK_SIZE ? block.triangle_id[k] :
+				next.triangle_id[k - TRIANGLE_BLOCK_SIZE];
+		}
+
+		t_nearest = floatN(nearest);
+		found = true;
+	}
 
 	return found;
-#endif
-#elif defined(MOLLER_TRUMBORE_INTERSECTION)
-    bool found = false;
-    
-    for (int i = 0; i < count; i++) {
-        const SetupTriangle & tri = data[i];
-
-        float3 p = cross(ray.direction, tri.e2);
-        
-        float det = dot(tri.e1, p);
-        
-        // Backfacing or parallel to ray
-        if (det <= 0.000001f) // TODO
-            continue;
-        
-        float f = 1.0f / det;
-        
-        float3 s = ray.origin - tri.v[0];
-        float beta = f * dot(s, p);
-        
-        if (beta < 0.0f || beta > 1.0f)
-            continue;
-        
-        float3 q = cross(s, tri.e1);
-        
-        float gamma = f * dot(ray.direction, q);
-        
-        if (gamma < 0.0f || beta + gamma > 1.0f)
-            continue;
-        
-        float t = f * dot(tri.e2, q);
-        
-        if ((found && t >= result.distance) || t < min || t > max)
-            continue;
-        
-        result.distance = t;
-        result.beta = beta;
-        result.gamma = gamma;
-        result.triangle_id = tri.triangle_id;
-        found = true;
-        
-        if (anyCollision)
-            return true;
-    }
-    
-    return found;
-#endif
 }
 
 // TODO: Try that other triangle intersection algorithm
@@ -178,7 +149,7 @@ template<unsigned int N>
 vector<bmask, N> intersectsPacket(
 	THREAD const vector<float, N> (&origin)[3],
 	THREAD const vector<float, N> (&direction)[3],
-	GLOBAL SetupTriangle      * data,
+	GLOBAL SetupTriangleBlock * data,
 	int                         count,
 	const vector<float, N>    & min,
 	const vector<float, N>    & max,
@@ -192,17 +163,30 @@ vector<bmask, N> intersectsPacket(
 	const int mod_table[5] = { 0, 1, 2, 0, 1 };
 
 	for (int i = 0; i < count; i++) {
-		GLOBAL const SetupTriangle & tri = data[i];
-
-		int u = mod_table[tri.k + 1];
-		int v = mod_table[tri.k + 2];
+		GLOBAL const SetupTriangleBlock & block = data[i / TRIANGLE_BLOCK_SIZE];
+		int lane = i % TRIANGLE_BLOCK_SIZE;
+
+		// The projected components of one triangle, in the order Wald stores them
+		int k = block.k[lane];
+		int u = mod_table[k + 1];
+		int v = mod_table[k + 2];
+
+		float n_u = block.n[u][lane];
+		float n_v = block.n[v][lane];
+		float n_d = block.n_d[lane];
+		float b_nu = block.b[u][lane];
+		float b_nv = block.b[v][lane];
+		float b_d = block.b_d[lane];
+		float c_nu = block.c[u][lane];
+		float c_nv = block.c[v][lane];
+		float c_d = block.c_d[lane];
 
 		// TODO: Some of these broadcast to 4 channels, which could be done earlier at the cost of
 		// bigger triangle data
 
 		// TODO: Big cache miss here due to loading triangle data
 		// TODO: Can use shuffle if we construct the mask at runtime
-		vector<float, N> dot = (direction[tri.k] + vector<float, N>(tri.n_u) * direction[u] + vector<float, N>(tri.n_v) *
+		vector<float, N> dot = (direction[k] + vector<float, N>(n_u) * direction[u] + vector<float, N>(n_v) *
 			direction[v]);
 
 		vector<bmask, N> hit = (dot != vector<float, N>(0.0f));
@@ -212,8 +196,8 @@ vector<bmask, N> intersectsPacket(
 
 		vector<float, N> nd = vector<float, N>(1.0f) / dot;
 
-		vector<float, N> t_plane = (vector<float, N>(tri.n_d) - origin[tri.k]
-			- vector<float, N>(tri.n_u) * origin[u] - vector<float, N>(tri.n_v) * origin[v]) * nd;
+		vector<float, N> t_plane = (vector<float, N>(n_d) - origin[k]
+			- vector<float, N>(n_u) * origin[u] - vector<float, N>(n_v) * origin[v]) * nd;
 
 		// Behind camera or further
         // TODO: min and result.distance can be baked into one
@@ -227,14 +211,14 @@ vector<bmask, N> intersectsPacket(
 		vector<float, N> hu = origin[u] + t_plane * direction[u];
 		vector<float, N> hv = origin[v] + t_plane * direction[v];
 
-		vector<float, N> beta = (hu * vector<float, N>(tri.b_nu) + hv * vector<float, N>(tri.b_nv) + vector<float, N>(tri.b_d));
+		vector<float, N> beta = (hu * vector<float, N>(b_nu) + hv * vector<float, N>(b_nv) + vector<float, N>(b_d));
 
 		hit = hit & (beta >= vector<float, N>(0.0f));
 
 		if (none(hit))
 			continue;
 
-		vector<float, N> gamma = (hu * vector<float, N>(tri.c_nu) + hv * vector<float, N>(tri.c_nv) + vector<float, N>(tri.c_d));
+		vector<float, N> gamma = (hu * vector<float, N>(c_nu) + hv * vector<float, N>(c_nv) + vector<float, N>(c_d));
 
 		hit = hit & (gamma >= vector<float, N>(0.0f));
 
@@ -249,7 +233,7 @@ vector<bmask, N> intersectsPacket(
 		result.distance = blend(hit, result.distance, t_plane);
 		result.beta = blend(hit, result.beta, beta);
 		result.gamma = blend(hit, result.gamma, gamma);
-		result.triangle_id = blend(hit, result.triangle_id, vector<int, N>(tri.triangle_id)); // TODO: broadcast
+		result.triangle_id = blend(hit, result.triangle_id, vector<int, N>(block.triangle_id[lane])); // TODO: broadcast
 
 		found = found | hit;
 
@@ -262,14 +246,175 @@ vector<bmask, N> intersectsPacket(
 	return found;
 }
 
-template vector<bmask, SIMD> intersectsPacket(
-	THREAD const vector<float, SIMD> (&origin)[3],
-	THREAD const vector<float, SIMD> (&direction)[3],
-	GLOBAL SetupTriangle      * data,
+/**
+ * @brief Check whether a ray hits any of an array of packed triangles. Like intersects(), but
+ * stops at the first hit found, which is not necessarily the closest, and does not compute
+ * barycentric coordinates.
+ *
+ * @param[in]  ray          Ray to test against
+ * @param[in]  data         Blocks of packed triangles to test
+ * @param[in]  count        Number of triangles to test
+ * @param[in]  min          Minimum collision distance
+ * @param[in]  max          Maximum collision distance
+ * @param[out] occluder     ID of the triangle that was hit, if one was
+ *
+ * @return True if there was a collision, or false otherwise
+ */
+bool occludes(
+                Ray                         ray,
+                GLOBAL SetupTriangleBlock * data,
+                int                         count,
+                float                       min,
+                float                       max,
+                THREAD unsigned int       & occluder)
+{
+	typedef vector<float, TRIANGLE_SIMD> floatN;
+	typedef vector<bmask, TRIANGLE_SIMD> bmaskN;
+
+	floatN origin[3] = { floatN(ray.origin.x), floatN(ray.origin.y), floatN(ray.origin.z) };
+	floatN direction[3] = { floatN(ray.direction.x), floatN(ray.direction.y), floatN(ray.direction.z) };
+
+	floatN t_min(min);
+	floatN t_max(max);
+
+	for (int i = 0; i < count; i += TRIANGLE_SIMD) {
+		GLOBAL const SetupTriangleBlock & block = data[i / TRIANGLE_BLOCK_SIZE];
+		GLOBAL const SetupTriangleBlock & next = nextTriangleBlock(data, i, count);
+
+		floatN n[3], b[3], c[3];
+
+		for (int j = 0; j < 3; j++) {
+			n[j] = loadTriangleLanes(block.n[j], next.n[j]);
+			b[j] = loadTriangleLanes(block.b[j], next.b[j]);
+			c[j] = loadTriangleLanes(block.c[j], next.c[j]);
+		}
+
+		floatN dot = n[0] * direction[0] + n[1] * direction[1] + n[2] * direction[2];
+
+		bmaskN hit = (dot != floatN(0.0f));
+
+		if (none(hit))
+			continue;
+
+		floatN n_d = loadTriangleLanes(block.n_d, next.n_d);
+
+		floatN t_plane = (n_d - n[0] * origin[0] - n[1] * origin[1] - n[2] * origin[2]) * (floatN(1.0f) / dot);
+
+		hit = hit & ~((t_plane < t_min) | (t_plane > t_max));
+
+		if (none(hit))
+			continue;
+
+		floatN h[3] = {
+			origin[0] + t_plane * direction[0],
+			origin[1] + t_plane * direction[1],
+			origin[2] + t_plane * direction[2]
+		};
+
+		floatN beta = h[0] * b[0] + h[1] * b[1] + h[2] * b[2] + loadTriangleLanes(block.b_d, next.b_d);
+		floatN gamma = h[0] * c[0] + h[1] * c[1] + h[2] * c[2] + loadTriangleLanes(block.c_d, next.c_d);
+
+		hit = hit & (beta >= floatN(0.0f)) & (gamma >= floatN(0.0f)) & (beta + gamma <= floatN(1.0f));
+
+		int mask = laneMask(hit);
+
+		if (!mask)
+			continue;
+
+		for (int k = 0; k < TRIANGLE_SIMD; k++) {
+			if (mask & (1 << k)) {
+				occluder = k < TRIANGLE_BLOCK_SIZE ? block.triangle_id[k] :
+					next.triangle_id[k - TRIANGLE_BLOCK_SIZE];
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Check whether each ray of a packet hits any of an array of packed triangles. Like
+ * intersectsPacket(), but each lane stops at the first hit found, and no distances or
+ * barycentric coordinates are computed.
+ *
+ * @param[in]  origin       Ray origins
+ * @param[in]  direction    Ray directions
+ * @param[in]  data         Blocks of packed triangles to test
+ * @param[in]  count        Number of triangles to test
+ * @param[in]  min          Minimum collision distance of each ray
+ * @param[in]  max          Maximum collision distance of each ray
+ * @param[in]  done         Lanes which do not need testing
+ * @param[out] occluder     ID of the triangle each newly occluded lane hit
+ *
+ * @return Lanes which were not done and hit something
+ */
+template<unsigned int N>
+vector<bmask, N> occludesPacket(
+	THREAD const vector<float, N> (&origin)[3],
+	THREAD const vector<float, N> (&direction)[3],
+	GLOBAL SetupTriangleBlock * data,
 	int                         count,
-	const vector<float, SIMD>    & min,
-	const vector<float, SIMD>    & max,
-	bool occlusionOnly,
-	THREAD PacketCollision<SIMD> & result);
+	const vector<float, N>    & min,
+	const vector<float, N>    & max,
+	vector<bmask, N>            done,
+	THREAD vector<int, N>     & occluder)
+{
+	// http://www.sci.utah.edu/~wald/PhD/wald_phd.pdf
+	vector<bmask, N> found = vector<bmask, N>(0x00000000);
+	const int mod_table[5] = { 0, 1, 2, 0, 1 };
+
+	for (int i = 0; i < count; i++) {
+		GLOBAL const SetupTriangleBlock & block = data[i / TRIANGLE_BLOCK_SIZE];
+		int lane = i % TRIANGLE_BLOCK_SIZE;
+
+		int k = block.k[lane];
+		int u = mod_table[k + 1];
+		int v = mod_table[k + 2];
+
+		vector<float, N> n_u(block.n[u][lane]);
+		vector<float, N> n_v(block.n[v][lane]);
+
+		vector<float, N> dot = direction[k] + n_u * direction[u] + n_v * direction[v];
+
+		vector<bmask, N> hit = (dot != vector<float, N>(0.0f)) & ~done;
+
+		if (none(hit))
+			continue;
+
+		vector<float, N> t_plane = (vector<float, N>(block.n_d[lane]) - origin[k] - n_u * origin[u] - n_v * origin[v]) *
+			(vector<float, N>(1.0f) / dot);
+
+		hit = hit & ~((t_plane < min) | (t_plane > max));
+
+		if (none(hit))
+			continue;
+
+		vector<float, N> hu = origin[u] + t_plane * direction[u];
+		vector<float, N> hv = origin[v] + t_plane * direction[v];
+
+		vector<float, N> beta = hu * vector<float, N>(block.b[u][lane]) + hv * vector<float, N>(block.b[v][lane]) +
+			vector<float, N>(block.b_d[lane]);
+
+		vector<float, N> gamma = hu * vector<float, N>(block.c[u][lane]) + hv * vector<float, N>(block.c[v][lane]) +
+			vector<float, N>(block.c_d[lane]);
+
+		hit = hit & (beta >= vector<float, N>(0.0f)) & (gamma >= vector<float, N>(0.0f)) &
+			(beta + gamma <= vector<float, N>(1.0f));
+
+		if (none(hit))
+			continue;
+
+		occluder = blend(hit, occluder, vector<int, N>(block.triangle_id[lane]));
+
+		found = found | hit;
+		done = done | hit;
+
+		if (all(done))
+			break;
+	}
+
+	return found;
+}
 
 #endif
@@ -14,6 +14,8 @@
 #include <util/align.h>
 #include <math/vector.h>
 
+#include <string.h>
+
 // TODO: Per-image tiling
 // TODO: Swizzling vs tiling
 // TODO: 3D and possibly 1D textures
@@ -91,6 +93,13 @@ public:
         aligned_free(data);
     }
 
+    /**
+     * @brief Set every pixel to zero
+     */
+    inline void clear() {
+        memset(data, 0, sizeof(T) * tilesW * TILEX * tilesH * TILEY * C);
+    }
+
     /**
      * @brief Copy pixels to an array in scanline order
      *
@@ -0,0 +1,35 @@
+/**
+ * @file kdtree/kdbenchmark.h
+ *
+ * @brief Measure KD-tree traversal speed and memory behaviour
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __KDBENCHMARK_H
+#define __KDBENCHMARK_H
+
+#include <kdtree/kdtree.h>
+#include <util/vector.h>
+
+/**
+ * @brief Results of benchmarkKDTraversal()
+ */
+struct KDTraversalBenchmark {
+    double raysPerSecond; //!< Best single ray throughput over several runs
+    double linesPerRay;   //!< Average number of different cache lines each ray read
+    double missesPerRay;  //!< Average number of misses in the cache model for each ray
+};
+
+/**
+ * @brief Time tracing rays one at a time with KDTree::intersect() on the calling thread. Then
+ * trace them again in order with KDTree::intersectObserved(), and feed every node and triangle
+ * block read into a model of a 32KB, 8-way L1 data cache. Prefetches are not modelled.
+ *
+ * @param[in]  tree   Tree to trace against
+ * @param[in]  rays   Rays to trace
+ * @param[out] result Throughput and cache behaviour
+ */
+void benchmarkKDTraversal(const KDTree & tree, const util::vector<Ray, 16> & rays, KDTraversalBenchmark & result);
+
+#endif
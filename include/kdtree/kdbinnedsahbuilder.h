@@ -0,0 +1,77 @@
+/**
+ * @file kdtree/kdbinnedsahbuilder.h
+ *
+ * @brief KD-Tree "surface area heuristic" builder which evaluates the SAH at a fixed number of
+ * candidate planes
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __KDBINNEDSAHBUILDER_H
+#define __KDBINNEDSAHBUILDER_H
+
+#include <kdtree/kdsahbuilder.h>
+
+// Largest number of bins per axis
+#define KD_BINNED_MAX_BINS 256
+
+// Default number of bins per axis
+#define KD_BINNED_DEFAULT_BINS 32
+
+// Nodes with fewer triangles than this use the exact sweep by default
+#define KD_BINNED_DEFAULT_EXACT_THRESHOLD 512
+
+/**
+ * @brief KD-tree builder which approximates the SAH. Each axis of a node is divided into equal
+ * bins, and the SAH is only evaluated at the boundaries between bins. Triangle bounds are
+ * clipped and binned for all three axes at once with SIMD, and no sorting is needed, so each
+ * node takes linear time. The splits are a little worse than KDSAHBuilder's, because the best
+ * plane usually lies between two bin boundaries.
+ *
+ * Small nodes, where the exact sweep is cheap and a bad split matters more, can optionally be
+ * handed back to KDSAHBuilder.
+ */
+class KDBinnedSAHBuilder : public KDSAHBuilder {
+private:
+
+    int numBins;        //!< Number of bins per axis
+    int exactThreshold; //!< Nodes with fewer triangles use the exact sweep
+
+protected:
+
+    /**
+     * @copydoc KDBuilder::splitNode
+     */
+    virtual bool shouldSplitNode(
+        KDSAHBuilderThreadCtx            & threadCtx,
+        const AABB                       & bounds,
+        const uint32_t                   * triangles,
+        uint32_t                           numTriangles,
+        int                                depth,
+        float                            & split,
+        int                              & dir,
+        enum KDBuilderPlanarMode         & planarMode) override;
+
+public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param[in] k_traversal    Cost of traversing a KD-tree node
+     * @param[in] k_intersect    Cost of intersecting a KD-tree node
+     * @param[in] numBins        Number of bins per axis, up to KD_BINNED_MAX_BINS
+     * @param[in] exactThreshold Nodes with fewer triangles than this use the exact sweep. Zero
+     *                           bins every node.
+     */
+    KDBinnedSAHBuilder(KDTree & tree, util::vector<Triangle, 16> & triangles, float k_traversal = 1.0f,
+        float k_intersect = 0.5f, int numBins = KD_BINNED_DEFAULT_BINS,
+        int exactThreshold = KD_BINNED_DEFAULT_EXACT_THRESHOLD);
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~KDBinnedSAHBuilder();
+
+};
+
+#endif
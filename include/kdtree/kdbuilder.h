@@ -13,15 +13,79 @@
 #include <kdtree/kdtree.h>
 #include <mutex>
 #include <thread>
-#include <util/queue.h>
+#include <util/arena.h>
+#include <util/taskscheduler.h>
 #include <util/vector.h>
+#include <vector>
 
-// TODO: Queue node might have some false sharing/atomic contention
-// TODO: Pool or something of queue nodes might be better than new/delete constantly.
-// TODO: Check overhead of queue locking. Maybe use work stealing or something.
 // TODO: The top-down recursive model here does not allow for bottom-up strategies
 //       like agglomerative clustering.
 
+// Defaults for KDBuilderParams
+#define KD_DEFAULT_TRAVERSAL_COST 12.0f
+#define KD_DEFAULT_INTERSECT_COST 1.0f
+#define KD_DEFAULT_MAX_DEPTH      23
+#define KD_DEFAULT_LEAF_TRIANGLES 4
+
+// Deepest split allowed, so that traversal never overflows its 64 entry stack
+#define KD_MAX_DEPTH_LIMIT 60
+
+// Nodes in a cache line. Each treelet fills one.
+#define KD_TREELET_NODES (CACHE_LINE / sizeof(KDNode))
+
+// Subtrees with fewer triangles than this are built by one thread, without spawning tasks
+#define KD_SERIAL_SUBTREE_TRIANGLES 4096
+
+// Nodes with at least this many triangles search for a split and partition in parallel
+#define KD_PARALLEL_NODE_TRIANGLES 65536
+
+// Costs used to report the expected SAH cost of a finished tree, so that trees from different
+// builders are measured the same way
+#define KD_SAH_COST_TRAVERSAL 12.0f
+#define KD_SAH_COST_INTERSECT 1.0f
+
+/**
+ * @brief Parameters for building a KD-tree, shared by all of the builders
+ */
+struct KDBuilderParams {
+    float traversalCost;  //!< SAH cost of traversing a node
+    float intersectCost;  //!< SAH cost of intersecting a triangle
+    int   maxDepth;       //!< Nodes at this depth are never split
+    int   leafTriangles;  //!< Nodes with this many triangles or fewer are never split
+    int   exactThreshold; //!< Nodes with fewer triangles use the exact SAH sweep in the binned builder
+    bool  clip;           //!< Whether to clip triangles to each node. See KDBuilder::setClipTriangles().
+    bool  treelets;       //!< Whether to lay nodes out in treelets. See KDBuilder::setTreeletLayout().
+    bool  blockCost;      //!< Whether SAH costs count whole triangle blocks. See KDBuilder::setBlockCost().
+
+    KDBuilderParams()
+        : traversalCost(KD_DEFAULT_TRAVERSAL_COST),
+          intersectCost(KD_DEFAULT_INTERSECT_COST),
+          maxDepth(KD_DEFAULT_MAX_DEPTH),
+          leafTriangles(KD_DEFAULT_LEAF_TRIANGLES),
+          exactThreshold(512),
+          clip(false),
+          treelets(true),
+          blockCost(false)
+    {
+    }
+};
+
+enum KDBuilderType {
+    KDBuilderTypeMedian,
+    KDBuilderTypeSAH,
+    KDBuilderTypePresortedSAH,
+    KDBuilderTypeBinnedSAH,
+    KDBuilderTypeCount
+};
+
+static const char *KDBuilderTypeNames[] = {
+    "median",
+    "sah",
+    "presorted-sah",
+    "binned-sah",
+    "Type Count"
+};
+
 /**
  * @brief Options for which child node to place triangles that lie in the split
  * plane of a node into
@@ -33,23 +97,29 @@ enum KDBuilderPlanarMode {
 };
 
 /**
- * @brief Node in a KDBuilder's work queue
+ * @brief Node being built by a KDBuilder. Nodes and their triangle lists are allocated from
+ * the builder's arenas, and are all freed at once after the tree is finalized.
  */
 struct KDBuilderNode {
-    uint32_t                    depth;     //!< Node depth in KD-tree
-    AABB                        bounds;    //!< Bounds of all triangles
-    util::vector<Triangle, 16>  triangles; //!< Triangles to place in node
+    uint32_t                    depth;        //!< Node depth in KD-tree
+    AABB                        bounds;       //!< Bounds of all triangles
+    uint32_t                   *triangles;    //!< Indices of the triangles to place in node
+    uint32_t                    numTriangles; //!< Number of triangles in node
     KDBuilderNode              *left;
     KDBuilderNode              *right;
     int                         dir;
     float                       split;
+    uint32_t                    index;        //!< Index of the finalized node in KDTree::nodes
 
     KDBuilderNode()
         : depth(0),
+          triangles(nullptr),
+          numTriangles(0),
           left(nullptr),
           right(nullptr),
           dir(0),
-          split(0.0f)
+          split(0.0f),
+          index(0)
     {
     }
 };
@@ -67,42 +137,79 @@ struct KDTreeStats {
     int sum_depth;       //!< Sum of the depths of all leaf nodes
     int num_zero_leaves; //!< Number of leaf nodes with no triangles
     int tree_mem;        //!< Approximate amount of memory used by the tree
+    float sah_cost;      //!< Expected cost of tracing a ray through the tree, from the SAH
 };
 
 template<typename T>
 class KDBuilder {
 private:
 
-    // Note: We need a dynamic queue here because we don't know how deep we're going
-    // to go while building the tree
-    util::queue<KDBuilderNode *, 8> node_queue;
-    std::mutex                      queue_lock;        //!< Work queue lock
-    std::atomic_int                 outstanding_nodes; //!< Number of unfinished nodes
+    std::vector<util::arena *>      arenas;            //!< Every arena which allocated nodes
+    std::mutex                      arena_lock;        //!< Arena list lock
+    T                              *workerCtx;         //!< Context of each worker
+    util::arena                   **workerArenas;      //!< Arena of each worker
 
-    KDTree                          & tree;
-    util::vector<Triangle, 16>      & triangles;
-    uint32_t                          numUnclippedTriangles;
-    std::atomic_int                   triangleID;
+    /**
+     * @brief Build a subtree on the calling worker
+     */
+    void buildSerial(KDBuilderNode *builderNode);
 
     /**
-     * @brief KD-builder worker THREAD entrypoint
+     * @brief Build a subtree, spawning a task for each left child until the nodes are small
+     * enough to build serially
      */
-    void builder_thread();
+    void buildTask(TaskGroup & group, KDBuilderNode *builderNode);
 
     void partition(
+        util::arena                      & arena,
         float                              split,
         int                                dir,
         enum KDBuilderPlanarMode         & planarMode,
-        const util::vector<Triangle, 16> & triangles,
-        util::vector<Triangle, 16>       & left,
-        util::vector<Triangle, 16>       & right);
+        const KDBuilderNode              & node,
+        KDBuilderNode                    & left,
+        KDBuilderNode                    & right);
 
     void splitNode(
+        util::arena              & arena,
         KDBuilderNode            & builderNode,
         float                      split,
         int                        dir,
         enum KDBuilderPlanarMode   planarMode);
 
+    /**
+     * @brief Place the children of every node directly after their parents' children, in
+     * depth first order
+     *
+     * @return Number of nodes
+     */
+    uint32_t layoutDepthFirst(KDBuilderNode *builderNode, uint32_t numNodes);
+
+    /**
+     * @brief Place nodes in cache line sized treelets. Each treelet is filled greedily with the
+     * children of the nodes inside it that rays are most likely to reach, by surface area, so
+     * that a ray visits fewer cache lines on its way down the tree.
+     *
+     * @return Number of nodes
+     */
+    uint32_t layoutTreelets(KDBuilderNode *root);
+
+    /**
+     * @brief Compute the SAH cost of a subtree of builder nodes, not normalized by the root's
+     * surface area, with the same costs as computeStats()
+     */
+    float computeCost(const KDBuilderNode & builderNode);
+
+    /**
+     * @brief Simplify a finished subtree of builder nodes, bottom up. Splits whose children are
+     * leaves with the same triangles become leaves, and chains of splits which cut off empty
+     * space on the same side are merged into one split.
+     *
+     * @param[in]    builderNode Root of the subtree
+     * @param[inout] numCollapsed Incremented for each split turned into a leaf
+     * @param[inout] numMerged    Incremented for each split removed from an empty chain
+     */
+    void optimizeNode(KDBuilderNode & builderNode, int & numCollapsed, int & numMerged);
+
     void finalizeLeafNode(
         const KDBuilderNode             & builderNode,
         KDNode                          & node);
@@ -115,22 +222,97 @@ private:
         const KDBuilderNode             & builderNode,
         KDNode                          & node);
 
-    void buildNode(
+    bool buildNode(
         T & threadCtx,
+        util::arena & arena,
         KDBuilderNode & builderNode);
 
     AABB buildAABB(const util::vector<Triangle, 16> & triangles);
 
 protected:
 
+    KDTree                          & tree;
+    util::vector<Triangle, 16>      & triangles;
+    util::vector<AABB, 16>            triangleBounds; //!< Bounds of each triangle, indexed like triangles
+    TaskScheduler                    *scheduler;      //!< Scheduler running the build
+    bool                              clipTriangles;  //!< Whether triangle bounds are clipped to each node
+    bool                              treeletLayout;  //!< Whether nodes are laid out in treelets
+    bool                              blockCost;      //!< Whether SAH costs count whole triangle blocks
+    int                               maxDepth;       //!< Nodes at this depth are never split
+    int                               leafTriangles;  //!< Nodes with this many triangles or fewer are never split
+
+    /**
+     * @brief Number of triangles the SAH charges for intersecting a leaf. With block costs, this
+     * is rounded up to whole triangle blocks, since the padding in a leaf's last block costs as
+     * much to test as a triangle.
+     */
+    inline int costTriangles(int count) const {
+        if (!blockCost)
+            return count;
+
+        return (count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE * TRIANGLE_BLOCK_SIZE;
+    }
+
+    /**
+     * @brief Get the bounds a triangle should have in a node. With clipping, these are the
+     * bounds of the part of the triangle inside the node. Otherwise they are the bounds of the
+     * whole triangle, which builders clamp to the node themselves.
+     */
+    inline AABB getTriangleBounds(uint32_t triangle, const AABB & node) const {
+        const AABB & box = triangleBounds[triangle];
+
+        if (!clipTriangles || (node.contains(box.min) && node.contains(box.max)))
+            return box;
+
+        // Triangles which only touch the node can miss it after rounding
+        AABB clipped;
+
+        if (!clipBounds(triangles[triangle], node, clipped))
+            return box;
+
+        return clipped;
+    }
+
+    /**
+     * @brief Create an arena for a thread to allocate builder nodes and triangle lists from.
+     * It is owned by the builder and freed after the tree is finalized.
+     */
+    util::arena *createArena();
+
+    /**
+     * @brief Get the arena of the calling worker
+     */
+    util::arena & getWorkerArena();
+
+    /**
+     * @brief Allocate a builder node from an arena
+     */
+    KDBuilderNode *createNode(util::arena & arena, uint32_t depth, const AABB & bounds);
+
+    /**
+     * @brief Run func(i) for i in [0, count) on the build's workers, and wait for all of
+     * them. The calling worker may run other build tasks while it waits.
+     */
+    void parallelFor(int count, const std::function<void(int)> & func);
+
+    /**
+     * @brief Build the tree of builder nodes below the root. Called on one of the scheduler's
+     * workers. The default implementation splits nodes with shouldSplitNode(), spawning a task
+     * for each large subtree.
+     *
+     * @param[in] root Root node, which holds every triangle
+     */
+    virtual void buildTree(KDBuilderNode *root);
+
     /**
      * @brief Should be overriden by builder implementations to decide how split a KD-tree
      * node
      *
-     * @param[in]  threadCtx  Worker THREAD context
-     * @param[in]  bounds     Bounding box for input triangles
-     * @param[in]  triangles  Triangle list to partition
-     * @param[in]  depth      KD-tree node depth
+     * @param[in]  threadCtx    Worker THREAD context
+     * @param[in]  bounds       Bounding box for input triangles
+     * @param[in]  triangles    Indices of the triangles to partition
+     * @param[in]  numTriangles Number of triangles
+     * @param[in]  depth        KD-tree node depth
      * @param[out] split      Split plane location
      * @param[out] dir        Split plane axis
      * @param[out] planarMode How to treat triangles lying in the split plane
@@ -140,13 +322,19 @@ protected:
     virtual bool shouldSplitNode(
         T                                & threadCtx,
         const AABB                       & bounds,
-        const util::vector<Triangle, 16> & triangles,
+        const uint32_t                   * triangles,
+        uint32_t                           numTriangles,
         int                                depth,
         float                            & split,
         int                              & dir,
         enum KDBuilderPlanarMode         & planarMode) = 0;
     
-    void computeStats(KDNode *root, KDTreeStats *stats, int depth);
+    /**
+     * @brief Compute statistics about a finished subtree
+     *
+     * @return SAH cost of the subtree, not normalized by the root's surface area
+     */
+    float computeStats(KDNode *root, const AABB & bounds, KDTreeStats *stats, int depth);
 
 public:
 
@@ -154,8 +342,49 @@ public:
 
     virtual ~KDBuilder();
 
+    /**
+     * @brief Clip triangles to each node when placing them, instead of using their full
+     * bounds. Triangles which straddle a split get tighter bounds in the children, and are
+     * left out of children they only overlap by bounding box. The triangles themselves are
+     * not changed.
+     */
+    void setClipTriangles(bool clip);
+
+    /**
+     * @brief Lay out the finished tree's nodes in cache line sized treelets, which is the
+     * default, or in depth first order
+     */
+    void setTreeletLayout(bool treelets);
+
+    /**
+     * @brief Charge the SAH for whole triangle blocks rather than single triangles, which favours
+     * leaves holding a multiple of TRIANGLE_BLOCK_SIZE triangles. Disabled by default. Only the
+     * SAH builders use this.
+     */
+    void setBlockCost(bool blockCost);
+
+    /**
+     * @brief Set when to stop splitting nodes. The depth is clamped to KD_MAX_DEPTH_LIMIT.
+     *
+     * @param[in] maxDepth      Nodes at this depth are never split
+     * @param[in] leafTriangles Nodes with this many triangles or fewer are never split
+     */
+    void setLimits(int maxDepth, int leafTriangles);
+
     void build(KDTreeStats *stats = nullptr);
 
 };
 
+/**
+ * @brief Build a KD-tree with one of the builders
+ *
+ * @param[in]  type      Builder to use
+ * @param[out] tree      Tree to build
+ * @param[in]  triangles Triangles to place in the tree
+ * @param[in]  params    Build parameters
+ * @param[out] stats     Optional tree statistics
+ */
+void buildKDTree(KDBuilderType type, KDTree & tree, util::vector<Triangle, 16> & triangles,
+    const KDBuilderParams & params, KDTreeStats *stats = nullptr);
+
 #endif
@@ -0,0 +1,102 @@
+/**
+ * @file kdtree/kdcache.h
+ *
+ * @brief On-disk cache of built KD-trees
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __KDCACHE_H
+#define __KDCACHE_H
+
+#include <kdtree/kdbuilder.h>
+#include <kdtree/kdtree.h>
+
+#include <string>
+
+// "KDTC", little endian
+#define KD_CACHE_MAGIC   0x4354444B
+
+// Increment whenever KDNode, SetupTriangleBlock, the file layout, or the builders' output change
+#define KD_CACHE_VERSION 5
+
+// Alignment of the node and triangle arrays in the file
+#define KD_CACHE_ALIGN   64
+
+/**
+ * @brief Header at the start of a KD-tree cache file. Followed by the node and triangle arrays
+ * at the given offsets, exactly as they are laid out in memory, so that they can be mapped in
+ * place. Files are only read back on the same kind of machine, so no byte swapping is done.
+ */
+struct KDCacheHeader {
+    uint32_t    magic;           //!< KD_CACHE_MAGIC
+    uint32_t    version;         //!< KD_CACHE_VERSION
+    uint64_t    key;             //!< Hash of the builder input, from hashKDTreeInput()
+    uint32_t    nodeSize;        //!< sizeof(KDNode)
+    uint32_t    triangleSize;    //!< sizeof(SetupTriangleBlock)
+    uint64_t    numNodes;        //!< Number of nodes
+    uint64_t    numTriangles;    //!< Number of setup triangle blocks
+    uint64_t    nodesOffset;     //!< Offset of the nodes from the start of the file
+    uint64_t    trianglesOffset; //!< Offset of the setup triangle blocks from the start of the file
+    float       bounds[6];       //!< Tree bounds: minimum, then maximum
+    KDTreeStats stats;           //!< Statistics computed when the tree was built
+};
+
+/**
+ * @brief Hash everything which affects the tree built from a set of triangles. Trees are only
+ * loaded from the cache if their key matches.
+ */
+uint64_t hashKDTreeInput(const util::vector<Triangle, 16> & triangles, KDBuilderType type,
+    const KDBuilderParams & params);
+
+/**
+ * @brief Get the path of the cache file for a tree with a key from hashKDTreeInput()
+ */
+std::string getKDTreeCachePath(const std::string & cacheDir, uint64_t key);
+
+/**
+ * @brief Map a cached tree into memory. The tree's nodes and triangles point directly into the
+ * file, which stays mapped until the tree is destroyed.
+ *
+ * @param[in]  path  Cache file
+ * @param[in]  key   Expected key, from hashKDTreeInput()
+ * @param[out] tree  Tree to load into
+ * @param[out] stats Optional statistics saved with the tree
+ *
+ * @return False if the file does not exist, or is not a valid cache of a tree with this key
+ */
+bool loadKDTree(const std::string & path, uint64_t key, KDTree & tree, KDTreeStats *stats = nullptr);
+
+/**
+ * @brief Save a tree to a cache file. The file is written under a temporary name and then
+ * renamed, so other processes never map a partially written file.
+ *
+ * @return True if the file was written
+ */
+bool saveKDTree(const std::string & path, uint64_t key, const KDTree & tree, const KDTreeStats & stats);
+
+/**
+ * @brief Load a KD-tree from the cache, or build it with buildKDTree() and add it to the cache
+ *
+ * @param[in] cacheDir Directory to keep cache files in. If empty, the tree is always built.
+ *
+ * See buildKDTree() for the other parameters.
+ */
+void loadOrBuildKDTree(const std::string & cacheDir, KDBuilderType type, KDTree & tree,
+    util::vector<Triangle, 16> & triangles, const KDBuilderParams & params, KDTreeStats *stats = nullptr);
+
+/**
+ * @brief Load builder parameters saved with saveKDBuilderParams()
+ *
+ * @return False if the file does not exist or is not valid. The parameters are not changed.
+ */
+bool loadKDBuilderParams(const std::string & path, KDBuilderParams & params);
+
+/**
+ * @brief Save builder parameters to a text file, one "name value" pair per line
+ *
+ * @return True if the file was written
+ */
+bool saveKDBuilderParams(const std::string & path, const KDBuilderParams & params);
+
+#endif
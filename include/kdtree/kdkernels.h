@@ -0,0 +1,191 @@
+/**
+ * @file kdtree/kdkernels.h
+ *
+ * @brief KD-tree traversal and triangle intersection kernels, built once for each instruction
+ * set and chosen between at runtime. The rest of the raytracer is built for the baseline
+ * instruction set, so one binary runs everywhere but still uses wide registers where they
+ * exist.
+ *
+ * The kernels live in kdtree.inl and triangle.inl. Each kdkernels_<isa>.cpp file is built with
+ * its own compiler flags and includes them inside its own namespace, so the copies never
+ * collide. Helpers they call from shared headers are FORCE_INLINE for the same reason.
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __KDKERNELS_H
+#define __KDKERNELS_H
+
+#include <kdtree/kdtree.h>
+
+enum KDKernelISA {
+    KDKernelISASSE42,
+    KDKernelISAAVX2,
+    KDKernelISAAVX512,
+    KDKernelISACount
+};
+
+static const char *KDKernelISANames[] = {
+    "sse4.2",
+    "avx2",
+    "avx512",
+    "ISA Count"
+};
+
+/**
+ * @brief Packet traversal kernel. See KDTree::intersectPacket().
+ */
+template<unsigned int N>
+using KDIntersectPacketFunc = vector<bmask, N> (*)(
+    const KDTree & tree,
+    THREAD const vector<float, N> (&origin)[3],
+    THREAD const vector<float, N> (&direction)[3],
+    THREAD const vector<float, N> & maxDist,
+    bool occlusionOnly,
+    THREAD PacketCollision<N> & result,
+    THREAD KDLaneStats & laneStats);
+
+/**
+ * @brief Packet occlusion traversal kernel. See KDTree::occludedPacket().
+ */
+template<unsigned int N>
+using KDOccludedPacketFunc = vector<bmask, N> (*)(
+    const KDTree & tree,
+    THREAD const vector<float, N> (&origin)[3],
+    THREAD const vector<float, N> (&direction)[3],
+    THREAD const vector<float, N> & maxDist,
+    THREAD vector<int, N> & occluder,
+    THREAD KDLaneStats & laneStats);
+
+/**
+ * @brief Stream traversal kernel. See KDTree::intersectStream().
+ */
+template<unsigned int N>
+using KDIntersectStreamFunc = void (*)(
+    const KDTree & tree,
+    const KDRayStream & stream,
+    bool occlusionOnly,
+    KDStreamScratch & scratch,
+    bool *hit,
+    THREAD Collision *result,
+    THREAD KDLaneStats & laneStats);
+
+/**
+ * @brief Traversal kernels built for one instruction set
+ */
+struct KDKernels {
+    KDKernelISA isa;
+    int         maxWidth; //!< Widest packets supported
+
+    /**
+     * @brief Find the closest collision between a ray and blocks of packed triangles, between
+     * min and max. See triangle.inl.
+     */
+    bool (*intersectTriangles)(Ray ray, GLOBAL SetupTriangleBlock *data, int count, float min,
+        float max, THREAD Collision & result);
+
+    /** @brief Single ray traversal. See KDTree::intersect(). */
+    bool (*intersect)(const KDTree & tree, const Ray & ray, float tmax, THREAD Collision & result);
+
+    /** @brief Single ray traversal which reports what it reads. See KDTree::intersectObserved(). */
+    bool (*intersectObserved)(const KDTree & tree, const Ray & ray, float tmax, THREAD Collision & result,
+        const KDAccessObserver & observer);
+
+    KDIntersectPacketFunc<4>  intersectPacket4;
+    KDIntersectPacketFunc<8>  intersectPacket8;  //!< Null if maxWidth < 8
+    KDIntersectPacketFunc<16> intersectPacket16; //!< Null if maxWidth < 16
+
+    KDIntersectStreamFunc<4>  intersectStream4;
+    KDIntersectStreamFunc<8>  intersectStream8;  //!< Null if maxWidth < 8
+    KDIntersectStreamFunc<16> intersectStream16; //!< Null if maxWidth < 16
+
+    /** @brief Single ray occlusion traversal. See KDTree::occluded(). */
+    bool (*occluded)(const KDTree & tree, const Ray & ray, float tmax, THREAD unsigned int & occluder);
+
+    KDOccludedPacketFunc<4>   occludedPacket4;
+    KDOccludedPacketFunc<8>   occludedPacket8;   //!< Null if maxWidth < 8
+    KDOccludedPacketFunc<16>  occludedPacket16;  //!< Null if maxWidth < 16
+
+    template<unsigned int N>
+    KDIntersectPacketFunc<N> intersectPacket() const;
+
+    template<unsigned int N>
+    KDIntersectStreamFunc<N> intersectStream() const;
+
+    template<unsigned int N>
+    KDOccludedPacketFunc<N> occludedPacket() const;
+};
+
+template<>
+inline KDIntersectPacketFunc<4> KDKernels::intersectPacket<4>() const {
+    return intersectPacket4;
+}
+
+template<>
+inline KDIntersectPacketFunc<8> KDKernels::intersectPacket<8>() const {
+    return intersectPacket8;
+}
+
+template<>
+inline KDIntersectPacketFunc<16> KDKernels::intersectPacket<16>() const {
+    return intersectPacket16;
+}
+
+template<>
+inline KDIntersectStreamFunc<4> KDKernels::intersectStream<4>() const {
+    return intersectStream4;
+}
+
+template<>
+inline KDIntersectStreamFunc<8> KDKernels::intersectStream<8>() const {
+    return intersectStream8;
+}
+
+template<>
+inline KDIntersectStreamFunc<16> KDKernels::intersectStream<16>() const {
+    return intersectStream16;
+}
+
+template<>
+inline KDOccludedPacketFunc<4> KDKernels::occludedPacket<4>() const {
+    return occludedPacket4;
+}
+
+template<>
+inline KDOccludedPacketFunc<8> KDKernels::occludedPacket<8>() const {
+    return occludedPacket8;
+}
+
+template<>
+inline KDOccludedPacketFunc<16> KDKernels::occludedPacket<16>() const {
+    return occludedPacket16;
+}
+
+/** @brief Kernels in use. See setKDKernelISA(). */
+extern RT_EXPORT const KDKernels *activeKDKernels;
+
+/**
+ * @brief Whether the CPU and OS support the instructions a set of kernels was built with
+ */
+RT_EXPORT bool isKDKernelISASupported(KDKernelISA isa);
+
+/**
+ * @brief Get the widest supported instruction set, which is used unless overridden
+ */
+RT_EXPORT KDKernelISA getBestKDKernelISA();
+
+/**
+ * @brief Switch kernels. Not safe while anything is tracing rays.
+ *
+ * @param[in] isa Instruction set, which must be supported
+ */
+RT_EXPORT void setKDKernelISA(KDKernelISA isa);
+
+/**
+ * @brief Get the kernels in use
+ */
+inline const KDKernels & getKDKernels() {
+    return *activeKDKernels;
+}
+
+#endif
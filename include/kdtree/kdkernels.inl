@@ -0,0 +1,69 @@
+#ifndef __KDKERNELS_INL_H
+#define __KDKERNELS_INL_H
+
+// Body of each kdkernels_<isa>.cpp. Expects KD_KERNEL_NAMESPACE and KD_KERNEL_ISA to be
+// defined, and kdkernels.h to have been included outside of the namespace.
+
+#include <algorithm>
+#include <cassert>
+
+#if defined(__AVX512F__)
+#define KD_KERNEL_MAX_WIDTH 16
+#elif defined(__AVX__)
+#define KD_KERNEL_MAX_WIDTH 8
+#else
+#define KD_KERNEL_MAX_WIDTH 4
+#endif
+
+namespace KD_KERNEL_NAMESPACE {
+
+#include <core/triangle.inl>
+#include <kdtree/kdtree.inl>
+
+extern const KDKernels kernels;
+
+const KDKernels kernels = {
+    KD_KERNEL_ISA,
+    KD_KERNEL_MAX_WIDTH,
+    &intersects,
+    &intersect,
+    &intersectObserved,
+    &intersectPacket<4>,
+#if KD_KERNEL_MAX_WIDTH >= 8
+    &intersectPacket<8>,
+#else
+    nullptr,
+#endif
+#if KD_KERNEL_MAX_WIDTH >= 16
+    &intersectPacket<16>,
+#else
+    nullptr,
+#endif
+    &intersectStream<4>,
+#if KD_KERNEL_MAX_WIDTH >= 8
+    &intersectStream<8>,
+#else
+    nullptr,
+#endif
+#if KD_KERNEL_MAX_WIDTH >= 16
+    &intersectStream<16>,
+#else
+    nullptr,
+#endif
+    &occluded,
+    &occludedPacket<4>,
+#if KD_KERNEL_MAX_WIDTH >= 8
+    &occludedPacket<8>,
+#else
+    nullptr,
+#endif
+#if KD_KERNEL_MAX_WIDTH >= 16
+    &occludedPacket<16>
+#else
+    nullptr
+#endif
+};
+
+}
+
+#endif
@@ -27,7 +27,8 @@ protected:
     virtual bool shouldSplitNode(
         KDMedianBuilderThreadCtx         & threadCtx,
         const AABB                       & bounds,
-        const util::vector<Triangle, 16> & triangles,
+        const uint32_t                   * triangles,
+        uint32_t                           numTriangles,
         int                                depth,
         float                            & split,
         int                              & dir,
@@ -20,14 +20,12 @@
 #define KD_INTERNAL_Z 2
 #define KD_LEAF       3
 
-// TODO: pack node
-
+/**
+ * @brief KD-tree node, packed into 8 bytes so that a cache line holds four pairs of siblings
+ */
 struct KDNode {
-    // TODO: could get this down to 8 bytes. With proper alignment, it's actually
-    // 16 bytes
-
-    // 8. Triangle pointer for leaves, children (adjacent) pointer for internal.
-    // Bottom two bits store node type, nodes are at least 16 bit aligned.
+    // 4. Byte offset of the triangle blocks for leaves, or of the children (adjacent) for internal
+    // nodes. Bottom two bits store node type, nodes are at least 4 byte aligned.
     uint32_t offset;
 
     // 4/4. Split distance or triangle count
@@ -36,23 +34,27 @@ struct KDNode {
         unsigned int   count;
     };
     
-    inline uint32_t type() const GLOBAL {
+    FORCE_INLINE uint32_t type() const GLOBAL {
         return offset & 0x00000003;
     }
     
-    inline GLOBAL KDNode *left(const GLOBAL KDNode *nodes) const GLOBAL {
+    FORCE_INLINE GLOBAL KDNode *left(const GLOBAL KDNode *nodes) const GLOBAL {
         GLOBAL KDNode *children = (GLOBAL KDNode *)((GLOBAL char *)nodes + (offset & 0xFFFFFFFC));
         return &children[0];
     }
     
-    inline GLOBAL KDNode *right(const GLOBAL KDNode *nodes) const GLOBAL {
+    FORCE_INLINE GLOBAL KDNode *right(const GLOBAL KDNode *nodes) const GLOBAL {
         GLOBAL KDNode *children = (GLOBAL KDNode *)((GLOBAL char *)nodes + (offset & 0xFFFFFFFC));
         return &children[1];
     }
     
-    inline GLOBAL SetupTriangle *triangles(const GLOBAL SetupTriangle *triangles) const GLOBAL {
-        return (GLOBAL SetupTriangle *)((GLOBAL char *)triangles + (offset & 0xFFFFFFFC));
+    FORCE_INLINE GLOBAL SetupTriangleBlock *triangles(const GLOBAL SetupTriangleBlock *triangles) const GLOBAL {
+        return (GLOBAL SetupTriangleBlock *)((GLOBAL char *)triangles + (offset & 0xFFFFFFFC));
     }
 };
 
+#if !GPU
+static_assert(sizeof(KDNode) == 8, "KD-tree nodes should be 8 bytes");
+#endif
+
 #endif
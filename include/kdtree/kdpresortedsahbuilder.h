@@ -0,0 +1,78 @@
+/**
+ * @file kdtree/kdpresortedsahbuilder.h
+ *
+ * @brief KD-Tree "surface area heuristic" builder which sorts its events only once
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __KDPRESORTEDSAHBUILDER_H
+#define __KDPRESORTEDSAHBUILDER_H
+
+#include <kdtree/kdsahbuilder.h>
+#include <vector>
+
+/**
+ * @brief Triangles and sorted events of a node which is still being built
+ */
+struct KDPresortedSAHNode {
+    util::vector<SAHEvent, 8> events[3]; //!< Events along each axis, sorted with compareEvent()
+    util::vector<uint32_t, 8> triangles; //!< Triangles in the node, in input order
+};
+
+/**
+ * @brief KD-tree SAH builder which runs in O(N log N) instead of O(N log^2 N). Events are
+ * sorted once at the root. Each split classifies the node's triangles as left, right or both,
+ * and then filters the sorted event lists into the children, which keeps them sorted. Only the
+ * events of triangles which straddle the split plane need new positions, because they are
+ * clamped to the child bounds. Those are regenerated, sorted and merged in. See Wald and Havran,
+ * "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)" (2006).
+ *
+ * The sweep and the partitioning rule are shared with KDSAHBuilder, so both builders produce
+ * the same tree.
+ */
+class KDPresortedSAHBuilder : public KDSAHBuilder {
+private:
+
+    std::vector<std::vector<uint8_t>> workerSide; //!< Which children each triangle goes to, for each worker
+
+    /**
+     * @brief Add a triangle's events along an axis, clamped or clipped to a node's bounds
+     */
+    void addEvents(uint32_t triangle, int axis, const AABB & bounds, util::vector<SAHEvent, 8> & events) const;
+
+    /**
+     * @brief Split a node and build its children, or turn it into a leaf. Takes ownership of
+     * the node's events and triangles.
+     *
+     * @param[in] group       Group to spawn tasks for large subtrees into
+     * @param[in] builderNode Node to build
+     * @param[in] data        Events and triangles in the node
+     */
+    void buildSubtree(TaskGroup & group, KDBuilderNode *builderNode, KDPresortedSAHNode *data);
+
+protected:
+
+    /**
+     * @copydoc KDBuilder::buildTree
+     */
+    virtual void buildTree(KDBuilderNode *root) override;
+
+public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param[in] k_traversal Cost of traversing a KD-tree node
+     * @param[in] k_intersect Cost of intersecting a KD-tree node
+     */
+    KDPresortedSAHBuilder(KDTree & tree, util::vector<Triangle, 16> & triangles, float k_traversal = 1.0f, float k_intersect = 0.5f);
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~KDPresortedSAHBuilder();
+
+};
+
+#endif
@@ -10,6 +10,7 @@
 #define __KDSAHBUILDER_H
 
 #include <kdtree/kdbuilder.h>
+#include <limits>
 
 /**
  * @brief SAH builder triangle event type enumeration
@@ -26,6 +27,30 @@ enum SAHEventType {
 struct SAHEvent {
     enum SAHEventType flag; //!< Event type
     float dist;             //!< Location along split axis
+    uint32_t triangle;      //!< Triangle index, for builders which keep events between nodes
+};
+
+/**
+ * @brief Sort events by plane location, then by event type
+ */
+bool compareEvent(const SAHEvent & e1, const SAHEvent & e2);
+
+/**
+ * @brief Best split plane found by an SAH sweep
+ */
+struct SAHSplit {
+    float                    cost;       //!< SAH cost of the split
+    float                    dist;       //!< Split plane location
+    int                      dir;        //!< Split axis, or -1 if no split was found
+    enum KDBuilderPlanarMode planarMode; //!< Which side planar triangles go to
+
+    SAHSplit()
+        : cost(std::numeric_limits<float>::infinity()),
+          dist(0.0f),
+          dir(-1),
+          planarMode(PLANAR_LEFT)
+    {
+    }
 };
 
 /**
@@ -39,12 +64,48 @@ struct KDSAHBuilderThreadCtx {
  * @brief KD-tree builder which splits nodes according to the Surface Area Heuristic
  */
 class KDSAHBuilder : public KDBuilder<KDSAHBuilderThreadCtx> {
-private:
+protected:
 
     float k_traversal; //!< Cost of traversing a KD-tree node
     float k_intersect; //!< Cost of intersecting a triangle
 
-protected:
+    /**
+     * @brief Sweep a sorted event list along one axis, and update the best split if a split on
+     * this axis is cheaper
+     *
+     * @param[in]    events       Events along the axis, sorted with compareEvent()
+     * @param[in]    numEvents    Number of events
+     * @param[in]    numTriangles Number of triangles in the node
+     * @param[in]    bounds       Node bounds
+     * @param[in]    axis         Axis the events lie along
+     * @param[inout] best         Best split found so far
+     */
+    void sweep(
+        const SAHEvent *events,
+        size_t          numEvents,
+        int             numTriangles,
+        const AABB    & bounds,
+        int             axis,
+        SAHSplit      & best) const;
+
+    /**
+     * @brief Generate and sort the events of a node's triangles along one axis, and sweep
+     * them to update the best split
+     *
+     * @param[in]    bounds       Node bounds
+     * @param[in]    triangles    Indices of the triangles in the node
+     * @param[in]    numTriangles Number of triangles
+     * @param[in]    axis         Axis to search
+     * @param[in]    events       Scratch space for events, left empty
+     * @param[inout] best         Best split found so far
+     */
+    void findSplit(
+        const AABB                & bounds,
+        const uint32_t            * triangles,
+        uint32_t                    numTriangles,
+        int                         axis,
+        util::vector<SAHEvent, 8> & events,
+        SAHSplit                  & best) const;
 
     /**
      * @copydoc KDBuilder::splitNode
@@ -52,7 +113,8 @@ protected:
     virtual bool shouldSplitNode(
         KDSAHBuilderThreadCtx            & threadCtx,
         const AABB                       & bounds,
-        const util::vector<Triangle, 16> & triangles,
+        const uint32_t                   * triangles,
+        uint32_t                           numTriangles,
         int                                depth,
         float                            & split,
         int                              & dir,
@@ -29,7 +29,7 @@ struct KDStackFrame {
     float enter;  //!< Distance from ray origin to bounding box entry point
     float exit;   //!< Distance from ray origin to bounding box exit point
     
-    KDStackFrame() {
+    FORCE_INLINE KDStackFrame() {
     }
 
     /**
@@ -39,7 +39,7 @@ struct KDStackFrame {
      * @param[in] enter Distance from ray origin to bounding box entry point
      * @param[in] exit  Distance from ray origin to bounding box exit point
      */
-    KDStackFrame(const GLOBAL KDNode *node, float enter, float exit)
+    FORCE_INLINE KDStackFrame(const GLOBAL KDNode *node, float enter, float exit)
         : node(node),
           enter(enter),
           exit(exit)
@@ -53,10 +53,10 @@ struct KDPacketStackFrame {
 	vector<float, N> enter;
 	vector<float, N> exit;
 	
-	KDPacketStackFrame() {
+	FORCE_INLINE KDPacketStackFrame() {
 	}
 
-	KDPacketStackFrame(const GLOBAL KDNode *node, vector<float, N> enter, vector<float, N> exit)
+	FORCE_INLINE KDPacketStackFrame(const GLOBAL KDNode *node, vector<float, N> enter, vector<float, N> exit)
 		: node(node),
 		  enter(enter),
 		  exit(exit)
@@ -64,19 +64,115 @@ struct KDPacketStackFrame {
 	}
 };
 
+/**
+ * @brief Callback for instrumenting traversal, e.g. with a cache model. See
+ * KDTree::intersectObserved().
+ */
+struct KDAccessObserver {
+	void (*access)(void *context, const void *address, size_t size); //!< Called for each read
+	void  *context;                                                   //!< Passed to access
+};
+
+/**
+ * @brief SIMD lane utilisation of triangle tests during traversal, summed over calls
+ */
+struct KDLaneStats {
+	uint64_t leafTests;   //!< Number of times a group of rays was tested against a leaf
+	uint64_t lanes;       //!< SIMD lanes used by the triangle tests in those leaves
+	uint64_t activeLanes; //!< Lanes in those tests whose rays still needed the result
+
+	KDLaneStats()
+		: leafTests(0),
+		  lanes(0),
+		  activeLanes(0)
+	{
+	}
+};
+
+// Longest ray stream KDTree::intersectStream() accepts
+#define KD_STREAM_MAX_RAYS 256
+
+// Ray list entries needed by a stream traversal. Every stack frame holds a list of at most
+// KD_STREAM_MAX_RAYS rays, and may sit on top of the discarded list it was split from. The
+// depth is bounded by KD_MAX_DEPTH_LIMIT, which is below 64.
+#define KD_STREAM_MAX_ENTRIES (KD_STREAM_MAX_RAYS * (2 * 64 + 1))
+
+/**
+ * @brief Rays traced together by KDTree::intersectStream(), as arrays of components. All
+ * rays must have the same direction signs, so that they agree on which child is near.
+ */
+struct KDRayStream {
+	const float *origin[3];
+	const float *direction[3];
+	const float *maxDist;
+	int          count;     //!< Number of rays, at most KD_STREAM_MAX_RAYS
+};
+
+/**
+ * @brief Working memory for KDTree::intersectStream(). Too big for the stack, so callers
+ * allocate one and reuse it.
+ */
+struct KDStreamScratch {
+	float    invDirection[3][KD_STREAM_MAX_RAYS];
+	bool     done[KD_STREAM_MAX_RAYS]; //!< Whether each ray has found its hit
+
+	// Lists of rays which traverse a node, with the part of each ray inside the node
+	uint32_t ids[KD_STREAM_MAX_ENTRIES];
+	float    enter[KD_STREAM_MAX_ENTRIES];
+	float    exit[KD_STREAM_MAX_ENTRIES];
+};
+
+/**
+ * @brief Stream traversal stack frame: a node and the list of rays which traverse it
+ */
+struct KDStreamStackFrame {
+	const GLOBAL KDNode *node;
+	uint32_t             begin; //!< First entry of the ray list in KDStreamScratch
+	uint32_t             end;   //!< One past the last entry of the ray list
+
+	FORCE_INLINE KDStreamStackFrame() {
+	}
+
+	FORCE_INLINE KDStreamStackFrame(const GLOBAL KDNode *node, uint32_t begin, uint32_t end)
+		: node(node),
+		  begin(begin),
+		  end(end)
+	{
+	}
+};
+
 /**
  * @brief KD-Tree acceleration structure
  */
 class KDTree {
 public:
 
-    KDNode                          *root;
-    util::vector<KDNode, 8>          nodes;
-    util::vector<SetupTriangle, 16>  triangles;
-    AABB                             bounds;
+    KDNode                              *root;
+    util::vector<KDNode, CACHE_LINE>     nodes;
+    util::vector<SetupTriangleBlock, 32> triangles;   //!< Leaf triangles, in blocks
+    AABB                                 bounds;
+    void                                *mapping;     //!< File nodes and triangles are mapped from, if any
+    size_t                               mappingSize; //!< Size of the mapping in bytes
+
+    KDTree();
+
+    /**
+     * @brief Destructor. Unmaps the tree's file, if it was loaded from one.
+     */
+    ~KDTree();
+
+    // Nodes and triangles may point into the mapping, which only one tree can own
+    KDTree(const KDTree & copy) = delete;
+    KDTree & operator=(const KDTree & copy) = delete;
+
+    /**
+     * @brief Exchange nodes, triangles and mapping with another tree, without copying
+     */
+    void swap(KDTree & other);
 
     /**
-     * @brief Intersect a ray against the KD-Tree
+     * @brief Intersect a ray against the KD-Tree, using the traversal kernels for the active
+     * instruction set. See kdtree/kdkernels.h.
      *
      * @param[in] stack  Reusable traversal stack
      * @param[in] ray    Ray to test
@@ -86,13 +182,78 @@ public:
      */
     bool intersect(const Ray & ray, float max, THREAD Collision & result) const;
 
+    /**
+     * @brief Intersect a ray exactly like intersect(), and report the address and size of every
+     * node and leaf triangle block the traversal reads, in order. This is slower, and is meant
+     * for measuring the traversal's memory behaviour. See kdtree/kdbenchmark.h.
+     */
+    bool intersectObserved(const Ray & ray, float max, THREAD Collision & result,
+        const KDAccessObserver & observer) const;
+
 	template<unsigned int N>
 	vector<bmask, N> intersectPacket(
 		THREAD const vector<float, N> (&origin)[3],
 		THREAD const vector<float, N> (&direction)[3],
 		THREAD const vector<float, N> & maxDist,
 		bool occlusionOnly,
-		THREAD PacketCollision<N> & result) const;
+		THREAD PacketCollision<N> & result,
+		THREAD KDLaneStats & laneStats) const;
+
+	/**
+	 * @brief Check whether anything blocks a ray before a distance, e.g. for a shadow ray. The
+	 * traversal stops at the first hit it finds, which is not necessarily the closest, and
+	 * never visits nodes beyond the distance.
+	 *
+	 * @param[in]  ray      Ray to test
+	 * @param[in]  max      Distance along the ray to test up to
+	 * @param[out] occluder ID of a triangle blocking the ray, if there is one
+	 *
+	 * @return True if something blocks the ray, or false if it is visible
+	 */
+	bool occluded(const Ray & ray, float max, THREAD unsigned int & occluder) const;
+
+	/**
+	 * @brief Packet version of occluded(). Each lane stops at its first hit, and no distances or
+	 * barycentric coordinates are computed.
+	 *
+	 * @param[in]  origin    Ray origins
+	 * @param[in]  direction Ray directions, which must have the same signs in every lane
+	 * @param[in]  maxDist   Distance along each ray to test up to
+	 * @param[out] occluder  ID of a triangle blocking each occluded ray
+	 * @param[out] laneStats Lane utilisation, added to
+	 *
+	 * @return Mask of the rays which are blocked
+	 */
+	template<unsigned int N>
+	vector<bmask, N> occludedPacket(
+		THREAD const vector<float, N> (&origin)[3],
+		THREAD const vector<float, N> (&direction)[3],
+		THREAD const vector<float, N> & maxDist,
+		THREAD vector<int, N> & occluder,
+		THREAD KDLaneStats & laneStats) const;
+
+	/**
+	 * @brief Intersect a stream of rays against the KD-Tree. Rays are not traced in fixed
+	 * packets. Instead, at each node the rays which reach it are split into a near list and a
+	 * far list, and the rays in each list are gathered into full SIMD vectors of N rays for
+	 * each test. Rays leave the lists once they hit something, so lanes are only spent on
+	 * rays that still need them, which suits incoherent secondary and shadow rays.
+	 *
+	 * @param[in]  stream        Rays to trace
+	 * @param[in]  occlusionOnly Whether any collision is enough, e.g. for shadow rays
+	 * @param[in]  scratch       Working memory
+	 * @param[out] hit           Whether each ray hit something
+	 * @param[out] result        Collision for each ray that hit something
+	 * @param[out] laneStats     Lane utilisation, added to
+	 */
+	template<unsigned int N>
+	void intersectStream(
+		const KDRayStream & stream,
+		bool occlusionOnly,
+		KDStreamScratch & scratch,
+		bool *hit,
+		THREAD Collision *result,
+		THREAD KDLaneStats & laneStats) const;
 
 };
 
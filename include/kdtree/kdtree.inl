@@ -1,6 +1,9 @@
 #ifndef __KDTREE_INL_H
 #define __KDTREE_INL_H
 
+// Traversal kernels. These are compiled once for each instruction set, each time inside its own
+// namespace, by the kdkernels_*.cpp files. See kdtree/kdkernels.h.
+
 // TODO: Can do 2, 4, 8, etc. at a time with SSE. Need to transpose to SOA
 // TODO: SSE has a min and bit scan
 // TODO: Might want to inline triangle code
@@ -13,28 +16,92 @@
 //       min and max distance, backfacing triangles.
 // TODO: Intersection-test-only mode to avoid computing barycentric? probably not
 // TODO: Might be faster to store less data and compute a bit more in triangle test
-// TODO: Cache align KD nodes, maybe other stuff: avoids false sharing during
-//       construction, allows clean caching at runtime
-// TODO: Group KD nodes in memory by some criteria. Probably want to keep top of
-//       tree in cache, allow locality to determine bottom portion to keep in
-//       cache. Might be able to micromanage this? Want to keep child nodes
-//       near parent or near each other or something. We do a depth first
-//       traversal on one thread.
 // TODO: Clone TBB's work queue for construction
 // TODO: Mailboxing is a thing. Figure out what it is.
 // TODO: Is this actually depth first? Make sure. And make sure we want that.
 // TODO: Might want a tree for light extents
 // TODO: Maybe help the heuristic with creating big empty gaps? Something about this
 //       in the SAH paper. Creating empty nodes or whatever.
-// TODO: Tweak heursitic constants
+/**
+ * @brief Start loading what a node points to, which is its children or its triangles, so that
+ * they are likely to be in cache by the time the node comes off the stack
+ */
+inline void prefetchNode(const GLOBAL KDNode *node, const GLOBAL KDNode *nodes,
+	const GLOBAL SetupTriangleBlock *triangles)
+{
+#if !GPU
+	if (node->type() != KD_LEAF)
+		_mm_prefetch((const char *)node->left(nodes), _MM_HINT_T0);
+	else if (node->count > 0)
+		_mm_prefetch((const char *)node->triangles(triangles), _MM_HINT_T0);
+#endif
+}
+
+/**
+ * @brief Whether testing a leaf's triangles against the live rays of a packet one ray at a
+ * time, TRIANGLE_SIMD triangles per test, takes fewer tests than testing the whole packet
+ * against one triangle at a time. This is the case once most of the packet has hit something
+ * or gone elsewhere, which is common for incoherent and shadow rays.
+ */
+inline bool testRaysSingly(int live, int count) {
+	return live * ((count + TRIANGLE_SIMD - 1) / TRIANGLE_SIMD) < count;
+}
+
+/**
+ * @brief Count the lanes used by testing one ray against a leaf, TRIANGLE_SIMD triangles at a time
+ */
+inline void countSingleRayLanes(THREAD KDLaneStats & laneStats, int count) {
+	laneStats.lanes += ((count + TRIANGLE_SIMD - 1) / TRIANGLE_SIMD) * TRIANGLE_SIMD;
+	laneStats.activeLanes += count;
+}
+
+/**
+ * @brief Traversal observer which does nothing, so the hooks compile away
+ */
+struct KDNullObserver {
+	FORCE_INLINE void node(const GLOBAL KDNode *node) {
+	}
+
+	FORCE_INLINE void leaf(const GLOBAL SetupTriangleBlock *triangles, int count) {
+	}
+};
+
+/**
+ * @brief Traversal observer which reports every node and triangle block read to a
+ * KDAccessObserver
+ */
+struct KDCallbackObserver {
+	const KDAccessObserver & observer;
+
+	KDCallbackObserver(const KDAccessObserver & observer)
+		: observer(observer)
+	{
+	}
+
+	FORCE_INLINE void node(const GLOBAL KDNode *node) {
+		observer.access(observer.context, node, sizeof(KDNode));
+	}
+
+	FORCE_INLINE void leaf(const GLOBAL SetupTriangleBlock *triangles, int count) {
+		if (count > 0)
+			observer.access(observer.context, triangles,
+				(count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE * sizeof(SetupTriangleBlock));
+	}
+};
+
 #if 1
-bool KDTree::intersect(const Ray & ray, float tmax, THREAD Collision & result) const
+/**
+ * @brief Single ray traversal. See KDTree::intersect(). The observer is told about every node
+ * and leaf the traversal reads, for instrumenting this exact traversal without a copy of it.
+ */
+template<typename Observer>
+bool traverse(const KDTree & tree, const Ray & ray, float tmax, THREAD Collision & result, Observer & observer)
 {
 	// http://dcgi.felk.cvut.cz/home/havran/ARTICLES/cgf2011.pdf
 
 	// TODO: use max to skip nodes, not just triangles
     
-    // TODO: the depth is bounded to 24... no need for such a big stack?
+    // The depth is bounded by KD_MAX_DEPTH_LIMIT, so the stack never overflows
 	KDStackFrame stackMem[64]; // TODO
     util::stack<KDStackFrame> stack(stackMem);
     
@@ -47,7 +114,7 @@ bool KDTree::intersect(const Ray & ray, float tmax, THREAD Collision & result) c
 	// TODO: Can precompute inv_direction when ray is created, along with ray.direction[i] < 0
 	float3 inv_direction = ray.invDirection();
     
-    if (!bounds.intersects(ray.origin, inv_direction, entry, exit))
+    if (!tree.bounds.intersects(ray.origin, inv_direction, entry, exit))
         return false;
 
 	entry = max(entry, 0.0001f);
@@ -56,7 +123,7 @@ bool KDTree::intersect(const Ray & ray, float tmax, THREAD Collision & result) c
 	if (entry > exit)
 		return false;
     
-    stack.push(KDStackFrame(root, entry, exit));
+    stack.push(KDStackFrame(tree.root, entry, exit));
     
     while (!stack.empty()) {
         KDStackFrame curr_stack = stack.pop();
@@ -65,6 +132,8 @@ bool KDTree::intersect(const Ray & ray, float tmax, THREAD Collision & result) c
         entry = curr_stack.enter;
         exit = curr_stack.exit;
         
+        observer.node(currentNode);
+
         uint32_t type = currentNode->type();
         
         while (type != KD_LEAF) {
@@ -73,8 +142,8 @@ bool KDTree::intersect(const Ray & ray, float tmax, THREAD Collision & result) c
             
             float t = (split - origin) * inv_direction[type];
             
-            const GLOBAL KDNode *nearNode = currentNode->left(&nodes[0]);
-            const GLOBAL KDNode *farNode = currentNode->right(&nodes[0]);
+            const GLOBAL KDNode *nearNode = currentNode->left(&tree.nodes[0]);
+            const GLOBAL KDNode *farNode = currentNode->right(&tree.nodes[0]);
             
 			if (ray.direction[type] < 0.0f) {
 				const GLOBAL KDNode *temp = nearNode;
@@ -89,19 +158,25 @@ bool KDTree::intersect(const Ray & ray, float tmax, THREAD Collision & result) c
 				currentNode = farNode;
 			else {
 				stack.push(KDStackFrame(farNode, max(t, entry), exit));
+				prefetchNode(farNode, &tree.nodes[0], &tree.triangles[0]);
 
 				currentNode = nearNode;
 				exit = min(t, exit);
 			}
 
-			// TODO: Significant cache miss here due to pulling node in from memory. Try prefetching or sorting rays by traversed nodes.
+			// TODO: Significant cache miss here due to pulling node in from memory. Nodes are laid out in treelets and far
+			// nodes are prefetched, but sorting rays by traversed nodes may still help.
+			observer.node(currentNode);
+
             type = currentNode->type();
         }
-        
+
+		observer.leaf(currentNode->triangles(&tree.triangles[0]), currentNode->count);
+
 		// TODO: inlining this function may help
 		hit = hit || intersects(
 			ray,
-			currentNode->triangles(&triangles[0]),
+			currentNode->triangles(&tree.triangles[0]),
 			currentNode->count,
 			entry,
 			exit,
@@ -113,6 +188,24 @@ bool KDTree::intersect(const Ray & ray, float tmax, THREAD Collision & result) c
     
     return hit;
 }
+
+/**
+ * @brief Single ray traversal. See KDTree::intersect().
+ */
+bool intersect(const KDTree & tree, const Ray & ray, float tmax, THREAD Collision & result) {
+	KDNullObserver observer;
+	return traverse(tree, ray, tmax, result, observer);
+}
+
+/**
+ * @brief Single ray traversal which reports what it reads. See KDTree::intersectObserved().
+ */
+bool intersectObserved(const KDTree & tree, const Ray & ray, float tmax, THREAD Collision & result,
+	const KDAccessObserver & observer)
+{
+	KDCallbackObserver callback(observer);
+	return traverse(tree, ray, tmax, result, callback);
+}
 #elif 1
 bool KDTree::intersect(Ray ray, float tmax, THREAD Collision & result)
 {
@@ -222,20 +315,25 @@ bool KDTree::intersect(Ray ray, float tmax, THREAD Collision & result)
 }
 #endif
 
+/**
+ * @brief Packet traversal. See KDTree::intersectPacket().
+ */
 template<unsigned int N>
-vector<bmask, N> KDTree::intersectPacket(
+vector<bmask, N> intersectPacket(
+	const KDTree & tree,
 	THREAD const vector<float, N> (&origin)[3],
 	THREAD const vector<float, N> (&direction)[3],
 	THREAD const vector<float, N> & maxDist,
 	bool occlusionOnly,
-	THREAD PacketCollision<N> & result) const
+	THREAD PacketCollision<N> & result,
+	THREAD KDLaneStats & laneStats)
 {
 	// http://dcgi.felk.cvut.cz/home/havran/ARTICLES/cgf2011.pdf
 
 	// TODO: use max to skip nodes, not just triangles
 
-	// TODO: the depth is bounded to 24... no need for such a big stack?
-	KDPacketStackFrame<4> stackMem[64]; // TODO
+	// The depth is bounded by KD_MAX_DEPTH_LIMIT, so the stack never overflows
+	KDPacketStackFrame<N> stackMem[64];
 	util::stack<KDPacketStackFrame<N>> stack(stackMem);
 
 	const GLOBAL KDNode *currentNode;
@@ -251,7 +349,7 @@ vector<bmask, N> KDTree::intersectPacket(
 		vector<float, N>(1.0f) / direction[2]
 	};
 
-	if (!any(bounds.intersectsPacket(origin, inv_direction, entry, exit)))
+	if (!any(tree.bounds.intersectsPacket(origin, inv_direction, entry, exit)))
 		return vector<bmask, N>(0x00000000);
 
 	entry = max(entry, vector<float, N>(0.0001f));
@@ -260,7 +358,7 @@ vector<bmask, N> KDTree::intersectPacket(
 	if (all(entry > exit))
 		return vector<bmask, N>(0x00000000);
 
-	stack.push(KDPacketStackFrame<N>(root, entry, exit));
+	stack.push(KDPacketStackFrame<N>(tree.root, entry, exit));
 
 	while (!stack.empty()) {
 		KDPacketStackFrame<N> curr_stack = stack.pop();
@@ -276,8 +374,8 @@ vector<bmask, N> KDTree::intersectPacket(
 
 			vector<float, N> t = (split - origin[type]) * inv_direction[type];
 
-			const GLOBAL KDNode *nearNode = currentNode->left(&nodes[0]);
-			const GLOBAL KDNode *farNode = currentNode->right(&nodes[0]);
+			const GLOBAL KDNode *nearNode = currentNode->left(&tree.nodes[0]);
+			const GLOBAL KDNode *farNode = currentNode->right(&tree.nodes[0]);
 
 			if (direction[type][0] < 0.0f) {
 				const GLOBAL KDNode *temp = nearNode;
@@ -292,27 +390,67 @@ vector<bmask, N> KDTree::intersectPacket(
 				currentNode = farNode;
 			else {
 				stack.push(KDPacketStackFrame<N>(farNode, max(t, entry), exit));
+				prefetchNode(farNode, &tree.nodes[0], &tree.triangles[0]);
 
 				currentNode = nearNode;
 				exit = min(t, exit);
 			}
 
-			// TODO: Significant cache miss here due to pulling node in from memory. Try prefetching or sorting rays by traversed nodes.
+			// TODO: Significant cache miss here due to pulling node in from memory. Nodes are laid out in treelets and far
+			// nodes are prefetched, but sorting rays by traversed nodes may still help.
 			type = currentNode->type();
 		}
 
-		// TODO: inlining this function may help
-		// Note: some rays may not have wanted to traverse this branch because they would not have hit anything. Therefore,
-		// there is no need to mask out the inactive rays' hit results.
-		hit = hit | intersectsPacket(
-			origin,
-			direction,
-			currentNode->triangles(&triangles[0]),
-			currentNode->count,
-			entry,
-			exit,
-			occlusionOnly,
-			result);
+		if (currentNode->count > 0) {
+			GLOBAL SetupTriangleBlock *leafTriangles = currentNode->triangles(&tree.triangles[0]);
+			int count = currentNode->count;
+
+			// Rays which did not want this branch, or have already hit something, still occupy lanes
+			int liveMask = laneMask((entry <= exit) & ~hit);
+			int live = _mm_popcnt_u32(liveMask);
+
+			laneStats.leafTests++;
+
+			if (testRaysSingly(live, count)) {
+				// Few rays are left, so fill the lanes with triangles instead
+				for (int k = 0; k < (int)N; k++) {
+					if (!(liveMask & (1 << k)))
+						continue;
+
+					Ray ray(float3(origin[0][k], origin[1][k], origin[2][k]),
+						float3(direction[0][k], direction[1][k], direction[2][k]));
+
+					Collision rayResult;
+
+					countSingleRayLanes(laneStats, count);
+
+					if (intersects(ray, leafTriangles, count, entry[k], exit[k], rayResult)) {
+						hit[k] = 0xFFFFFFFF;
+						result.distance[k] = rayResult.distance;
+						result.beta[k] = rayResult.beta;
+						result.gamma[k] = rayResult.gamma;
+						result.triangle_id[k] = rayResult.triangle_id;
+					}
+				}
+			}
+			else {
+				laneStats.lanes += (uint64_t)count * N;
+				laneStats.activeLanes += (uint64_t)count * live;
+
+				// TODO: inlining this function may help
+				// Note: some rays may not have wanted to traverse this branch because they would not have hit anything. Therefore,
+				// there is no need to mask out the inactive rays' hit results.
+				hit = hit | intersectsPacket(
+					origin,
+					direction,
+					leafTriangles,
+					count,
+					entry,
+					exit,
+					occlusionOnly,
+					result);
+			}
+		}
 
 		// TODO: If a ray has hit something, should we invalidate it so it doesn't impact future branching tests?
 
@@ -324,11 +462,486 @@ vector<bmask, N> KDTree::intersectPacket(
 	return hit;
 }
 
-template vector<bmask, SIMD> KDTree::intersectPacket(
-	THREAD const vector<float, SIMD> (&origin)[3],
-	THREAD const vector<float, SIMD> (&direction)[3],
-	THREAD const vector<float, SIMD> & maxDist,
-	bool occlusionOnly, // TODO: could templatize
-	THREAD PacketCollision<SIMD> & result) const;
+/**
+ * @brief Single ray occlusion traversal. See KDTree::occluded().
+ */
+bool occluded(const KDTree & tree, const Ray & ray, float tmax, THREAD unsigned int & occluder)
+{
+	// The depth is bounded by KD_MAX_DEPTH_LIMIT, so the stack never overflows
+	KDStackFrame stackMem[64];
+	util::stack<KDStackFrame> stack(stackMem);
+
+	const GLOBAL KDNode *currentNode;
+	float entry, exit;
+
+	float3 inv_direction = ray.invDirection();
+
+	if (!tree.bounds.intersects(ray.origin, inv_direction, entry, exit))
+		return false;
+
+	// Nothing past the end of the ray can occlude it, so subtrees beyond tmax are never visited
+	entry = max(entry, 0.0001f);
+	exit = min(exit, tmax);
+
+	if (entry > exit)
+		return false;
+
+	stack.push(KDStackFrame(tree.root, entry, exit));
+
+	while (!stack.empty()) {
+		KDStackFrame curr_stack = stack.pop();
+
+		currentNode = curr_stack.node;
+		entry = curr_stack.enter;
+		exit = curr_stack.exit;
+
+		uint32_t type = currentNode->type();
+
+		while (type != KD_LEAF) {
+			float t = (currentNode->split_dist - ray.origin[type]) * inv_direction[type];
+
+			const GLOBAL KDNode *nearNode = currentNode->left(&tree.nodes[0]);
+			const GLOBAL KDNode *farNode = currentNode->right(&tree.nodes[0]);
+
+			if (ray.direction[type] < 0.0f) {
+				const GLOBAL KDNode *temp = nearNode;
+				nearNode = farNode;
+				farNode = temp;
+			}
+
+			if (t > exit)
+				currentNode = nearNode;
+			else if (t < entry)
+				currentNode = farNode;
+			else {
+				stack.push(KDStackFrame(farNode, max(t, entry), exit));
+				prefetchNode(farNode, &tree.nodes[0], &tree.triangles[0]);
+
+				currentNode = nearNode;
+				exit = min(t, exit);
+			}
+
+			type = currentNode->type();
+		}
+
+		// Any hit will do, so there is no need to finish the near to far walk
+		if (occludes(ray, currentNode->triangles(&tree.triangles[0]), currentNode->count, entry, exit, occluder))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * @brief Packet occlusion traversal. See KDTree::occludedPacket().
+ */
+template<unsigned int N>
+vector<bmask, N> occludedPacket(
+	const KDTree & tree,
+	THREAD const vector<float, N> (&origin)[3],
+	THREAD const vector<float, N> (&direction)[3],
+	THREAD const vector<float, N> & maxDist,
+	THREAD vector<int, N> & occluder,
+	THREAD KDLaneStats & laneStats)
+{
+	// The depth is bounded by KD_MAX_DEPTH_LIMIT, so the stack never overflows
+	KDPacketStackFrame<N> stackMem[64];
+	util::stack<KDPacketStackFrame<N>> stack(stackMem);
+
+	const GLOBAL KDNode *currentNode;
+	vector<float, N> entry, exit;
+
+	vector<bmask, N> hit = vector<bmask, N>(0x00000000);
+
+	vector<float, N> inv_direction[3] = {
+		vector<float, N>(1.0f) / direction[0],
+		vector<float, N>(1.0f) / direction[1],
+		vector<float, N>(1.0f) / direction[2]
+	};
+
+	if (!any(tree.bounds.intersectsPacket(origin, inv_direction, entry, exit)))
+		return vector<bmask, N>(0x00000000);
+
+	// Nothing past the end of a ray can occlude it, so each lane's interval ends at its max
+	// distance, and subtrees beyond every lane's max distance are never visited
+	entry = max(entry, vector<float, N>(0.0001f));
+	exit = min(exit, maxDist);
+
+	if (all(entry > exit))
+		return vector<bmask, N>(0x00000000);
+
+	stack.push(KDPacketStackFrame<N>(tree.root, entry, exit));
+
+	while (!stack.empty()) {
+		KDPacketStackFrame<N> curr_stack = stack.pop();
+
+		currentNode = curr_stack.node;
+		entry = curr_stack.enter;
+		exit = curr_stack.exit;
+
+		// Occluded rays are finished, so they no longer pull the packet into subtrees
+		vector<bmask, N> done = (exit < entry) | hit;
+
+		if (all(done))
+			continue;
+
+		uint32_t type = currentNode->type();
+
+		while (type != KD_LEAF) {
+			vector<float, N> split(currentNode->split_dist);
+
+			vector<float, N> t = (split - origin[type]) * inv_direction[type];
+
+			const GLOBAL KDNode *nearNode = currentNode->left(&tree.nodes[0]);
+			const GLOBAL KDNode *farNode = currentNode->right(&tree.nodes[0]);
+
+			if (direction[type][0] < 0.0f) {
+				const GLOBAL KDNode *temp = nearNode;
+				nearNode = farNode;
+				farNode = temp;
+			}
+
+			if (all((t > exit) | done))
+				currentNode = nearNode;
+			else if (all((t < entry) | done))
+				currentNode = farNode;
+			else {
+				stack.push(KDPacketStackFrame<N>(farNode, max(t, entry), exit));
+				prefetchNode(farNode, &tree.nodes[0], &tree.triangles[0]);
+
+				currentNode = nearNode;
+				exit = min(t, exit);
+				done = done | (exit < entry);
+			}
+
+			type = currentNode->type();
+		}
+
+		if (currentNode->count == 0)
+			continue;
+
+		GLOBAL SetupTriangleBlock *leafTriangles = currentNode->triangles(&tree.triangles[0]);
+		int count = currentNode->count;
+
+		int liveMask = laneMask(~done);
+		int live = _mm_popcnt_u32(liveMask);
+
+		if (live == 0)
+			continue;
+
+		laneStats.leafTests++;
+
+		if (testRaysSingly(live, count)) {
+			for (int k = 0; k < (int)N; k++) {
+				if (!(liveMask & (1 << k)))
+					continue;
+
+				Ray ray(float3(origin[0][k], origin[1][k], origin[2][k]),
+					float3(direction[0][k], direction[1][k], direction[2][k]));
+
+				unsigned int rayOccluder;
+
+				countSingleRayLanes(laneStats, count);
+
+				if (occludes(ray, leafTriangles, count, entry[k], exit[k], rayOccluder)) {
+					hit[k] = 0xFFFFFFFF;
+					occluder[k] = (int)rayOccluder;
+				}
+			}
+		}
+		else {
+			laneStats.lanes += (uint64_t)count * N;
+			laneStats.activeLanes += (uint64_t)count * live;
+
+			hit = hit | occludesPacket(origin, direction, leafTriangles, count, entry, exit, done, occluder);
+		}
+
+		if (all(hit))
+			return hit;
+	}
+
+	return hit;
+}
+
+/**
+ * @brief Stream traversal. See KDTree::intersectStream().
+ *
+ * Ray lists live in the scratch memory. When a node splits a list, the rays which go near are
+ * compacted in place and the rays which go far are appended to the top, so the list for the
+ * near child is always ready and the far list waits on the stack. A list is only freed with
+ * everything above it, when the frame for the list below it is popped.
+ */
+template<unsigned int N>
+void intersectStream(
+	const KDTree & tree,
+	const KDRayStream & stream,
+	bool occlusionOnly,
+	KDStreamScratch & scratch,
+	bool *hit,
+	THREAD Collision *result,
+	THREAD KDLaneStats & laneStats)
+{
+	// http://dcgi.felk.cvut.cz/home/havran/ARTICLES/cgf2011.pdf
+	// http://fileadmin.cs.lth.se/graphics/research/papers/2014/drst/
+
+	assert(stream.count <= KD_STREAM_MAX_RAYS);
+
+	const GLOBAL KDNode *nodes = &tree.nodes[0];
+	const GLOBAL SetupTriangleBlock *triangles = &tree.triangles[0];
+
+	uint32_t *ids = scratch.ids;
+	float *enter = scratch.enter;
+	float *exit = scratch.exit;
+
+	// Clip each ray to the scene bounds to make the root list
+	uint32_t top = 0;
+
+	for (int i = 0; i < stream.count; i++) {
+		Ray ray;
+
+		for (int j = 0; j < 3; j++) {
+			ray.origin[j] = stream.origin[j][i];
+			ray.direction[j] = stream.direction[j][i];
+		}
+
+		float3 inv_direction = ray.invDirection();
+
+		for (int j = 0; j < 3; j++)
+			scratch.invDirection[j][i] = inv_direction[j];
+
+		hit[i] = false;
+		scratch.done[i] = false;
+
+		float entry, exitDist;
+
+		if (!tree.bounds.intersects(ray.origin, inv_direction, entry, exitDist))
+			continue;
+
+		entry = max(entry, 0.0001f);
+		exitDist = min(exitDist, stream.maxDist[i]);
+
+		if (entry > exitDist)
+			continue;
+
+		ids[top] = i;
+		enter[top] = entry;
+		exit[top] = exitDist;
+		top++;
+	}
+
+	if (top == 0)
+		return;
+
+	// The rays agree on which child is near, so the first ray's signs stand for all of them
+	bool negative[3] = {
+		stream.direction[0][0] < 0.0f,
+		stream.direction[1][0] < 0.0f,
+		stream.direction[2][0] < 0.0f
+	};
+
+	// The depth is bounded by KD_MAX_DEPTH_LIMIT, so the stack never overflows
+	KDStreamStackFrame stackMem[64];
+	util::stack<KDStreamStackFrame> stack(stackMem);
+
+	stack.push(KDStreamStackFrame(tree.root, 0, top));
+
+	while (!stack.empty()) {
+		KDStreamStackFrame frame = stack.pop();
+
+		const GLOBAL KDNode *currentNode = frame.node;
+		uint32_t begin = frame.begin;
+		uint32_t end = frame.end;
+
+		// Everything above this list belonged to frames which have been popped
+		top = end;
+
+		uint32_t type = currentNode->type();
+
+		while (type != KD_LEAF && end > begin) {
+			vector<float, N> split(currentNode->split_dist);
+
+			const GLOBAL KDNode *nearNode = currentNode->left(nodes);
+			const GLOBAL KDNode *farNode = currentNode->right(nodes);
+
+			if (negative[type]) {
+				const GLOBAL KDNode *temp = nearNode;
+				nearNode = farNode;
+				farNode = temp;
+			}
+
+			assert(top + (end - begin) <= KD_STREAM_MAX_ENTRIES);
+
+			uint32_t nearEnd = begin;
+			uint32_t farBegin = top;
+
+			// Classify N rays at a time. Lanes past the end of the list repeat its last ray and
+			// are ignored.
+			for (uint32_t i = begin; i < end; i += N) {
+				vector<float, N> origin, inv_direction, entry, exitDist;
+				uint32_t laneIds[N];
+				int active = (int)min((uint32_t)N, end - i);
+
+				for (int k = 0; k < (int)N; k++) {
+					uint32_t e = i + min(k, active - 1);
+					uint32_t id = ids[e];
+
+					laneIds[k] = id;
+					origin[k] = stream.origin[type][id];
+					inv_direction[k] = scratch.invDirection[type][id];
+					entry[k] = enter[e];
+					exitDist[k] = exit[e];
+				}
+
+				vector<float, N> t = (split - origin) * inv_direction;
+
+				int nearOnly = laneMask(t > exitDist);
+				int farOnly = laneMask(t < entry) & ~nearOnly;
+
+				vector<float, N> nearExit = min(t, exitDist);
+				vector<float, N> farEntry = max(t, entry);
+
+				// Compact into the near and far lists. The near list never overtakes the rays
+				// being read, and the far list is above the current list.
+				for (int k = 0; k < active; k++) {
+					uint32_t id = laneIds[k];
+
+					if (scratch.done[id])
+						continue;
+
+					if (!(farOnly & (1 << k))) {
+						ids[nearEnd] = id;
+						enter[nearEnd] = entry[k];
+						exit[nearEnd] = nearExit[k];
+						nearEnd++;
+					}
+
+					if (!(nearOnly & (1 << k))) {
+						ids[top] = id;
+						enter[top] = farEntry[k];
+						exit[top] = exitDist[k];
+						top++;
+					}
+				}
+			}
+
+			if (top > farBegin) {
+				stack.push(KDStreamStackFrame(farNode, farBegin, top));
+				prefetchNode(farNode, nodes, triangles);
+			}
+
+			currentNode = nearNode;
+			end = nearEnd;
+
+			// TODO: Significant cache miss here due to pulling node in from memory. Nodes are laid out in treelets and far
+			// nodes are prefetched, but sorting rays by traversed nodes may still help.
+			type = currentNode->type();
+		}
+
+		if (type != KD_LEAF || currentNode->count == 0)
+			continue;
+
+		GLOBAL SetupTriangleBlock *leafTriangles = currentNode->triangles(triangles);
+
+		// Test the rays still in the list against the leaf, N at a time
+		uint32_t e = begin;
+
+		while (e < end) {
+			vector<float, N> origin[3], direction[3], entry, exitDist;
+			uint32_t laneIds[N];
+			int active = 0;
+
+			// Gather the rays which have not hit anything yet. A ray in a far list may have hit
+			// something in the near subtree since the list was made.
+			for (; e < end && active < (int)N; e++) {
+				uint32_t id = ids[e];
+
+				if (scratch.done[id])
+					continue;
+
+				laneIds[active] = id;
+
+				for (int j = 0; j < 3; j++) {
+					origin[j][active] = stream.origin[j][id];
+					direction[j][active] = stream.direction[j][id];
+				}
+
+				entry[active] = enter[e];
+				exitDist[active] = exit[e];
+				active++;
+			}
+
+			if (active == 0)
+				break;
+
+			for (int k = active; k < (int)N; k++) {
+				for (int j = 0; j < 3; j++) {
+					origin[j][k] = origin[j][active - 1];
+					direction[j][k] = direction[j][active - 1];
+				}
+
+				entry[k] = entry[active - 1];
+				exitDist[k] = exitDist[active - 1];
+			}
+
+			int count = currentNode->count;
+
+			laneStats.leafTests++;
+
+			if (testRaysSingly(active, count)) {
+				// Too few rays to fill a packet, so fill the lanes with triangles instead
+				for (int k = 0; k < active; k++) {
+					uint32_t id = laneIds[k];
+
+					Ray ray(float3(origin[0][k], origin[1][k], origin[2][k]),
+						float3(direction[0][k], direction[1][k], direction[2][k]));
+
+					countSingleRayLanes(laneStats, count);
+
+					if (intersects(ray, leafTriangles, count, entry[k], exitDist[k], result[id])) {
+						hit[id] = true;
+						scratch.done[id] = true;
+					}
+				}
+
+				continue;
+			}
+
+			laneStats.lanes += (uint64_t)count * N;
+			laneStats.activeLanes += (uint64_t)count * active;
+
+			PacketCollision<N> packetResult;
+			packetResult.distance = INFINITY;
+
+			vector<bmask, N> packetHit = intersectsPacket(
+				origin,
+				direction,
+				leafTriangles,
+				count,
+				entry,
+				exitDist,
+				occlusionOnly,
+				packetResult);
+
+			// Hits are clipped to the part of the ray inside this leaf, and the rays visit
+			// leaves near to far, so the first hit is the closest one
+			int hitMask = laneMask(packetHit);
+
+			for (int k = 0; k < active; k++) {
+				if (!(hitMask & (1 << k)))
+					continue;
+
+				uint32_t id = laneIds[k];
+
+				hit[id] = true;
+				scratch.done[id] = true;
+
+				result[id].beta = packetResult.beta[k];
+				result[id].gamma = packetResult.gamma[k];
+				result[id].distance = packetResult.distance[k];
+				result[id].triangle_id = packetResult.triangle_id[k];
+			}
+		}
+	}
+}
 
 #endif
@@ -86,7 +86,7 @@ public:
      * @return Whether the ray intersected the box
      */
     // TODO test inline
-    inline bool intersects(
+    FORCE_INLINE bool intersects(
 		THREAD const float3 & origin,
 		THREAD const float3 & inv_direction,
 		THREAD float & tmin_out,
@@ -129,7 +129,7 @@ public:
     }
 
 	template<unsigned int N>
-	inline vector<bmask, N> intersectsPacket(
+	FORCE_INLINE vector<bmask, N> intersectsPacket(
 		THREAD const vector<float, N> (&origin)[3],
 		THREAD const vector<float, N> (&inv_direction)[3],
 		THREAD vector<float, N> & tmin_out,
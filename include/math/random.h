@@ -0,0 +1,118 @@
+/**
+ * @file math/random.h
+ *
+ * @brief Counter-based random number generator
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __RANDOM_H
+#define __RANDOM_H
+
+#include <math/vector.h>
+#include <stdint.h>
+
+/**
+ * @brief Finalizer from SplitMix64. Maps a 64-bit integer to a well mixed 64-bit integer.
+ */
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+
+    return x;
+}
+
+/**
+ * @brief Hash two 64-bit integers. Unlike XORing two hashes together, the result depends on
+ * the order of the arguments, and zero inputs do not produce a zero hash.
+ */
+inline uint64_t hash64(uint64_t a, uint64_t b) {
+    return mix64(mix64(a + 0x9E3779B97F4A7C15ull) ^ b);
+}
+
+/**
+ * @brief Counter-based random number stream. Each value is a hash of a key and a counter
+ * (the "dimension") rather than the next state of a shared generator, so there is no shared
+ * state between threads and the value for any (pixel, sample index, dimension) can be
+ * reproduced regardless of which thread evaluates it or in what order. Streams are cheap to
+ * construct, so one is created on the stack whenever a path needs random numbers.
+ */
+class RandomStream {
+private:
+
+    uint64_t key;       //!< Hash of the seed, pixel, and sample index
+    uint32_t dimension; //!< Index of the next value to generate
+
+public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param[in] seed      Global seed, e.g. per render
+     * @param[in] pixel     Pixel coordinates
+     * @param[in] sample    Sample index within the pixel
+     * @param[in] dimension Index of the first value to generate
+     */
+    RandomStream(uint32_t seed, const int2 & pixel, uint32_t sample, uint32_t dimension = 0)
+        : key(hash64(((uint64_t)(uint32_t)pixel.x << 32) | (uint32_t)pixel.y,
+              ((uint64_t)sample << 32) | seed)),
+          dimension(dimension)
+    {
+    }
+
+    /**
+     * @brief Get the index of the next value to generate
+     */
+    inline uint32_t getDimension() const {
+        return dimension;
+    }
+
+    /**
+     * @brief Skip to a specific dimension. Useful to give each bounce of a path a fixed range
+     * of dimensions, independent of how many values earlier bounces consumed.
+     */
+    inline void setDimension(uint32_t dimension) {
+        this->dimension = dimension;
+    }
+
+    /**
+     * @brief Generate a random 32-bit integer
+     */
+    inline uint32_t nextUInt() {
+        return (uint32_t)(mix64(key ^ (dimension++ * 0x9E3779B97F4A7C15ull)) >> 32);
+    }
+
+    /**
+     * @brief Generate a random number in [0, 1)
+     */
+    inline float next1D() {
+        // Use the top 24 bits so the result is exactly representable and strictly less than 1
+        return (float)(nextUInt() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    /**
+     * @brief Generate a random 2D sample in [0, 1)^2
+     */
+    inline float2 next2D() {
+        float x = next1D();
+        float y = next1D();
+
+        return float2(x, y);
+    }
+
+    /**
+     * @brief Generate a random 3D sample in [0, 1)^3
+     */
+    inline float3 next3D() {
+        float x = next1D();
+        float y = next1D();
+        float z = next1D();
+
+        return float3(x, y, z);
+    }
+};
+
+#endif
@@ -23,7 +23,7 @@ struct Ray {
     /**
      * @brief Constructor
      */
-    Ray() {
+    FORCE_INLINE Ray() {
     }
 
     /**
@@ -32,7 +32,7 @@ struct Ray {
      * @param[in] origin    Ray origin point
      * @param[in] direction Ray direction vector
      */
-    Ray(float3 origin, float3 direction)
+    FORCE_INLINE Ray(float3 origin, float3 direction)
         : origin(origin),
           direction(direction)
     {
@@ -48,7 +48,7 @@ struct Ray {
     /**
      * @brief Get inverse ray direction
      */
-    inline float3 invDirection() const {
+    FORCE_INLINE float3 invDirection() const {
         return float3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
     }
 };
@@ -10,76 +10,69 @@
 #ifndef __SAMPLING_H
 #define __SAMPLING_H
 
-#include <random>
+#include <math/random.h>
 
 // TODO: Maybe use a random table
-// TODO: Add an initialization function
-// TODO: Use shiny new C++ random
 // TODO: Jittered N rooks thing
 // TODO: Adaptive, importance sampling
 // TODO: Could use SSE for some of this
 // TODO: Lots of pow/sqrt/sin/cos in the hemisphere code
 // TODO: Non-uniform distributions of samples, i.e. normal/poisson
 
+// Note: All random values come from an explicit RandomStream rather than global state, so
+// results do not depend on thread count or scheduling order.
+
 /**
- * @brief Generate a random sample between 0 and 1 inclusive
+ * @brief Generate a random sample in [0, 1)
  *
- * @param[in]  count   The number of samples to be generated
- * @param[out] samples 2D array of samples
+ * @param[inout] rng Random number stream
  */
-inline float rand1D() {
-	return (float)rand() / (float)RAND_MAX;
+inline float rand1D(RandomStream & rng) {
+    return rng.next1D();
 }
 
 /**
- * @brief Generate random 2D samples between 0 and 1 inclusive
+ * @brief Generate a random 2D sample in [0, 1)^2
  *
- * @param[in]  count   The square root of the number of samples to be generated
- * @param[out] samples 2D array of samples
+ * @param[inout] rng Random number stream
  */
-inline float2 rand2D() {
-    return float2(
-        (float)rand(),
-        (float)rand()
-    ) / (float)RAND_MAX;
+inline float2 rand2D(RandomStream & rng) {
+    return rng.next2D();
 }
 
 /**
- * @brief Generate random 3D samples between 0 and 1 inclusive
+ * @brief Generate a random 3D sample in [0, 1)^3
  *
- * @param[in]  count   The number of samples to be generated
- * @param[out] samples 3D array of samples
+ * @param[inout] rng Random number stream
  */
-inline float3 rand3D() {
-    return float3(
-        (float)rand(),
-        (float)rand(),
-        (float)rand()
-    ) / (float)RAND_MAX;
+inline float3 rand3D(RandomStream & rng) {
+    return rng.next3D();
 }
 
 // TODO: Jitter sphere samples
 
 /**
- * @brief Generate a random sample between 0 and 1 inclusive, jittered to reduce variance
+ * @brief Generate a random sample in [0, 1), jittered to reduce variance
  *
- * @param[in]  count   The number of samples to be generated, less than MAX_SAMPLES.
- * @param[out] samples 2D array of samples
+ * @param[inout] rng   Random number stream
+ * @param[in]    count The number of strata
+ * @param[in]    i     Stratum index
  */
-inline float randJittered1D(int count, int i) {
-    float u = (float)rand() / (float)RAND_MAX;
-	return (i + u) / count;
+inline float randJittered1D(RandomStream & rng, int count, int i) {
+    return (i + rng.next1D()) / count;
 }
 
 /**
- * @brief Generate random 2D samples between 0 and 1 inclusive, jittered to reduce variance
+ * @brief Generate a random 2D sample in [0, 1)^2, jittered to reduce variance
  *
- * @param[in]  count   The square root of the number of samples to be generated
- * @param[out] samples 2D array of samples
+ * @param[inout] rng   Random number stream
+ * @param[in]    count The number of strata along each axis
+ * @param[in]    i     Stratum index along X
+ * @param[in]    j     Stratum index along Y
  */
 // TODO: 1 / count can be pulled out
-inline float2 randJittered2D(int count, int i, int j) {
-	return (float2(i, j) + float2(rand(), rand()) / (float)RAND_MAX) / count;
+inline float2 randJittered2D(RandomStream & rng, int count, int i, int j) {
+    return (float2(i, j) + rng.next2D()) / count;
 }
 
 /**
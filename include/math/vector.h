@@ -22,18 +22,28 @@ using namespace simd;
 #include <immintrin.h>
 #include <iostream>
 
-using std::min;
-using std::max;
 using std::swap;
 
+// Same results as std::min and std::max, including which argument is returned for NaNs, but
+// always inlined. See FORCE_INLINE.
+template<typename T>
+FORCE_INLINE T min(T a, T b) {
+	return b < a ? b : a;
+}
+
+template<typename T>
+FORCE_INLINE T max(T a, T b) {
+	return a < b ? b : a;
+}
+
 // TODO: move me
 template<typename T>
-inline T clamp(T val, T a, T b) {
+FORCE_INLINE T clamp(T val, T a, T b) {
 	return min(max(val, min), max);
 }
 
 template<typename T>
-inline T saturate(T val) {
+FORCE_INLINE T saturate(T val) {
 	return min(max(val, 0.0f), 1.0f);
 }
 
@@ -41,21 +51,21 @@ template<typename T, unsigned int N>
 struct ALIGN(16) vector {
     T _v[N];
     
-    vector<T, N>()
+    FORCE_INLINE vector<T, N>()
         : _v()
     {
     }
 
-	vector<T, N>(T v){
+	FORCE_INLINE vector<T, N>(T v){
 		for (unsigned int i = 0; i < N; i++)
 			_v[i] = v;
 	}
     
-    T & operator[](unsigned int i) {
+    FORCE_INLINE T & operator[](unsigned int i) {
         return _v[i];
     }
     
-    const T& operator[](unsigned int i) const {
+    FORCE_INLINE const T& operator[](unsigned int i) const {
         return _v[i];
     }
 };
@@ -84,21 +94,21 @@ struct vector<T, 1> {
 		};
 	};
 
-	vector<T, 1>()
+	FORCE_INLINE vector<T, 1>()
 		: _v()
 	{
 	}
 
-	vector<T, 1>(T v)
+	FORCE_INLINE vector<T, 1>(T v)
 		: x(v)
 	{
 	}
 
-	T & operator[](unsigned int i) {
+	FORCE_INLINE T & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const T& operator[](unsigned int i) const {
+	FORCE_INLINE const T& operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
@@ -113,28 +123,28 @@ struct vector<T, 2> {
         };
     };
     
-    vector<T, 2>()
+    FORCE_INLINE vector<T, 2>()
         : _v()
     {
     }
 
-    vector<T, 2>(T v)
+    FORCE_INLINE vector<T, 2>(T v)
         : x(v),
           y(v)
     {
     }
     
-    vector<T, 2>(T x, T y)
+    FORCE_INLINE vector<T, 2>(T x, T y)
         : x(x),
           y(y)
     {
     }
     
-    T & operator[](unsigned int i) {
+    FORCE_INLINE T & operator[](unsigned int i) {
         return _v[i];
     }
     
-    const T& operator[](unsigned int i) const {
+    FORCE_INLINE const T& operator[](unsigned int i) const {
         return _v[i];
     }
 };
@@ -150,37 +160,37 @@ struct vector<T, 3> {
         };
     };
     
-    vector<T, 3>()
+    FORCE_INLINE vector<T, 3>()
         : _v()
     {
     }
 
-    vector<T, 3>(T v)
+    FORCE_INLINE vector<T, 3>(T v)
         : x(v),
           y(v),
           z(v)
     {
     }
 
-	vector<T, 3>(const vector<T, 2> & xy, T z)
+	FORCE_INLINE vector<T, 3>(const vector<T, 2> & xy, T z)
 		: x(xy.x),
 		  y(xy.y),
 		  z(z)
 	{
 	}
     
-    vector<T, 3>(T x, T y, T z)
+    FORCE_INLINE vector<T, 3>(T x, T y, T z)
         : x(x),
           y(y),
           z(z)
     {
     }
     
-    T & operator[](unsigned int i) {
+    FORCE_INLINE T & operator[](unsigned int i) {
         return _v[i];
     }
     
-    const T& operator[](unsigned int i) const {
+    FORCE_INLINE const T& operator[](unsigned int i) const {
         return _v[i];
     }
 };
@@ -197,12 +207,12 @@ struct vector<T, 4> {
         };
     };
     
-    vector<T, 4>()
+    FORCE_INLINE vector<T, 4>()
         : _v()
     {
     }
 
-    vector<T, 4>(T v)
+    FORCE_INLINE vector<T, 4>(T v)
         : x(v),
           y(v),
           z(v),
@@ -210,7 +220,7 @@ struct vector<T, 4> {
     {
     }
 
-	vector<T, 4>(const vector<T, 3> & xyz, T w)
+	FORCE_INLINE vector<T, 4>(const vector<T, 3> & xyz, T w)
 		: x(xyz.x),
 	 	  y(xyz.y),
           z(xyz.z),
@@ -218,7 +228,7 @@ struct vector<T, 4> {
 	{
 	}
     
-    vector<T, 4>(T x, T y, T z, T w)
+    FORCE_INLINE vector<T, 4>(T x, T y, T z, T w)
         : x(x),
           y(y),
           z(z),
@@ -226,15 +236,15 @@ struct vector<T, 4> {
     {
     }
 
-	vector<T, 3> xyz() {
+	FORCE_INLINE vector<T, 3> xyz() {
 		return vector<T, 3>(x, y, z);
 	}
     
-    T & operator[](unsigned int i) {
+    FORCE_INLINE T & operator[](unsigned int i) {
         return _v[i];
     }
     
-    const T& operator[](unsigned int i) const {
+    FORCE_INLINE const T& operator[](unsigned int i) const {
         return _v[i];
     }
 };
@@ -242,7 +252,7 @@ struct vector<T, 4> {
 
 #if 0
 template<typename T, unsigned int N>
-inline vector<T, N> min(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> min(const vector<T, N> & lhs, const vector<T, N> & rhs) {
     vector<T, N> out;
     
     for (unsigned int i = 0; i < N; i++)
@@ -252,7 +262,7 @@ inline vector<T, N> min(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> max(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> max(const vector<T, N> & lhs, const vector<T, N> & rhs) {
     vector<T, N> out;
     
     for (unsigned int i = 0; i < N; i++)
@@ -262,7 +272,7 @@ inline vector<T, N> max(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> abs(const vector<T, N> & v) {
+FORCE_INLINE vector<T, N> abs(const vector<T, N> & v) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -272,7 +282,7 @@ inline vector<T, N> abs(const vector<T, N> & v) {
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> saturate(const vector<T, N> & v) {
+FORCE_INLINE vector<T, N> saturate(const vector<T, N> & v) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -282,63 +292,63 @@ inline vector<T, N> saturate(const vector<T, N> & v) {
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> & operator+=(vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> & operator+=(vector<T, N> & lhs, const vector<T, N> & rhs) {
     for (unsigned int i = 0; i < N; i++)
         lhs[i] += rhs[i];
     return lhs;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator+(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator+(const vector<T, N> & lhs, const vector<T, N> & rhs) {
     vector<T, N> val = lhs;
     val += rhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> & operator-=(vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> & operator-=(vector<T, N> & lhs, const vector<T, N> & rhs) {
     for (unsigned int i = 0; i < N; i++)
         lhs[i] -= rhs[i];
     return lhs;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator-(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator-(const vector<T, N> & lhs, const vector<T, N> & rhs) {
     vector<T, N> val = lhs;
     val -= rhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> & operator*=(vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> & operator*=(vector<T, N> & lhs, const vector<T, N> & rhs) {
     for (unsigned int i = 0; i < N; i++)
         lhs[i] *= rhs[i];
     return lhs;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator*(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator*(const vector<T, N> & lhs, const vector<T, N> & rhs) {
     vector<T, N> val = lhs;
     val *= rhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> & operator/=(vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> & operator/=(vector<T, N> & lhs, const vector<T, N> & rhs) {
     for (unsigned int i = 0; i < N; i++)
         lhs[i] /= rhs[i];
     return lhs;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator/(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator/(const vector<T, N> & lhs, const vector<T, N> & rhs) {
     vector<T, N> val = lhs;
     val /= rhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> & operator+=(vector<T, N> & lhs, T rhs) {
+FORCE_INLINE vector<T, N> & operator+=(vector<T, N> & lhs, T rhs) {
     for (unsigned int i = 0; i < N; i++)
         lhs[i] += rhs;
     return lhs;
@@ -348,84 +358,84 @@ inline vector<T, N> & operator+=(vector<T, N> & lhs, T rhs) {
 // they're reused?
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator+(const vector<T, N> & lhs, T rhs) {
+FORCE_INLINE vector<T, N> operator+(const vector<T, N> & lhs, T rhs) {
     vector<T, N> val = lhs;
     val += rhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator+(T lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator+(T lhs, const vector<T, N> & rhs) {
     vector<T, N> val = rhs;
     val += lhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> & operator-=(vector<T, N> & lhs, T rhs) {
+FORCE_INLINE vector<T, N> & operator-=(vector<T, N> & lhs, T rhs) {
     for (unsigned int i = 0; i < N; i++)
         lhs[i] -= rhs;
     return lhs;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator-(const vector<T, N> & lhs, T rhs) {
+FORCE_INLINE vector<T, N> operator-(const vector<T, N> & lhs, T rhs) {
     vector<T, N> val = lhs;
     val -= rhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator-(T lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator-(T lhs, const vector<T, N> & rhs) {
     vector<T, N> val = rhs;
     val -= lhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> & operator*=(vector<T, N> & lhs, T rhs) {
+FORCE_INLINE vector<T, N> & operator*=(vector<T, N> & lhs, T rhs) {
     for (unsigned int i = 0; i < N; i++)
         lhs[i] *= rhs;
     return lhs;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator*(const vector<T, N> & lhs, T rhs) {
+FORCE_INLINE vector<T, N> operator*(const vector<T, N> & lhs, T rhs) {
     vector<T, N> val = lhs;
     val *= rhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator*(T lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator*(T lhs, const vector<T, N> & rhs) {
     vector<T, N> val = rhs;
     val *= lhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> & operator/=(vector<T, N> & lhs, T rhs) {
+FORCE_INLINE vector<T, N> & operator/=(vector<T, N> & lhs, T rhs) {
     for (unsigned int i = 0; i < N; i++)
         lhs[i] /= rhs;
     return lhs;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator/(const vector<T, N> & lhs, T rhs) {
+FORCE_INLINE vector<T, N> operator/(const vector<T, N> & lhs, T rhs) {
     vector<T, N> val = lhs;
     val /= rhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator/(T lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator/(T lhs, const vector<T, N> & rhs) {
     vector<T, N> val = rhs;
     val /= lhs;
     return val;
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> operator-(const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> operator-(const vector<T, N> & rhs) {
     vector<T, N> val;
 
     for (unsigned int i = 0; i < N; i++)
@@ -435,7 +445,7 @@ inline vector<T, N> operator-(const vector<T, N> & rhs) {
 }
 
 template<typename T, unsigned int N>
-inline T any(const vector<T, N> & v) {
+FORCE_INLINE T any(const vector<T, N> & v) {
 	for (unsigned int i = 0; i < N; i++)
 		if (v[i])
 			return true;
@@ -444,7 +454,7 @@ inline T any(const vector<T, N> & v) {
 }
 
 template<typename T, unsigned int N>
-inline T all(const vector<T, N> & v) {
+FORCE_INLINE T all(const vector<T, N> & v) {
 	for (unsigned int i = 0; i < N; i++)
 		if (!v[i])
 			return false;
@@ -453,7 +463,7 @@ inline T all(const vector<T, N> & v) {
 }
 
 template<typename T, typename B, unsigned int N>
-inline vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -463,7 +473,7 @@ inline vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, c
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator<(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator<(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -473,7 +483,7 @@ inline vector<bmask, N> operator<(const vector<T, N> & lhs, const vector<T, N> &
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator<=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator<=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -483,7 +493,7 @@ inline vector<bmask, N> operator<=(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator==(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator==(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -493,7 +503,7 @@ inline vector<bmask, N> operator==(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator>=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator>=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -503,7 +513,7 @@ inline vector<bmask, N> operator>=(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator>(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator>(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -513,7 +523,7 @@ inline vector<bmask, N> operator>(const vector<T, N> & lhs, const vector<T, N> &
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator!=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator!=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -523,7 +533,7 @@ inline vector<bmask, N> operator!=(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator&&(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator&&(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -533,7 +543,7 @@ inline vector<bmask, N> operator&&(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator||(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator||(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -543,7 +553,7 @@ inline vector<bmask, N> operator||(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator!(const vector<T, N> & v) {
+FORCE_INLINE vector<bmask, N> operator!(const vector<T, N> & v) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -553,7 +563,7 @@ inline vector<bmask, N> operator!(const vector<T, N> & v) {
 }
 
 template<typename T, unsigned int N>
-inline T dot(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE T dot(const vector<T, N> & lhs, const vector<T, N> & rhs) {
     T result = 0;
 
     for (unsigned int i = 0; i < N; i++)
@@ -563,28 +573,28 @@ inline T dot(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 }
 
 template<typename T, unsigned int N>
-inline T length2(const vector<T, N> & vec) {
+FORCE_INLINE T length2(const vector<T, N> & vec) {
     return dot(vec, vec);
 }
 
 template<typename T, unsigned int N>
-inline T length(const vector<T, N> & vec) {
+FORCE_INLINE T length(const vector<T, N> & vec) {
     return static_cast<T>(sqrt(dot(vec, vec)));
 }
 
 template<unsigned int N>
-inline float length(const vector<float, N> & vec) {
+FORCE_INLINE float length(const vector<float, N> & vec) {
     return sqrtf(dot(vec, vec));
 }
 
 template<typename T, unsigned int N>
-inline vector<T, N> normalize(const vector<T, N> & v) {
+FORCE_INLINE vector<T, N> normalize(const vector<T, N> & v) {
     T len = length(v);
     return v / len;
 }
 
 template<typename T>
-inline vector<T, 3> cross(const vector<T, 3> & lhs, const vector<T, 3> & rhs) {
+FORCE_INLINE vector<T, 3> cross(const vector<T, 3> & lhs, const vector<T, 3> & rhs) {
     return vector<T, 3>(
         lhs.y * rhs.z - lhs.z * rhs.y,
         lhs.z * rhs.x - lhs.x * rhs.z,
@@ -595,7 +605,7 @@ inline vector<T, 3> cross(const vector<T, 3> & lhs, const vector<T, 3> & rhs) {
  * Reflect this vector across a normal vector. TODO.
  */
 template<typename T>
-inline vector<T, 3> reflect(const vector<T, 3> & vec, const vector<T, 3> & norm) {
+FORCE_INLINE vector<T, 3> reflect(const vector<T, 3> & vec, const vector<T, 3> & norm) {
     return 2.0f * dot(vec, norm) * norm - vec;
 }
 
@@ -608,7 +618,7 @@ inline vector<T, 3> reflect(const vector<T, 3> & vec, const vector<T, 3> & norm)
  * @param n2   Index of refractio nof material being entered
  */
 template<typename T>
-inline vector<T, 3> refract(const vector<T, 3> & vec, const vector<T, 3> & norm, float n1, float n2) {
+FORCE_INLINE vector<T, 3> refract(const vector<T, 3> & vec, const vector<T, 3> & norm, float n1, float n2) {
     vector<T, 3> L = -vec;
     vector<T, 3> N = norm;
 
@@ -634,7 +644,7 @@ inline vector<T, 3> refract(const vector<T, 3> & vec, const vector<T, 3> & norm,
  * 1 = reflection only
  */
 template<typename T>
-inline float schlick(const vector<T, 3> & n, const vector<T, 3> & v, float n1, float n2) {
+FORCE_INLINE float schlick(const vector<T, 3> & n, const vector<T, 3> & v, float n1, float n2) {
     // TODO specular highlights can use this too?
 
     float cos_i = dot(n, v);
@@ -661,80 +671,80 @@ struct ALIGN(16) vector<float, 2> {
 		__m128 _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_ps())
 	{
 	}
 
-	vector(float v)
-		: _s(_mm_broadcast_ss(&v))
+	FORCE_INLINE vector(float v)
+		: _s(_mm_set1_ps(v))
 	{
 	}
 
-	vector(float x, float y)
+	FORCE_INLINE vector(float x, float y)
 		: _s(_mm_setr_ps(x, y, 0.0f, 0.0f))
 	{
 	}
 
-	vector(__m128 s)
+	FORCE_INLINE vector(__m128 s)
 		: _s(s)
 	{
 	}
 
-	float & operator[](unsigned int i) {
+	FORCE_INLINE float & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const float & operator[](unsigned int i) const {
+	FORCE_INLINE const float & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
 
 template<unsigned int N, unsigned int X, unsigned int Y, unsigned int Z, unsigned int W, unsigned int M>
-inline vector<float, N> shuffle(const vector<float, M> v) {
+FORCE_INLINE vector<float, N> shuffle(const vector<float, M> v) {
 	return _mm_shuffle_ps(v._s, v._s, _MM_SHUFFLE(X, Y, Z, W));
 }
 
-inline vector<float, 2> min(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<float, 2> min(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_min_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 2> max(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<float, 2> max(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_max_ps(lhs._s, rhs._s);
 }
 
 // TODO: abs
 // TODO: saturate. Note: SSE has special functions for saturation
 
-inline vector<float, 2> operator+(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<float, 2> operator+(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_add_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 2> operator-(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<float, 2> operator-(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_sub_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 2> operator-(const vector<float, 2> & vec) {
+FORCE_INLINE vector<float, 2> operator-(const vector<float, 2> & vec) {
 	return _mm_sub_ps(_mm_set1_ps(0.0f), vec._s);
 }
 
-inline vector<float, 2> operator*(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<float, 2> operator*(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_mul_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 2> operator/(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<float, 2> operator/(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_div_ps(lhs._s, rhs._s);
 }
 
-inline float dot(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE float dot(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return vector<float, 2>(_mm_dp_ps(lhs._s, rhs._s, 0x3F)).x;
 }
 
-inline float length(const vector<float, 2> & vec) {
+FORCE_INLINE float length(const vector<float, 2> & vec) {
 	return vector<float, 2>(_mm_sqrt_ps(_mm_dp_ps(vec._s, vec._s, 0x3F))).x;
 }
 
-inline vector<float, 2> normalize(const vector<float, 2> & vec) {
+FORCE_INLINE vector<float, 2> normalize(const vector<float, 2> & vec) {
 	return _mm_div_ps(vec._s, _mm_sqrt_ps(_mm_dp_ps(vec._s, vec._s, 0x3F)));
 }
 
@@ -751,88 +761,88 @@ struct ALIGN(16) vector<float, 3> {
 		__m128 _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_ps())
 	{
 	}
 
-	vector(float v)
-		: _s(_mm_broadcast_ss(&v))
+	FORCE_INLINE vector(float v)
+		: _s(_mm_set1_ps(v))
 	{
 	}
 
 #if 0
-	vector(const vector<float, 2> & xy, float z)
+	FORCE_INLINE vector(const vector<float, 2> & xy, float z)
 		: _s(_mm_setr_ps(xy.x, xy.y, z, 0.0f)) // TODO
 	{
 	}
 #endif
 
-	vector(float x, float y, float z)
+	FORCE_INLINE vector(float x, float y, float z)
 		: _s(_mm_setr_ps(x, y, z, 0.0f))
 	{
 	}
 
-	vector(__m128 s)
+	FORCE_INLINE vector(__m128 s)
 		: _s(s)
 	{
 	}
 
-	float & operator[](unsigned int i) {
+	FORCE_INLINE float & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const float & operator[](unsigned int i) const {
+	FORCE_INLINE const float & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
 
-inline vector<float, 3> min(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<float, 3> min(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return _mm_min_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 3> max(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<float, 3> max(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return _mm_max_ps(lhs._s, rhs._s);
 }
 
 // TODO: abs
 // TODO: saturate. Note: SSE has special functions for saturation
 
-inline vector<float, 3> operator+(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<float, 3> operator+(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return _mm_add_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 3> operator-(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<float, 3> operator-(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return _mm_sub_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 3> operator-(const vector<float, 3> & vec) {
+FORCE_INLINE vector<float, 3> operator-(const vector<float, 3> & vec) {
 	return _mm_sub_ps(_mm_set1_ps(0.0f), vec._s);
 }
 
-inline vector<float, 3> operator*(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<float, 3> operator*(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return _mm_mul_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 3> operator/(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<float, 3> operator/(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return _mm_div_ps(lhs._s, rhs._s);
 }
 
-inline float dot(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE float dot(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return vector<float, 3>(_mm_dp_ps(lhs._s, rhs._s, 0x71)).x;
 }
 
-inline float length(const vector<float, 3> & vec) {
+FORCE_INLINE float length(const vector<float, 3> & vec) {
 	return vector<float, 3>(_mm_sqrt_ps(_mm_dp_ps(vec._s, vec._s, 0x7F))).x;
 }
 
-inline vector<float, 3> normalize(const vector<float, 3> & vec) {
+FORCE_INLINE vector<float, 3> normalize(const vector<float, 3> & vec) {
 	// TODO: Check if rsqrt is accurate enough and faster
 	return _mm_div_ps(vec._s, _mm_sqrt_ps(_mm_dp_ps(vec._s, vec._s, 0x7F)));
 }
 
 // TODO: These can probably be implemented more efficiently
-inline vector<float, 3> cross(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<float, 3> cross(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return vector<float, 3>(
 		lhs.y * rhs.z - lhs.z * rhs.y,
 		lhs.z * rhs.x - lhs.x * rhs.z,
@@ -842,7 +852,7 @@ inline vector<float, 3> cross(const vector<float, 3> & lhs, const vector<float,
 /**
 * Reflect this vector across a normal vector. TODO.
 */
-inline vector<float, 3> reflect(const vector<float, 3> & vec, const vector<float, 3> & norm) {
+FORCE_INLINE vector<float, 3> reflect(const vector<float, 3> & vec, const vector<float, 3> & norm) {
 	return 2.0f * dot(vec, norm) * norm - vec;
 }
 
@@ -854,7 +864,7 @@ inline vector<float, 3> reflect(const vector<float, 3> & vec, const vector<float
 * @param n1   Index of refraction of material being left
 * @param n2   Index of refractio nof material being entered
 */
-inline vector<float, 3> refract(const vector<float, 3> & vec, const vector<float, 3> & norm, float n1, float n2) {
+FORCE_INLINE vector<float, 3> refract(const vector<float, 3> & vec, const vector<float, 3> & norm, float n1, float n2) {
 	vector<float, 3> L = -vec;
 	vector<float, 3> N = norm;
 
@@ -879,7 +889,7 @@ inline vector<float, 3> refract(const vector<float, 3> & vec, const vector<float
 * @return A factor for blending reflection and refraction. 0 = refraction only,
 * 1 = reflection only
 */
-inline float schlick(const vector<float, 3> & n, const vector<float, 3> & v, float n1, float n2) {
+FORCE_INLINE float schlick(const vector<float, 3> & n, const vector<float, 3> & v, float n1, float n2) {
 	// TODO specular highlights can use this too?
 
 	float cos_i = dot(n, v);
@@ -894,7 +904,7 @@ inline float schlick(const vector<float, 3> & n, const vector<float, 3> & v, flo
 
 #if 0
 template<typename T, unsigned int N>
-inline T any(const vector<T, N> & v) {
+FORCE_INLINE T any(const vector<T, N> & v) {
 	for (unsigned int i = 0; i < N; i++)
 		if (v[i])
 			return true;
@@ -903,7 +913,7 @@ inline T any(const vector<T, N> & v) {
 }
 
 template<typename T, unsigned int N>
-inline T all(const vector<T, N> & v) {
+FORCE_INLINE T all(const vector<T, N> & v) {
 	for (unsigned int i = 0; i < N; i++)
 		if (!v[i])
 			return false;
@@ -912,7 +922,7 @@ inline T all(const vector<T, N> & v) {
 }
 
 template<typename T, typename B, unsigned int N>
-inline vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -924,7 +934,7 @@ inline vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, c
 
 #if 0
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator<(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator<(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -934,7 +944,7 @@ inline vector<bmask, N> operator<(const vector<T, N> & lhs, const vector<T, N> &
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator<=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator<=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -944,7 +954,7 @@ inline vector<bmask, N> operator<=(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator==(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator==(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -954,7 +964,7 @@ inline vector<bmask, N> operator==(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator>=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator>=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -964,7 +974,7 @@ inline vector<bmask, N> operator>=(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator>(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator>(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -974,7 +984,7 @@ inline vector<bmask, N> operator>(const vector<T, N> & lhs, const vector<T, N> &
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator!=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator!=(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<bmask, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -984,7 +994,7 @@ inline vector<bmask, N> operator!=(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator&&(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator&&(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -994,7 +1004,7 @@ inline vector<bmask, N> operator&&(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator||(const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<bmask, N> operator||(const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -1004,7 +1014,7 @@ inline vector<bmask, N> operator||(const vector<T, N> & lhs, const vector<T, N>
 }
 
 template<typename T, unsigned int N>
-inline vector<bmask, N> operator!(const vector<T, N> & v) {
+FORCE_INLINE vector<bmask, N> operator!(const vector<T, N> & v) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -1027,99 +1037,99 @@ struct ALIGN(16) vector<float, 4> {
 		__m128 _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_ps())
 	{
 	}
 
-	vector(float v)
-		: _s(_mm_broadcast_ss(&v))
+	FORCE_INLINE vector(float v)
+		: _s(_mm_set1_ps(v))
 	{
 	}
 
-    vector(const vector<float, 2> & xy, float z, float w)
+    FORCE_INLINE vector(const vector<float, 2> & xy, float z, float w)
         : _s(_mm_setr_ps(xy.x, xy.y, z, w))
     {
     }
 
-	vector(const vector<float, 3> & xyz, float w)
+	FORCE_INLINE vector(const vector<float, 3> & xyz, float w)
 		: _s(_mm_setr_ps(xyz.x, xyz.y, xyz.z, w)) // TODO
 	{
 	}
 
-	vector(float x, float y, float z, float w)
+	FORCE_INLINE vector(float x, float y, float z, float w)
 		: _s(_mm_setr_ps(x, y, z, w))
 	{
 	}
 
-	vector(__m128 s)
+	FORCE_INLINE vector(__m128 s)
 		: _s(s)
 	{
 	}
 
-    vector<float, 2> xy() {
+    FORCE_INLINE vector<float, 2> xy() {
         return vector<float, 2>(_s);
     }
 
-	vector<float, 3> xyz() {
+	FORCE_INLINE vector<float, 3> xyz() {
 		return vector<float, 3>(_s);
 	}
 
-	float & operator[](unsigned int i) {
+	FORCE_INLINE float & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const float & operator[](unsigned int i) const {
+	FORCE_INLINE const float & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
 
-inline vector<float, 4> min(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<float, 4> min(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return _mm_min_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 4> max(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<float, 4> max(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return _mm_max_ps(lhs._s, rhs._s);
 }
 
 // TODO: abs
 // TODO: saturate. Note: SSE has special functions for saturation
 
-inline vector<float, 4> operator+(const vector<float, 4> lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<float, 4> operator+(const vector<float, 4> lhs, const vector<float, 4> & rhs) {
 	return _mm_add_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 4> operator-(const vector<float, 4> lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<float, 4> operator-(const vector<float, 4> lhs, const vector<float, 4> & rhs) {
 	return _mm_sub_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 4> operator-(const vector<float, 4> & vec) {
+FORCE_INLINE vector<float, 4> operator-(const vector<float, 4> & vec) {
 	return _mm_sub_ps(_mm_set1_ps(0.0f), vec._s);
 }
 
-inline vector<float, 4> operator*(const vector<float, 4> lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<float, 4> operator*(const vector<float, 4> lhs, const vector<float, 4> & rhs) {
 	return _mm_mul_ps(lhs._s, rhs._s);
 }
 
-inline vector<float, 4> operator/(const vector<float, 4> lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<float, 4> operator/(const vector<float, 4> lhs, const vector<float, 4> & rhs) {
 	return _mm_div_ps(lhs._s, rhs._s);
 }
 
-inline float dot(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE float dot(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return vector<float, 4>(_mm_dp_ps(lhs._s, rhs._s, 0xFF)).x;
 }
 
-inline float length(const vector<float, 4> & vec) {
+FORCE_INLINE float length(const vector<float, 4> & vec) {
 	return vector<float, 4>(_mm_sqrt_ps(_mm_dp_ps(vec._s, vec._s, 0xFF))).x;
 }
 
-inline vector<float, 4> normalize(const vector<float, 4> & vec) {
+FORCE_INLINE vector<float, 4> normalize(const vector<float, 4> & vec) {
 	return _mm_div_ps(vec._s, _mm_sqrt_ps(_mm_dp_ps(vec._s, vec._s, 0xFF)));
 }
 
 #if 0
 template<typename T, unsigned int N>
-inline T any(const vector<T, N> & v) {
+FORCE_INLINE T any(const vector<T, N> & v) {
 	for (unsigned int i = 0; i < N; i++)
 		if (v[i])
 			return true;
@@ -1128,7 +1138,7 @@ inline T any(const vector<T, N> & v) {
 }
 
 template<typename T, unsigned int N>
-inline T all(const vector<T, N> & v) {
+FORCE_INLINE T all(const vector<T, N> & v) {
 	for (unsigned int i = 0; i < N; i++)
 		if (!v[i])
 			return false;
@@ -1137,7 +1147,7 @@ inline T all(const vector<T, N> & v) {
 }
 
 template<typename T, typename B, unsigned int N>
-inline vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -1160,44 +1170,44 @@ struct ALIGN(16) vector<bmask, 2> {
 		__m128 _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_ps())
 	{
 	}
 
-	vector(bmask v)
+	FORCE_INLINE vector(bmask v)
 		: _s(_mm_castsi128_ps(_mm_set1_epi32(v)))
 	{
 	}
 
 #if 0
-	vector(const vector<bmask, 3> & xyz, bmask w)
+	FORCE_INLINE vector(const vector<bmask, 3> & xyz, bmask w)
 		: _s(_mm_setr_ps(xyz.x, xyz.y, xyz.z, w)) // TODO
 	{
 	}
 #endif
 
-	vector(bmask x, bmask y)
+	FORCE_INLINE vector(bmask x, bmask y)
 		: _s(_mm_castsi128_ps(_mm_setr_epi32(x, y, 0, 0)))
 	{
 	}
 
-	vector(__m128 s)
+	FORCE_INLINE vector(__m128 s)
 		: _s(s)
 	{
 	}
 
 #if 0
-	vector<bmask, 3> xyz() {
+	FORCE_INLINE vector<bmask, 3> xyz() {
 		return vector<bmask, 3 >(_s);
 	}
 #endif
 
-	bmask & operator[](unsigned int i) {
+	FORCE_INLINE bmask & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const bmask & operator[](unsigned int i) const {
+	FORCE_INLINE const bmask & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
@@ -1215,44 +1225,44 @@ struct ALIGN(16) vector<bmask, 3> {
 		__m128 _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_ps())
 	{
 	}
 
-	vector(bmask v)
+	FORCE_INLINE vector(bmask v)
 		: _s(_mm_castsi128_ps(_mm_set1_epi32(v)))
 	{
 	}
 
 #if 0
-	vector(const vector<bmask, 3> & xyz, bmask w)
+	FORCE_INLINE vector(const vector<bmask, 3> & xyz, bmask w)
 		: _s(_mm_setr_ps(xyz.x, xyz.y, xyz.z, w)) // TODO
 	{
 	}
 #endif
 
-	vector(bmask x, bmask y, bmask z)
+	FORCE_INLINE vector(bmask x, bmask y, bmask z)
 		: _s(_mm_castsi128_ps(_mm_setr_epi32(x, y, z, 0)))
 	{
 	}
 
-	vector(__m128 s)
+	FORCE_INLINE vector(__m128 s)
 		: _s(s)
 	{
 	}
 
 #if 0
-	vector<bmask, 3> xyz() {
+	FORCE_INLINE vector<bmask, 3> xyz() {
 		return vector<bmask, 3 >(_s);
 	}
 #endif
 
-	bmask & operator[](unsigned int i) {
+	FORCE_INLINE bmask & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const bmask & operator[](unsigned int i) const {
+	FORCE_INLINE const bmask & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
@@ -1270,123 +1280,123 @@ struct ALIGN(16) vector<bmask, 4> {
 		__m128 _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_ps())
 	{
 	}
 
-	vector(bmask v)
+	FORCE_INLINE vector(bmask v)
 		: _s(_mm_castsi128_ps(_mm_set1_epi32(v)))
 	{
 	}
 
 #if 0
-	vector(const vector<bmask, 3> & xyz, bmask w)
+	FORCE_INLINE vector(const vector<bmask, 3> & xyz, bmask w)
 		: _s(_mm_setr_ps(xyz.x, xyz.y, xyz.z, w)) // TODO
 	{
 	}
 #endif
 
-	vector(bmask x, bmask y, bmask z, bmask w)
+	FORCE_INLINE vector(bmask x, bmask y, bmask z, bmask w)
 		: _s(_mm_castsi128_ps(_mm_setr_epi32(x, y, z, w)))
 	{
 	}
 
-	vector(__m128 s)
+	FORCE_INLINE vector(__m128 s)
 		: _s(s)
 	{
 	}
 
 #if 0
-	vector<bmask, 3> xyz() {
+	FORCE_INLINE vector<bmask, 3> xyz() {
 		return vector<bmask, 3 >(_s);
 	}
 #endif
 
-	bmask & operator[](unsigned int i) {
+	FORCE_INLINE bmask & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const bmask & operator[](unsigned int i) const {
+	FORCE_INLINE const bmask & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
 
-inline vector<bmask, 2> operator<(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<bmask, 2> operator<(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_cmplt_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 2> operator<=(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<bmask, 2> operator<=(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_cmple_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 2> operator==(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<bmask, 2> operator==(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_cmpeq_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 2> operator>=(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<bmask, 2> operator>=(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_cmpge_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 2> operator>(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<bmask, 2> operator>(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_cmpgt_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 2> operator!=(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<bmask, 2> operator!=(const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_cmpneq_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 3> operator<(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<bmask, 3> operator<(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
     return _mm_cmplt_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 3> operator<=(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<bmask, 3> operator<=(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
     return _mm_cmple_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 3> operator==(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<bmask, 3> operator==(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
     return _mm_cmpeq_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 3> operator>=(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<bmask, 3> operator>=(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
     return _mm_cmpge_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 3> operator>(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<bmask, 3> operator>(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
     return _mm_cmpgt_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 3> operator!=(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<bmask, 3> operator!=(const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
     return _mm_cmpneq_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator<(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator<(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
     return _mm_cmplt_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator<=(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator<=(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return _mm_cmple_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator==(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator==(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return _mm_cmpeq_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator>=(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator>=(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return _mm_cmpge_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator>(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator>(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return _mm_cmpgt_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator!=(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator!=(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return _mm_cmpneq_ps(lhs._s, rhs._s);
 }
 
 #if 0
 template<>
-inline vector<bmask, 4> operator&&(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator&&(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	vector<float, 4> out;
 
 	for (unsigned int i = 0; i < 4; i++)
@@ -1396,7 +1406,7 @@ inline vector<bmask, 4> operator&&(const vector<float, 4> & lhs, const vector<fl
 }
 
 template<>
-inline vector<bmask, 4> operator||(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator||(const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	vector<float, 4> out;
 
 	for (unsigned int i = 0; i < 4; i++)
@@ -1406,7 +1416,7 @@ inline vector<bmask, 4> operator||(const vector<float, 4> & lhs, const vector<fl
 }
 
 template<>
-inline vector<bmask, 4> operator!(const vector<float, 4> & v) {
+FORCE_INLINE vector<bmask, 4> operator!(const vector<float, 4> & v) {
 	vector<float, 4> out;
 
 	for (unsigned int i = 0; i < 4; i++)
@@ -1418,7 +1428,7 @@ inline vector<bmask, 4> operator!(const vector<float, 4> & v) {
 
 #if 0
 template<typename T, unsigned int N>
-inline T any(const vector<T, N> & v) {
+FORCE_INLINE T any(const vector<T, N> & v) {
 	for (unsigned int i = 0; i < N; i++)
 		if (v[i])
 			return true;
@@ -1427,7 +1437,7 @@ inline T any(const vector<T, N> & v) {
 }
 
 template<typename T, unsigned int N>
-inline T all(const vector<T, N> & v) {
+FORCE_INLINE T all(const vector<T, N> & v) {
 	for (unsigned int i = 0; i < N; i++)
 		if (!v[i])
 			return false;
@@ -1436,7 +1446,7 @@ inline T all(const vector<T, N> & v) {
 }
 
 template<typename T, typename B, unsigned int N>
-inline vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, const vector<T, N> & rhs) {
+FORCE_INLINE vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, const vector<T, N> & rhs) {
 	vector<T, N> out;
 
 	for (unsigned int i = 0; i < N; i++)
@@ -1446,80 +1456,87 @@ inline vector<T, N> blend(const vector<B, N> & mask, const vector<T, N> & lhs, c
 }
 #endif
 
-inline vector<bmask, 4> operator==(const vector<bmask, 4> & lhs, const vector<bmask, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator==(const vector<bmask, 4> & lhs, const vector<bmask, 4> & rhs) {
 	return _mm_cmpeq_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator!=(const vector<bmask, 4> & lhs, const vector<bmask, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator!=(const vector<bmask, 4> & lhs, const vector<bmask, 4> & rhs) {
 	return _mm_cmpneq_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 2> operator&(const vector<bmask, 2> & lhs, const vector<bmask, 2> & rhs) {
+FORCE_INLINE vector<bmask, 2> operator&(const vector<bmask, 2> & lhs, const vector<bmask, 2> & rhs) {
 	return _mm_and_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 2> operator|(const vector<bmask, 2> & lhs, const vector<bmask, 2> & rhs) {
+FORCE_INLINE vector<bmask, 2> operator|(const vector<bmask, 2> & lhs, const vector<bmask, 2> & rhs) {
 	return _mm_or_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 3> operator&(const vector<bmask, 3> & lhs, const vector<bmask, 3> & rhs) {
+FORCE_INLINE vector<bmask, 3> operator&(const vector<bmask, 3> & lhs, const vector<bmask, 3> & rhs) {
 	return _mm_and_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 3> operator|(const vector<bmask, 3> & lhs, const vector<bmask, 3> & rhs) {
+FORCE_INLINE vector<bmask, 3> operator|(const vector<bmask, 3> & lhs, const vector<bmask, 3> & rhs) {
 	return _mm_or_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator&(const vector<bmask, 4> & lhs, const vector<bmask, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator&(const vector<bmask, 4> & lhs, const vector<bmask, 4> & rhs) {
 	return _mm_and_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 4> operator|(const vector<bmask, 4> & lhs, const vector<bmask, 4> & rhs) {
+FORCE_INLINE vector<bmask, 4> operator|(const vector<bmask, 4> & lhs, const vector<bmask, 4> & rhs) {
 	return _mm_or_ps(lhs._s, rhs._s);
 }
 
-inline vector<bmask, 2> operator~(const vector<bmask, 2> & v) {
+FORCE_INLINE vector<bmask, 2> operator~(const vector<bmask, 2> & v) {
 	__m128 mask = _mm_cmpge_ps(_mm_setzero_ps(), _mm_setzero_ps());
 	return _mm_andnot_ps(v._s, mask);
 }
 
-inline vector<bmask, 3> operator~(const vector<bmask, 3> & v) {
+FORCE_INLINE vector<bmask, 3> operator~(const vector<bmask, 3> & v) {
 	__m128 mask = _mm_cmpge_ps(_mm_setzero_ps(), _mm_setzero_ps());
 	return _mm_andnot_ps(v._s, mask);
 }
 
-inline vector<bmask, 4> operator~(const vector<bmask, 4> & v) {
+FORCE_INLINE vector<bmask, 4> operator~(const vector<bmask, 4> & v) {
 	__m128 mask = _mm_cmpge_ps(_mm_setzero_ps(), _mm_setzero_ps());
 	return _mm_andnot_ps(v._s, mask);
 }
 
-inline vector<float, 2> blend(const vector<bmask, 2> & mask, const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
+FORCE_INLINE vector<float, 2> blend(const vector<bmask, 2> & mask, const vector<float, 2> & lhs, const vector<float, 2> & rhs) {
 	return _mm_blendv_ps(lhs._s, rhs._s, mask._s);
 }
 
-inline vector<float, 3> blend(const vector<bmask, 3> & mask, const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
+FORCE_INLINE vector<float, 3> blend(const vector<bmask, 3> & mask, const vector<float, 3> & lhs, const vector<float, 3> & rhs) {
 	return _mm_blendv_ps(lhs._s, rhs._s, mask._s);
 }
 
-inline vector<float, 4> blend(const vector<bmask, 4> & mask, const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
+FORCE_INLINE vector<float, 4> blend(const vector<bmask, 4> & mask, const vector<float, 4> & lhs, const vector<float, 4> & rhs) {
 	return _mm_blendv_ps(lhs._s, rhs._s, mask._s);
 }
 
-inline bool none(const vector<bmask, 4> & v) {
+FORCE_INLINE bool none(const vector<bmask, 4> & v) {
 	return _mm_movemask_ps(v._s) == 0x00000000;
 	// TODO: more efficient way?
 }
 
-inline bool any(const vector<bmask, 4> & v) {
+FORCE_INLINE bool any(const vector<bmask, 4> & v) {
 	return _mm_movemask_ps(v._s) != 0x00000000;
 	// TODO: more efficient way?
 }
 
-inline bool all(const vector<bmask, 4> & v) {
+FORCE_INLINE bool all(const vector<bmask, 4> & v) {
 	return _mm_movemask_ps(v._s) == 0x0000000F;
 	// TODO: more efficient way?
 }
 
+/**
+ * @brief Pack a mask into an integer with one bit per lane
+ */
+FORCE_INLINE int laneMask(const vector<bmask, 4> & v) {
+	return _mm_movemask_ps(v._s);
+}
+
 template<>
 struct ALIGN(16) vector<int, 2> {
 	union {
@@ -1533,31 +1550,31 @@ struct ALIGN(16) vector<int, 2> {
 		__m128i _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_si128())
 	{
 	}
 
-	vector(int v)
+	FORCE_INLINE vector(int v)
 		: _s(_mm_set1_epi32(v))
 	{
 	}
 
-	vector(int x, int y)
+	FORCE_INLINE vector(int x, int y)
 		: _s(_mm_setr_epi32(x, y, 0, 0))
 	{
 	}
 
-	vector(__m128i s)
+	FORCE_INLINE vector(__m128i s)
 		: _s(s)
 	{
 	}
 
-	int & operator[](unsigned int i) {
+	FORCE_INLINE int & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const int & operator[](unsigned int i) const {
+	FORCE_INLINE const int & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
@@ -1575,31 +1592,31 @@ struct ALIGN(16) vector<int, 3> {
 		__m128i _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_si128())
 	{
 	}
 
-	vector(int v)
+	FORCE_INLINE vector(int v)
 		: _s(_mm_set1_epi32(v))
 	{
 	}
 
-	vector(int x, int y, int z)
+	FORCE_INLINE vector(int x, int y, int z)
 		: _s(_mm_setr_epi32(x, y, z, 0))
 	{
 	}
 
-	vector(__m128i s)
+	FORCE_INLINE vector(__m128i s)
 		: _s(s)
 	{
 	}
 
-	int & operator[](unsigned int i) {
+	FORCE_INLINE int & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const int & operator[](unsigned int i) const {
+	FORCE_INLINE const int & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
@@ -1617,41 +1634,473 @@ struct ALIGN(16) vector<int, 4> {
 		__m128i _s;
 	};
 
-	vector()
+	FORCE_INLINE vector()
 		: _s(_mm_setzero_si128())
 	{
 	}
 
-	vector(int v)
+	FORCE_INLINE vector(int v)
 		: _s(_mm_set1_epi32(v))
 	{
 	}
 
-	vector(int x, int y, int z, int w)
+	FORCE_INLINE vector(int x, int y, int z, int w)
 		: _s(_mm_setr_epi32(x, y, z, w))
 	{
 	}
 
-	vector(__m128i s)
+	FORCE_INLINE vector(__m128i s)
 		: _s(s)
 	{
 	}
 
-	int & operator[](unsigned int i) {
+	FORCE_INLINE int & operator[](unsigned int i) {
 		return _v[i];
 	}
 
-	const int & operator[](unsigned int i) const {
+	FORCE_INLINE const int & operator[](unsigned int i) const {
 		return _v[i];
 	}
 };
 
-inline vector<int, 4> blend(const vector<bmask, 4> & mask, const vector<int, 4> & lhs, const vector<int, 4> & rhs) {
+FORCE_INLINE vector<int, 4> blend(const vector<bmask, 4> & mask, const vector<int, 4> & lhs, const vector<int, 4> & rhs) {
 	// TODO: Conversion between float and int vector pipes may be a problem
 	// TODO: make sure the masking is compatible
 	return _mm_blendv_epi8(lhs._s, rhs._s, _mm_castps_si128(mask._s));
 }
 
+// 8 and 16 wide vectors for ray packets. Code built without AVX or AVX-512 can still store
+// and index them, so that it can hand packets to traversal kernels built for those instruction
+// sets. Arithmetic is only available where the compiler targets the instruction set.
+
+template<>
+struct ALIGN(32) vector<float, 8> {
+	union {
+		float _v[8];
+#if defined(__AVX__)
+		__m256 _s;
+#endif
+	};
+
+	FORCE_INLINE vector()
+		: _v()
+	{
+	}
+
+	FORCE_INLINE vector(float v) {
+#if defined(__AVX__)
+		_s = _mm256_set1_ps(v);
+#else
+		for (unsigned int i = 0; i < 8; i++)
+			_v[i] = v;
+#endif
+	}
+
+#if defined(__AVX__)
+	FORCE_INLINE vector(__m256 s)
+		: _s(s)
+	{
+	}
+#endif
+
+	FORCE_INLINE float & operator[](unsigned int i) {
+		return _v[i];
+	}
+
+	FORCE_INLINE const float & operator[](unsigned int i) const {
+		return _v[i];
+	}
+};
+
+template<>
+struct ALIGN(32) vector<bmask, 8> {
+	union {
+		bmask _v[8];
+#if defined(__AVX__)
+		__m256 _s;
+#endif
+	};
+
+	FORCE_INLINE vector()
+		: _v()
+	{
+	}
+
+	FORCE_INLINE vector(bmask v) {
+#if defined(__AVX__)
+		_s = _mm256_castsi256_ps(_mm256_set1_epi32(v));
+#else
+		for (unsigned int i = 0; i < 8; i++)
+			_v[i] = v;
+#endif
+	}
+
+#if defined(__AVX__)
+	FORCE_INLINE vector(__m256 s)
+		: _s(s)
+	{
+	}
+#endif
+
+	FORCE_INLINE bmask & operator[](unsigned int i) {
+		return _v[i];
+	}
+
+	FORCE_INLINE const bmask & operator[](unsigned int i) const {
+		return _v[i];
+	}
+};
+
+template<>
+struct ALIGN(32) vector<int, 8> {
+	union {
+		int _v[8];
+#if defined(__AVX__)
+		__m256i _s;
+#endif
+	};
+
+	FORCE_INLINE vector()
+		: _v()
+	{
+	}
+
+	FORCE_INLINE vector(int v) {
+#if defined(__AVX__)
+		_s = _mm256_set1_epi32(v);
+#else
+		for (unsigned int i = 0; i < 8; i++)
+			_v[i] = v;
+#endif
+	}
+
+#if defined(__AVX__)
+	FORCE_INLINE vector(__m256i s)
+		: _s(s)
+	{
+	}
+#endif
+
+	FORCE_INLINE int & operator[](unsigned int i) {
+		return _v[i];
+	}
+
+	FORCE_INLINE const int & operator[](unsigned int i) const {
+		return _v[i];
+	}
+};
+
+template<>
+struct ALIGN(64) vector<float, 16> {
+	union {
+		float _v[16];
+#if defined(__AVX512F__)
+		__m512 _s;
+#endif
+	};
+
+	FORCE_INLINE vector()
+		: _v()
+	{
+	}
+
+	FORCE_INLINE vector(float v) {
+#if defined(__AVX512F__)
+		_s = _mm512_set1_ps(v);
+#else
+		for (unsigned int i = 0; i < 16; i++)
+			_v[i] = v;
+#endif
+	}
+
+#if defined(__AVX512F__)
+	FORCE_INLINE vector(__m512 s)
+		: _s(s)
+	{
+	}
+#endif
+
+	FORCE_INLINE float & operator[](unsigned int i) {
+		return _v[i];
+	}
+
+	FORCE_INLINE const float & operator[](unsigned int i) const {
+		return _v[i];
+	}
+};
+
+template<>
+struct ALIGN(64) vector<bmask, 16> {
+	union {
+		bmask _v[16];
+#if defined(__AVX512F__)
+		__m512i _s;
+#endif
+	};
+
+	FORCE_INLINE vector()
+		: _v()
+	{
+	}
+
+	FORCE_INLINE vector(bmask v) {
+#if defined(__AVX512F__)
+		_s = _mm512_set1_epi32(v);
+#else
+		for (unsigned int i = 0; i < 16; i++)
+			_v[i] = v;
+#endif
+	}
+
+#if defined(__AVX512F__)
+	FORCE_INLINE vector(__m512i s)
+		: _s(s)
+	{
+	}
+#endif
+
+	FORCE_INLINE bmask & operator[](unsigned int i) {
+		return _v[i];
+	}
+
+	FORCE_INLINE const bmask & operator[](unsigned int i) const {
+		return _v[i];
+	}
+};
+
+template<>
+struct ALIGN(64) vector<int, 16> {
+	union {
+		int _v[16];
+#if defined(__AVX512F__)
+		__m512i _s;
+#endif
+	};
+
+	FORCE_INLINE vector()
+		: _v()
+	{
+	}
+
+	FORCE_INLINE vector(int v) {
+#if defined(__AVX512F__)
+		_s = _mm512_set1_epi32(v);
+#else
+		for (unsigned int i = 0; i < 16; i++)
+			_v[i] = v;
+#endif
+	}
+
+#if defined(__AVX512F__)
+	FORCE_INLINE vector(__m512i s)
+		: _s(s)
+	{
+	}
+#endif
+
+	FORCE_INLINE int & operator[](unsigned int i) {
+		return _v[i];
+	}
+
+	FORCE_INLINE const int & operator[](unsigned int i) const {
+		return _v[i];
+	}
+};
+
+#if defined(__AVX__)
+// Comparisons use the same ordered/unordered predicates as the SSE versions
+
+FORCE_INLINE vector<float, 8> min(const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_min_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 8> max(const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_max_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 8> operator+(const vector<float, 8> lhs, const vector<float, 8> & rhs) {
+	return _mm256_add_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 8> operator-(const vector<float, 8> lhs, const vector<float, 8> & rhs) {
+	return _mm256_sub_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 8> operator-(const vector<float, 8> & vec) {
+	return _mm256_sub_ps(_mm256_setzero_ps(), vec._s);
+}
+
+FORCE_INLINE vector<float, 8> operator*(const vector<float, 8> lhs, const vector<float, 8> & rhs) {
+	return _mm256_mul_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 8> operator/(const vector<float, 8> lhs, const vector<float, 8> & rhs) {
+	return _mm256_div_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<bmask, 8> operator<(const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_cmp_ps(lhs._s, rhs._s, _CMP_LT_OS);
+}
+
+FORCE_INLINE vector<bmask, 8> operator<=(const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_cmp_ps(lhs._s, rhs._s, _CMP_LE_OS);
+}
+
+FORCE_INLINE vector<bmask, 8> operator==(const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_cmp_ps(lhs._s, rhs._s, _CMP_EQ_OQ);
+}
+
+FORCE_INLINE vector<bmask, 8> operator>=(const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_cmp_ps(lhs._s, rhs._s, _CMP_GE_OS);
+}
+
+FORCE_INLINE vector<bmask, 8> operator>(const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_cmp_ps(lhs._s, rhs._s, _CMP_GT_OS);
+}
+
+FORCE_INLINE vector<bmask, 8> operator!=(const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_cmp_ps(lhs._s, rhs._s, _CMP_NEQ_UQ);
+}
+
+FORCE_INLINE vector<bmask, 8> operator&(const vector<bmask, 8> & lhs, const vector<bmask, 8> & rhs) {
+	return _mm256_and_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<bmask, 8> operator|(const vector<bmask, 8> & lhs, const vector<bmask, 8> & rhs) {
+	return _mm256_or_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<bmask, 8> operator~(const vector<bmask, 8> & v) {
+	return _mm256_xor_ps(v._s, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+}
+
+FORCE_INLINE vector<float, 8> blend(const vector<bmask, 8> & mask, const vector<float, 8> & lhs, const vector<float, 8> & rhs) {
+	return _mm256_blendv_ps(lhs._s, rhs._s, mask._s);
+}
+
+FORCE_INLINE vector<int, 8> blend(const vector<bmask, 8> & mask, const vector<int, 8> & lhs, const vector<int, 8> & rhs) {
+	// AVX has no 256 bit integer blend, but the float blend moves the same bits
+	return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(lhs._s), _mm256_castsi256_ps(rhs._s), mask._s));
+}
+
+FORCE_INLINE bool none(const vector<bmask, 8> & v) {
+	return _mm256_movemask_ps(v._s) == 0x00000000;
+}
+
+FORCE_INLINE bool any(const vector<bmask, 8> & v) {
+	return _mm256_movemask_ps(v._s) != 0x00000000;
+}
+
+FORCE_INLINE bool all(const vector<bmask, 8> & v) {
+	return _mm256_movemask_ps(v._s) == 0x000000FF;
+}
+
+FORCE_INLINE int laneMask(const vector<bmask, 8> & v) {
+	return _mm256_movemask_ps(v._s);
+}
+#endif
+
+#if defined(__AVX512F__)
+// AVX-512 compares into mask registers, but masks are kept as vectors of all ones or all
+// zeros like the narrower widths, so that packet code can index them
+
+FORCE_INLINE vector<bmask, 16> maskToVector(__mmask16 m) {
+	return _mm512_maskz_set1_epi32(m, -1);
+}
+
+FORCE_INLINE __mmask16 vectorToMask(const vector<bmask, 16> & v) {
+	return _mm512_test_epi32_mask(v._s, v._s);
+}
+
+FORCE_INLINE vector<float, 16> min(const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return _mm512_min_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 16> max(const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return _mm512_max_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 16> operator+(const vector<float, 16> lhs, const vector<float, 16> & rhs) {
+	return _mm512_add_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 16> operator-(const vector<float, 16> lhs, const vector<float, 16> & rhs) {
+	return _mm512_sub_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 16> operator-(const vector<float, 16> & vec) {
+	return _mm512_sub_ps(_mm512_setzero_ps(), vec._s);
+}
+
+FORCE_INLINE vector<float, 16> operator*(const vector<float, 16> lhs, const vector<float, 16> & rhs) {
+	return _mm512_mul_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<float, 16> operator/(const vector<float, 16> lhs, const vector<float, 16> & rhs) {
+	return _mm512_div_ps(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<bmask, 16> operator<(const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return maskToVector(_mm512_cmp_ps_mask(lhs._s, rhs._s, _CMP_LT_OS));
+}
+
+FORCE_INLINE vector<bmask, 16> operator<=(const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return maskToVector(_mm512_cmp_ps_mask(lhs._s, rhs._s, _CMP_LE_OS));
+}
+
+FORCE_INLINE vector<bmask, 16> operator==(const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return maskToVector(_mm512_cmp_ps_mask(lhs._s, rhs._s, _CMP_EQ_OQ));
+}
+
+FORCE_INLINE vector<bmask, 16> operator>=(const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return maskToVector(_mm512_cmp_ps_mask(lhs._s, rhs._s, _CMP_GE_OS));
+}
+
+FORCE_INLINE vector<bmask, 16> operator>(const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return maskToVector(_mm512_cmp_ps_mask(lhs._s, rhs._s, _CMP_GT_OS));
+}
+
+FORCE_INLINE vector<bmask, 16> operator!=(const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return maskToVector(_mm512_cmp_ps_mask(lhs._s, rhs._s, _CMP_NEQ_UQ));
+}
+
+FORCE_INLINE vector<bmask, 16> operator&(const vector<bmask, 16> & lhs, const vector<bmask, 16> & rhs) {
+	return _mm512_and_si512(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<bmask, 16> operator|(const vector<bmask, 16> & lhs, const vector<bmask, 16> & rhs) {
+	return _mm512_or_si512(lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<bmask, 16> operator~(const vector<bmask, 16> & v) {
+	return _mm512_xor_si512(v._s, _mm512_set1_epi32(-1));
+}
+
+FORCE_INLINE vector<float, 16> blend(const vector<bmask, 16> & mask, const vector<float, 16> & lhs, const vector<float, 16> & rhs) {
+	return _mm512_mask_blend_ps(vectorToMask(mask), lhs._s, rhs._s);
+}
+
+FORCE_INLINE vector<int, 16> blend(const vector<bmask, 16> & mask, const vector<int, 16> & lhs, const vector<int, 16> & rhs) {
+	return _mm512_mask_blend_epi32(vectorToMask(mask), lhs._s, rhs._s);
+}
+
+FORCE_INLINE bool none(const vector<bmask, 16> & v) {
+	return vectorToMask(v) == 0x0000;
+}
+
+FORCE_INLINE bool any(const vector<bmask, 16> & v) {
+	return vectorToMask(v) != 0x0000;
+}
+
+FORCE_INLINE bool all(const vector<bmask, 16> & v) {
+	return vectorToMask(v) == 0xFFFF;
+}
+
+FORCE_INLINE int laneMask(const vector<bmask, 16> & v) {
+	return vectorToMask(v);
+}
+#endif
+
 template<typename T, unsigned int N>
 inline std::ostream & operator<<(std::ostream & os, const vector<T, N> & v) {
     os << "<";
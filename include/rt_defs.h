@@ -30,12 +30,26 @@
 #define THREAD
 #endif
 
+// Default packet width
 #define SIMD 4
 
+// Widest packets any traversal kernel supports. Which widths are available depends on the
+// instruction set of the kernels chosen at runtime. See kdtree/kdkernels.h.
+#define SIMD_MAX 16
+
 #ifdef WIN32
 #define ALIGN(N) __declspec(align(N))
 #else
 #define ALIGN(N) __attribute__((aligned(N)))
 #endif
 
+// The traversal kernels are compiled once for each instruction set. Small functions they share
+// with the rest of the program are always inlined, so that the linker never picks an out of
+// line copy built for a newer instruction set than the one running.
+#ifdef WIN32
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
 #endif
@@ -0,0 +1,25 @@
+/**
+ * @file util/affinity.h
+ *
+ * @brief Thread affinity utilities
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __AFFINITY_H
+#define __AFFINITY_H
+
+#include <rt_defs.h>
+
+/**
+ * @brief Pin the calling thread to a logical CPU. On macOS, which does not support hard
+ * affinity, this sets an affinity tag instead, which only hints to the scheduler that threads
+ * with different tags should run on different cores.
+ *
+ * @param[in] cpu Logical CPU index. Wrapped to the number of hardware threads.
+ *
+ * @return True if the affinity was set
+ */
+RT_EXPORT bool pinCurrentThread(int cpu);
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file util/arena.h
+ *
+ * @brief Arena/bump allocator. Allocations are carved out of large blocks and are only freed
+ * all at once, which makes them nearly free and keeps related data close together in memory.
+ * An arena is not thread safe, so each thread should allocate from its own.
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __UTIL_ARENA_H
+#define __UTIL_ARENA_H
+
+#include <algorithm>
+#include <cassert>
+#include <util/align.h>
+
+namespace util {
+
+class arena {
+private:
+
+    struct block {
+        block *next;
+    };
+
+    // Block headers are padded so that allocations start at this alignment
+    static const size_t HEADER_SIZE = 64;
+
+    block  *_blocks;    //!< Most recently allocated block, linked to the older ones
+    char   *_curr;      //!< Next free byte in the current block
+    char   *_end;       //!< End of the current block
+    size_t  _blockSize; //!< Usable size of each block
+    size_t  _allocated; //!< Total size of all blocks, including headers
+
+    arena(const arena & copy) = delete;
+    arena & operator=(const arena & copy) = delete;
+
+    void grow(size_t size) {
+        size_t blockSize = std::max(size, _blockSize);
+
+        block *b = (block *)aligned_alloc(HEADER_SIZE + blockSize, CACHE_LINE);
+        assert(b);
+
+        b->next = _blocks;
+        _blocks = b;
+
+        _curr = (char *)b + HEADER_SIZE;
+        _end = _curr + blockSize;
+        _allocated += HEADER_SIZE + blockSize;
+    }
+
+public:
+
+    /**
+     * @brief Constructor. No memory is allocated until the first allocation.
+     *
+     * @param[in] blockSize Size of each block. Larger allocations get a block of their own.
+     */
+    inline arena(size_t blockSize = 1 << 20)
+        : _blocks(nullptr),
+          _curr(nullptr),
+          _end(nullptr),
+          _blockSize(blockSize),
+          _allocated(0)
+    {
+    }
+
+    inline ~arena() {
+        release();
+    }
+
+    /**
+     * @brief Allocate uninitialized space for an array. Aligned to 16 bytes.
+     */
+    template<typename T>
+    inline T *alloc(size_t count = 1) {
+        size_t size = (sizeof(T) * count + 15) & ~(size_t)15;
+
+        if (_curr + size > _end || !_curr)
+            grow(size);
+
+        T *ptr = (T *)_curr;
+        _curr += size;
+
+        return ptr;
+    }
+
+    /**
+     * @brief Free every allocation at once. Destructors are not called.
+     */
+    inline void release() {
+        while (_blocks) {
+            block *next = _blocks->next;
+            aligned_free(_blocks);
+            _blocks = next;
+        }
+
+        _curr = nullptr;
+        _end = nullptr;
+        _allocated = 0;
+    }
+
+    /**
+     * @brief Get the amount of memory held by the arena
+     */
+    inline size_t allocated() const {
+        return _allocated;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,32 @@
+/**
+ * @file util/cpufeatures.h
+ *
+ * @brief Detection of the instruction set extensions the CPU and OS support
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __CPUFEATURES_H
+#define __CPUFEATURES_H
+
+#include <rt_defs.h>
+
+/**
+ * @brief Instruction set extensions that are usable on this machine. An extension that uses
+ * wider registers only counts as supported if the OS also saves those registers on context
+ * switches.
+ */
+struct CPUFeatures {
+    bool sse42;   //!< SSE 4.2, and therefore SSE 4.1
+    bool avx;     //!< AVX
+    bool avx2;    //!< AVX2
+    bool fma;     //!< Fused multiply-add (FMA3)
+    bool avx512f; //!< AVX-512 foundation
+};
+
+/**
+ * @brief Get the features of the CPU the process is running on. Detected once, on first use.
+ */
+RT_EXPORT const CPUFeatures & getCPUFeatures();
+
+#endif
@@ -0,0 +1,36 @@
+/**
+ * @file util/imagewriter.h
+ *
+ * @brief Utility for saving images to disk in PFM, EXR, or PNG format
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __IMAGEWRITER_H
+#define __IMAGEWRITER_H
+
+#include <image/image.h>
+#include <rt_defs.h>
+#include <string>
+
+namespace ImageWriter {
+
+/**
+ * @brief Write an image to a file. The format is chosen from the file extension:
+ *
+ *     .pfm: 32-bit float RGB, linear
+ *     .exr: 32-bit float RGB, linear, uncompressed scanlines
+ *     .png: 8-bit RGB, clamped and sRGB encoded
+ *
+ * The alpha channel is not written.
+ *
+ * @param[in] filename File to write
+ * @param[in] image    Image to write
+ *
+ * @return True if the image was written, or false if there is an error
+ */
+RT_EXPORT bool write(std::string filename, const Image<float, 4> *image);
+
+};
+
+#endif
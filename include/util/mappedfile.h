@@ -0,0 +1,33 @@
+/**
+ * @file util/mappedfile.h
+ *
+ * @brief Read-only memory mapped files
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __MAPPEDFILE_H
+#define __MAPPEDFILE_H
+
+#include <rt_defs.h>
+
+#include <string>
+
+/**
+ * @brief Map a whole file into memory, read-only. Pages are loaded on demand and shared with
+ * the OS file cache, so nothing is read or copied up front.
+ *
+ * @param[in]  path File to map
+ * @param[out] size Size of the file in bytes
+ *
+ * @return Address of the mapping, which is page aligned, or nullptr if the file could not be
+ *         opened or is empty
+ */
+RT_EXPORT void *mapFile(const std::string & path, size_t & size);
+
+/**
+ * @brief Unmap a file mapped with mapFile()
+ */
+RT_EXPORT void unmapFile(void *data, size_t size);
+
+#endif
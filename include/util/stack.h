@@ -13,6 +13,8 @@
 #ifndef __STACK_H
 #define __STACK_H
 
+#include <rt_defs.h>
+
 namespace util {
 
 /**
@@ -27,7 +29,7 @@ private:
 
 public:
 
-    stack(THREAD T *stack)
+    FORCE_INLINE stack(THREAD T *stack)
         : _stack(stack),
 		  _curr(stack)
     {
@@ -37,7 +39,7 @@ public:
      * @brief Add a stack frame to the top of the stack, allocating more memory if needed. Returns
      * the newly allocated frame.
      */
-    inline void push(T elem) {
+    FORCE_INLINE void push(T elem) {
         *(_curr++) = elem;
     }
 
@@ -45,7 +47,7 @@ public:
      * @brief Pop the top frame off of the stack. The caller should check empty()
      * first. TODO.
      */
-    inline T pop() {
+    FORCE_INLINE T pop() {
 		return *(--_curr);
     }
 
@@ -59,7 +61,7 @@ public:
     /**
      * @brief Check whether the stack is empty
      */
-    inline bool empty() const {
+    FORCE_INLINE bool empty() const {
         return _curr == _stack;
     }
 
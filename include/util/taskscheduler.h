@@ -0,0 +1,132 @@
+/**
+ * @file util/taskscheduler.h
+ *
+ * @brief Work-stealing scheduler for fork/join task parallelism
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#ifndef __TASKSCHEDULER_H
+#define __TASKSCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <rt_defs.h>
+#include <thread>
+#include <util/align.h>
+#include <vector>
+
+/**
+ * @brief Set of tasks which can be waited on together
+ */
+struct TaskGroup {
+    std::atomic_int pending; //!< Number of tasks which have not finished
+
+    TaskGroup()
+        : pending(0)
+    {
+    }
+};
+
+/**
+ * @brief Task scheduler. Each worker pushes the tasks it spawns onto its own deque, and takes
+ * tasks from the back of it, so it works depth first on the newest, smallest tasks. Idle
+ * workers steal from the front of another worker's deque, which holds the oldest and usually
+ * largest tasks. Workers that wait for a group of tasks run other tasks in the meantime, so
+ * tasks may spawn and wait for subtasks without tying up a thread. Workers with nothing to do
+ * sleep until a task is spawned.
+ */
+class RT_EXPORT TaskScheduler {
+private:
+
+    struct Task {
+        std::function<void()>  func;
+        TaskGroup             *group;
+    };
+
+    struct ALIGN(CACHE_LINE) WorkerQueue {
+        std::mutex       lock;
+        std::deque<Task> tasks;
+    };
+
+    WorkerQueue              *queues;     //!< Task deque for each worker
+    int                       numWorkers; //!< Number of workers, including the thread calling run()
+    std::vector<std::thread>  threads;    //!< Worker threads
+    std::atomic_int           numQueued;  //!< Number of tasks waiting in any deque
+    std::atomic_int           numSteals;  //!< Number of tasks stolen from another worker
+    std::atomic_bool          done;       //!< Whether the workers should exit
+    std::mutex                sleepLock;
+    std::condition_variable   sleepCond;  //!< Signaled when a task is spawned
+
+    /**
+     * @brief Take a task from a worker's own deque, or steal one from another worker
+     */
+    bool take(int worker, Task & task);
+
+    /**
+     * @brief Run a task and mark it finished
+     */
+    void execute(Task & task);
+
+    void worker(int worker);
+
+public:
+
+    /**
+     * @brief Constructor. Does not start any threads until run() is called.
+     *
+     * @param[in] numWorkers Number of workers, including the thread which calls run()
+     */
+    TaskScheduler(int numWorkers);
+
+    /**
+     * @brief Destructor
+     */
+    ~TaskScheduler();
+
+    /**
+     * @brief Start the worker threads, run a task on the calling thread as worker 0, and stop
+     * the workers once it has returned. The task should wait for everything it spawns.
+     */
+    void run(const std::function<void()> & func);
+
+    /**
+     * @brief Add a task to a group. Must be called from a worker.
+     */
+    void spawn(TaskGroup & group, const std::function<void()> & func);
+
+    /**
+     * @brief Run tasks until every task in a group has finished. Must be called from a worker.
+     */
+    void wait(TaskGroup & group);
+
+    /**
+     * @brief Run func(i) for i in [0, count), in parallel, and wait for all of them. Must be
+     * called from a worker.
+     */
+    void parallelFor(int count, const std::function<void(int)> & func);
+
+    /**
+     * @brief Get the index of the calling worker, or -1 if it is not a worker
+     */
+    static int getWorkerIndex();
+
+    /**
+     * @brief Get the number of workers
+     */
+    int getNumWorkers() const {
+        return numWorkers;
+    }
+
+    /**
+     * @brief Get the number of tasks stolen from another worker
+     */
+    int getNumSteals() const {
+        return numSteals;
+    }
+};
+
+#endif
@@ -1,9 +1,11 @@
 #ifndef __UTIL_VECTOR_H
 #define __UTIL_VECTOR_H
 
+#include <rt_defs.h>
 #include <util/align.h>
 
 #include <iostream>
+#include <utility>
 
 namespace util {
 
@@ -15,20 +17,23 @@ private:
     T *_curr;
     
     size_t _capacity;
+    bool   _owned;    //!< Whether _data was allocated by the vector. See wrap().
 
 public:
 
     inline vector(size_t capacity = 4)
         : _data((T *)aligned_alloc(sizeof(T) * capacity, A)),
           _curr(_data),
-          _capacity(capacity)
+          _capacity(capacity),
+          _owned(true)
     {
     }
 
     inline vector(const vector& copy)
         : _data((T *)aligned_alloc(sizeof(T) * copy._capacity, A)),
           _curr(_data + (copy._curr - copy._data)),
-          _capacity(copy._capacity)
+          _capacity(copy._capacity),
+          _owned(true)
     {
         for (size_t i = 0; i < size(); i++)
             new (&_data[i]) T(copy._data[i]);
@@ -37,13 +42,14 @@ public:
     inline vector(vector&& move)
         : _data(move._data),
           _curr(move._curr),
-          _capacity(move._capacity)
+          _capacity(move._capacity),
+          _owned(move._owned)
     {
         move._data = nullptr;
     }
 
     inline ~vector() {
-        if (_data) {
+        if (_data && _owned) {
             for (size_t i = 0; i < size(); i++)
                 _data[i].~T();
 
@@ -62,16 +68,40 @@ public:
 
             for (size_t i = 0; i < size(); i++) {
                 new (&newData[i]) T(std::move(_data[i]));
-                _data[i].~T();
+
+                if (_owned)
+                    _data[i].~T();
             }
 
-            aligned_free(_data);
+            if (_owned)
+                aligned_free(_data);
+
             _curr = _curr - _data + newData;
             _data = newData;
             _capacity = newCapacity;
+            _owned = true;
         }
     }
 
+    /**
+     * @brief Replace the contents with memory owned by someone else, such as a mapped file.
+     * The memory is never written, destroyed or freed, so it may be read-only, and must
+     * outlive the vector. Growing the vector copies it into memory owned by the vector.
+     */
+    inline void wrap(T *data, size_t size) {
+        clear();
+
+        if (size == 0)
+            return;
+
+        aligned_free(_data);
+
+        _data = data;
+        _curr = data + size;
+        _capacity = size;
+        _owned = false;
+    }
+
     inline void push_back_inbounds(T&& elem) {
         new (_curr++) T(std::move(elem));
     }
@@ -98,27 +128,27 @@ public:
         return *(_curr - 1);
     }
 
-    inline const T *begin() const {
+    FORCE_INLINE const T *begin() const {
         return _data;
     }
 
-    inline T *begin() {
+    FORCE_INLINE T *begin() {
         return _data;
     }
 
-    inline const T *end() const {
+    FORCE_INLINE const T *end() const {
         return _curr;
     }
 
-    inline T *end() {
+    FORCE_INLINE T *end() {
         return _curr;
     }
 
-    inline const T& operator[](size_t i) const {
+    FORCE_INLINE const T& operator[](size_t i) const {
         return _data[i];
     }
 
-    inline T& operator[](size_t i) {
+    FORCE_INLINE T& operator[](size_t i) {
         return _data[i];
     }
 
@@ -126,15 +156,23 @@ public:
         (--_curr)->~T();
     }
 
-    inline size_t size() const {
+    FORCE_INLINE size_t size() const {
         return _curr - _data;
     }
 
-    inline bool empty() const {
+    FORCE_INLINE bool empty() const {
         return _curr == _data;
     }
 
     inline void clear() {
+        // Borrowed memory can't be written, so switch back to our own
+        if (!_owned) {
+            _data = (T *)aligned_alloc(sizeof(T) * _capacity, A);
+            _curr = _data;
+            _owned = true;
+            return;
+        }
+
         for (size_t i = 0; i < size(); i++)
             _data[i].~T();
 
@@ -145,6 +183,17 @@ public:
         return _capacity;
     }
 
+    /**
+     * @brief Exchange contents with another vector without copying. Pointers to elements stay
+     * valid, and now point into the other vector.
+     */
+    inline void swap(vector& other) {
+        std::swap(_data, other._data);
+        std::swap(_curr, other._curr);
+        std::swap(_capacity, other._capacity);
+        std::swap(_owned, other._owned);
+    }
+
 };
 
 }
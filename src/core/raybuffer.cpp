@@ -0,0 +1,116 @@
+/**
+ * @file core/raybuffer.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <core/raybuffer.h>
+
+RayBuffer::RayBuffer(const KDTree & tree, size_t capacity, int width)
+    : tree(&tree),
+      capacity(capacity),
+      width(width),
+      streamScratch(nullptr)
+{
+    assert(width == 4 || width == 8 || width == 16);
+    assert(width <= SIMD_MAX);
+
+    paths.reserve(capacity);
+    weights.reserve(capacity);
+    maxDists.reserve(capacity);
+    octants.reserve(capacity);
+
+    for (int j = 0; j < 3; j++) {
+        origins[j].reserve(capacity);
+        directions[j].reserve(capacity);
+    }
+
+    // Sorted rays are written by index, so fill them up front. Each octant may need up to
+    // width - 1 rays of padding.
+    size_t sortedCapacity = capacity + 8 * width;
+
+    sortedPaths.reserve(sortedCapacity);
+    sortedWeights.reserve(sortedCapacity);
+    sortedMaxDists.reserve(sortedCapacity);
+
+    for (int j = 0; j < 3; j++) {
+        sortedOrigins[j].reserve(sortedCapacity);
+        sortedDirections[j].reserve(sortedCapacity);
+    }
+
+    for (size_t i = 0; i < sortedCapacity; i++) {
+        sortedPaths.push_back_inbounds(0);
+        sortedWeights.push_back_inbounds(float3(0.0f));
+        sortedMaxDists.push_back_inbounds(0.0f);
+
+        for (int j = 0; j < 3; j++) {
+            sortedOrigins[j].push_back_inbounds(0.0f);
+            sortedDirections[j].push_back_inbounds(0.0f);
+        }
+    }
+
+    for (int i = 0; i < 8; i++)
+        begin[i] = end[i] = 0;
+}
+
+RayBuffer::~RayBuffer() {
+    delete streamScratch;
+}
+
+void RayBuffer::sort() {
+    // Counting sort by octant. Pushing is just an append, and the whole wavefront is binned at
+    // once, which keeps one copy of the rays instead of one per octant.
+    size_t counts[8] = { 0 };
+
+    for (size_t i = 0; i < octants.size(); i++)
+        counts[octants[i]]++;
+
+    size_t offset = 0;
+
+    for (int i = 0; i < 8; i++) {
+        begin[i] = end[i] = offset;
+        offset = (offset + counts[i] + width - 1) & ~(size_t)(width - 1);
+    }
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        size_t k = end[octants[i]]++;
+
+        sortedPaths[k] = paths[i];
+        sortedWeights[k] = weights[i];
+        sortedMaxDists[k] = maxDists[i];
+
+        for (int j = 0; j < 3; j++) {
+            sortedOrigins[j][k] = origins[j][i];
+            sortedDirections[j][k] = directions[j][i];
+        }
+    }
+
+    // Pad the last packet of each octant with copies of the octant's last ray. The padding
+    // has the same direction signs as the rest of the packet and its results are ignored.
+    for (int i = 0; i < 8; i++) {
+        if (end[i] == begin[i])
+            continue;
+
+        size_t last = end[i] - 1;
+
+        for (size_t k = end[i]; k & (width - 1); k++) {
+            sortedMaxDists[k] = sortedMaxDists[last];
+
+            for (int j = 0; j < 3; j++) {
+                sortedOrigins[j][k] = sortedOrigins[j][last];
+                sortedDirections[j][k] = sortedDirections[j][last];
+            }
+        }
+    }
+
+    // Hit and miss functions may push more rays
+    paths.clear();
+    weights.clear();
+    octants.clear();
+    maxDists.clear();
+
+    for (int j = 0; j < 3; j++) {
+        origins[j].clear();
+        directions[j].clear();
+    }
+}
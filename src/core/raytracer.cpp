@@ -6,19 +6,46 @@
 
 #include <core/raytracer.h>
 
+#include <core/raybuffer.h>
+#include <kdtree/kdbenchmark.h>
+#include <kdtree/kdcache.h>
+#include <kdtree/kdkernels.h>
 #include <math/matrix.h>
 #include <materials/pbrmaterial.h>
+#include <util/affinity.h>
 #include <util/imageloader.h>
 #include <map>
 
-#include <iostream>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <functional>
+#include <iostream>
 
-// TODO: thread affinity
-
-// TODO: Increasing tile size seems to make the computer happy
-#define BLOCKW 32
-#define BLOCKH 32
+// Sample dimensions used by each path. Each bounce has a fixed layout of dimensions, offset
+// by the bounce number, so the samples used at one bounce do not depend on which samples were
+// consumed at earlier bounces.
+enum SampleDimension {
+    // Primary rays
+    SampleDimensionPixel        = 0, // 2D
+    SampleDimensionLens         = 2, // 2D
+    SampleDimensionPrimaryCount = 4,
+
+    // Each bounce, relative to SampleDimensionPrimaryCount + generation * SampleDimensionBounceCount
+    SampleDimensionLightSelect  = 0, // 1D
+    SampleDimensionLight        = 1, // 3D
+    SampleDimensionRoulette     = 4, // 1D
+    SampleDimensionLobe         = 5, // 1D
+    SampleDimensionDirection    = 6, // 2D
+    SampleDimensionBounceCount  = 8
+};
+
+// Width and height of the blocks of the output image which are published atomically
+#define PUBLISH_BLOCK_SIZE 8
+
+// Mean luminance below which adaptive sampling measures absolute rather than relative error,
+// so that dark pixels are not sampled forever
+#define ADAPTIVE_MIN_LUMINANCE 0.01f
 
 // TODO: Come up with a better workflow
 
@@ -51,19 +78,48 @@ Vertex transformVertex(const PVVertex & vertex, const float4x4 & transform,
 Raytracer::Raytracer(RaytracerSettings settings, Scene *scene, Image<float, 4> *output)
     : settings(settings),
       scene(scene),
-      output(output)
+      output(output),
+      activeTree(&tree),
+      scheduler(NULL),
+      numWorkers(0),
+      numPasses(1),
+      passesCompleted(0),
+      passArrived(0),
+      passGeneration(0),
+      passSamples(0),
+      passAdaptive(false),
+      morePasses(false),
+      adaptiveBudget(0),
+      workerStats(NULL),
+      renderSeconds(0.0f)
 {
     // TODO: make these runtime errors
     assert(scene->getCamera());
 
     scene->getCamera()->setAspectRatio((float)output->getWidth() / (float)output->getHeight());
 
-    srand((unsigned)time(0));
+    accumulation = new Image<float, 4>(output->getWidth(), output->getHeight());
+    moments = new Image<float, 2>(output->getWidth(), output->getHeight());
+
+    blocksW = (output->getWidth() + PUBLISH_BLOCK_SIZE - 1) / PUBLISH_BLOCK_SIZE;
+    blocksH = (output->getHeight() + PUBLISH_BLOCK_SIZE - 1) / PUBLISH_BLOCK_SIZE;
+    blockVersions = new std::atomic<uint32_t>[blocksW * blocksH];
+
+    for (int i = 0; i < blocksW * blocksH; i++)
+        blockVersions[i] = 0;
+
+    sampleGenerator = SampleGenerator::create(settings.sampler, settings.seed, getMaxPixelSamples());
 
     addMeshesFromScene();
 }
 
 Raytracer::~Raytracer() {
+    delete sampleGenerator;
+    delete accumulation;
+    delete moments;
+    delete [] blockVersions;
+    aligned_free(workerStats);
+    delete scheduler;
 }
 
 void Raytracer::addMeshesFromScene() {
@@ -163,227 +219,604 @@ void Raytracer::addMeshesFromScene() {
 	}
 }
 
+void Raytracer::compareKDBuilders(const std::vector<KDBuilderType> & types) {
+    // Run each builder without clipping, and then again with clipping if it is enabled
+    int numRuns = (int)types.size() * (settings.kdParams.clip ? 2 : 1);
+
+    std::vector<KDTree> trees(numRuns);
+    std::vector<KDTreeStats> stats(numRuns);
+    std::vector<double> seconds(numRuns);
+
+    for (int i = 0; i < numRuns; i++) {
+        KDBuilderType type = types[i % types.size()];
+        bool clip = i >= (int)types.size();
+
+        printf("Building with %s builder%s\n", KDBuilderTypeNames[type], clip ? ", clipping" : "");
+
+        KDBuilderParams params = settings.kdParams;
+        params.clip = clip;
+
+        Timer timer;
+        buildKDTree(type, trees[i], triangles, params, &stats[i]);
+        seconds[i] = timer.getElapsedMilliseconds() / 1000.0;
+    }
+
+    printf("%-20s %10s %10s %10s %10s %10s %10s %10s %10s\n", "Builder", "Seconds", "Speedup", "Nodes", "Triangles",
+        "SAH Cost", "Identical", "Refs", "Cost");
+
+    for (int i = 0; i < numRuns; i++) {
+        KDBuilderType type = types[i % types.size()];
+        bool clip = i >= (int)types.size();
+
+        // Compare against the first builder with the same clipping
+        int first = clip ? (int)types.size() : 0;
+
+        bool identical =
+            trees[first].nodes.size() == trees[i].nodes.size() &&
+            trees[first].triangles.size() == trees[i].triangles.size() &&
+            memcmp(trees[first].nodes.begin(), trees[i].nodes.begin(), trees[first].nodes.size() * sizeof(KDNode)) == 0 &&
+            memcmp(trees[first].triangles.begin(), trees[i].triangles.begin(), trees[first].triangles.size() * sizeof(SetupTriangleBlock)) == 0;
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s%s", KDBuilderTypeNames[type], clip ? " (clip)" : "");
+
+        printf("%-20s %10.03f %9.02fx %10lu %10lu %10.02f %10s", name, seconds[i], seconds[0] / seconds[i],
+            (unsigned long)trees[i].nodes.size(), (unsigned long)stats[i].num_triangles, stats[i].sah_cost,
+            identical ? "yes" : "no");
+
+        // Change in triangle references and traversal cost from the same builder without clipping
+        if (clip) {
+            const KDTreeStats & unclipped = stats[i - types.size()];
+
+            printf(" %+9.02f%% %+9.02f%%",
+                ((float)stats[i].num_triangles / (float)unclipped.num_triangles - 1.0f) * 100.0f,
+                (stats[i].sah_cost / unclipped.sah_cost - 1.0f) * 100.0f);
+        }
+
+        printf("\n");
+    }
+}
+
+void Raytracer::benchmarkKDTraversal() {
+    int width = output->getWidth();
+    int height = output->getHeight();
+
+    // One camera ray through the center of each pixel, in scanline order
+    util::vector<Ray, 16> rays;
+    rays.reserve(width * height);
+
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            rays.push_back_inbounds(scene->getCamera()->getViewRay(float2(0.0f, 0.0f),
+                float2((x + 0.5f) / width, (y + 0.5f) / height)));
+
+    static const char *layoutNames[] = { "depth-first", "treelet" };
+
+    KDTraversalBenchmark results[2];
+
+    for (int layout = 0; layout < 2; layout++) {
+        printf("Building with %s layout\n", layoutNames[layout]);
+
+        KDBuilderParams params = settings.kdParams;
+        params.treelets = layout == 1;
+
+        KDTree layoutTree;
+        buildKDTree(settings.kdBuilder, layoutTree, triangles, params);
+
+        ::benchmarkKDTraversal(layoutTree, rays, results[layout]);
+    }
+
+    printf("%-16s %10s %10s %10s %10s\n", "Layout", "Mrays/s", "Speedup", "Lines/Ray", "Misses/Ray");
+
+    for (int layout = 0; layout < 2; layout++) {
+        printf("%-16s %10.03f %9.02fx %10.02f %10.03f\n", layoutNames[layout], results[layout].raysPerSecond / 1e6,
+            results[layout].raysPerSecond / results[0].raysPerSecond, results[layout].linesPerRay,
+            results[layout].missesPerRay);
+    }
+}
+
+// Camera rays traced by the KD-tree auto-tuner, in each direction
+#define AUTOTUNE_RAYS_X 128
+#define AUTOTUNE_RAYS_Y 72
+
+/**
+ * @brief Time tracing rays through a tree on the calling thread, the way the workers trace
+ * them: camera rays in packets, and bounce rays in packets or streams, through RayBuffer
+ *
+ * @return Best cycles per ray over several runs
+ */
+static double timeKDTraversal(const KDTree & tree, const util::vector<Ray, 16> & cameraRays,
+    const util::vector<Ray, 16> & bounceRays, int width, bool stream)
+{
+    RayBuffer buffer(tree, std::max(cameraRays.size(), bounceRays.size()), width);
+
+    auto hitFunc = [](const Ray & ray, unsigned int path, const float3 & weight, float maxDist,
+        const Collision & result) {};
+
+    auto missFunc = [](const Ray & ray, unsigned int path, const float3 & weight, float maxDist) {};
+
+    uint64_t best = UINT64_MAX;
+
+    for (int run = 0; run < 3; run++) {
+        uint64_t cycles = 0;
+
+        // Pushing and sorting are not part of the traversal, but are the same for every tree
+        for (size_t i = 0; i < cameraRays.size(); i++)
+            buffer.push(cameraRays[i], (unsigned int)i, float3(1.0f), INFINITY);
+
+        uint64_t start = __rdtsc();
+        buffer.flush(false, false, hitFunc, missFunc);
+        cycles += __rdtsc() - start;
+
+        for (size_t i = 0; i < bounceRays.size(); i++)
+            buffer.push(bounceRays[i], (unsigned int)i, float3(1.0f), INFINITY);
+
+        start = __rdtsc();
+        buffer.flush(false, stream, hitFunc, missFunc);
+        cycles += __rdtsc() - start;
+
+        best = std::min<uint64_t>(best, cycles);
+    }
+
+    return (double)best / (cameraRays.size() + bounceRays.size());
+}
+
+bool Raytracer::autotuneKDParams() {
+    std::string path;
+
+    // Keyed by the parameters tuning starts from, which are the ones the user asked for
+    if (!settings.kdCacheDir.empty()) {
+        uint64_t key = hashKDTreeInput(triangles, settings.kdBuilder, settings.kdParams);
+
+        char name[64];
+        snprintf(name, sizeof(name), "kdtune-%016llx.txt", (unsigned long long)key);
+
+        path = settings.kdCacheDir + "/" + name;
+
+        if (loadKDBuilderParams(path, settings.kdParams)) {
+            printf("Loaded KD tree parameters from %s\n", path.c_str());
+            return false;
+        }
+    }
+
+    printf("Auto-tuning KD tree parameters\n");
+
+    // The best tree so far is kept in the tree member, so the one tuning settles on is not
+    // built a second time
+    buildKDTree(settings.kdBuilder, tree, triangles, settings.kdParams, &_treeStats);
+
+    // Camera rays, plus one cosine weighted bounce from each hit, so that the sample has
+    // both coherent and incoherent rays. The sample is the same for every candidate.
+    util::vector<Ray, 16> cameraRays;
+    util::vector<Ray, 16> bounceRays;
+    cameraRays.reserve(AUTOTUNE_RAYS_X * AUTOTUNE_RAYS_Y);
+    bounceRays.reserve(AUTOTUNE_RAYS_X * AUTOTUNE_RAYS_Y);
+
+    for (int y = 0; y < AUTOTUNE_RAYS_Y; y++) {
+        for (int x = 0; x < AUTOTUNE_RAYS_X; x++) {
+            Ray ray = scene->getCamera()->getViewRay(float2(0.0f, 0.0f),
+                float2((x + 0.5f) / AUTOTUNE_RAYS_X, (y + 0.5f) / AUTOTUNE_RAYS_Y));
+
+            cameraRays.push_back_inbounds(ray);
+
+            Collision result;
+
+            if (!tree.intersect(ray, INFINITY, result))
+                continue;
+
+            float3 normal = triangles[result.triangle_id].normal;
+
+            if (dot(normal, ray.direction) > 0.0f)
+                normal = -normal;
+
+            RandomStream rng(0, int2(x, y), 0);
+            float3 position = ray.origin + ray.direction * result.distance;
+            float3 direction = alignHemisphere(mapCosHemisphere(1.0f, rng.next2D()), normal);
+
+            bounceRays.push_back_inbounds(Ray(position + normal * 0.001f, direction));
+        }
+    }
+
+    static const float traversalCosts[] = { 4.0f, 8.0f, 12.0f, 20.0f };
+    static const int maxDepths[] = { 20, 23, 26 };
+    static const int leafTriangles[] = { 2, 4, 8 };
+
+    // The builders print as they go, so the table is printed once every candidate is timed
+    struct Candidate {
+        const char      *name;
+        KDBuilderParams  params;
+        double           cycles;
+    };
+
+    std::vector<Candidate> candidates;
+
+    KDBuilderParams best = settings.kdParams;
+    double bestCycles = timeKDTraversal(tree, cameraRays, bounceRays, settings.simdWidth,
+        settings.streamTraversal);
+
+    candidates.push_back({ "start", best, bestCycles });
+
+    auto tryParams = [&](const char *name, const KDBuilderParams & params) {
+        KDTree candidate;
+        KDTreeStats candidateStats;
+        buildKDTree(settings.kdBuilder, candidate, triangles, params, &candidateStats);
+
+        double cycles = timeKDTraversal(candidate, cameraRays, bounceRays, settings.simdWidth,
+            settings.streamTraversal);
+
+        candidates.push_back({ name, params, cycles });
+
+        if (cycles < bestCycles) {
+            bestCycles = cycles;
+            best = params;
+
+            tree.swap(candidate);
+            _treeStats = candidateStats;
+        }
+    };
+
+    // Search one parameter at a time, starting from the best values so far. The value being
+    // searched from has already been timed.
+    KDBuilderParams from = best;
+
+    for (float cost : traversalCosts) {
+        KDBuilderParams params = from;
+        params.traversalCost = cost;
+
+        if (cost != from.traversalCost)
+            tryParams("traversal", params);
+    }
+
+    from = best;
+
+    for (int depth : maxDepths) {
+        KDBuilderParams params = from;
+        params.maxDepth = depth;
+
+        if (depth != from.maxDepth)
+            tryParams("depth", params);
+    }
+
+    from = best;
+
+    for (int leaf : leafTriangles) {
+        KDBuilderParams params = from;
+        params.leafTriangles = leaf;
+
+        if (leaf != from.leafTriangles)
+            tryParams("leaf", params);
+    }
+
+    printf("%-12s %10s %10s %10s %12s\n", "Parameter", "Traversal", "Depth", "Leaf", "Cycles/Ray");
+
+    for (auto & candidate : candidates) {
+        printf("%-12s %10.02f %10d %10d %12.01f\n", candidate.name, candidate.params.traversalCost,
+            candidate.params.maxDepth, candidate.params.leafTriangles, candidate.cycles);
+    }
+
+    printf("Auto-tuned KD tree parameters: traversal cost %.02f, max depth %d, leaf triangles %d, %.01f cycles/ray\n",
+        best.traversalCost, best.maxDepth, best.leafTriangles, bestCycles);
+
+    settings.kdParams = best;
+
+    if (!path.empty()) {
+        if (saveKDBuilderParams(path, best))
+            printf("Saved KD tree parameters to %s\n", path.c_str());
+        else
+            printf("Could not save KD tree parameters to %s\n", path.c_str());
+    }
+
+    if (!settings.kdCacheDir.empty()) {
+        uint64_t key = hashKDTreeInput(triangles, settings.kdBuilder, best);
+        std::string treePath = getKDTreeCachePath(settings.kdCacheDir, key);
+
+        if (saveKDTree(treePath, key, tree, _treeStats))
+            printf("Saved KD tree to %s\n", treePath.c_str());
+        else
+            printf("Could not save KD tree to %s\n", treePath.c_str());
+    }
+
+    return true;
+}
+
 void Raytracer::render() {
     shouldShutdown = false;
 
-    KDSAHBuilder builder(tree, triangles, 12.0f, 1.0f);
-    builder.build(&_treeStats);
+    output->clear();
+    accumulation->clear();
+    moments->clear();
+
+    // Tuning leaves the tree it settles on built, unless the parameters came from the cache
+    bool treeBuilt = settings.kdAutotune && autotuneKDParams();
+
+    if (treeBuilt)
+        activeTree = &tree;
+    else if (settings.kdProgressive) {
+        // Render with a median split tree, which builds in a fraction of the time, while the
+        // real tree is built in the background
+        Timer timer;
+        buildKDTree(KDBuilderTypeMedian, previewTree, triangles, settings.kdParams);
 
-    nBlocksW = (output->getWidth() + BLOCKW - 1) / BLOCKW;
-    nBlocksH = (output->getHeight() + BLOCKH - 1) / BLOCKH;
-    nBlocks = nBlocksW * nBlocksH;
+        printf("Built preview KD tree: %f seconds\n", timer.getElapsedMilliseconds() / 1000.0);
 
-    currBlockID = 0;
+        activeTree = &previewTree;
+
+        treeBuilder = std::thread([this]() {
+            Timer timer;
+            loadOrBuildKDTree(settings.kdCacheDir, settings.kdBuilder, tree, triangles, settings.kdParams,
+                &_treeStats);
+
+            // Workers pick up the new tree when they start their next wavefront. The preview
+            // tree may still be in use until then, so it is kept until the next render.
+            activeTree.store(&tree, std::memory_order_release);
+
+            printf("Switched to %s KD tree after %f seconds\n", KDBuilderTypeNames[settings.kdBuilder],
+                timer.getElapsedMilliseconds() / 1000.0);
+        });
+    }
+    else {
+        loadOrBuildKDTree(settings.kdCacheDir, settings.kdBuilder, tree, triangles, settings.kdParams, &_treeStats);
+        activeTree = &tree;
+    }
 
     int nThreads = settings.numThreads;
 
     if (nThreads == 0)
         nThreads = std::thread::hardware_concurrency(); // TODO: Maybe better way to update image
 
+    delete scheduler;
+    scheduler = new TileScheduler(output->getWidth(), output->getHeight(), settings.tileSize,
+        settings.tileOrder, nThreads);
+
     numThreadsAlive = nThreads;
+    numWorkers = nThreads;
+
+    numPasses = getNumPasses();
+    passesCompleted = 0;
+    passArrived = 0;
+
+    int numSamples = settings.pixelSamples * settings.pixelSamples;
 
-	for (int i = 0; i < nThreads; i++)
-		workerStats.push_back(RaytracerStats());
+    adaptiveBudget = (int64_t)((double)settings.adaptiveBudget * output->getWidth() *
+        output->getHeight() * numSamples);
+
+    morePasses = preparePass(0);
+
+	workerStats = (WorkerStats *)aligned_alloc(sizeof(WorkerStats) * nThreads, CACHE_LINE);
+
+	renderSeconds = 0.0f;
+	renderTimer.reset();
 
 	for (int i = 0; i < nThreads; i++) {
 		workers.push_back(std::make_shared<std::thread>(std::bind(&Raytracer::worker_thread,
-			this, i, nThreads, &workerStats[i])));
+			this, i, nThreads, &workerStats[i].stats)));
 	}
 
-    printf("Started %d worker threads\n", nThreads);
+    printf("Started %d worker threads (%s tile order%s, %d passes, up to %d adaptive, %d wide %s)\n",
+        nThreads, TileOrderNames[settings.tileOrder], settings.pinThreads ? ", pinned" : "", numPasses,
+        settings.adaptivePasses, settings.simdWidth, settings.streamTraversal ? "streams" : "packets");
 }
 
-void Raytracer::shutdown(bool waitUntilFinished, RaytracerStats *stats) {
-    if (!waitUntilFinished)
+void Raytracer::shutdown(bool waitUntilFinished, RaytracerStats *stats,
+    std::vector<RaytracerStats> *threadStats)
+{
+    if (!waitUntilFinished) {
+        // Wake workers waiting at the end of a pass. Workers that see shouldShutdown stop
+        // without reaching the barrier, so the others cannot wait for them.
+        passLock.lock();
         shouldShutdown = true;
+        passLock.unlock();
+
+        passCond.notify_all();
+    }
 
     for (auto& worker : workers)
         worker->join();
 
+    // The tree build can't be cancelled, so even an aborted render waits for it
+    if (treeBuilder.joinable())
+        treeBuilder.join();
+
+	int nThreads = workers.size();
+
+	for (int i = 0; i < nThreads; i++) {
+		RaytracerStats & s = workerStats[i].stats;
+
+		s.stat[RaytracerStatUnaccountedCycles] = s.stat[RaytracerStatTotalCycles];
+
+		for (int j = 1; j < RaytracerStatCount - 1; j++)
+			s.stat[RaytracerStatUnaccountedCycles] -= s.stat[j];
+	}
+
 	if (stats) {
 		memset(stats, 0, sizeof(RaytracerStats));
 
-		int nThreads = workers.size();
-
 		for (int i = 0; i < nThreads; i++) {
 			for (int j = 0; j < RaytracerStatCount; j++)
-				stats->stat[j] += workerStats[i].stat[j];
+				stats->stat[j] += workerStats[i].stats.stat[j];
+
+			for (int j = 0; j < RaytracerCounterCount; j++)
+				stats->counter[j] += workerStats[i].stats.counter[j];
 		}
 
-		stats->stat[RaytracerStatUnaccountedCycles] = stats->stat[RaytracerStatTotalCycles];
+		printf("Tiles stolen: %d, split: %d\n", scheduler->getNumSteals(), scheduler->getNumSplits());
+	}
 
-		for (int j = 1; j < RaytracerStatCount - 1; j++)
-			stats->stat[RaytracerStatUnaccountedCycles] -= stats->stat[j];
+	if (threadStats) {
+		threadStats->clear();
+
+		for (int i = 0; i < nThreads; i++)
+			threadStats->push_back(workerStats[i].stats);
 	}
 
-	workerStats.clear();
+	aligned_free(workerStats);
+	workerStats = NULL;
+
     workers.clear();
 }
 
-void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
-	memset(stats, 0, sizeof(RaytracerStats));
+bool Raytracer::endPass() {
+    std::unique_lock<std::mutex> lock(passLock);
 
-	int width = output->getWidth();
-    int height = output->getHeight();
+    int generation = passGeneration;
 
-    float2 invImageSize = float2(1.0f / (float)width, 1.0f / (float)height);
-    float sampleContrib = 1.0f / (float)(settings.pixelSamples * settings.pixelSamples);
+    if (++passArrived == numWorkers) {
+        // Last worker to arrive. Every tile of this pass has been resolved into the output.
+        passArrived = 0;
+        passGeneration++;
 
-    int blockID = idx;
+        if (!shouldShutdown) {
+            passesCompleted++;
+            morePasses = preparePass(passesCompleted);
+        }
 
-    // TODO: the depth is bounded to 24... no need for such a big stack?
-	assert(_treeStats.max_depth < 64);
+        passCond.notify_all();
+    }
+    else
+        passCond.wait(lock, [&]() { return passGeneration != generation || shouldShutdown; });
 
-	// TODO: specialized version which doesn't take max distance
-	class RayBuffer {
-	private:
+    return !shouldShutdown && morePasses;
+}
 
-		const KDTree & tree;
-		util::vector<int2, 16>   pixels[8];
-		util::vector<float3, 16> weights[8];
-		util::vector<float, 16>  origins[8][3];
-		util::vector<float, 16>  directions[8][3];
-		util::vector<float, 16>  maxDists[8];
-		size_t                   count;
-		size_t                   capacity;
+int Raytracer::getNumPasses() const {
+    return std::max(1, std::min(settings.numPasses, settings.pixelSamples * settings.pixelSamples));
+}
 
-	public:
+int Raytracer::getMaxPixelSamples() const {
+    // Adaptive passes continue each pixel's sample sequence past the regular samples. See
+    // preparePass().
+    int numSamples = settings.pixelSamples * settings.pixelSamples;
 
-		RayBuffer(const KDTree & tree, size_t capacity)
-			: tree(tree),
-			  capacity(capacity),
-			  count(0)
-		{
-			for (int i = 0; i < 8; i++) {
-				pixels[i].reserve(capacity);
-				weights[i].reserve(capacity);
-				maxDists[i].reserve(capacity);
-
-				for (int j = 0; j < 3; j++) {
-					origins[i][j].reserve(capacity);
-					directions[i][j].reserve(capacity);
-				}
-			}
-		}
+    return numSamples + settings.adaptivePasses * std::max(1, numSamples / getNumPasses());
+}
 
-		void push(const Ray & ray, const int2 & pixel, const float3 & weight, float maxDist) {
-			assert(count < capacity);
-			
-			int c = (signbit(ray.direction.x) << 2) | (signbit(ray.direction.y) << 1) | (signbit(ray.direction.z) << 0);
+bool Raytracer::preparePass(int pass) {
+    int numSamples = settings.pixelSamples * settings.pixelSamples;
 
-			pixels[c].push_back_inbounds(pixel);
-			weights[c].push_back_inbounds(weight);
+    if (pass < numPasses) {
+        // Regular passes split the samples evenly and render every pixel
+        passSamples = numSamples * (pass + 1) / numPasses - numSamples * pass / numPasses;
+        passAdaptive = false;
 
-			origins[c][0].push_back_inbounds(ray.origin.x);
-			origins[c][1].push_back_inbounds(ray.origin.y);
-			origins[c][2].push_back_inbounds(ray.origin.z);
+        // The scheduler starts out with every tile
+        if (pass > 0)
+            scheduler->reset();
 
-			directions[c][0].push_back_inbounds(ray.direction.x);
-			directions[c][1].push_back_inbounds(ray.direction.y);
-			directions[c][2].push_back_inbounds(ray.direction.z);
+        return true;
+    }
 
-			maxDists[c].push_back_inbounds(maxDist);
+    if (pass >= numPasses + settings.adaptivePasses || adaptiveBudget <= 0)
+        return false;
 
-			count++;
-		}
+    int width = output->getWidth();
+    int height = output->getHeight();
 
-		void flush(
-			bool anyCollision,
-			std::function<void(const Ray &, const int2 &, const float3 &, float, const Collision &)> hitFunc,
-			std::function<void(const Ray &, const int2 &, const float3 &, float)> missFunc)
-		{
-			// Note: rays now have same sign bits in each direction
+    passSamples = std::max(1, numSamples / numPasses);
+    passAdaptive = true;
 
-			for (int i = 0; i < 8; i++) {
-				for (int j = 0; j < (pixels[i].size() & ~(SIMD - 1)); j += SIMD) { // TODO: handle last elements
-					PacketCollision<SIMD> result;
+    // Estimate the relative error of each pixel from the variance of its sample luminance
+    std::vector<float> error(width * height);
+    std::vector<float> candidates;
 
-					const vector<float, SIMD> (&origin)[3] = {
-						*(vector<float, SIMD> *)&origins[i][0][j],
-						*(vector<float, SIMD> *)&origins[i][1][j],
-						*(vector<float, SIMD> *)&origins[i][2][j]
-					};
+    float threshold = settings.adaptiveThreshold;
 
-					const vector<float, SIMD> (&direction)[3] = {
-						*(vector<float, SIMD> *)&directions[i][0][j],
-						*(vector<float, SIMD> *)&directions[i][1][j],
-						*(vector<float, SIMD> *)&directions[i][2][j]
-					};
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float n = accumulation->getPixel(x, y).w;
+            float2 m = moments->getPixel(x, y);
+            float e = INFINITY;
 
-					// Max dist is unused for primary rays
-					const vector<float, SIMD> & maxDist = *(vector<float, SIMD> *)&maxDists[i][j]; // TODO: does passing these as args work better?
+            if (n >= 2.0f)
+                e = sqrtf(m.y / (n - 1.0f) / n) / std::max(m.x, ADAPTIVE_MIN_LUMINANCE);
 
-					vector<bmask, SIMD> hit = tree.intersectPacket(
-						origin, direction, maxDist, anyCollision, result);
+            error[y * width + x] = e;
 
-					StatTimer shadingPack = startStatTimer(RaytracerStatShadingPackCycles);
+            if (e > threshold)
+                candidates.push_back(e);
+        }
+    }
 
-					// TODO: Might be useful to pass in active mask
+    if (candidates.size() == 0) {
+        printf("Adaptive pass %d: converged\n", pass - numPasses);
+        return false;
+    }
 
-					for (int k = 0; k < SIMD; k++) {
-						Ray ray;
+    // If the budget does not cover every unconverged pixel, only sample the worst ones
+    int64_t maxPixels = adaptiveBudget / passSamples;
 
-						ray.origin[0] = origins[i][0][j + k];
-						ray.origin[1] = origins[i][1][j + k];
-						ray.origin[2] = origins[i][2][j + k];
+    if (maxPixels == 0)
+        return false;
 
-						ray.direction[0] = directions[i][0][j + k];
-						ray.direction[1] = directions[i][1][j + k];
-						ray.direction[2] = directions[i][2][j + k];
+    if ((int64_t)candidates.size() > maxPixels) {
+        std::nth_element(candidates.begin(), candidates.begin() + (maxPixels - 1), candidates.end(),
+            std::greater<float>());
 
-						float maxDist = maxDists[i][j + k];
-						int2 pixel = pixels[i][j + k];
-						float3 weight = weights[i][j + k];
+        threshold = candidates[maxPixels - 1];
+    }
 
-						if (hit[k]) {
-							Collision collision;
+    pixelActive.assign(width * height, 0);
 
-							collision.beta = result.beta[k];
-							collision.gamma = result.gamma[k];
-							collision.distance = result.distance[k];
-							collision.triangle_id = result.triangle_id[k];
+    int64_t numActive = 0;
 
-							collision.beta = result.beta[k];
-							collision.gamma = result.gamma[k];
-							collision.distance = result.distance[k];
-							collision.triangle_id = result.triangle_id[k];
+    for (int i = 0; i < width * height && numActive < maxPixels; i++) {
+        if (error[i] > settings.adaptiveThreshold && error[i] >= threshold) {
+            pixelActive[i] = 1;
+            numActive++;
+        }
+    }
 
-							hitFunc(ray, pixel, weight, maxDist, collision);
-						}
-						else {
-							missFunc(ray, pixel, weight, maxDist);
-						}
-					}
-				}
-			}
+    // Only hand out tiles which contain at least one active pixel
+    int numTiles = scheduler->getNumTiles();
+    int numActiveTiles = 0;
+    std::vector<bool> tileActive(numTiles, false);
 
-			for (int i = 0; i < 8; i++) {
-				pixels[i].clear();
-				weights[i].clear();
+    for (int i = 0; i < numTiles; i++) {
+        const Tile & tile = scheduler->getTile(i);
 
-				origins[i][0].clear();
-				origins[i][1].clear();
-				origins[i][2].clear();
+        for (int y = tile.y0; y < tile.y1 && !tileActive[i]; y++)
+            for (int x = tile.x0; x < tile.x1 && !tileActive[i]; x++)
+                tileActive[i] = pixelActive[y * width + x] != 0;
 
-				directions[i][0].clear();
-				directions[i][1].clear();
-				directions[i][2].clear();
+        if (tileActive[i])
+            numActiveTiles++;
+    }
 
-				maxDists[i].clear();
-			}
+    adaptiveBudget -= numActive * passSamples;
 
-			count = 0;
-		}
-	};
+    printf("Adaptive pass %d: %lld pixels, %d/%d tiles, %d samples per pixel\n", pass - numPasses,
+        (long long)numActive, numActiveTiles, numTiles, passSamples);
+
+    scheduler->reset(tileActive);
+
+    return true;
+}
+
+void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
+	memset(stats, 0, sizeof(RaytracerStats));
+
+	if (settings.pinThreads && !pinCurrentThread(idx))
+		printf("Warning: failed to pin worker thread %d\n", idx);
+
+	int width = output->getWidth();
+    int height = output->getHeight();
+
+    float2 invImageSize = float2(1.0f / (float)width, 1.0f / (float)height);
+
+    // Traversal uses a fixed size stack
+    static_assert(KD_MAX_DEPTH_LIMIT < 64, "KD-tree traversal stack is too small");
 
-	int numRays = BLOCKW * BLOCKH * settings.pixelSamples * settings.pixelSamples;
+	// Every path in a wavefront has one primary ray in flight, and each traced ray produces
+	// at most one extension ray and one shadow ray, so the queues never hold more rays than
+	// there are paths. A wavefront must fit at least one whole tile.
+	int maxTileRays = settings.tileSize * settings.tileSize * settings.pixelSamples * settings.pixelSamples;
+	int numRays = std::max(settings.waveSize, maxTileRays);
 
-	RayBuffer radianceBuffer(tree, numRays);
-	RayBuffer shadowBuffer(tree, numRays);
+	RayBuffer radianceBuffer(*activeTree, numRays, settings.simdWidth);
+	RayBuffer shadowBuffer(*activeTree, numRays, settings.simdWidth);
 
 	struct ShadingWorkItem {
 		Ray ray;
-		int2 pixel;
+		unsigned int path;
 		float3 weight;
 		float maxDist;
 		Collision collision; // TODO: mess with offset of triangle ID
@@ -395,58 +828,116 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 	util::vector<ShadingWorkItem, 16> shadowBuff;
 	shadowBuff.reserve(numRays);
 
-    while(!shouldShutdown) {
-        blockID = currBlockID++;
+	// Pixel and sample index of each path in the wavefront
+	struct PathState {
+		int2 pixel;
+		unsigned int sample;
+	};
+
+	util::vector<PathState, 16> paths;
+	paths.reserve(numRays);
+
+	// Radiance of each path in the wavefront, so that the per-pixel variance can be updated
+	// with individual samples when the tiles are resolved
+	util::vector<float3, 16> pathRadiance;
+	pathRadiance.reserve(numRays);
 
-        if (blockID >= nBlocks)
-            break;
+	for (int i = 0; i < numRays; i++)
+		pathRadiance.push_back_inbounds(float3(0.0f));
 
+	// Tiles in the current wavefront, in the order their paths were emitted
+	std::vector<Tile> waveTiles;
+
+	// Resolved pixels of one tile. Tiles are resolved privately and then published to the
+	// output all at once.
+	util::vector<float4, CACHE_LINE> tileOutput;
+	tileOutput.reserve(settings.tileSize * settings.tileSize);
+
+	for (int i = 0; i < settings.tileSize * settings.tileSize; i++)
+		tileOutput.push_back_inbounds(float4(0.0f));
+
+    Tile tile;
+
+    while(!shouldShutdown) {
 		StatTimer totalCycles = startStatTimer(RaytracerStatTotalCycles);
 
-        int y = blockID / nBlocksW;
-        int x = blockID % nBlocksW;
+		// Switch trees between wavefronts, so that each tile is traced against one tree
+		const KDTree *waveTree = activeTree.load(std::memory_order_acquire);
+		radianceBuffer.setTree(*waveTree);
+		shadowBuffer.setTree(*waveTree);
+
+		// Gather tiles into one wavefront until the next tile might not fit, so that every
+		// generation is traced in large batches instead of shrinking with each bounce of a
+		// single tile
+		int tileRays = settings.tileSize * settings.tileSize * passSamples;
+
+		waveTiles.clear();
+		paths.clear();
+
+		while (paths.size() + tileRays <= numRays && scheduler->next(idx, tile)) {
+			waveTiles.push_back(tile);
 
-        int x0 = BLOCKW * x;
-        int y0 = BLOCKH * y;
+			for (int y = tile.y0; y < tile.y1; y++) {
+				for (int x = tile.x0; x < tile.x1; x++) {
+					if (passAdaptive && !pixelActive[y * width + x])
+						continue;
 
-		for (int y = y0; y < y0 + BLOCKH && y < height; y++) {
-			for (int x = x0; x < x0 + BLOCKW && x < width; x++) {
-				float3 color(0.0f);
+					// TODO: Is the pointer chasing through scene bad?
 
-				// TODO: Is the pointer chasing through scene bad?
+					// TODO: It's possible to do better sampling
 
-				// TODO: It's possible to do better sampling
+					float2 xy = float2(x, y);
 
-				float2 xy = float2(x, y);
+					// Each pass continues the pixel's sample sequence where the last one stopped, so
+					// the samples taken so far are always a prefix of the sequence
+					unsigned int sampleStart = (unsigned int)accumulation->getPixel(x, y).w;
+					unsigned int sampleEnd = sampleStart + passSamples;
 
-				for (int p = 0; p < settings.pixelSamples; p++) {
-					for (int q = 0; q < settings.pixelSamples; q++) {
+					for (unsigned int sample = sampleStart; sample < sampleEnd; sample++) {
 						StatTimer primaryEmit = startStatTimer(RaytracerStatPrimaryEmitCycles);
 
-						// Take jittered sampled to reduce variance and move from stairstepping
+						PathSampler sampler(sampleGenerator, int2(x, y), sample, 0);
+
+						// Take stratified samples to reduce variance and move from stairstepping
 						// artifacts to noise
-						float2 xy2 = (xy + randJittered2D(settings.pixelSamples, p, q)) * invImageSize;
+						float2 xy2 = (xy + sampler.get2D(SampleDimensionPixel)) * invImageSize;
 
-						float2 uv = rand2D();
+						float2 uv = sampler.get2D(SampleDimensionLens);
 						Ray r = scene->getCamera()->getViewRay(uv, xy2);
 
-						float3 weight(1.0f / (settings.pixelSamples * settings.pixelSamples));
+						// Radiance is accumulated unweighted and divided by the sample count when
+						// the tile is resolved
+						float3 weight(1.0f);
+
+						PathState state;
+						state.pixel = int2(x, y);
+						state.sample = sample;
+
+						unsigned int path = (unsigned int)paths.size();
+						paths.push_back_inbounds(state);
 
 						endStatTimer(stats, primaryEmit);
 
 						StatTimer primaryPack = startStatTimer(RaytracerStatPrimaryPackCycles);
-						radianceBuffer.push(r, int2(x, y), weight, INFINITY);
+						radianceBuffer.push(r, path, weight, INFINITY);
 						endStatTimer(stats, primaryPack);
 					}
 				}
 			}
 		}
 
-		auto primaryHitFunc = [&](const Ray & ray, const int2 & pixel, const float3 & weight, float maxDist, const Collision & collision)
+		if (waveTiles.size() == 0) {
+			if (!endPass())
+				break;
+
+			continue;
+		}
+
+		auto primaryHitFunc = [&](const Ray & ray, unsigned int path, const float3 & weight, float maxDist, const Collision & collision)
 		{
 			ShadingWorkItem item;
 			item.ray = ray;
-			item.pixel = pixel;
+			item.path = path;
 			item.weight = weight;
 			item.maxDist = maxDist;
 			item.collision = collision;
@@ -455,7 +946,7 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 			shadingBuff.push_back_inbounds(item);
 		};
 
-		auto primaryMissFunc = [&](const Ray & ray, const int2 & pixel, const float3 & weight, float maxDist)
+		auto primaryMissFunc = [&](const Ray & ray, unsigned int path, const float3 & weight, float maxDist)
 		{
 			float3 environmentColor = scene->getEnvironmentColor();
 			const Image<float, 4> *environmentMap = scene->getEnvironmentMap();
@@ -463,18 +954,26 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 			if (environmentMap)
 				environmentColor = scene->getEnvironmentMapSampler()->sample(environmentMap, ray.direction).xyz();
 
-			float3 color = output->getPixel(pixel.x, pixel.y).xyz();
-			color = color + weight * environmentColor; // TODO
-			output->setPixel(pixel.x, pixel.y, float4(color, 1.0f));
+			pathRadiance[path] = pathRadiance[path] + weight * environmentColor;
 		};
 
 		// Alternate between tree traversal and shading. Shading may produce more traversal work.
 		for (int generation = 0; generation < settings.maxDepth; generation++) {
-			radianceBuffer.flush(
+			stats->counter[generation == 0 ? RaytracerCounterPrimaryRays : RaytracerCounterSecondaryRays] +=
+				radianceBuffer.size();
+
+			StatTimer trace = startStatTimer(generation == 0 ? RaytracerStatPrimaryTraceCycles : RaytracerStatSecondaryTraceCycles);
+
+			bool radianceStream = settings.streamTraversal && generation > 0;
+
+			stats->counter[radianceStream ? RaytracerCounterStreams : RaytracerCounterPackets] += radianceBuffer.flush(
 				false,
+				radianceStream,
 				primaryHitFunc,
 				primaryMissFunc);
 
+			endStatTimer(stats, trace);
+
 			StatTimer shadingSort = startStatTimer(RaytracerStatShadingSortCycles);
 
 #if 1
@@ -528,13 +1027,18 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 
 				float3 wo = -item.ray.direction;
 
+				const PathState & state = paths[item.path];
+
+				PathSampler sampler(sampleGenerator, state.pixel, state.sample,
+					SampleDimensionPrimaryCount + generation * SampleDimensionBounceCount);
+
 				endStatTimer(stats, shading);
 
 				if (scene->getNumLights() > 0) {
 #if 0
 					for (int l = 0; l < scene->getNumLights(); l++)
 #else
-					int l = (int)(rand1D() * scene->getNumLights() * 0.999f);
+					int l = (int)(sampler.get1D(SampleDimensionLightSelect) * scene->getNumLights() * 0.999f);
 #endif
 					{
 						StatTimer shading = startStatTimer(RaytracerStatShadingCycles);
@@ -543,7 +1047,7 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 
 						// TODO: Can we jitter in more than one dimensin
 						// TODO: importance sampling, multiple importance sampling (need PDF probably)
-						float3 lightUV = rand3D();
+						float3 lightUV = sampler.get3D(SampleDimensionLight);
 
 						float3 wi, Li;
 						float r;
@@ -559,7 +1063,7 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 
 						StatTimer shadowPack = startStatTimer(RaytracerStatShadowPackCycles);
 
-						shadowBuffer.push(shadowRay, item.pixel, weight, r * 0.999f);
+						shadowBuffer.push(shadowRay, item.path, weight, r * 0.999f);
 
 						// TODO: If light does not cast shadows, return color immediately
 						endStatTimer(stats, shadowPack);
@@ -572,7 +1076,7 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 
 				if (generation == settings.maxDepth - 1)
 					kill = true;
-				else if (generation >= 1 && rand1D() <= p_kill) {
+				else if (generation >= 1 && sampler.get1D(SampleDimensionRoulette) < p_kill) {
 					pdf *= p_kill;
 					kill = true;
 				}
@@ -596,9 +1100,11 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 						p_transparent /= p_sum;
 						p_indirect /= p_sum;
 
-						float x = rand1D();
+						float x = sampler.get1D(SampleDimensionLobe);
 
-						if (x <= p_transparent) {
+						// Samples are in [0, 1), so strict comparisons give each branch exactly its
+						// probability and never pick a branch with probability zero
+						if (x < p_transparent) {
 							pdf *= p_transparent;
 
 							indirectRay.origin = interp.position + item.ray.direction * 0.01f;
@@ -607,10 +1113,10 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 							// Importance sampling: n dot l term cancels out
 							indirectWeight = item.weight * (1.0f - opacity) / pdf;
 						}
-						else if (x - p_transparent <= p_indirect) {
+						else if (x - p_transparent < p_indirect) {
 							pdf *= p_indirect;
 
-							float2 rand = rand2D();
+							float2 rand = sampler.get2D(SampleDimensionDirection);
 
 							indirectRay.origin = interp.position + triangle->normal * 0.001f;
 							indirectRay.direction = mapCosHemisphere(1.0f, rand);
@@ -631,7 +1137,7 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 
 						StatTimer secondaryPack = startStatTimer(RaytracerStatSecondaryPackCycles);
 
-						radianceBuffer.push(indirectRay, item.pixel, indirectWeight, INFINITY);
+						radianceBuffer.push(indirectRay, item.path, indirectWeight, INFINITY);
 
 						endStatTimer(stats, secondaryPack);
 					}
@@ -640,17 +1146,43 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 
 			shadingBuff.clear();
 
+			if (settings.occlusionQueries) {
+				stats->counter[RaytracerCounterShadowRays] += shadowBuffer.size();
+
+				StatTimer shadowTrace = startStatTimer(RaytracerStatShadowTraceCycles);
+
+				// Rays blocked by an opaque triangle are done. The rest are traced again below to
+				// find the closest hit, which is needed to look up the triangle's opacity.
+				stats->counter[RaytracerCounterPackets] += shadowBuffer.flushOcclusion(
+					[&](const Ray & ray, unsigned int path, const float3 & weight, float maxDist, unsigned int occluder) {
+						const Material *material = materials[triangles[occluder].material_id];
+
+						if (material->getTransparentTexture() || material->getOpacity() < 1.0f)
+							shadowBuffer.push(ray, path, weight, maxDist);
+					},
+					[&](const Ray & ray, unsigned int path, const float3 & weight, float maxDist) {
+						pathRadiance[path] = pathRadiance[path] + weight;
+					});
+
+				endStatTimer(stats, shadowTrace);
+			}
+
 			for (int k = 0; k < 3; k++) {
-				shadowBuffer.flush(
-					true, 
-					[&](const Ray & ray, const int2 & pixel, const float3 & weight, float maxDist, const Collision & collision) {
+				stats->counter[RaytracerCounterShadowRays] += shadowBuffer.size();
+
+				StatTimer shadowTrace = startStatTimer(RaytracerStatShadowTraceCycles);
+
+				stats->counter[settings.streamTraversal ? RaytracerCounterStreams : RaytracerCounterPackets] += shadowBuffer.flush(
+					true,
+					settings.streamTraversal,
+					[&](const Ray & ray, unsigned int path, const float3 & weight, float maxDist, const Collision & collision) {
 						// TODO: Terminate eventually
 
 						if (k < 2) {
 							ShadingWorkItem item;
 
 							item.ray = ray;
-							item.pixel = pixel;
+							item.path = path;
 							item.weight = weight;
 							item.maxDist = maxDist;
 							item.collision = collision;
@@ -659,12 +1191,12 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 							shadowBuff.push_back_inbounds(item);
 						}
 					},
-					[&](const Ray & ray, const int2 & pixel, const float3 & weight, float maxDist) {
-						float3 color = output->getPixel(pixel.x, pixel.y).xyz();
-						color = color + weight; // TODO
-						output->setPixel(pixel.x, pixel.y, float4(color, 1.0f));
+					[&](const Ray & ray, unsigned int path, const float3 & weight, float maxDist) {
+						pathRadiance[path] = pathRadiance[path] + weight;
 					});
 
+				endStatTimer(stats, shadowTrace);
+
 				for (auto & item : shadowBuff) {
 					// TODO: Only do this for transparent objects/triangles
 					const Triangle *triangle = &triangles[item.collision.triangle_id];
@@ -700,7 +1232,7 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 						// Importance sampling: n dot l term cancels out
 						float3 shadowWeight = item.weight * (1.0f - opacity);
 
-						shadowBuffer.push(shadowRay, item.pixel, shadowWeight, item.maxDist - item.collision.distance);
+						shadowBuffer.push(shadowRay, item.path, shadowWeight, item.maxDist - item.collision.distance);
 					}
 				}
 
@@ -708,19 +1240,139 @@ void Raytracer::worker_thread(int idx, int numThreads, RaytracerStats *stats) {
 			}
 		}
 
-        // TODO: Flushing one tile at a time keeps the tile in the cache probably, but might
-        // not get the most coherence. Adjusting the tile size would affect this probably.
+		StatTimer updateFramebuffer = startStatTimer(RaytracerStatUpdateFramebufferCycles);
+
+		// Resolve the tiles so the output always holds the average of the samples taken so far.
+		// Paths were emitted in this same order, one run of passSamples paths per pixel.
+		unsigned int path = 0;
+
+		for (auto & tile : waveTiles) {
+			int tileWidth = tile.x1 - tile.x0;
+
+			for (int y = tile.y0; y < tile.y1; y++) {
+				for (int x = tile.x0; x < tile.x1; x++) {
+					float4 accum = accumulation->getPixel(x, y);
+
+					if (passAdaptive && !pixelActive[y * width + x]) {
+						tileOutput[(y - tile.y0) * tileWidth + (x - tile.x0)] = float4(accum.xyz() / accum.w, 1.0f);
+						continue;
+					}
+
+					float2 m = moments->getPixel(x, y);
+
+					for (int i = 0; i < passSamples; i++, path++) {
+						float3 L = pathRadiance[path];
+						pathRadiance[path] = float3(0.0f);
+
+						accum = accum + float4(L, 1.0f);
+
+						// Welford's update of the luminance mean and sum of squared deviations
+						float Y = dot(L, float3(0.2126f, 0.7152f, 0.0722f));
+						float delta = Y - m.x;
+						m.x += delta / accum.w;
+						m.y += delta * (Y - m.x);
+					}
+
+					accumulation->setPixel(x, y, accum);
+					moments->setPixel(x, y, m);
+
+					tileOutput[(y - tile.y0) * tileWidth + (x - tile.x0)] = float4(accum.xyz() / accum.w, 1.0f);
+				}
+			}
+
+			publishTile(tile, &tileOutput[0]);
+		}
+
+		assert(path == paths.size());
+
+		stats->counter[RaytracerCounterTiles] += waveTiles.size();
+
+		for (RayBuffer *buffer : { &radianceBuffer, &shadowBuffer }) {
+			stats->counter[RaytracerCounterLeafTests] += buffer->getLaneStats().leafTests;
+			stats->counter[RaytracerCounterLanes] += buffer->getLaneStats().lanes;
+			stats->counter[RaytracerCounterActiveLanes] += buffer->getLaneStats().activeLanes;
+			buffer->clearLaneStats();
+		}
+
+		endStatTimer(stats, updateFramebuffer);
 
 		endStatTimer(stats, totalCycles);
     }
 
     //std::cout << "Ray buffer size: " << rayBuff.capacity() << " (" << (rayBuff.capacity() * sizeof(Ray) + 1024 - 1) / 1024 << "kb)" << std::endl;
 
-    numThreadsAlive--;
+    // The last worker to finish records how long rendering took
+    if (numThreadsAlive.fetch_sub(1) == 1)
+        renderSeconds = (float)(renderTimer.getElapsedMilliseconds() / 1000.0);
+}
+
+void Raytracer::publishTile(const Tile & tile, const float4 *pixels) {
+    int tileWidth = tile.x1 - tile.x0;
+
+    for (int by = tile.y0 / PUBLISH_BLOCK_SIZE; by <= (tile.y1 - 1) / PUBLISH_BLOCK_SIZE; by++) {
+        for (int bx = tile.x0 / PUBLISH_BLOCK_SIZE; bx <= (tile.x1 - 1) / PUBLISH_BLOCK_SIZE; bx++) {
+            std::atomic<uint32_t> & version = blockVersions[by * blocksW + bx];
+
+            // Lock the block by making its version odd. Tiles split by the scheduler may share
+            // a block, in which case the writers take turns.
+            uint32_t v = version.load(std::memory_order_relaxed);
+
+            while ((v & 1) || !version.compare_exchange_weak(v, v + 1, std::memory_order_acquire))
+                v = version.load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_release);
+
+            int x0 = std::max(tile.x0, bx * PUBLISH_BLOCK_SIZE);
+            int y0 = std::max(tile.y0, by * PUBLISH_BLOCK_SIZE);
+            int x1 = std::min(tile.x1, (bx + 1) * PUBLISH_BLOCK_SIZE);
+            int y1 = std::min(tile.y1, (by + 1) * PUBLISH_BLOCK_SIZE);
+
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                    output->setPixel(x, y, pixels[(y - tile.y0) * tileWidth + (x - tile.x0)]);
+
+            version.store(v + 2, std::memory_order_release);
+        }
+    }
+}
+
+void Raytracer::snapshot(Image<float, 4> *image) {
+    int width = output->getWidth();
+    int height = output->getHeight();
+
+    for (int by = 0; by < blocksH; by++) {
+        for (int bx = 0; bx < blocksW; bx++) {
+            std::atomic<uint32_t> & version = blockVersions[by * blocksW + bx];
+
+            int x0 = bx * PUBLISH_BLOCK_SIZE;
+            int y0 = by * PUBLISH_BLOCK_SIZE;
+            int x1 = std::min(width, x0 + PUBLISH_BLOCK_SIZE);
+            int y1 = std::min(height, y0 + PUBLISH_BLOCK_SIZE);
+
+            // Copy the block, and try again if a worker published it in the meantime
+            while (true) {
+                uint32_t v = version.load(std::memory_order_acquire);
+
+                if (v & 1) {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                for (int y = y0; y < y1; y++)
+                    for (int x = x0; x < x1; x++)
+                        image->setPixel(x, y, output->getPixel(x, y));
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (version.load(std::memory_order_relaxed) == v)
+                    break;
+            }
+        }
+    }
 }
 
 bool Raytracer::intersect(float2 uv, Collision & result) {
 	Ray r = scene->getCamera()->getViewRay(float2(0, 0), uv);
 
-	return tree.intersect(r, INFINITY, result);
+	return activeTree.load(std::memory_order_acquire)->intersect(r, INFINITY, result);
 }
@@ -9,7 +9,23 @@
 RaytracerSettings::RaytracerSettings()
     : pixelSamples(2),
       maxDepth(2),
+      numPasses(1),
+      adaptivePasses(0),
+      adaptiveThreshold(0.05f),
+      adaptiveBudget(1.0f),
       numThreads(0),
+      seed(0),
+      sampler(SampleGeneratorSobol),
+      tileSize(32),
+      waveSize(32768),
+      tileOrder(TileOrderHilbert),
+      pinThreads(false),
+      simdWidth(SIMD),
+      streamTraversal(false),
+      occlusionQueries(true),
+      kdBuilder(KDBuilderTypePresortedSAH),
+      kdAutotune(false),
+      kdProgressive(false),
       width(1024),
       height(1024)
 {
@@ -0,0 +1,357 @@
+/**
+ * @file core/samplegenerator.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <core/samplegenerator.h>
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+// Number of independent PMJ02 sequences to generate
+#define PMJ02_NUM_TABLES 32
+
+// Largest PMJ02 table to generate. Larger sample counts fall back to random samples.
+#define PMJ02_MAX_SAMPLES 4096
+
+/**
+ * @brief Combine a 32-bit seed with a small integer into a new seed
+ */
+static inline uint32_t hashCombine(uint32_t seed, uint32_t value) {
+    return (uint32_t)(hash64(seed, value) >> 32);
+}
+
+static inline uint32_t reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+    x = (x >> 16) | (x << 16);
+
+    return x;
+}
+
+/**
+ * @brief Laine-Karras style hash permutation. Each output bit only depends on the input bits
+ * below it, which makes it an Owen scramble when applied to bit reversed values.
+ */
+static inline uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+
+    return x;
+}
+
+/**
+ * @brief Owen scramble a 32-bit fixed point value in [0, 1)
+ */
+static inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+/**
+ * @brief Second dimension of the Sobol sequence. The first is the bit reversed index.
+ */
+static inline uint32_t sobol1(uint32_t index) {
+    uint32_t result = 0;
+
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+
+    return result;
+}
+
+SampleGenerator::SampleGenerator(uint32_t seed)
+    : seed(seed)
+{
+}
+
+SampleGenerator::~SampleGenerator() {
+}
+
+SampleGenerator *SampleGenerator::create(SampleGeneratorType type, uint32_t seed, int samplesPerPixel) {
+    switch (type) {
+    case SampleGeneratorRandom:
+        return new RandomSampleGenerator(seed);
+    case SampleGeneratorSobol:
+        return new SobolSampleGenerator(seed);
+    case SampleGeneratorPMJ02:
+        return new PMJ02SampleGenerator(seed, samplesPerPixel);
+    default:
+        assert(0);
+        return NULL;
+    }
+}
+
+RandomSampleGenerator::RandomSampleGenerator(uint32_t seed)
+    : SampleGenerator(seed)
+{
+}
+
+float RandomSampleGenerator::get1D(const int2 & pixel, uint32_t index, uint32_t dimension) const {
+    RandomStream rng(seed, pixel, index, dimension);
+    return rng.next1D();
+}
+
+float2 RandomSampleGenerator::get2D(const int2 & pixel, uint32_t index, uint32_t dimension) const {
+    RandomStream rng(seed, pixel, index, dimension);
+    return rng.next2D();
+}
+
+SobolSampleGenerator::SobolSampleGenerator(uint32_t seed)
+    : SampleGenerator(seed)
+{
+}
+
+float SobolSampleGenerator::get1D(const int2 & pixel, uint32_t index, uint32_t dimension) const {
+    uint32_t pattern = hashPattern(pixel, dimension);
+
+    // Shuffle the order of the samples so that different dimensions are decorrelated. Owen
+    // scrambling the index keeps each power of two prefix stratified.
+    index = nestedUniformScramble(index, pattern);
+
+    uint32_t x = nestedUniformScramble(reverseBits(index), hashCombine(pattern, 0));
+
+    return toFloat(x);
+}
+
+float2 SobolSampleGenerator::get2D(const int2 & pixel, uint32_t index, uint32_t dimension) const {
+    uint32_t pattern = hashPattern(pixel, dimension);
+
+    index = nestedUniformScramble(index, pattern);
+
+    uint32_t x = nestedUniformScramble(reverseBits(index), hashCombine(pattern, 0));
+    uint32_t y = nestedUniformScramble(sobol1(index), hashCombine(pattern, 1));
+
+    return float2(toFloat(x), toFloat(y));
+}
+
+/**
+ * @brief Progressive multi-jittered (0, 2) sequence generator, following Christensen et al.
+ * Each time the number of samples doubles, every new sample is placed in the empty
+ * sub-quadrant of a cell diagonally opposite (or adjacent, on odd steps) to an existing sample,
+ * at a position that leaves every elementary interval at the new sample count with exactly one
+ * sample. Samples are 32-bit fixed point values.
+ */
+class PMJ02Builder {
+private:
+
+    RandomStream                   & rng;
+    uint32_t                        *points;   //!< Interleaved X and Y values
+    int                              log2M;    //!< Log2 of the target number of samples
+    std::vector<std::vector<bool>>   occupied; //!< Occupied cells for each elementary interval shape
+    std::vector<uint32_t>            columns;
+    std::vector<uint32_t>            rows;
+
+    /**
+     * @brief Get the index of the cell containing a point in elementary interval shape k,
+     * which has 2^k columns and 2^(log2M - k) rows
+     */
+    inline uint32_t cell(int k, uint32_t cx, uint32_t cy) const {
+        return ((cx >> (log2M - k)) << (log2M - k)) | (cy >> k);
+    }
+
+    void mark(uint32_t x, uint32_t y) {
+        uint32_t cx = x >> (32 - log2M);
+        uint32_t cy = y >> (32 - log2M);
+
+        for (int k = 0; k <= log2M; k++)
+            occupied[k][cell(k, cx, cy)] = true;
+    }
+
+    void shuffle(std::vector<uint32_t> & values) {
+        for (int i = (int)values.size() - 1; i > 0; i--)
+            std::swap(values[i], values[rng.nextUInt() % (i + 1)]);
+    }
+
+    /**
+     * @brief Place a sample in a sub-quadrant of the grid with the given number of cells per
+     * axis. Returns false if there is no valid position.
+     */
+    bool place(int s, uint32_t qx, uint32_t qy, int log2Grid) {
+        int log2Cells = log2M - log2Grid;
+        uint32_t cellsPerQuadrant = 1 << log2Cells;
+
+        // Columns and rows which are not occupied by any sample yet. The shapes with one row
+        // or one column track these.
+        columns.clear();
+        rows.clear();
+
+        for (uint32_t i = 0; i < cellsPerQuadrant; i++) {
+            uint32_t cx = (qx << log2Cells) | i;
+            uint32_t cy = (qy << log2Cells) | i;
+
+            if (!occupied[log2M][cell(log2M, cx, 0)])
+                columns.push_back(cx);
+
+            if (!occupied[0][cell(0, 0, cy)])
+                rows.push_back(cy);
+        }
+
+        shuffle(columns);
+        shuffle(rows);
+
+        for (uint32_t cx : columns) {
+            for (uint32_t cy : rows) {
+                bool valid = true;
+
+                for (int k = 1; k < log2M && valid; k++)
+                    valid = !occupied[k][cell(k, cx, cy)];
+
+                if (!valid)
+                    continue;
+
+                uint32_t x = (cx << (32 - log2M)) | (rng.nextUInt() >> log2M);
+                uint32_t y = (cy << (32 - log2M)) | (rng.nextUInt() >> log2M);
+
+                points[s * 2 + 0] = x;
+                points[s * 2 + 1] = y;
+
+                mark(x, y);
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Get the sub-quadrant containing an existing sample in a grid with 2^log2Grid cells
+     * per axis
+     */
+    inline void quadrant(int s, int log2Grid, uint32_t & qx, uint32_t & qy) const {
+        qx = points[s * 2 + 0] >> (32 - log2Grid);
+        qy = points[s * 2 + 1] >> (32 - log2Grid);
+    }
+
+public:
+
+    PMJ02Builder(RandomStream & rng, uint32_t *points)
+        : rng(rng),
+          points(points)
+    {
+    }
+
+    /**
+     * @brief Generate a sequence. Returns false if generation got stuck, in which case it
+     * can be retried with different random values.
+     */
+    bool build(int count) {
+        points[0] = rng.nextUInt();
+        points[1] = rng.nextUInt();
+
+        for (int N = 1, log2N = 0; N < count; N *= 2, log2N++) {
+            log2M = log2N + 1;
+
+            occupied.assign(log2M + 1, std::vector<bool>(1 << log2M, false));
+
+            for (int i = 0; i < N; i++)
+                mark(points[i * 2 + 0], points[i * 2 + 1]);
+
+            // The first N samples have one sample per cell of an n x n grid (even steps) or
+            // two samples in diagonally opposite sub-quadrants of each cell (odd steps).
+            // Sub-quadrants form a grid of 2n x 2n.
+            int log2Grid = log2N / 2 + 1;
+            uint32_t qx, qy;
+
+            if ((log2N & 1) == 0) {
+                for (int i = 0; i < N; i++) {
+                    quadrant(i, log2Grid, qx, qy);
+
+                    if (!place(N + i, qx ^ 1, qy ^ 1, log2Grid))
+                        return false;
+                }
+            }
+            else {
+                for (int i = 0; i < N / 2; i++) {
+                    quadrant(i, log2Grid, qx, qy);
+
+                    if (rng.nextUInt() & 1)
+                        qx ^= 1;
+                    else
+                        qy ^= 1;
+
+                    if (!place(N + i, qx, qy, log2Grid))
+                        return false;
+                }
+
+                for (int i = 0; i < N / 2; i++) {
+                    quadrant(N + i, log2Grid, qx, qy);
+
+                    if (!place(N + N / 2 + i, qx ^ 1, qy ^ 1, log2Grid))
+                        return false;
+                }
+            }
+        }
+
+        return true;
+    }
+};
+
+PMJ02SampleGenerator::PMJ02SampleGenerator(uint32_t seed, int numSamples)
+    : SampleGenerator(seed),
+      numSamples(1)
+{
+    while (this->numSamples < numSamples && this->numSamples < PMJ02_MAX_SAMPLES)
+        this->numSamples *= 2;
+
+    if (numSamples > this->numSamples) {
+        std::cout << "PMJ02 tables hold " << this->numSamples << " of " << numSamples
+            << " samples per pixel, the rest will be independent random values" << std::endl;
+    }
+
+    tables.resize(PMJ02_NUM_TABLES * this->numSamples * 2);
+
+    int retries = 0;
+
+    for (int i = 0; i < PMJ02_NUM_TABLES; i++) {
+        RandomStream rng(seed, int2(i, 0), 0);
+        PMJ02Builder builder(rng, &tables[i * this->numSamples * 2]);
+
+        // The stream keeps advancing, so a retry uses different random values
+        while (!builder.build(this->numSamples))
+            retries++;
+    }
+
+    if (retries > 0)
+        std::cout << "PMJ02 table generation needed " << retries << " retries" << std::endl;
+}
+
+void PMJ02SampleGenerator::lookup(const int2 & pixel, uint32_t index, uint32_t dimension, uint32_t & x, uint32_t & y) const {
+    uint32_t pattern = hashPattern(pixel, dimension);
+
+    if (index >= (uint32_t)numSamples) {
+        RandomStream rng(pattern, pixel, index);
+        x = rng.nextUInt();
+        y = rng.nextUInt();
+        return;
+    }
+
+    const uint32_t *table = &tables[(pattern % PMJ02_NUM_TABLES) * numSamples * 2];
+
+    // XOR scrambling flips the same bits of every sample, which maps elementary intervals to
+    // elementary intervals and so preserves the stratification
+    x = table[index * 2 + 0] ^ hashCombine(pattern, 0);
+    y = table[index * 2 + 1] ^ hashCombine(pattern, 1);
+}
+
+float PMJ02SampleGenerator::get1D(const int2 & pixel, uint32_t index, uint32_t dimension) const {
+    uint32_t x, y;
+    lookup(pixel, index, dimension, x, y);
+
+    return toFloat(x);
+}
+
+float2 PMJ02SampleGenerator::get2D(const int2 & pixel, uint32_t index, uint32_t dimension) const {
+    uint32_t x, y;
+    lookup(pixel, index, dimension, x, y);
+
+    return float2(toFloat(x), toFloat(y));
+}
@@ -0,0 +1,220 @@
+/**
+ * @file core/tilescheduler.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <core/tilescheduler.h>
+
+#include <algorithm>
+#include <new>
+#include <stdint.h>
+
+// Stolen tiles are not split below this width or height
+#define MIN_TILE_SIZE 8
+
+/**
+ * @brief Interleave the bits of x and y
+ */
+static uint32_t mortonKey(uint32_t x, uint32_t y) {
+    uint32_t key = 0;
+
+    for (int i = 0; i < 16; i++)
+        key |= ((x >> i) & 1) << (2 * i) | ((y >> i) & 1) << (2 * i + 1);
+
+    return key;
+}
+
+/**
+ * @brief Distance along a Hilbert curve covering an n x n grid, where n is a power of two
+ */
+static uint32_t hilbertKey(uint32_t n, uint32_t x, uint32_t y) {
+    uint32_t key = 0;
+
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+
+        key += s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the sub-curve has the right orientation
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+
+            std::swap(x, y);
+        }
+    }
+
+    return key;
+}
+
+TileScheduler::TileScheduler(int width, int height, int tileSize, TileOrder order, int numWorkers)
+    : numWorkers(numWorkers),
+      minTileSize(MIN_TILE_SIZE),
+      numSteals(0),
+      numSplits(0)
+{
+    queues = (WorkerQueue *)aligned_alloc(sizeof(WorkerQueue) * numWorkers, CACHE_LINE);
+
+    for (int i = 0; i < numWorkers; i++)
+        new (&queues[i]) WorkerQueue();
+
+    int nTilesW = (width + tileSize - 1) / tileSize;
+    int nTilesH = (height + tileSize - 1) / tileSize;
+
+    uint32_t n = 1;
+
+    while (n < (uint32_t)nTilesW || n < (uint32_t)nTilesH)
+        n *= 2;
+
+    std::vector<std::pair<uint32_t, Tile>> keyed;
+    keyed.reserve(nTilesW * nTilesH);
+
+    for (int y = 0; y < nTilesH; y++) {
+        for (int x = 0; x < nTilesW; x++) {
+            Tile tile;
+            tile.x0 = x * tileSize;
+            tile.y0 = y * tileSize;
+            tile.x1 = std::min(tile.x0 + tileSize, width);
+            tile.y1 = std::min(tile.y0 + tileSize, height);
+
+            uint32_t key;
+
+            switch (order) {
+            case TileOrderMorton:
+                key = mortonKey(x, y);
+                break;
+            case TileOrderHilbert:
+                key = hilbertKey(n, x, y);
+                break;
+            default:
+                key = y * nTilesW + x;
+                break;
+            }
+
+            keyed.push_back(std::make_pair(key, tile));
+        }
+    }
+
+    std::sort(keyed.begin(), keyed.end(), [](const std::pair<uint32_t, Tile> & l, const std::pair<uint32_t, Tile> & r) -> bool {
+        return l.first < r.first;
+    });
+
+    tiles.reserve(keyed.size());
+
+    for (auto & tile : keyed)
+        tiles.push_back(tile.second);
+
+    reset();
+}
+
+TileScheduler::~TileScheduler() {
+    for (int i = 0; i < numWorkers; i++)
+        queues[i].~WorkerQueue();
+
+    aligned_free(queues);
+}
+
+void TileScheduler::reset() {
+    reset(std::vector<bool>(tiles.size(), true));
+}
+
+void TileScheduler::reset(const std::vector<bool> & active) {
+    std::vector<Tile> remaining;
+    remaining.reserve(tiles.size());
+
+    for (size_t i = 0; i < tiles.size(); i++)
+        if (active[i])
+            remaining.push_back(tiles[i]);
+
+    // Give each worker a contiguous run along the curve
+    size_t numTiles = remaining.size();
+
+    for (int i = 0; i < numWorkers; i++) {
+        size_t start = numTiles * i / numWorkers;
+        size_t end = numTiles * (i + 1) / numWorkers;
+
+        queues[i].tiles.assign(remaining.begin() + start, remaining.begin() + end);
+    }
+}
+
+bool TileScheduler::next(int worker, Tile & tile) {
+    WorkerQueue & queue = queues[worker];
+
+    queue.lock.lock();
+
+    if (!queue.tiles.empty()) {
+        tile = queue.tiles.front();
+        queue.tiles.pop_front();
+        queue.lock.unlock();
+
+        return true;
+    }
+
+    queue.lock.unlock();
+
+    return steal(worker, tile);
+}
+
+bool TileScheduler::steal(int worker, Tile & tile) {
+    // Try the nearest workers first. With pinned threads, they are likely to share a cache.
+    for (int i = 1; i < numWorkers; i++) {
+        WorkerQueue & victim = queues[(worker + i) % numWorkers];
+
+        victim.lock.lock();
+
+        if (victim.tiles.empty()) {
+            victim.lock.unlock();
+            continue;
+        }
+
+        // The back of the deque is farthest along the curve from where the victim is working
+        tile = victim.tiles.back();
+        victim.tiles.pop_back();
+        victim.lock.unlock();
+
+        numSteals++;
+
+        int w = tile.x1 - tile.x0;
+        int h = tile.y1 - tile.y0;
+
+        bool splitX = w > minTileSize;
+        bool splitY = h > minTileSize;
+
+        if (!splitX && !splitY)
+            return true;
+
+        int midX = splitX ? tile.x0 + w / 2 : tile.x1;
+        int midY = splitY ? tile.y0 + h / 2 : tile.y1;
+
+        Tile pieces[4] = {
+            { tile.x0, tile.y0, midX,    midY    },
+            { midX,    tile.y0, tile.x1, midY    },
+            { midX,    midY,    tile.x1, tile.y1 },
+            { tile.x0, midY,    midX,    tile.y1 }
+        };
+
+        // Keep the first piece and make the rest available to other workers, in an order that
+        // keeps neighboring pieces adjacent
+        WorkerQueue & queue = queues[worker];
+
+        queue.lock.lock();
+
+        for (int j = 1; j < 4; j++)
+            if (pieces[j].x0 < pieces[j].x1 && pieces[j].y0 < pieces[j].y1)
+                queue.tiles.push_back(pieces[j]);
+
+        queue.lock.unlock();
+
+        numSplits++;
+
+        tile = pieces[0];
+
+        return true;
+    }
+
+    return false;
+}
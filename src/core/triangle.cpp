@@ -5,184 +5,172 @@
  */
 
 #include <core/triangle.h>
-#include <core/triangle.inl>
 
 #include <string.h>
 #include <util/align.h>
 
 /**
- * @brief Pack triangle data into setup triangle data
- *
- * @param[in] triangles     An array of pointers to unpacked triangles
- * @param[in] num_triangles Number of triangles to pack
+ * @brief Pack one triangle into a lane of a setup triangle block
  */
-void setupTriangles(
-    const util::vector<Triangle, 16> & triangles, 
-    util::vector<SetupTriangle, 16>  & setupTriangles)
-{
-#if defined(WALD_INTERSECTION)
-    // TODO: should this be aligned (and possibly padded) to a cache line to
-    // make sure it only requires one memory request?
+static void setupTriangle(const Triangle & tri, SetupTriangleBlock & block, int lane) {
     static const int mod_table[5] = { 0, 1, 2, 0, 1 };
+
+    const float3 & v0 = tri.v[0].position;
+    const float3 & v1 = tri.v[1].position;
+    const float3 & v2 = tri.v[2].position;
     
-    for (auto & tri : triangles) {
-        SetupTriangle setup;
-        
-        const float3 & v0 = tri.v[0].position;
-        const float3 & v1 = tri.v[1].position;
-        const float3 & v2 = tri.v[2].position;
-        
-        // Edges and normal
-        float3 b = v2 - v0;
-        float3 c = v1 - v0;
-        float3 n = cross(c, b);
-        
-        // Choose which dimension to project
-        if (fabs(n.x) > fabs(n.y))
-            setup.k = fabs(n.x) > fabs(n.z) ? 0 : 2;
-        else
-            setup.k = fabs(n.y) > fabs(n.z) ? 1 : 2;
-        
-        int u = mod_table[setup.k + 1]; // TODO %
-        int v = mod_table[setup.k + 2];
-        
-        n = n / n[setup.k];
-        
-        setup.n_u = n[u];
-        setup.n_v = n[v];
-        setup.n_d = dot(v0, n);
-        
-        // TODO: inv_denom
-        
-        float denom = b[u] * c[v] - b[v] * c[u];
-        setup.b_nu = -b[v] / denom;
-        setup.b_nv = b[u] / denom;
-        setup.b_d = (b[v] * v0[u] - b[u] * v0[v]) / denom;
-        
-        setup.c_nu = c[v] / denom;
-        setup.c_nv = -c[u] / denom;
-        setup.c_d = (c[u] * v0[v] - c[v] * v0[u]) / denom;
-        
-        setup.triangle_id = tri.triangle_id;
-
-        setupTriangles.push_back(setup);
-    }
-#elif defined(MOLLER_TRUMBORE_INTERSECTION)
-    for (int i = 0; i < num_triangles; i++) {
-        const Triangle & tri = *(triangles[i]);
-        SetupTriangle & setup = data[i];
-        
-        setup.v[0] = tri.v[0].position;
-        setup.e1 = tri.v[1].position - tri.v[0].position;
-        setup.e2 = tri.v[2].position - tri.v[0].position;
-        setup.triangle_id = tri.triangle_id;
+    // Edges and normal
+    float3 b = v2 - v0;
+    float3 c = v1 - v0;
+    float3 n = cross(c, b);
+    
+    // Choose which dimension to project
+    int k;
+
+    if (fabs(n.x) > fabs(n.y))
+        k = fabs(n.x) > fabs(n.z) ? 0 : 2;
+    else
+        k = fabs(n.y) > fabs(n.z) ? 1 : 2;
+    
+    int u = mod_table[k + 1]; // TODO %
+    int v = mod_table[k + 2];
+    
+    n = n / n[k];
+    
+    block.k[lane] = k;
+
+    block.n[k][lane] = 1.0f;
+    block.n[u][lane] = n[u];
+    block.n[v][lane] = n[v];
+    block.n_d[lane] = dot(v0, n);
+    
+    // TODO: inv_denom
+    
+    float denom = b[u] * c[v] - b[v] * c[u];
+    block.b[k][lane] = 0.0f;
+    block.b[u][lane] = -b[v] / denom;
+    block.b[v][lane] = b[u] / denom;
+    block.b_d[lane] = (b[v] * v0[u] - b[u] * v0[v]) / denom;
+    
+    block.c[k][lane] = 0.0f;
+    block.c[u][lane] = c[v] / denom;
+    block.c[v][lane] = -c[u] / denom;
+    block.c_d[lane] = (c[u] * v0[v] - c[v] * v0[u]) / denom;
+    
+    block.triangle_id[lane] = tri.triangle_id;
+}
+
+/**
+ * @brief Fill a lane of a setup triangle block with a triangle that no ray hits: the plane
+ * is never in front of a ray, and the barycentric coordinate beta is always negative
+ */
+static void setupPadding(SetupTriangleBlock & block, int lane) {
+    block.k[lane] = 0;
+
+    for (int j = 0; j < 3; j++) {
+        block.n[j][lane] = 0.0f;
+        block.b[j][lane] = 0.0f;
+        block.c[j][lane] = 0.0f;
     }
-#endif
+
+    block.n_d[lane] = 0.0f;
+    block.b_d[lane] = -1.0f;
+    block.c_d[lane] = -1.0f;
+    block.triangle_id[lane] = 0;
 }
 
-int clip(float3 *input,
-         float3 *output,
-         float   plane,
-         int     axis,
-         int     keep)
+void setupTriangles(
+    const util::vector<Triangle, 16>       & triangles,
+    util::vector<SetupTriangleBlock, 32>   & setupTriangles)
 {
-    int count = 0;
- 
-    // TODO: Eliminate branch, function call
-    // TODO: Could use SIMD
-
-    if (keep & 0x1) {
-        float3 vertices[4] = {};
-        int vertex = 0;
-        
-        for (int edge = 0; edge < 3; edge++) {
-            int i = edge;
-            int j = (edge + 1) % 3;
-            
-            if (input[i][axis] == plane) {
-                vertices[vertex++][i] = 1;
-            }
-            else if (input[i][axis] > plane) {
-                vertices[vertex++][i] = 1;
-                
-                // Edge exits
-                if (input[j][axis] < plane) {
-                    float t = (plane - input[j][axis]) / (input[i][axis] - input[j][axis]);
-                    vertices[vertex][j] = 1 - t;
-                    vertices[vertex++][i] = t;
-                }
-            }
-            else {
-                // Edge enters
-                if (input[j][axis] > plane) {
-                    float t = (plane - input[i][axis]) / (input[j][axis] - input[i][axis]);
-                    vertices[vertex][i] = 1 - t;
-                    vertices[vertex++][j] = t;
-                }
-                ;
-                // Edge outside
-            }
-        }
-        
-        if (vertex >= 3) {
-            output[count++] = vertices[0];
-            output[count++] = vertices[1];
-            output[count++] = vertices[2];
-            
-            if (vertex == 4) {
-                output[count++] = vertices[0];
-                output[count++] = vertices[2];
-                output[count++] = vertices[3];
-            }
+    util::vector<uint32_t, 16> indices;
+    indices.reserve(triangles.size());
+
+    for (uint32_t i = 0; i < triangles.size(); i++)
+        indices.push_back_inbounds(i);
+
+    ::setupTriangles(triangles, &indices[0], (uint32_t)indices.size(), setupTriangles);
+}
+
+void setupTriangles(
+    const util::vector<Triangle, 16>       & triangles,
+    const uint32_t                         * indices,
+    uint32_t                                 num_indices,
+    util::vector<SetupTriangleBlock, 32>   & setupTriangles)
+{
+    uint32_t numBlocks = (num_indices + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+
+    setupTriangles.reserve(setupTriangles.size() + numBlocks);
+
+    for (uint32_t i = 0; i < numBlocks; i++) {
+        SetupTriangleBlock block;
+
+        for (uint32_t lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+            uint32_t j = i * TRIANGLE_BLOCK_SIZE + lane;
+
+            if (j < num_indices)
+                setupTriangle(triangles[indices[j]], block, lane);
+            else
+                setupPadding(block, lane);
         }
+
+        setupTriangles.push_back_inbounds(block);
     }
-    
-    if (keep & 0x2) {
-        float3 vertices[4] = {};
-        int vertex = 0;
-        
-        for (int edge = 0; edge < 3; edge++) {
-            int i = edge;
-            int j = (edge + 1) % 3;
-            
-            if (input[i][axis] == plane) {
-                // Edge inside
-                vertices[vertex++][i] = 1; // TODO
-            }
-            else if (input[i][axis] > plane) {
-                // Edge exits
-                if (input[j][axis] < plane) {
-                    float t = (plane - input[j][axis]) / (input[i][axis] - input[j][axis]);
-                    vertices[vertex][j] = 1 - t;
-                    vertices[vertex++][i] = t;
-                }
-                
-                // Edge inside
-            }
-            else {
-                vertices[vertex++][i] = 1;
-                
-                // Edge enters
-                if (input[j][axis] > plane) {
-                    float t = (plane - input[i][axis]) / (input[j][axis] - input[i][axis]);
-                    vertices[vertex][i] = 1 - t;
-                    vertices[vertex++][j] = t;
+}
+
+bool clipBounds(const Triangle & tri, const AABB & box, AABB & bounds) {
+    // Clip the triangle against each face of the box in turn. Each face adds at most one vertex.
+    float3 polygon[2][9];
+    int count = 3;
+    int in = 0;
+
+    for (int i = 0; i < 3; i++)
+        polygon[0][i] = tri.v[i].position;
+
+    for (int axis = 0; axis < 3; axis++) {
+        for (int face = 0; face < 2; face++) {
+            float plane = face == 0 ? box.min[axis] : box.max[axis];
+            float sign = face == 0 ? 1.0f : -1.0f;
+
+            const float3 *input = polygon[in];
+            float3 *output = polygon[in ^ 1];
+            int vertex = 0;
+
+            for (int i = 0; i < count; i++) {
+                const float3 & a = input[i];
+                const float3 & b = input[(i + 1) % count];
+
+                // Signed distances, positive inside the box
+                float da = (a[axis] - plane) * sign;
+                float db = (b[axis] - plane) * sign;
+
+                if (da >= 0.0f)
+                    output[vertex++] = a;
+
+                // Edge crosses the plane
+                if ((da < 0.0f && db > 0.0f) || (da > 0.0f && db < 0.0f)) {
+                    float3 p = a + (b - a) * (da / (da - db));
+                    p[axis] = plane;
+                    output[vertex++] = p;
                 }
             }
-        }
-        
-        if (vertex >= 3) {
-            output[count++] = vertices[0];
-            output[count++] = vertices[1];
-            output[count++] = vertices[2];
-            
-            if (vertex == 4) {
-                output[count++] = vertices[0];
-                output[count++] = vertices[2];
-                output[count++] = vertices[3];
-            }
+
+            count = vertex;
+            in ^= 1;
+
+            if (count == 0)
+                return false;
         }
     }
-    
-    return count / 3;
+
+    bounds = AABB(polygon[in][0]);
+
+    for (int i = 1; i < count; i++)
+        bounds.join(polygon[in][i]);
+
+    // Rounding in the intersections can put points just outside the box
+    bounds.min = max(bounds.min, box.min);
+    bounds.max = min(bounds.max, box.max);
+
+    return true;
 }
@@ -0,0 +1,130 @@
+/**
+ * @file kdtree/kdbenchmark.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <kdtree/kdbenchmark.h>
+
+#include <algorithm>
+#include <cstring>
+#include <util/align.h>
+#include <util/timer.h>
+
+/**
+ * @brief Set associative cache with LRU replacement, for counting the cache lines a traversal
+ * would miss. Models a 32KB, 8-way L1 data cache.
+ */
+class CacheModel {
+private:
+
+    static const int NumSets = 64;
+    static const int NumWays = 8;
+
+    uintptr_t lines[NumSets][NumWays];
+    uint64_t  lastUse[NumSets][NumWays];
+    uint64_t  time;
+
+public:
+
+    uint64_t  accesses;
+    uint64_t  misses;
+
+    CacheModel()
+        : time(0),
+          accesses(0),
+          misses(0)
+    {
+        memset(lines, 0xFF, sizeof(lines));
+        memset(lastUse, 0, sizeof(lastUse));
+    }
+
+    void access(uintptr_t line) {
+        int set = (int)(line % NumSets);
+        int victim = 0;
+
+        accesses++;
+        time++;
+
+        for (int way = 0; way < NumWays; way++) {
+            if (lines[set][way] == line) {
+                lastUse[set][way] = time;
+                return;
+            }
+
+            if (lastUse[set][way] < lastUse[set][victim])
+                victim = way;
+        }
+
+        misses++;
+        lines[set][victim] = line;
+        lastUse[set][victim] = time;
+    }
+};
+
+// Different cache lines tracked for each ray. Rays which read more are undercounted.
+#define KD_BENCHMARK_MAX_LINES 1024
+
+/**
+ * @brief Reads of the ray being traced, fed to the cache model
+ */
+struct KDBenchmarkContext {
+    CacheModel cache;
+    uintptr_t  lines[KD_BENCHMARK_MAX_LINES]; //!< Different lines the current ray read
+    int        numLines;
+};
+
+static void recordAccess(void *context, const void *address, size_t size) {
+    KDBenchmarkContext *ctx = (KDBenchmarkContext *)context;
+
+    uintptr_t first = (uintptr_t)address / CACHE_LINE;
+    uintptr_t last = ((uintptr_t)address + size - 1) / CACHE_LINE;
+
+    for (uintptr_t line = first; line <= last; line++) {
+        ctx->cache.access(line);
+
+        if (std::find(ctx->lines, ctx->lines + ctx->numLines, line) == ctx->lines + ctx->numLines &&
+            ctx->numLines < KD_BENCHMARK_MAX_LINES)
+        {
+            ctx->lines[ctx->numLines++] = line;
+        }
+    }
+}
+
+void benchmarkKDTraversal(const KDTree & tree, const util::vector<Ray, 16> & rays, KDTraversalBenchmark & result) {
+    // Best of several runs
+    result.raysPerSecond = 0.0;
+
+    for (int run = 0; run < 5; run++) {
+        Timer timer;
+
+        for (size_t i = 0; i < rays.size(); i++) {
+            Collision collision;
+            tree.intersect(rays[i], INFINITY, collision);
+        }
+
+        double seconds = timer.getElapsedMilliseconds() / 1000.0;
+        result.raysPerSecond = std::max(result.raysPerSecond, rays.size() / seconds);
+    }
+
+    KDBenchmarkContext ctx;
+
+    KDAccessObserver observer;
+    observer.access = recordAccess;
+    observer.context = &ctx;
+
+    uint64_t lines = 0;
+
+    for (size_t i = 0; i < rays.size(); i++) {
+        ctx.numLines = 0;
+
+        Collision collision;
+        tree.intersectObserved(rays[i], INFINITY, collision, observer);
+
+        lines += ctx.numLines;
+    }
+
+    result.linesPerRay = (double)lines / rays.size();
+    result.missesPerRay = (double)ctx.cache.misses / rays.size();
+
+}
@@ -0,0 +1,142 @@
+/**
+ * @file kdtree/kdbinnedsahbuilder.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <kdtree/kdbinnedsahbuilder.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+KDBinnedSAHBuilder::KDBinnedSAHBuilder(KDTree & tree, util::vector<Triangle, 16> & triangles, float k_traversal,
+    float k_intersect, int numBins, int exactThreshold)
+    : KDSAHBuilder(tree, triangles, k_traversal, k_intersect),
+      numBins(std::max(2, std::min(numBins, KD_BINNED_MAX_BINS))),
+      exactThreshold(exactThreshold)
+{
+}
+
+KDBinnedSAHBuilder::~KDBinnedSAHBuilder() {
+}
+
+bool KDBinnedSAHBuilder::shouldSplitNode(
+    KDSAHBuilderThreadCtx            & ctx,
+    const AABB                       & bounds,
+    const uint32_t                   * triangles,
+    uint32_t                           numTriangles,
+    int                                depth,
+    float                            & split,
+    int                              & dir,
+    enum KDBuilderPlanarMode         & planarMode)
+{
+    if ((int)numTriangles < exactThreshold)
+        return KDSAHBuilder::shouldSplitNode(ctx, bounds, triangles, numTriangles, depth, split, dir, planarMode);
+
+    if (numTriangles == 0)
+        return false;
+
+    // Number of triangles starting and ending in each bin, for each axis
+    int starts[3][KD_BINNED_MAX_BINS];
+    int ends[3][KD_BINNED_MAX_BINS];
+
+    memset(starts, 0, sizeof(starts));
+    memset(ends, 0, sizeof(ends));
+
+    float3 extent = bounds.max - bounds.min;
+
+    // Flat axes get a zero scale, which puts every triangle in the first bin. The surface area
+    // check below rejects their planes anyway.
+    float3 scale;
+
+    for (int axis = 0; axis < 3; ++axis)
+        scale[axis] = extent[axis] > 0.0f ? (float)numBins / extent[axis] : 0.0f;
+
+    __m128i maxBin = _mm_set1_epi32(numBins - 1);
+    __m128i zero = _mm_setzero_si128();
+
+    for (uint32_t i = 0; i < numTriangles; i++) {
+        AABB tri = getTriangleBounds(triangles[i], bounds);
+
+        // Triangle bounds for every axis at once, clipped to the node
+        float3 tri_min = max(tri.min, bounds.min);
+        float3 tri_max = min(tri.max, bounds.max);
+
+        __m128i lo = _mm_cvttps_epi32(((tri_min - bounds.min) * scale)._s);
+        __m128i hi = _mm_cvttps_epi32(((tri_max - bounds.min) * scale)._s);
+
+        lo = _mm_max_epi32(_mm_min_epi32(lo, maxBin), zero);
+        hi = _mm_max_epi32(_mm_min_epi32(hi, maxBin), zero);
+
+        ALIGN(16) int loBin[4];
+        ALIGN(16) int hiBin[4];
+
+        _mm_store_si128((__m128i *)loBin, lo);
+        _mm_store_si128((__m128i *)hiBin, hi);
+
+        for (int axis = 0; axis < 3; ++axis) {
+            starts[axis][loBin[axis]]++;
+            ends[axis][hiBin[axis]]++;
+        }
+    }
+
+    float sa_v = bounds.surfaceArea();
+
+    float min_cost = std::numeric_limits<float>::infinity();
+    int min_dir = -1;
+    float min_dist = 0.0f;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (scale[axis] == 0.0f)
+            continue;
+
+        // Triangles starting before the plane overlap the left child, and triangles ending
+        // after it overlap the right child.
+        int count_left = 0;
+        int count_right = (int)numTriangles;
+
+        for (int i = 1; i < numBins; ++i) {
+            count_left += starts[axis][i - 1];
+            count_right -= ends[axis][i - 1];
+
+            float dist = bounds.min[axis] + extent[axis] * ((float)i / (float)numBins);
+
+            AABB v1, v2;
+            bounds.split(dist, axis, v1, v2);
+
+            float sa_l = v1.surfaceArea();
+            float sa_r = v2.surfaceArea();
+
+            if (sa_l == 0.0f || sa_r == 0.0f)
+                continue;
+
+            float cost = k_traversal + k_intersect * (sa_l / sa_v * costTriangles(count_left) +
+                sa_r / sa_v * costTriangles(count_right));
+
+            // Same bonus for cutting off empty space as the exact sweep
+            if (count_left == 0 || count_right == 0)
+                cost *= 0.8f;
+
+            if (cost < min_cost) {
+                min_cost = cost;
+                min_dir = axis;
+                min_dist = dist;
+            }
+        }
+    }
+
+    if (min_dir == -1)
+        return false;
+
+    // If the minimum split cost is greater than the cost of not splitting, don't split
+    if (min_cost > k_intersect * costTriangles((int)numTriangles))
+        return false;
+
+    split = min_dist;
+    dir = min_dir;
+    planarMode = PLANAR_LEFT;
+
+    return true;
+}
@@ -7,153 +7,195 @@
 #include <kdtree/kdbuilder.h>
 #include <kdtree/kdsahbuilder.h>
 #include <kdtree/kdmedianbuilder.h>
+#include <kdtree/kdpresortedsahbuilder.h>
+#include <kdtree/kdbinnedsahbuilder.h>
 
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <new>
 #include <util/align.h>
 #include <util/timer.h>
 #include <vector>
-#include <cassert>
 
 template<typename T>
 KDBuilder<T>::KDBuilder(KDTree & tree, util::vector<Triangle, 16> & triangles)
-    : outstanding_nodes(0),
+    : workerCtx(nullptr),
+      workerArenas(nullptr),
       tree(tree),
       triangles(triangles),
-      numUnclippedTriangles(triangles.size()),
-      triangleID(triangles.size())
+      scheduler(nullptr),
+      clipTriangles(false),
+      treeletLayout(true),
+      blockCost(false),
+      maxDepth(KD_DEFAULT_MAX_DEPTH),
+      leafTriangles(KD_DEFAULT_LEAF_TRIANGLES)
 {
 }
 
 template<typename T>
 KDBuilder<T>::~KDBuilder() {
+    for (auto arena : arenas)
+        delete arena;
+}
+
+template<typename T>
+util::arena *KDBuilder<T>::createArena() {
+    util::arena *arena = new util::arena();
+
+    arena_lock.lock();
+    arenas.push_back(arena);
+    arena_lock.unlock();
+
+    return arena;
+}
+
+template<typename T>
+void KDBuilder<T>::setClipTriangles(bool clip) {
+    clipTriangles = clip;
+}
+
+template<typename T>
+void KDBuilder<T>::setTreeletLayout(bool treelets) {
+    treeletLayout = treelets;
+}
+
+template<typename T>
+void KDBuilder<T>::setBlockCost(bool blockCost) {
+    this->blockCost = blockCost;
+}
+
+template<typename T>
+void KDBuilder<T>::setLimits(int maxDepth, int leafTriangles) {
+    this->maxDepth = std::min(maxDepth, KD_MAX_DEPTH_LIMIT);
+    this->leafTriangles = leafTriangles;
+}
+
+template<typename T>
+util::arena & KDBuilder<T>::getWorkerArena() {
+    return *workerArenas[TaskScheduler::getWorkerIndex()];
+}
+
+template<typename T>
+KDBuilderNode *KDBuilder<T>::createNode(util::arena & arena, uint32_t depth, const AABB & bounds) {
+    KDBuilderNode *node = new (arena.alloc<KDBuilderNode>()) KDBuilderNode();
+
+    node->depth = depth;
+    node->bounds = bounds;
+
+    return node;
 }
 
 template<typename T>
 void KDBuilder<T>::partition(
+    util::arena                      & arena,
     float                              split,
     int                                dir,
     enum KDBuilderPlanarMode         & planarMode,
-    const util::vector<Triangle, 16> & triangles,
-    util::vector<Triangle, 16>       & left,
-    util::vector<Triangle, 16>       & right)
+    const KDBuilderNode              & node,
+    KDBuilderNode                    & left,
+    KDBuilderNode                    & right)
 {
-    // TODO: By keeping references to triangles in the SAH event list, we could
-    // avoid this whole loop.
+    // Large nodes are partitioned in chunks in parallel. Each chunk is counted first, so that
+    // the child lists can be allocated at their exact size and every chunk knows where to write
+    // its triangles, which keeps them in order.
+    int numChunks = 1;
 
-    for (auto it = triangles.begin(); it != triangles.end(); it++) {
-        const Triangle & tri = *it;
+    if (scheduler && node.numTriangles >= KD_PARALLEL_NODE_TRIANGLES)
+        numChunks = scheduler->getNumWorkers() * 4;
 
-        float min = fminf(fminf(tri.v[0].position[dir], tri.v[1].position[dir]), tri.v[2].position[dir]);
-        float max = fmaxf(fmaxf(tri.v[0].position[dir], tri.v[1].position[dir]), tri.v[2].position[dir]);
-
-        if (min == split && max == split) {
-            if (planarMode == PLANAR_LEFT)
-                left.push_back(tri);
-            else if (planarMode == PLANAR_RIGHT)
-                right.push_back(tri);
-            else {
-                left.push_back(tri);
-                right.push_back(tri);
-            }
-        }
-#if 0 // Clipping
-        else if (max <= split) {
-            left.push_back(tri);
-        }
-        else if (min >= split) {
-            right.push_back(tri);
-        }
-        else {
-            float3 positions[3] = { tri.v[0].position, tri.v[1].position, tri.v[2].position };
-            
-            float3 bary_r[6];
-            int n_r = clip(positions, bary_r, split, dir, 0x1);
-
-            float3 bary_l[6];
-            int n_l = clip(positions, bary_l, split, dir, 0x2);
-
-            assert(n_l > 0 && n_l <= 2);
-            assert(n_r > 0 && n_r <= 2);
-
-            for (int i = 0; i < n_r; i++) {
-                Triangle clipped(
-                    tri.interpolate(bary_r[i * 3 + 0].y, bary_r[i * 3 + 0].z),
-                    tri.interpolate(bary_r[i * 3 + 1].y, bary_r[i * 3 + 1].z),
-                    tri.interpolate(bary_r[i * 3 + 2].y, bary_r[i * 3 + 2].z),
-                    triangleID++,
-                    tri.material_id);
-
-                // TODO: kill degenerate triangles on the way in as well
-                #if 1
-                if (length(cross(
-                    clipped.v[2].position - clipped.v[0].position,
-                    clipped.v[1].position - clipped.v[0].position
-                )) > 0)
-                #endif
-                    right.push_back(clipped);
+    std::vector<uint32_t> chunkLeft(numChunks + 1, 0);
+    std::vector<uint32_t> chunkRight(numChunks + 1, 0);
+
+    for (int pass = 0; pass < 2; pass++) {
+        parallelFor(numChunks, [&](int chunk) {
+            uint32_t start = (uint32_t)((uint64_t)node.numTriangles * chunk / numChunks);
+            uint32_t end = (uint32_t)((uint64_t)node.numTriangles * (chunk + 1) / numChunks);
+
+            // The first pass counts, the second writes from the chunk's start
+            uint32_t numLeft = pass == 1 ? chunkLeft[chunk] : 0;
+            uint32_t numRight = pass == 1 ? chunkRight[chunk] : 0;
+
+            for (uint32_t i = start; i < end; i++) {
+                uint32_t tri = node.triangles[i];
+
+                AABB box = getTriangleBounds(tri, node.bounds);
+
+                float min = box.min[dir];
+                float max = box.max[dir];
+
+                bool inLeft, inRight;
+
+                if (min == split && max == split) {
+                    inLeft = planarMode != PLANAR_RIGHT;
+                    inRight = planarMode != PLANAR_LEFT;
+                }
+                else {
+                    inLeft = min < split;
+                    inRight = max > split;
+                }
+
+                if (pass == 1) {
+                    if (inLeft)
+                        left.triangles[numLeft] = tri;
+
+                    if (inRight)
+                        right.triangles[numRight] = tri;
+                }
+
+                numLeft += inLeft;
+                numRight += inRight;
             }
 
-            for (int i = 0; i < n_l; i++) {
-                Triangle clipped(
-                    tri.interpolate(bary_l[i * 3 + 0].y, bary_l[i * 3 + 0].z),
-                    tri.interpolate(bary_l[i * 3 + 1].y, bary_l[i * 3 + 1].z),
-                    tri.interpolate(bary_l[i * 3 + 2].y, bary_l[i * 3 + 2].z),
-                    triangleID++,
-                    tri.material_id);
-                
-                #if 1
-                if (length(cross(
-                    clipped.v[2].position - clipped.v[0].position,
-                    clipped.v[1].position - clipped.v[0].position
-                )) > 0)
-                #endif
-                    left.push_back(clipped);
+            // Counts are shifted by one, so the prefix sum gives each chunk's start
+            if (pass == 0) {
+                chunkLeft[chunk + 1] = numLeft;
+                chunkRight[chunk + 1] = numRight;
             }
+        });
 
-            // TODO: Original triangle is now dead
-        }
-#else
-        else {
-            if (min < split)
-                left.push_back(tri);
+        if (pass == 0) {
+            for (int chunk = 0; chunk < numChunks; chunk++) {
+                chunkLeft[chunk + 1] += chunkLeft[chunk];
+                chunkRight[chunk + 1] += chunkRight[chunk];
+            }
 
-            if (max > split)
-                right.push_back(tri);
+            left.numTriangles = chunkLeft[numChunks];
+            right.numTriangles = chunkRight[numChunks];
+            left.triangles = arena.alloc<uint32_t>(left.numTriangles);
+            right.triangles = arena.alloc<uint32_t>(right.numTriangles);
         }
-#endif
     }
 }
 
 template<typename T>
 void KDBuilder<T>::splitNode(
+    util::arena              & arena,
     KDBuilderNode            & builderNode,
     float                      split,
     int                        dir,
     enum KDBuilderPlanarMode   planarMode)
 {
-    KDBuilderNode *left = new KDBuilderNode();
-    KDBuilderNode *right = new KDBuilderNode();
+    AABB leftBounds, rightBounds;
+    builderNode.bounds.split(split, dir, leftBounds, rightBounds);
+
+    KDBuilderNode *left = createNode(arena, builderNode.depth + 1, leftBounds);
+    KDBuilderNode *right = createNode(arena, builderNode.depth + 1, rightBounds);
 
     builderNode.left = left;
     builderNode.right = right;
-    
-    left->depth = builderNode.depth + 1;
-    right->depth = builderNode.depth + 1;
-
-    builderNode.bounds.split(split, dir, left->bounds, right->bounds);
 
     // TODO: If the partition produced empty nodes, skip traversal
-    partition(split, dir, planarMode, builderNode.triangles, left->triangles, right->triangles);
-    builderNode.triangles.clear();
+    partition(arena, split, dir, planarMode, builderNode, *left, *right);
+
+    // The parent's list stays in the arena until the whole build is released
+    builderNode.triangles = nullptr;
+    builderNode.numTriangles = 0;
 
     builderNode.dir = dir;
     builderNode.split = split;
-
-    queue_lock.lock();
-    node_queue.push_back(left);
-    node_queue.push_back(right);
-    outstanding_nodes += 2;
-    queue_lock.unlock();
 }
 
 template<typename T>
@@ -161,19 +203,12 @@ void KDBuilder<T>::finalizeLeafNode(
     const KDBuilderNode             & builderNode,
     KDNode                          & node)
 {
-    uint32_t numTriangles = (uint32_t)builderNode.triangles.size();
+    uint32_t numTriangles = builderNode.numTriangles;
     uint32_t offset = 0;
 
     if (numTriangles > 0) {
-        // Add any triangles introduced by clipping
-        // TODO: Discard triangles which are no longer referenced
-        for (auto & tri : builderNode.triangles) {
-            if (tri.triangle_id >= numUnclippedTriangles)
-                triangles[tri.triangle_id] = tri;
-        }
-        
-        offset = tree.triangles.size() * sizeof(SetupTriangle);
-        setupTriangles(builderNode.triangles, tree.triangles);
+        offset = tree.triangles.size() * sizeof(SetupTriangleBlock);
+        setupTriangles(triangles, builderNode.triangles, numTriangles, tree.triangles);
     }
 
     node.offset = (uint32_t)offset | KD_LEAF;
@@ -184,20 +219,16 @@ template<typename T>
 void KDBuilder<T>::finalizeInnerNode(
     const KDBuilderNode             & builderNode,
     KDNode                          & node)
-{   
-    uint32_t offset = tree.nodes.size();
+{
+    // Children were placed next to each other by the layout
+    uint32_t offset = builderNode.left->index;
+    assert(builderNode.right->index == offset + 1);
 
     node.offset = (offset * sizeof(KDNode)) | builderNode.dir;
     node.split_dist = builderNode.split;
 
-    tree.nodes.push_back(KDNode());
-    tree.nodes.push_back(KDNode());
-
     finalizeNode(*builderNode.left,  tree.nodes[offset + 0]);
     finalizeNode(*builderNode.right, tree.nodes[offset + 1]);
-
-    delete builderNode.left;
-    delete builderNode.right;
 }
 
 template<typename T>
@@ -211,11 +242,142 @@ void KDBuilder<T>::finalizeNode(
         finalizeLeafNode(builderNode, node);
 }
 
-// TODO: traverse after construction to remove useless cells, etc.
+template<typename T>
+uint32_t KDBuilder<T>::layoutDepthFirst(KDBuilderNode *builderNode, uint32_t numNodes) {
+    if (!builderNode->left)
+        return numNodes;
+
+    builderNode->left->index = numNodes;
+    builderNode->right->index = numNodes + 1;
+
+    numNodes = layoutDepthFirst(builderNode->left, numNodes + 2);
+    return layoutDepthFirst(builderNode->right, numNodes);
+}
+
+template<typename T>
+uint32_t KDBuilder<T>::layoutTreelets(KDBuilderNode *root) {
+    // The root shares the first cache line with three pairs of children, after an unused node
+    // which keeps the pairs from straddling cache lines
+    root->index = 0;
+    uint32_t numNodes = 2;
+
+    std::vector<KDBuilderNode *> frontier; // Nodes whose children can go in the current treelet
+    std::vector<KDBuilderNode *> pending;  // Nodes whose children start new treelets
+
+    auto moreLikely = [](const KDBuilderNode *a, const KDBuilderNode *b) {
+        return a->bounds.surfaceArea() > b->bounds.surfaceArea();
+    };
+
+    if (root->left)
+        frontier.push_back(root);
+
+    while (!frontier.empty() || !pending.empty()) {
+        // Start a treelet, or finish filling a cache line that a small subtree did not fill
+        if (frontier.empty()) {
+            frontier.push_back(pending.back());
+            pending.pop_back();
+        }
+
+        auto next = std::min_element(frontier.begin(), frontier.end(), moreLikely);
+        KDBuilderNode *node = *next;
+        frontier.erase(next);
+
+        node->left->index = numNodes;
+        node->right->index = numNodes + 1;
+        numNodes += 2;
+
+        if (node->left->left)
+            frontier.push_back(node->left);
+
+        if (node->right->left)
+            frontier.push_back(node->right);
+
+        // Once the cache line is full, the rest of the frontier starts new treelets. The most
+        // likely one goes on top of the stack, so that it is placed next.
+        if (numNodes % KD_TREELET_NODES == 0) {
+            std::sort(frontier.begin(), frontier.end(), moreLikely);
+            pending.insert(pending.end(), frontier.rbegin(), frontier.rend());
+            frontier.clear();
+        }
+    }
+
+    return numNodes;
+}
+
+template<typename T>
+float KDBuilder<T>::computeCost(const KDBuilderNode & builderNode) {
+    float sa = builderNode.bounds.surfaceArea();
+
+    if (!builderNode.left)
+        return KD_SAH_COST_INTERSECT * builderNode.numTriangles * sa;
+
+    return KD_SAH_COST_TRAVERSAL * sa + computeCost(*builderNode.left) + computeCost(*builderNode.right);
+}
+
+/**
+ * @brief Check whether a builder node is a leaf with no triangles
+ */
+static inline bool isEmptyLeaf(const KDBuilderNode *builderNode) {
+    return !builderNode->left && builderNode->numTriangles == 0;
+}
 
 template<typename T>
-void KDBuilder<T>::buildNode(
+void KDBuilder<T>::optimizeNode(KDBuilderNode & builderNode, int & numCollapsed, int & numMerged) {
+    if (!builderNode.left)
+        return;
+
+    optimizeNode(*builderNode.left, numCollapsed, numMerged);
+    optimizeNode(*builderNode.right, numCollapsed, numMerged);
+
+    // A split which cuts off empty space, next to a child which cuts off more empty space on
+    // the same side along the same axis, can move to the child's plane and skip the child
+    while (true) {
+        KDBuilderNode *left = builderNode.left;
+        KDBuilderNode *right = builderNode.right;
+
+        if (isEmptyLeaf(left) && right->left && right->dir == builderNode.dir && isEmptyLeaf(right->left)) {
+            builderNode.split = right->split;
+            builderNode.right = right->right;
+        }
+        else if (isEmptyLeaf(right) && left->left && left->dir == builderNode.dir && isEmptyLeaf(left->right)) {
+            builderNode.split = left->split;
+            builderNode.left = left->left;
+        }
+        else
+            break;
+
+        // The child that was kept covers the same space as before. The empty leaf grows.
+        AABB leftBounds, rightBounds;
+        builderNode.bounds.split(builderNode.split, builderNode.dir, leftBounds, rightBounds);
+
+        builderNode.left->bounds = leftBounds;
+        builderNode.right->bounds = rightBounds;
+
+        numMerged++;
+    }
+
+    // Splitting doesn't help if both children end up with the same triangles. Triangle lists
+    // keep the order of the input, so equal sets are equal lists.
+    KDBuilderNode *left = builderNode.left;
+    KDBuilderNode *right = builderNode.right;
+
+    if (!left->left && !right->left && left->numTriangles == right->numTriangles &&
+        memcmp(left->triangles, right->triangles, left->numTriangles * sizeof(uint32_t)) == 0)
+    {
+        builderNode.triangles = left->triangles;
+        builderNode.numTriangles = left->numTriangles;
+        builderNode.left = nullptr;
+        builderNode.right = nullptr;
+
+        numCollapsed++;
+    }
+}
+
+
+template<typename T>
+bool KDBuilder<T>::buildNode(
     T & threadCtx,
+    util::arena & arena,
     KDBuilderNode & builderNode)
 {
     int dir;
@@ -224,12 +386,12 @@ void KDBuilder<T>::buildNode(
 
     bool shouldSplit = false;
 
-    // TODO: Expose these constants to the build algorithm
-    if (builderNode.depth < 23 && builderNode.triangles.size() > 4) {
+    if ((int)builderNode.depth < maxDepth && builderNode.numTriangles > (uint32_t)leafTriangles) {
         shouldSplit = shouldSplitNode(
             threadCtx,
             builderNode.bounds,
             builderNode.triangles,
+            builderNode.numTriangles,
             builderNode.depth,
             split,
             dir,
@@ -237,7 +399,9 @@ void KDBuilder<T>::buildNode(
     }
 
     if (shouldSplit)
-        splitNode(builderNode, split, dir, planarMode);
+        splitNode(arena, builderNode, split, dir, planarMode);
+
+    return shouldSplit;
 }
 
 template<typename T>
@@ -258,86 +422,56 @@ AABB KDBuilder<T>::buildAABB(const util::vector<Triangle, 16> & triangles) {
 }
 
 template<typename T>
-void KDBuilder<T>::builder_thread() {
-    T ctx;
-
-    util::queue<KDBuilderNode *, 8> local_queue;
-
-    while (true) {
-        int local_count = 0;
-
-        queue_lock.lock();
-
-        // If there are no more nodes to process, then we will never have more
-        // work to do.
-        if (outstanding_nodes == 0) {
-            queue_lock.unlock();
-            break;
-        }
-
-#if 0
-        // If the queue is empty, sleep until it isn't. We wake up with the lock again.
-        // TODO use condition variable to do this.
-
-        // The queue may now have work, but if another THREAD woke up first and consumed all of it,
-        // then we will just loop around and go back to sleep.
-
-        // TODO: Arbitary constant
-        // Collect a batch of nodes of a reasonable size. This reduces locking overhead. The batch
-        // should be big enough to avoid overhead of tiny nodes, but small enough to ensure that
-        // other threads can do work in parallel.
-        while (!node_queue.empty() && local_count < 1024) {
-            KDBuilderNode *node = node_queue.front();
-            node_queue.pop_front();
-            local_queue.push_back(node);
-            local_count += (int)node->triangles.size(); // TODO int
-        }
-
-        // TODO: Instead of waking up everybody, it may be better to wake up another THREAD if there
-        // are more in the queue. We'd probably have to know how many threads are waiting.
+void KDBuilder<T>::buildSerial(KDBuilderNode *builderNode) {
+    int worker = TaskScheduler::getWorkerIndex();
 
-        queue_lock.unlock();
-
-        // Process the batch we collected. When we're done, go back to either
-        // immediately grab another batch or go to sleep.
-
-        while (!local_queue.empty()) {
-            KDBuilderNode *node = local_queue.front();
-            local_queue.pop_front();
-
-            buildNode(ctx, *node);
+    if (buildNode(workerCtx[worker], *workerArenas[worker], *builderNode)) {
+        buildSerial(builderNode->left);
+        buildSerial(builderNode->right);
+    }
+}
 
-            // Note: This must happen after the node is built, to ensure that its children
-            // are enqueued.
-            --outstanding_nodes;
-        }
-#endif
+template<typename T>
+void KDBuilder<T>::buildTask(TaskGroup & group, KDBuilderNode *builderNode) {
+    while (builderNode->numTriangles >= KD_SERIAL_SUBTREE_TRIANGLES) {
+        int worker = TaskScheduler::getWorkerIndex();
 
-        if (node_queue.empty()) {
-            queue_lock.unlock();
-            continue;
-        }
+        if (!buildNode(workerCtx[worker], *workerArenas[worker], *builderNode))
+            return;
 
-        KDBuilderNode *node = node_queue.front();
+        // Leave the left child for another worker to steal, and keep going down the right
+        KDBuilderNode *left = builderNode->left;
 
-        node_queue.pop_front();
+        scheduler->spawn(group, [this, &group, left]() {
+            buildTask(group, left);
+        });
 
-        queue_lock.unlock();
+        builderNode = builderNode->right;
+    }
 
-        buildNode(ctx, *node);
+    buildSerial(builderNode);
+}
 
-        --outstanding_nodes;
+template<typename T>
+void KDBuilder<T>::parallelFor(int count, const std::function<void(int)> & func) {
+    if (scheduler && count > 1)
+        scheduler->parallelFor(count, func);
+    else {
+        for (int i = 0; i < count; i++)
+            func(i);
     }
 }
 
 template<typename T>
-void KDBuilder<T>::computeStats(KDNode *root, KDTreeStats *stats, int depth) {
-    // TODO: Pass to eliminate empty leaves
-    // TODO: Pass that eliminates leaves that don't improve on their parents split
-
+float KDBuilder<T>::computeStats(KDNode *root, const AABB & bounds, KDTreeStats *stats, int depth) {
     stats->num_nodes++;
     stats->tree_mem += sizeof(KDNode);
 
+    // Surface area weighted cost, normalized by the root's surface area in build(). Subtree
+    // costs are summed in pairs, like computeCost(), which loses much less precision than
+    // adding every node to one total.
+    float sa = bounds.surfaceArea();
+
     if (root->type() == KD_LEAF) {
         stats->num_leaves++;
         stats->num_triangles += root->count;
@@ -352,12 +486,18 @@ void KDBuilder<T>::computeStats(KDNode *root, KDTreeStats *stats, int depth) {
 
         if (depth < stats->min_depth || stats->min_depth == 0)
             stats->min_depth = depth;
+
+        return KD_SAH_COST_INTERSECT * root->count * sa;
     }
     else {
         stats->num_internal++;
 
-        computeStats(root->left(&tree.nodes[0]), stats, depth + 1);
-        computeStats(root->right(&tree.nodes[0]), stats, depth + 1);
+        AABB left, right;
+        bounds.split(root->split_dist, root->type(), left, right);
+
+        return KD_SAH_COST_TRAVERSAL * sa +
+            computeStats(root->left(&tree.nodes[0]), left, stats, depth + 1) +
+            computeStats(root->right(&tree.nodes[0]), right, stats, depth + 1);
     }
 }
 
@@ -369,23 +509,19 @@ void KDBuilder<T>::build(KDTreeStats *stats) {
 
     tree.bounds = buildAABB(triangles);
 
-    KDBuilderNode *builderNode = new KDBuilderNode();
-
-    // Use pointers while building the tree, because we need to be able to sort, etc.
-    // Triangles are converted to "setup" triangles, so we don't actually need the
-    // triangle data anyway.
+    // Builders only look at triangle bounds, so compute them once up front
+    triangleBounds.reserve(triangles.size());
 
-    // TODO: Actually use pointers again
-    // TODO: Compress triangle lists
-    // TODO: redundant
-    for (auto & tri : triangles)
-        builderNode->triangles.push_back(tri);
+    for (auto & tri : triangles) {
+        AABB box;
 
-    builderNode->bounds = tree.bounds;
-    builderNode->depth = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            box.min[axis] = fminf(fminf(tri.v[0].position[axis], tri.v[1].position[axis]), tri.v[2].position[axis]);
+            box.max[axis] = fmaxf(fmaxf(tri.v[0].position[axis], tri.v[1].position[axis]), tri.v[2].position[axis]);
+        }
 
-    outstanding_nodes = 1;
-    node_queue.push_back(builderNode);
+        triangleBounds.push_back_inbounds(box);
+    }
 
 #ifndef NDEBUG
 	// TODO: reserving a core for the rest of the system
@@ -398,36 +534,94 @@ void KDBuilder<T>::build(KDTreeStats *stats) {
     num_threads = 1;
 #endif
 
-    std::vector<std::thread> workers;
+    scheduler = new TaskScheduler(num_threads);
+    workerCtx = new T[num_threads];
+    workerArenas = new util::arena *[num_threads];
 
     for (int i = 0; i < num_threads; i++)
-        workers.push_back(std::thread(std::bind(&KDBuilder::builder_thread, this)));
+        workerArenas[i] = createArena();
+
+    util::arena *arena = workerArenas[0];
+
+    KDBuilderNode *builderNode = createNode(*arena, 0, tree.bounds);
+
+    builderNode->numTriangles = (uint32_t)triangles.size();
+    builderNode->triangles = arena->alloc<uint32_t>(builderNode->numTriangles);
+
+    for (uint32_t i = 0; i < builderNode->numTriangles; i++)
+        builderNode->triangles[i] = i;
 
     std::cout << "Started " << num_threads << " worker threads" << std::endl;
 
-    for (auto & worker : workers)
-        worker.join();
+    scheduler->run([this, builderNode]() {
+        buildTree(builderNode);
+    });
+
+    printf("Tasks stolen: %d\n", scheduler->getNumSteals());
+
+    delete scheduler;
+    delete [] workerCtx;
+    delete [] workerArenas;
 
-    workers.clear();
+    scheduler = nullptr;
+    workerCtx = nullptr;
+    workerArenas = nullptr;
+
+    // Simplify the tree, and measure how much that helped
+    float rootArea = tree.bounds.surfaceArea();
+    float costBefore = computeCost(*builderNode);
+
+    int numCollapsed = 0, numMerged = 0;
+    optimizeNode(*builderNode, numCollapsed, numMerged);
+
+    float costAfter = computeCost(*builderNode);
+
+    if (rootArea > 0.0f) {
+        costBefore /= rootArea;
+        costAfter /= rootArea;
+    }
+
+    printf("Optimized KD tree: collapsed %d splits, merged %d empty splits, SAH cost %.02f -> %.02f\n",
+        numCollapsed, numMerged, costBefore, costAfter);
 
     std::cout << "Finalizing KD tree" << std::endl;
 
-    // TODO: vector resize()
-    for (uint32_t i = 0; i < triangleID - numUnclippedTriangles; i++)
-        triangles.push_back(Triangle());
+    uint32_t numNodes = treeletLayout ? layoutTreelets(builderNode) : layoutDepthFirst(builderNode, 1);
+
+    // Nodes the layout leaves unused are empty leaves
+    KDNode unused;
+    unused.offset = KD_LEAF;
+    unused.count = 0;
+
+    tree.nodes.reserve(numNodes);
 
-    tree.nodes.push_back(KDNode());
+    for (uint32_t i = 0; i < numNodes; i++)
+        tree.nodes.push_back_inbounds(unused);
 
-    finalizeNode(*builderNode, tree.nodes[0]);
+    finalizeNode(*builderNode, tree.nodes[builderNode->index]);
     tree.root = &tree.nodes[0];
 
-    delete builderNode;
+    // Free every builder node and triangle list at once
+    size_t arenaMemory = 0;
+
+    for (auto arena : arenas) {
+        arenaMemory += arena->allocated();
+        delete arena;
+    }
+
+    arenas.clear();
+    triangleBounds.clear();
+
+    printf("Builder Memory: %.02fmb\n", arenaMemory / (1024.0f * 1024.0f));
 
     std::cout << "Computing KD tree statistics" << std::endl;
 
     if (stats) {
         memset(stats, 0, sizeof(KDTreeStats));
-        computeStats(tree.root, stats, 1);
+        stats->sah_cost = computeStats(tree.root, tree.bounds, stats, 1);
+
+        if (rootArea > 0.0f)
+            stats->sah_cost /= rootArea;
     }
 
     double elapsed = timer.getElapsedMilliseconds() / 1000.0;
@@ -442,13 +636,67 @@ void KDBuilder<T>::build(KDTreeStats *stats) {
         printf("Nodes:            %d\n", stats->num_nodes);
         printf("Leaf Nodes:       %d (%.02f%%)\n", stats->num_leaves, (float)stats->num_leaves / (float)stats->num_nodes * 100.0f);
         printf("Internal Nodes:   %d (%.02f%%)\n", stats->num_internal, (float)stats->num_internal / (float)stats->num_nodes * 100.0f);
-        printf("Triangles:        %d (average %.02f, %.02fx input)\n", stats->num_triangles, (float)stats->num_triangles / (float)stats->num_leaves, (float)stats->num_triangles / (float)numUnclippedTriangles);
+        printf("Triangles:        %d (average %.02f, %.02fx input)\n", stats->num_triangles, (float)stats->num_triangles / (float)stats->num_leaves, (float)stats->num_triangles / (float)triangles.size());
         printf("Max Node Depth:   %d\n", stats->max_depth);
         printf("Min Node Depth:   %d\n", stats->min_depth);
         printf("Avg Node Depth:   %.02f\n", (float)stats->sum_depth / (float)stats->num_leaves);
         printf("Empty Leaf Nodes: %d (%.02f%%)\n", stats->num_zero_leaves, (float)stats->num_zero_leaves / (float)stats->num_leaves * 100.0f);
         printf("Tree Memory:      %.02fmb\n", stats->tree_mem / (1024.0f * 1024.0f));
-        printf("Triangle Memory:  %.02fmb\n", stats->num_triangles * sizeof(SetupTriangle) / (1024.0f * 1024.0f));
+        printf("Triangle Memory:  %.02fmb (%.02f%% padding)\n", tree.triangles.size() * sizeof(SetupTriangleBlock) / (1024.0f * 1024.0f),
+            (1.0f - (float)stats->num_triangles / (float)(tree.triangles.size() * TRIANGLE_BLOCK_SIZE)) * 100.0f);
+        printf("SAH Cost:         %.02f\n", stats->sah_cost);
+    }
+}
+
+template<typename T>
+void KDBuilder<T>::buildTree(KDBuilderNode *builderNode) {
+    TaskGroup group;
+
+    buildTask(group, builderNode);
+
+    scheduler->wait(group);
+}
+
+/**
+ * @brief Apply the parameters which every builder shares, and build the tree
+ */
+template<typename B>
+static void runBuilder(B & builder, const KDBuilderParams & params, KDTreeStats *stats) {
+    builder.setClipTriangles(params.clip);
+    builder.setTreeletLayout(params.treelets);
+    builder.setBlockCost(params.blockCost);
+    builder.setLimits(params.maxDepth, params.leafTriangles);
+    builder.build(stats);
+}
+
+void buildKDTree(KDBuilderType type, KDTree & tree, util::vector<Triangle, 16> & triangles,
+    const KDBuilderParams & params, KDTreeStats *stats)
+{
+    switch (type) {
+    case KDBuilderTypeMedian: {
+        KDMedianBuilder builder(tree, triangles);
+        runBuilder(builder, params, stats);
+        break;
+    }
+    case KDBuilderTypeSAH: {
+        KDSAHBuilder builder(tree, triangles, params.traversalCost, params.intersectCost);
+        runBuilder(builder, params, stats);
+        break;
+    }
+    case KDBuilderTypePresortedSAH: {
+        KDPresortedSAHBuilder builder(tree, triangles, params.traversalCost, params.intersectCost);
+        runBuilder(builder, params, stats);
+        break;
+    }
+    case KDBuilderTypeBinnedSAH: {
+        KDBinnedSAHBuilder builder(tree, triangles, params.traversalCost, params.intersectCost,
+            KD_BINNED_DEFAULT_BINS, params.exactThreshold);
+        runBuilder(builder, params, stats);
+        break;
+    }
+    default:
+        assert(0);
+        break;
     }
 }
 
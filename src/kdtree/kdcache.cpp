@@ -0,0 +1,296 @@
+/**
+ * @file kdtree/kdcache.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <kdtree/kdcache.h>
+
+#include <cstdio>
+#include <cstring>
+#include <util/align.h>
+#include <util/mappedfile.h>
+#include <util/timer.h>
+
+/**
+ * @brief 64 bit FNV-1a hash
+ */
+class FNVHash {
+private:
+
+    uint64_t hash;
+
+public:
+
+    FNVHash()
+        : hash(0xcbf29ce484222325ULL)
+    {
+    }
+
+    template<typename T>
+    void add(const T & value) {
+        const unsigned char *bytes = (const unsigned char *)&value;
+
+        for (size_t i = 0; i < sizeof(T); i++) {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    uint64_t get() const {
+        return hash;
+    }
+};
+
+uint64_t hashKDTreeInput(const util::vector<Triangle, 16> & triangles, KDBuilderType type,
+    const KDBuilderParams & params)
+{
+    FNVHash hash;
+
+    // Anything compiled into the builders or the node and triangle layout
+    hash.add((uint32_t)KD_CACHE_VERSION);
+    hash.add((uint32_t)sizeof(KDNode));
+    hash.add((uint32_t)sizeof(SetupTriangleBlock));
+#if defined(WALD_INTERSECTION)
+    hash.add((int32_t)1);
+#else
+    hash.add((int32_t)2);
+#endif
+
+    hash.add((int32_t)type);
+    hash.add(params.traversalCost);
+    hash.add(params.intersectCost);
+    hash.add((int32_t)params.maxDepth);
+    hash.add((int32_t)params.leafTriangles);
+    hash.add((int32_t)params.exactThreshold);
+    hash.add((uint8_t)params.clip);
+    hash.add((uint8_t)params.treelets);
+    hash.add((uint8_t)params.blockCost);
+    hash.add((uint64_t)triangles.size());
+
+    // Only the positions and IDs end up in the tree. Hash the components, not the float3s,
+    // which have an unused fourth lane.
+    for (auto & tri : triangles) {
+        for (int i = 0; i < 3; i++) {
+            hash.add(tri.v[i].position.x);
+            hash.add(tri.v[i].position.y);
+            hash.add(tri.v[i].position.z);
+        }
+
+        hash.add((uint32_t)tri.triangle_id);
+    }
+
+    return hash.get();
+}
+
+std::string getKDTreeCachePath(const std::string & cacheDir, uint64_t key) {
+    char name[64];
+    snprintf(name, sizeof(name), "kdtree-%016llx.bin", (unsigned long long)key);
+
+    return cacheDir + "/" + name;
+}
+
+bool loadKDTree(const std::string & path, uint64_t key, KDTree & tree, KDTreeStats *stats) {
+    size_t size;
+    void *data = mapFile(path, size);
+
+    if (!data)
+        return false;
+
+    const KDCacheHeader *header = (const KDCacheHeader *)data;
+
+    bool valid =
+        size >= sizeof(KDCacheHeader) &&
+        header->magic == KD_CACHE_MAGIC &&
+        header->version == KD_CACHE_VERSION &&
+        header->key == key &&
+        header->nodeSize == sizeof(KDNode) &&
+        header->triangleSize == sizeof(SetupTriangleBlock) &&
+        header->numNodes > 0 &&
+        header->nodesOffset % KD_CACHE_ALIGN == 0 &&
+        header->trianglesOffset % KD_CACHE_ALIGN == 0 &&
+        header->nodesOffset + header->numNodes * sizeof(KDNode) <= size &&
+        header->trianglesOffset + header->numTriangles * sizeof(SetupTriangleBlock) <= size;
+
+    if (!valid) {
+        unmapFile(data, size);
+        return false;
+    }
+
+    char *base = (char *)data;
+
+    tree.nodes.wrap((KDNode *)(base + header->nodesOffset), (size_t)header->numNodes);
+    tree.triangles.wrap((SetupTriangleBlock *)(base + header->trianglesOffset), (size_t)header->numTriangles);
+    tree.root = &tree.nodes[0];
+    tree.bounds = AABB(
+        float3(header->bounds[0], header->bounds[1], header->bounds[2]),
+        float3(header->bounds[3], header->bounds[4], header->bounds[5]));
+
+    if (stats)
+        *stats = header->stats;
+
+    // The tree no longer points into its old mapping, if it had one
+    unmapFile(tree.mapping, tree.mappingSize);
+
+    tree.mapping = data;
+    tree.mappingSize = size;
+
+    return true;
+}
+
+/**
+ * @brief Write zeros up to an offset
+ */
+static bool padFile(FILE *file, uint64_t offset) {
+    static const char zeros[KD_CACHE_ALIGN] = {};
+
+    long position = ftell(file);
+
+    if (position < 0 || (uint64_t)position > offset)
+        return false;
+
+    size_t count = (size_t)(offset - (uint64_t)position);
+
+    return fwrite(zeros, 1, count, file) == count;
+}
+
+bool saveKDTree(const std::string & path, uint64_t key, const KDTree & tree, const KDTreeStats & stats) {
+    KDCacheHeader header;
+    memset(&header, 0, sizeof(header));
+
+    uint64_t nodesSize = tree.nodes.size() * sizeof(KDNode);
+    uint64_t trianglesSize = tree.triangles.size() * sizeof(SetupTriangleBlock);
+
+    header.magic = KD_CACHE_MAGIC;
+    header.version = KD_CACHE_VERSION;
+    header.key = key;
+    header.nodeSize = sizeof(KDNode);
+    header.triangleSize = sizeof(SetupTriangleBlock);
+    header.numNodes = tree.nodes.size();
+    header.numTriangles = tree.triangles.size();
+    header.nodesOffset = ALIGN_PTR(sizeof(KDCacheHeader), KD_CACHE_ALIGN);
+    header.trianglesOffset = ALIGN_PTR(header.nodesOffset + nodesSize, KD_CACHE_ALIGN);
+    header.stats = stats;
+
+    for (int i = 0; i < 3; i++) {
+        header.bounds[i] = tree.bounds.min[i];
+        header.bounds[i + 3] = tree.bounds.max[i];
+    }
+
+    std::string tempPath = path + ".tmp";
+
+    FILE *file = fopen(tempPath.c_str(), "wb");
+
+    if (!file)
+        return false;
+
+    bool written =
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        padFile(file, header.nodesOffset) &&
+        fwrite(tree.nodes.begin(), 1, (size_t)nodesSize, file) == nodesSize &&
+        padFile(file, header.trianglesOffset) &&
+        fwrite(tree.triangles.begin(), 1, (size_t)trianglesSize, file) == trianglesSize;
+
+    written = fclose(file) == 0 && written;
+
+    // Windows won't rename over an existing file
+    if (written && rename(tempPath.c_str(), path.c_str()) != 0) {
+        remove(path.c_str());
+        written = rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+
+    if (!written)
+        remove(tempPath.c_str());
+
+    return written;
+}
+
+void loadOrBuildKDTree(const std::string & cacheDir, KDBuilderType type, KDTree & tree,
+    util::vector<Triangle, 16> & triangles, const KDBuilderParams & params, KDTreeStats *stats)
+{
+    if (cacheDir.empty()) {
+        buildKDTree(type, tree, triangles, params, stats);
+        return;
+    }
+
+    uint64_t key = hashKDTreeInput(triangles, type, params);
+    std::string path = getKDTreeCachePath(cacheDir, key);
+
+    Timer timer;
+    KDTreeStats treeStats;
+
+    if (loadKDTree(path, key, tree, &treeStats)) {
+        printf("Loaded KD tree from %s: %f seconds, %lu nodes, %lu triangles, SAH cost %.02f\n", path.c_str(),
+            timer.getElapsedMilliseconds() / 1000.0, (unsigned long)tree.nodes.size(),
+            (unsigned long)treeStats.num_triangles, treeStats.sah_cost);
+    }
+    else {
+        buildKDTree(type, tree, triangles, params, &treeStats);
+
+        if (saveKDTree(path, key, tree, treeStats))
+            printf("Saved KD tree to %s\n", path.c_str());
+        else
+            printf("Could not save KD tree to %s\n", path.c_str());
+    }
+
+    if (stats)
+        *stats = treeStats;
+}
+
+bool loadKDBuilderParams(const std::string & path, KDBuilderParams & params) {
+    FILE *file = fopen(path.c_str(), "r");
+
+    if (!file)
+        return false;
+
+    KDBuilderParams loaded = params;
+    int clip, treelets, blockCost;
+
+    int numRead = fscanf(file,
+        "traversal_cost %f\n"
+        "intersect_cost %f\n"
+        "max_depth %d\n"
+        "leaf_triangles %d\n"
+        "exact_threshold %d\n"
+        "clip %d\n"
+        "treelets %d\n"
+        "block_cost %d\n",
+        &loaded.traversalCost, &loaded.intersectCost, &loaded.maxDepth, &loaded.leafTriangles,
+        &loaded.exactThreshold, &clip, &treelets, &blockCost);
+
+    fclose(file);
+
+    // Files saved before block costs existed stop after the treelets line
+    if (numRead != 7 && numRead != 8)
+        return false;
+
+    loaded.clip = clip != 0;
+    loaded.treelets = treelets != 0;
+
+    if (numRead == 8)
+        loaded.blockCost = blockCost != 0;
+
+    params = loaded;
+    return true;
+}
+
+bool saveKDBuilderParams(const std::string & path, const KDBuilderParams & params) {
+    FILE *file = fopen(path.c_str(), "w");
+
+    if (!file)
+        return false;
+
+    int numWritten = fprintf(file,
+        "traversal_cost %f\n"
+        "intersect_cost %f\n"
+        "max_depth %d\n"
+        "leaf_triangles %d\n"
+        "exact_threshold %d\n"
+        "clip %d\n"
+        "treelets %d\n"
+        "block_cost %d\n",
+        params.traversalCost, params.intersectCost, params.maxDepth, params.leafTriangles,
+        params.exactThreshold, params.clip ? 1 : 0, params.treelets ? 1 : 0, params.blockCost ? 1 : 0);
+
+    return fclose(file) == 0 && numWritten > 0;
+}
@@ -0,0 +1,50 @@
+/**
+ * @file kdtree/kdkernels.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <kdtree/kdkernels.h>
+#include <util/cpufeatures.h>
+
+#include <cassert>
+
+namespace kd_sse42  { extern const KDKernels kernels; }
+namespace kd_avx2   { extern const KDKernels kernels; }
+namespace kd_avx512 { extern const KDKernels kernels; }
+
+static const KDKernels *kernelsByISA[KDKernelISACount] = {
+    &kd_sse42::kernels,
+    &kd_avx2::kernels,
+    &kd_avx512::kernels
+};
+
+const KDKernels *activeKDKernels = kernelsByISA[getBestKDKernelISA()];
+
+bool isKDKernelISASupported(KDKernelISA isa) {
+    const CPUFeatures & cpu = getCPUFeatures();
+
+    switch (isa) {
+    case KDKernelISASSE42:
+        return cpu.sse42;
+    case KDKernelISAAVX2:
+        return cpu.avx2 && cpu.fma;
+    case KDKernelISAAVX512:
+        return cpu.avx512f && cpu.avx2 && cpu.fma;
+    default:
+        return false;
+    }
+}
+
+KDKernelISA getBestKDKernelISA() {
+    for (int isa = KDKernelISACount - 1; isa > KDKernelISASSE42; isa--)
+        if (isKDKernelISASupported((KDKernelISA)isa))
+            return (KDKernelISA)isa;
+
+    return KDKernelISASSE42;
+}
+
+void setKDKernelISA(KDKernelISA isa) {
+    assert(isKDKernelISASupported(isa));
+    activeKDKernels = kernelsByISA[isa];
+}
@@ -0,0 +1,18 @@
+/**
+ * @file kdtree/kdkernels_avx2.cpp
+ *
+ * @brief Traversal kernels for AVX2 and FMA. Built with -mavx2 -mfma, or /arch:AVX2.
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#if !defined(__AVX2__)
+#error "kdkernels_avx2.cpp must be built with AVX2 enabled"
+#endif
+
+#include <kdtree/kdkernels.h>
+
+#define KD_KERNEL_NAMESPACE kd_avx2
+#define KD_KERNEL_ISA       KDKernelISAAVX2
+
+#include <kdtree/kdkernels.inl>
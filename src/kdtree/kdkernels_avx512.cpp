@@ -0,0 +1,18 @@
+/**
+ * @file kdtree/kdkernels_avx512.cpp
+ *
+ * @brief Traversal kernels for AVX-512. Built with -mavx512f -mavx2 -mfma, or /arch:AVX512.
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#if !defined(__AVX512F__)
+#error "kdkernels_avx512.cpp must be built with AVX-512 enabled"
+#endif
+
+#include <kdtree/kdkernels.h>
+
+#define KD_KERNEL_NAMESPACE kd_avx512
+#define KD_KERNEL_ISA       KDKernelISAAVX512
+
+#include <kdtree/kdkernels.inl>
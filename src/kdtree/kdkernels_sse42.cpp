@@ -0,0 +1,14 @@
+/**
+ * @file kdtree/kdkernels_sse42.cpp
+ *
+ * @brief Baseline traversal kernels. Built with the same flags as everything else.
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <kdtree/kdkernels.h>
+
+#define KD_KERNEL_NAMESPACE kd_sse42
+#define KD_KERNEL_ISA       KDKernelISASSE42
+
+#include <kdtree/kdkernels.inl>
@@ -17,13 +17,14 @@ KDMedianBuilder::~KDMedianBuilder() {
 bool KDMedianBuilder::shouldSplitNode(
     KDMedianBuilderThreadCtx         & threadCtx,
     const AABB                       & bounds,
-    const util::vector<Triangle, 16> & triangles,
+    const uint32_t                   * triangles,
+    uint32_t                           numTriangles,
     int                                depth,
     float                            & split,
     int                              & dir,
     enum KDBuilderPlanarMode         & planarMode)
 {
-    if (depth >= 25 || triangles.size() < 4)
+    if (depth >= 25 || numTriangles < 4)
         return false;
 
 #if 1
@@ -0,0 +1,312 @@
+/**
+ * @file kdtree/kdpresortedsahbuilder.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <kdtree/kdpresortedsahbuilder.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// Which children a triangle is placed in
+#define SIDE_LEFT  0x1
+#define SIDE_RIGHT 0x2
+#define SIDE_BOTH  (SIDE_LEFT | SIDE_RIGHT)
+
+KDPresortedSAHBuilder::KDPresortedSAHBuilder(KDTree & tree, util::vector<Triangle, 16> & triangles, float k_traversal, float k_intersect)
+    : KDSAHBuilder(tree, triangles, k_traversal, k_intersect)
+{
+}
+
+KDPresortedSAHBuilder::~KDPresortedSAHBuilder() {
+}
+
+void KDPresortedSAHBuilder::addEvents(uint32_t triangle, int axis, const AABB & bounds, util::vector<SAHEvent, 8> & events) const {
+    // Clip triangle bounding box to voxel bounding box, exactly like KDSAHBuilder
+    AABB box = getTriangleBounds(triangle, bounds);
+
+    float tri_min = fmax(bounds.min[axis], box.min[axis]);
+    float tri_max = fmin(bounds.max[axis], box.max[axis]);
+
+    SAHEvent event;
+    event.triangle = triangle;
+
+    if (tri_min == tri_max) {
+        event.flag = SAH_PLANAR;
+        event.dist = tri_min;
+        events.push_back(event);
+    }
+    else {
+        event.flag = SAH_BEGIN;
+        event.dist = tri_min;
+        events.push_back(event);
+
+        event.flag = SAH_END;
+        event.dist = tri_max;
+        events.push_back(event);
+    }
+}
+
+/**
+ * @brief Merge two sorted event lists
+ */
+static void mergeEvents(
+    const util::vector<SAHEvent, 8> & a,
+    const util::vector<SAHEvent, 8> & b,
+    util::vector<SAHEvent, 8>       & out)
+{
+    out.reserve(a.size() + b.size());
+
+    size_t i = 0, j = 0;
+
+    while (i < a.size() && j < b.size()) {
+        if (compareEvent(b[j], a[i]))
+            out.push_back_inbounds(b[j++]);
+        else
+            out.push_back_inbounds(a[i++]);
+    }
+
+    while (i < a.size())
+        out.push_back_inbounds(a[i++]);
+
+    while (j < b.size())
+        out.push_back_inbounds(b[j++]);
+}
+
+void KDPresortedSAHBuilder::buildSubtree(TaskGroup & group, KDBuilderNode *builderNode, KDPresortedSAHNode *data) {
+    util::arena & arena = getWorkerArena();
+
+    SAHSplit best;
+
+    size_t numTriangles = data->triangles.size();
+
+    // Large nodes sweep, classify and filter in parallel, so that the other workers are not
+    // left idle near the root
+    bool parallel = scheduler && numTriangles >= KD_PARALLEL_NODE_TRIANGLES;
+
+    if ((int)builderNode->depth < maxDepth && numTriangles > (size_t)leafTriangles) {
+        if (parallel) {
+            // Sweep each axis on a different worker
+            SAHSplit axisBest[3];
+
+            parallelFor(3, [&](int axis) {
+                sweep(data->events[axis].begin(), data->events[axis].size(), (int)numTriangles,
+                    builderNode->bounds, axis, axisBest[axis]);
+            });
+
+            // Combine in axis order, so that ties are broken the same way as the serial sweep
+            for (int axis = 0; axis < 3; ++axis)
+                if (axisBest[axis].cost < best.cost)
+                    best = axisBest[axis];
+        }
+        else {
+            for (int axis = 0; axis < 3; ++axis)
+                sweep(data->events[axis].begin(), data->events[axis].size(), (int)numTriangles,
+                    builderNode->bounds, axis, best);
+        }
+
+        assert(best.dir != -1);
+    }
+
+    // If the minimum split cost is greater than the cost of not splitting, don't split
+    if (best.dir == -1 || best.cost > k_intersect * costTriangles((int)numTriangles)) {
+        builderNode->numTriangles = (uint32_t)numTriangles;
+        builderNode->triangles = arena.alloc<uint32_t>(numTriangles);
+
+        memcpy(builderNode->triangles, data->triangles.begin(), numTriangles * sizeof(uint32_t));
+
+        delete data;
+        return;
+    }
+
+    float split = best.dist;
+    int dir = best.dir;
+
+    // Triangles which straddle a split are in both subtrees, so each worker needs its own
+    // scratch space. Small nodes never wait, so nothing else can use it until this node is
+    // finished with it. Large nodes wait for their parallel loops, and the worker may run
+    // another subtree in the meantime, so they have their own.
+    std::vector<uint8_t> nodeSide;
+    uint8_t *side;
+
+    if (parallel) {
+        nodeSide.resize(triangles.size());
+        side = nodeSide.data();
+    }
+    else
+        side = workerSide[TaskScheduler::getWorkerIndex()].data();
+
+    // Classify triangles with the same rule and bounds as KDBuilder::partition(), in chunks
+    // for large nodes. Each triangle is in a node once, so chunks never write the same entry.
+    int numChunks = parallel ? scheduler->getNumWorkers() * 4 : 1;
+
+    parallelFor(numChunks, [&](int chunk) {
+        size_t start = numTriangles * chunk / numChunks;
+        size_t end = numTriangles * (chunk + 1) / numChunks;
+
+        for (size_t j = start; j < end; j++) {
+            uint32_t i = data->triangles[j];
+
+            AABB box = getTriangleBounds(i, builderNode->bounds);
+
+            float min = box.min[dir];
+            float max = box.max[dir];
+
+            uint8_t s = 0;
+
+            if (min == split && max == split) {
+                if (best.planarMode == PLANAR_LEFT)
+                    s = SIDE_LEFT;
+                else if (best.planarMode == PLANAR_RIGHT)
+                    s = SIDE_RIGHT;
+                else
+                    s = SIDE_BOTH;
+            }
+            else {
+                if (min < split)
+                    s |= SIDE_LEFT;
+
+                if (max > split)
+                    s |= SIDE_RIGHT;
+            }
+
+            side[i] = s;
+        }
+    });
+
+    AABB leftBounds, rightBounds;
+    builderNode->bounds.split(split, dir, leftBounds, rightBounds);
+
+    KDBuilderNode *left = createNode(arena, builderNode->depth + 1, leftBounds);
+    KDBuilderNode *right = createNode(arena, builderNode->depth + 1, rightBounds);
+
+    builderNode->left = left;
+    builderNode->right = right;
+    builderNode->dir = dir;
+    builderNode->split = split;
+    builderNode->triangles = nullptr;
+    builderNode->numTriangles = 0;
+
+    KDPresortedSAHNode *leftData = new KDPresortedSAHNode();
+    KDPresortedSAHNode *rightData = new KDPresortedSAHNode();
+
+    // Task 3 splits the triangle list, and tasks 0 to 2 split the events along each axis. They
+    // write to different lists, so large nodes run them in parallel.
+    auto distribute = [&](int task) {
+        if (task == 3) {
+            for (uint32_t i : data->triangles) {
+                if (side[i] & SIDE_LEFT)
+                    leftData->triangles.push_back(i);
+
+                if (side[i] & SIDE_RIGHT)
+                    rightData->triangles.push_back(i);
+            }
+
+            return;
+        }
+
+        int axis = task;
+
+        // Bounds only change for triangles which straddle the split plane, so every other event
+        // keeps its position. Filtering keeps them sorted. Without clipping, straddling triangles
+        // are only clamped along the split axis, so the other axes can be filtered as well.
+        if (axis != dir && !clipTriangles) {
+            for (auto & event : data->events[axis]) {
+                uint8_t s = side[event.triangle];
+
+                if (s & SIDE_LEFT)
+                    leftData->events[axis].push_back(event);
+
+                if (s & SIDE_RIGHT)
+                    rightData->events[axis].push_back(event);
+            }
+
+            return;
+        }
+
+        util::vector<SAHEvent, 8> onlyLeft, onlyRight;
+
+        for (auto & event : data->events[axis]) {
+            uint8_t s = side[event.triangle];
+
+            if (s == SIDE_LEFT)
+                onlyLeft.push_back(event);
+            else if (s == SIDE_RIGHT)
+                onlyRight.push_back(event);
+        }
+
+        // Clamp or clip straddling triangles to the child bounds, and merge them back in
+        util::vector<SAHEvent, 8> straddleLeft, straddleRight;
+
+        for (uint32_t i : data->triangles) {
+            if (side[i] == SIDE_BOTH) {
+                addEvents(i, axis, left->bounds, straddleLeft);
+                addEvents(i, axis, right->bounds, straddleRight);
+            }
+        }
+
+        std::sort(straddleLeft.begin(), straddleLeft.end(), compareEvent);
+        std::sort(straddleRight.begin(), straddleRight.end(), compareEvent);
+
+        mergeEvents(onlyLeft, straddleLeft, leftData->events[axis]);
+        mergeEvents(onlyRight, straddleRight, rightData->events[axis]);
+    };
+
+    if (parallel)
+        parallelFor(4, distribute);
+    else {
+        for (int task = 0; task < 4; task++)
+            distribute(task);
+    }
+
+    delete data;
+
+    // Leave large left subtrees for another worker to steal
+    if (leftData->triangles.size() >= KD_SERIAL_SUBTREE_TRIANGLES) {
+        scheduler->spawn(group, [this, &group, left, leftData]() {
+            buildSubtree(group, left, leftData);
+        });
+    }
+    else
+        buildSubtree(group, left, leftData);
+
+    buildSubtree(group, right, rightData);
+}
+
+void KDPresortedSAHBuilder::buildTree(KDBuilderNode *root) {
+    uint32_t numTriangles = root->numTriangles;
+
+    KDPresortedSAHNode *data = new KDPresortedSAHNode();
+
+    data->triangles.reserve(numTriangles);
+
+    for (uint32_t i = 0; i < numTriangles; i++)
+        data->triangles.push_back_inbounds(root->triangles[i]);
+
+    // This is the only place events are sorted from scratch
+    parallelFor(3, [&](int axis) {
+        data->events[axis].reserve(numTriangles * 2);
+
+        for (uint32_t i = 0; i < numTriangles; i++)
+            addEvents(root->triangles[i], axis, root->bounds, data->events[axis]);
+
+        std::sort(data->events[axis].begin(), data->events[axis].end(), compareEvent);
+    });
+
+    workerSide.resize(scheduler->getNumWorkers());
+
+    for (auto & side : workerSide)
+        side.resize(triangles.size());
+
+    TaskGroup group;
+
+    buildSubtree(group, root, data);
+
+    scheduler->wait(group);
+
+    workerSide.clear();
+}
@@ -5,4 +5,115 @@
  */
 
 #include <kdtree/kdtree.h>
-#include <kdtree/kdtree.inl>
+#include <kdtree/kdkernels.h>
+#include <util/mappedfile.h>
+
+#include <cassert>
+#include <utility>
+
+KDTree::KDTree()
+    : root(nullptr),
+      mapping(nullptr),
+      mappingSize(0)
+{
+}
+
+KDTree::~KDTree() {
+    unmapFile(mapping, mappingSize);
+}
+
+void KDTree::swap(KDTree & other) {
+    // The roots point into the node arrays, which move with them
+    std::swap(root, other.root);
+    nodes.swap(other.nodes);
+    triangles.swap(other.triangles);
+    std::swap(bounds, other.bounds);
+    std::swap(mapping, other.mapping);
+    std::swap(mappingSize, other.mappingSize);
+}
+
+bool KDTree::intersect(const Ray & ray, float tmax, THREAD Collision & result) const {
+    return getKDKernels().intersect(*this, ray, tmax, result);
+}
+
+bool KDTree::intersectObserved(const Ray & ray, float tmax, THREAD Collision & result,
+    const KDAccessObserver & observer) const
+{
+    return getKDKernels().intersectObserved(*this, ray, tmax, result, observer);
+}
+
+template<unsigned int N>
+vector<bmask, N> KDTree::intersectPacket(
+    THREAD const vector<float, N> (&origin)[3],
+    THREAD const vector<float, N> (&direction)[3],
+    THREAD const vector<float, N> & maxDist,
+    bool occlusionOnly,
+    THREAD PacketCollision<N> & result,
+    THREAD KDLaneStats & laneStats) const
+{
+    KDIntersectPacketFunc<N> kernel = getKDKernels().template intersectPacket<N>();
+    assert(kernel && "Packet width not supported by the active kernels");
+
+    return kernel(*this, origin, direction, maxDist, occlusionOnly, result, laneStats);
+}
+
+bool KDTree::occluded(const Ray & ray, float max, THREAD unsigned int & occluder) const {
+    return getKDKernels().occluded(*this, ray, max, occluder);
+}
+
+template<unsigned int N>
+vector<bmask, N> KDTree::occludedPacket(
+    THREAD const vector<float, N> (&origin)[3],
+    THREAD const vector<float, N> (&direction)[3],
+    THREAD const vector<float, N> & maxDist,
+    THREAD vector<int, N> & occluder,
+    THREAD KDLaneStats & laneStats) const
+{
+    KDOccludedPacketFunc<N> kernel = getKDKernels().template occludedPacket<N>();
+    assert(kernel && "Packet width not supported by the active kernels");
+
+    return kernel(*this, origin, direction, maxDist, occluder, laneStats);
+}
+
+template<unsigned int N>
+void KDTree::intersectStream(
+    const KDRayStream & stream,
+    bool occlusionOnly,
+    KDStreamScratch & scratch,
+    bool *hit,
+    THREAD Collision *result,
+    THREAD KDLaneStats & laneStats) const
+{
+    KDIntersectStreamFunc<N> kernel = getKDKernels().template intersectStream<N>();
+    assert(kernel && "Stream width not supported by the active kernels");
+
+    kernel(*this, stream, occlusionOnly, scratch, hit, result, laneStats);
+}
+
+#define INSTANTIATE_INTERSECT(N) \
+    template vector<bmask, N> KDTree::intersectPacket<N>( \
+        THREAD const vector<float, N> (&origin)[3], \
+        THREAD const vector<float, N> (&direction)[3], \
+        THREAD const vector<float, N> & maxDist, \
+        bool occlusionOnly, \
+        THREAD PacketCollision<N> & result, \
+        THREAD KDLaneStats & laneStats) const; \
+    \
+    template vector<bmask, N> KDTree::occludedPacket<N>( \
+        THREAD const vector<float, N> (&origin)[3], \
+        THREAD const vector<float, N> (&direction)[3], \
+        THREAD const vector<float, N> & maxDist, \
+        THREAD vector<int, N> & occluder, \
+        THREAD KDLaneStats & laneStats) const; \
+    \
+    template void KDTree::intersectStream<N>( \
+        const KDRayStream & stream, \
+        bool occlusionOnly, \
+        KDStreamScratch & scratch, \
+        bool *hit, \
+        THREAD Collision *result, \
+        THREAD KDLaneStats & laneStats) const;
+
+INSTANTIATE_INTERSECT(4)
+INSTANTIATE_INTERSECT(8)
+INSTANTIATE_INTERSECT(16)
@@ -7,13 +7,182 @@
  */
 
 #include <core/raytracer.h>
-#include <util/imagedisplay.h>
+#include <kdtree/kdkernels.h>
+#include <util/imagewriter.h>
 #include <scenes/sponzascene.h>
 #include <scenes/simplescene.h>
 #include <scenes/cornellscene.h>
 
+#if !RT_HEADLESS
+#include <util/imagedisplay.h>
+#endif
+
+#include <chrono>
+#include <cstring>
+#include <string>
+
 extern void testVectors();
 
+void printStats(const RaytracerStats & stats) {
+    unsigned long longestName = 0;
+
+    for (int i = 0; i < RaytracerStatCount; i++)
+        longestName = max(strlen(RaytracerStatNames[i]), longestName);
+
+    for (int i = 0; i < RaytracerStatCount; i++) {
+        printf("%s:", RaytracerStatNames[i]);
+
+        int len = strlen(RaytracerStatNames[i]);
+
+        for (int j = 0; j < longestName - len; j++)
+            printf(" ");
+
+        printf("%16llu (%6.02f %%)\n", (unsigned long long)stats.stat[i],
+            (float)stats.stat[i] / (float)stats.stat[0] * 100);
+    }
+}
+
+/**
+ * @brief Total number of rays traced
+ */
+uint64_t totalRays(const RaytracerStats & stats) {
+    return stats.counter[RaytracerCounterPrimaryRays] +
+        stats.counter[RaytracerCounterSecondaryRays] +
+        stats.counter[RaytracerCounterShadowRays];
+}
+
+/**
+ * @brief Print ray counts and throughput, in total and for each worker thread
+ */
+void printThroughput(const RaytracerStats & stats, const std::vector<RaytracerStats> & threadStats, float elapsed)
+{
+    printf("\n%-16s %16s %10s\n", "Rays", "Count", "Mrays/s");
+
+    for (int i = RaytracerCounterPrimaryRays; i <= RaytracerCounterShadowRays; i++)
+        printf("%-16s %16llu %10.02f\n", RaytracerCounterNames[i], (unsigned long long)stats.counter[i],
+            (float)stats.counter[i] / elapsed / 1e6f);
+
+    uint64_t rays = totalRays(stats);
+    uint64_t leafTests = stats.counter[RaytracerCounterLeafTests];
+    uint64_t lanes = stats.counter[RaytracerCounterLanes];
+
+    printf("%-16s %16llu %10.02f\n", "Total", (unsigned long long)rays, (float)rays / elapsed / 1e6f);
+
+    // Lanes count as active while their rays still need the leaf's result
+    printf("\nPackets: %llu, streams: %llu, tiles: %llu\n",
+        (unsigned long long)stats.counter[RaytracerCounterPackets],
+        (unsigned long long)stats.counter[RaytracerCounterStreams],
+        (unsigned long long)stats.counter[RaytracerCounterTiles]);
+    printf("Leaf tests: %llu, active lanes: %llu of %llu (%.01f%% SIMD utilisation)\n",
+        (unsigned long long)leafTests, (unsigned long long)stats.counter[RaytracerCounterActiveLanes],
+        (unsigned long long)lanes,
+        lanes ? (float)stats.counter[RaytracerCounterActiveLanes] / (float)lanes * 100.0f : 0.0f);
+
+    printf("\n%-8s %16s %10s %8s\n", "Thread", "Rays", "Mrays/s", "Tiles");
+
+    for (int i = 0; i < threadStats.size(); i++) {
+        uint64_t threadRays = totalRays(threadStats[i]);
+
+        printf("%-8d %16llu %10.02f %8llu\n", i, (unsigned long long)threadRays,
+            (float)threadRays / elapsed / 1e6f, (unsigned long long)threadStats[i].counter[RaytracerCounterTiles]);
+    }
+}
+
+/**
+ * @brief Write statistics as JSON, for scripts that compare runs
+ */
+bool writeStatsJSON(const std::string & filename, const RaytracerStats & stats,
+    const std::vector<RaytracerStats> & threadStats, float elapsed, int simdWidth)
+{
+    FILE *file = fopen(filename.c_str(), "w");
+
+    if (!file) {
+        printf("Error opening %s\n", filename.c_str());
+        return false;
+    }
+
+    auto writeStats = [&](const RaytracerStats & s, const char *indent) {
+        fprintf(file, "%s\"cycles\": {\n", indent);
+
+        for (int i = 0; i < RaytracerStatCount; i++)
+            fprintf(file, "%s    \"%s\": %llu%s\n", indent, RaytracerStatNames[i], (unsigned long long)s.stat[i],
+                i < RaytracerStatCount - 1 ? "," : "");
+
+        fprintf(file, "%s},\n", indent);
+        fprintf(file, "%s\"counters\": {\n", indent);
+
+        for (int i = 0; i < RaytracerCounterCount; i++)
+            fprintf(file, "%s    \"%s\": %llu,\n", indent, RaytracerCounterNames[i],
+                (unsigned long long)s.counter[i]);
+
+        fprintf(file, "%s    \"Mrays/s\": %f\n", indent, (float)totalRays(s) / elapsed / 1e6f);
+        fprintf(file, "%s}\n", indent);
+    };
+
+    fprintf(file, "{\n");
+    fprintf(file, "    \"seconds\": %f,\n", elapsed);
+    fprintf(file, "    \"simd\": %d,\n", simdWidth);
+    fprintf(file, "    \"isa\": \"%s\",\n", KDKernelISANames[getKDKernels().isa]);
+    fprintf(file, "    \"total\": {\n");
+    writeStats(stats, "        ");
+    fprintf(file, "    },\n");
+    fprintf(file, "    \"threads\": [\n");
+
+    for (int i = 0; i < threadStats.size(); i++) {
+        fprintf(file, "        {\n");
+        writeStats(threadStats[i], "            ");
+        fprintf(file, "        }%s\n", i < threadStats.size() - 1 ? "," : "");
+    }
+
+    fprintf(file, "    ]\n");
+    fprintf(file, "}\n");
+
+    fclose(file);
+
+    return true;
+}
+
+/**
+ * @brief Print timing and statistics for a finished render, and save the output image if
+ * requested
+ */
+bool finishRender(Raytracer *rt, Timer & timer, Image<float, 4> *output, const std::string & outputFile,
+    const std::string & statsFile)
+{
+    // TODO: Move into raytracer itself
+    float elapsed = (float)timer.getElapsedMilliseconds() / 1000.0f;
+    float cpu     = (float)timer.getCPUTime() / 1000.0f;
+
+    printf("Done: %f seconds (total), %f seconds (CPU), speedup: %.02f\n",
+        elapsed, cpu, cpu / elapsed);
+
+    RaytracerStats stats;
+    std::vector<RaytracerStats> threadStats;
+    rt->shutdown(true, &stats, &threadStats);
+
+    // Throughput is measured over rendering only, not loading and building the tree
+    float renderSeconds = rt->getRenderSeconds();
+
+    printStats(stats);
+    printThroughput(stats, threadStats, renderSeconds);
+
+    if (statsFile != "") {
+        printf("Writing %s\n", statsFile.c_str());
+
+        if (!writeStatsJSON(statsFile, stats, threadStats, renderSeconds, rt->getSIMDWidth()))
+            return false;
+    }
+
+    if (outputFile != "") {
+        printf("Writing %s\n", outputFile.c_str());
+
+        if (!ImageWriter::write(outputFile, output))
+            return false;
+    }
+
+    return true;
+}
+
 int main(int argc, char *argv[]) {
     RaytracerSettings settings;
     settings.width = 1920;
@@ -23,15 +192,38 @@ int main(int argc, char *argv[]) {
 	settings.maxDepth = 20;
 
     int sceneIndex = 0;
+    std::string outputFile = "";
+    std::string statsFile = "";
+    bool compareBuilders = false;
+    bool benchmarkTraversal = false;
+
+#if RT_HEADLESS
+    bool headless = true;
+#else
+    bool headless = false;
+#endif
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             printf("Usage: %s [--width <width>] [--height <height>] [--samples <samples>] [--scene <scene>]\n", argv[0]);
+            printf("          [--seed <seed>] [--sampler <random|sobol|pmj02>] [--headless] [--output <file>]\n");
+            printf("          [--threads <threads>] [--tile-size <size>] [--tile-order <scanline|morton|hilbert>]\n");
+            printf("          [--pin-threads] [--passes <passes>] [--adaptive-passes <passes>]\n");
+            printf("          [--adaptive-threshold <error>] [--adaptive-budget <fraction>]\n");
+            printf("          [--wave-size <paths>] [--stats <file.json>]\n");
+            printf("          [--kd-builder <median|sah|presorted-sah|binned-sah>] [--kd-exact-threshold <triangles>]\n");
+            printf("          [--kd-clip] [--kd-block-cost] [--kd-traversal-cost <cost>] [--kd-intersect-cost <cost>]\n");
+            printf("          [--kd-max-depth <depth>] [--kd-leaf-triangles <triangles>] [--kd-autotune]\n");
+            printf("          [--kd-progressive] [--kd-cache <directory>] [--compare-kd-builders]\n");
+            printf("          [--benchmark-kd-traversal] [--simd-width <4|8|16>] [--isa <sse4.2|avx2|avx512>]\n");
+            printf("          [--stream-traversal] [--no-occlusion-queries]\n");
             printf("\n");
             printf("Scenes:\n");
             printf("    0: Sponza\n");
             printf("    1: Simple\n");
             printf("    2: Cornell\n");
+            printf("\n");
+            printf("Output formats (by extension): .pfm, .exr, .png\n");
             return 0;
         }
         else if (strcmp(argv[i], "--width") == 0)
@@ -42,12 +234,145 @@ int main(int argc, char *argv[]) {
             settings.pixelSamples = atoi(argv[++i]);
         else if (strcmp(argv[i], "--scene") == 0)
             sceneIndex = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0)
+            settings.seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--sampler") == 0) {
+            const char *name = argv[++i];
+            int type = 0;
+
+            while (type < SampleGeneratorTypeCount && strcmp(name, SampleGeneratorTypeNames[type]) != 0)
+                type++;
+
+            if (type == SampleGeneratorTypeCount) {
+                printf("Unknown sampler '%s'\n", name);
+                return 1;
+            }
+
+            settings.sampler = (SampleGeneratorType)type;
+        }
+        else if (strcmp(argv[i], "--passes") == 0)
+            settings.numPasses = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--adaptive-passes") == 0)
+            settings.adaptivePasses = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--adaptive-threshold") == 0)
+            settings.adaptiveThreshold = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--adaptive-budget") == 0)
+            settings.adaptiveBudget = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0)
+            settings.numThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--tile-size") == 0)
+            settings.tileSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--wave-size") == 0)
+            settings.waveSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--tile-order") == 0) {
+            const char *name = argv[++i];
+            int order = 0;
+
+            while (order < TileOrderCount && strcmp(name, TileOrderNames[order]) != 0)
+                order++;
+
+            if (order == TileOrderCount) {
+                printf("Unknown tile order '%s'\n", name);
+                return 1;
+            }
+
+            settings.tileOrder = (TileOrder)order;
+        }
+        else if (strcmp(argv[i], "--kd-builder") == 0) {
+            const char *name = argv[++i];
+            int type = 0;
+
+            while (type < KDBuilderTypeCount && strcmp(name, KDBuilderTypeNames[type]) != 0)
+                type++;
+
+            if (type == KDBuilderTypeCount) {
+                printf("Unknown KD-tree builder '%s'\n", name);
+                return 1;
+            }
+
+            settings.kdBuilder = (KDBuilderType)type;
+        }
+        else if (strcmp(argv[i], "--kd-exact-threshold") == 0)
+            settings.kdParams.exactThreshold = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--kd-clip") == 0)
+            settings.kdParams.clip = true;
+        else if (strcmp(argv[i], "--kd-block-cost") == 0)
+            settings.kdParams.blockCost = true;
+        else if (strcmp(argv[i], "--kd-traversal-cost") == 0)
+            settings.kdParams.traversalCost = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--kd-intersect-cost") == 0)
+            settings.kdParams.intersectCost = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--kd-max-depth") == 0)
+            settings.kdParams.maxDepth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--kd-leaf-triangles") == 0)
+            settings.kdParams.leafTriangles = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--kd-autotune") == 0)
+            settings.kdAutotune = true;
+        else if (strcmp(argv[i], "--kd-progressive") == 0)
+            settings.kdProgressive = true;
+        else if (strcmp(argv[i], "--kd-cache") == 0)
+            settings.kdCacheDir = argv[++i];
+        else if (strcmp(argv[i], "--compare-kd-builders") == 0)
+            compareBuilders = true;
+        else if (strcmp(argv[i], "--benchmark-kd-traversal") == 0)
+            benchmarkTraversal = true;
+        else if (strcmp(argv[i], "--simd-width") == 0) {
+            int width = atoi(argv[++i]);
+
+            if (width != 4 && width != 8 && width != 16) {
+                printf("Unsupported SIMD width %d\n", width);
+                return 1;
+            }
+
+            settings.simdWidth = width;
+        }
+        else if (strcmp(argv[i], "--stream-traversal") == 0)
+            settings.streamTraversal = true;
+        else if (strcmp(argv[i], "--no-occlusion-queries") == 0)
+            settings.occlusionQueries = false;
+        else if (strcmp(argv[i], "--isa") == 0) {
+            const char *name = argv[++i];
+            int isa = 0;
+
+            while (isa < KDKernelISACount && strcmp(name, KDKernelISANames[isa]) != 0)
+                isa++;
+
+            if (isa == KDKernelISACount) {
+                printf("Unknown instruction set '%s'\n", name);
+                return 1;
+            }
+
+            if (!isKDKernelISASupported((KDKernelISA)isa)) {
+                printf("Instruction set '%s' is not supported by this CPU\n", name);
+                return 1;
+            }
+
+            setKDKernelISA((KDKernelISA)isa);
+        }
+        else if (strcmp(argv[i], "--pin-threads") == 0)
+            settings.pinThreads = true;
+        else if (strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if (strcmp(argv[i], "--output") == 0)
+            outputFile = argv[++i];
+        else if (strcmp(argv[i], "--stats") == 0)
+            statsFile = argv[++i];
         else {
             printf("Unknown argument '%s'\n", argv[i]);
             return 1;
         }
     }
 
+    // The kernels are only known once --isa has been seen
+    if (settings.simdWidth > getKDKernels().maxWidth) {
+        printf("SIMD width %d is not supported by the %s kernels, which support widths up to %d\n",
+            settings.simdWidth, KDKernelISANames[getKDKernels().isa], getKDKernels().maxWidth);
+        return 1;
+    }
+
+    printf("Using %s traversal kernels (best supported: %s)\n", KDKernelISANames[getKDKernels().isa],
+        KDKernelISANames[getBestKDKernelISA()]);
+
     #ifndef NDEBUG
     printf("DEBUG build\n");
 #else
@@ -78,7 +403,59 @@ int main(int argc, char *argv[]) {
     //printf("%lu polygons, %lu lights\n", scene->getTriangles().size(), scene->getNumLights());
 
     auto rt = new Raytracer(settings, scene, output);
-	auto disp = new ImageDisplay(settings.width, settings.height, output);
+
+    if (compareBuilders) {
+        rt->compareKDBuilders({ KDBuilderTypeSAH, KDBuilderTypePresortedSAH, KDBuilderTypeBinnedSAH });
+
+        delete rt;
+
+        return 0;
+    }
+
+    if (benchmarkTraversal) {
+        rt->benchmarkKDTraversal();
+
+        delete rt;
+
+        return 0;
+    }
+
+    if (headless) {
+        if (outputFile == "")
+            printf("Warning: rendering headless without --output\n");
+
+        printf("Rendering\n");
+
+        Timer timer;
+        timer.reset();
+
+        rt->render();
+
+        int passesReported = 0;
+
+        while (!rt->finished()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+            int passes = rt->getPassesCompleted();
+
+            // Adaptive passes may stop early, so the total is only an upper bound
+            if (passes != passesReported && passes < settings.numPasses + settings.adaptivePasses) {
+                printf("Pass %d/%d: %f seconds\n", passes, settings.numPasses + settings.adaptivePasses,
+                    (float)timer.getElapsedMilliseconds() / 1000.0f);
+
+                passesReported = passes;
+            }
+        }
+
+        return finishRender(rt, timer, output, outputFile, statsFile) ? 0 : 1;
+    }
+
+#if !RT_HEADLESS
+	// The display shows snapshots of the output, so it never sees a partially updated tile
+	auto displayImage = new Image<float, 4>(settings.width, settings.height);
+	displayImage->clear();
+
+	auto disp = new ImageDisplay(settings.width, settings.height, displayImage);
 
     printf("Rendering\n");
 
@@ -99,6 +476,7 @@ int main(int argc, char *argv[]) {
     bool finished = false;
 
     while (!disp->shouldClose()) {
+        rt->snapshot(displayImage);
         disp->refresh();
         disp->swap();
 
@@ -115,37 +493,13 @@ int main(int argc, char *argv[]) {
 
         if (!finished && rt->finished()) {
             finished = true;
-            
-            // TODO: Move into raytracer itself
-            float elapsed = (float)timer.getElapsedMilliseconds() / 1000.0f;
-            float cpu     = (float)timer.getCPUTime() / 1000.0f;
-
-            printf("Done: %f seconds (total), %f seconds (CPU), speedup: %.02f\n",
-                elapsed, cpu, cpu / elapsed);
-
-			RaytracerStats stats;
-			rt->shutdown(true, &stats);
-
-			unsigned long longestName = 0;
-
-			for (int i = 0; i < RaytracerStatCount; i++)
-				longestName = max(strlen(RaytracerStatNames[i]), longestName);
-
-			for (int i = 0; i < RaytracerStatCount; i++) {
-				printf("%s:", RaytracerStatNames[i]);
-
-				int len = strlen(RaytracerStatNames[i]);
-
-				for (int j = 0; j < longestName - len; j++)
-					printf(" ");
-
-				printf("%16llu (%6.02f %%)\n", stats.stat[i], (float)stats.stat[i] / (float)stats.stat[0] * 100);
-			}
+            finishRender(rt, timer, output, outputFile, statsFile);
         }
     }
 
 	if (!finished)
 		rt->shutdown(false);
+#endif
 
     return 0;
 }
@@ -0,0 +1,43 @@
+/**
+ * @file util/affinity.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <util/affinity.h>
+
+#include <thread>
+
+#if defined(__APPLE__)
+    #include <mach/mach.h>
+    #include <mach/thread_policy.h>
+#elif defined(__linux__)
+    #include <pthread.h>
+    #include <sched.h>
+#elif defined(_WIN32)
+    #include <Windows.h>
+#endif
+
+bool pinCurrentThread(int cpu) {
+    int numCPUs = std::thread::hardware_concurrency();
+
+    if (numCPUs > 0)
+        cpu %= numCPUs;
+
+#if defined(__APPLE__)
+    thread_affinity_policy_data_t policy = { cpu + 1 };
+
+    return thread_policy_set(mach_thread_self(), THREAD_AFFINITY_POLICY,
+        (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT) == KERN_SUCCESS;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+#elif defined(_WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+    return false;
+#endif
+}
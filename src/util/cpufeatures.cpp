@@ -0,0 +1,82 @@
+/**
+ * @file util/cpufeatures.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <util/cpufeatures.h>
+
+#if defined(_WIN32)
+    #include <intrin.h>
+    #include <immintrin.h>
+#else
+    #include <cpuid.h>
+#endif
+
+/**
+ * @brief Execute CPUID, storing EAX, EBX, ECX and EDX in regs
+ */
+static void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4]) {
+#if defined(_WIN32)
+    __cpuidex((int *)regs, leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/**
+ * @brief Read XCR0, which says which register states the OS saves on context switches. Only
+ * valid if CPUID reports OSXSAVE.
+ */
+static unsigned long long xgetbv0() {
+#if defined(_WIN32)
+    return _xgetbv(0);
+#else
+    unsigned int lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+static CPUFeatures detectCPUFeatures() {
+    CPUFeatures features = {};
+    unsigned int regs[4];
+
+    cpuid(0, 0, regs);
+    unsigned int maxLeaf = regs[0];
+
+    if (maxLeaf < 1)
+        return features;
+
+    cpuid(1, 0, regs);
+    bool sse42   = (regs[2] & (1 << 20)) != 0;
+    bool fma     = (regs[2] & (1 << 12)) != 0;
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    bool avx     = (regs[2] & (1 << 28)) != 0;
+
+    bool avx2 = false, avx512f = false;
+
+    if (maxLeaf >= 7) {
+        cpuid(7, 0, regs);
+        avx2    = (regs[1] & (1 << 5)) != 0;
+        avx512f = (regs[1] & (1 << 16)) != 0;
+    }
+
+    // XMM and YMM state for AVX, plus opmask and both halves of ZMM state for AVX-512
+    unsigned long long xcr0 = osxsave ? xgetbv0() : 0;
+    bool ymmState = (xcr0 & 0x06) == 0x06;
+    bool zmmState = (xcr0 & 0xE6) == 0xE6;
+
+    features.sse42   = sse42;
+    features.avx     = avx && ymmState;
+    features.avx2    = features.avx && avx2;
+    features.fma     = features.avx && fma;
+    features.avx512f = features.avx2 && avx512f && zmmState;
+
+    return features;
+}
+
+const CPUFeatures & getCPUFeatures() {
+    static const CPUFeatures features = detectCPUFeatures();
+    return features;
+}
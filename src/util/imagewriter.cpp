@@ -0,0 +1,311 @@
+/**
+ * @file util/imagewriter.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <util/imagewriter.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+
+// Note: All of the formats below are written assuming a little endian host
+
+namespace ImageWriter {
+
+/**
+ * @brief Get the lowercase extension of a filename, without the dot
+ */
+static std::string getExtension(const std::string & filename) {
+    size_t dot = filename.find_last_of('.');
+
+    if (dot == std::string::npos)
+        return "";
+
+    std::string ext = filename.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+    return ext;
+}
+
+template<typename T>
+static void writeValue(std::vector<uint8_t> & out, T value) {
+    const uint8_t *bytes = (const uint8_t *)&value;
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+static void writeBigEndian32(std::vector<uint8_t> & out, uint32_t value) {
+    out.push_back((value >> 24) & 0xFF);
+    out.push_back((value >> 16) & 0xFF);
+    out.push_back((value >>  8) & 0xFF);
+    out.push_back((value >>  0) & 0xFF);
+}
+
+static void writeString(std::vector<uint8_t> & out, const char *str) {
+    do {
+        out.push_back(*str);
+    } while (*str++);
+}
+
+/**
+ * @brief Encode a portable float map. Rows are stored bottom to top, like the image, whose row 0
+ * is the bottom of the frame.
+ */
+static void encodePFM(const Image<float, 4> *image, std::vector<uint8_t> & out) {
+    int width = image->getWidth();
+    int height = image->getHeight();
+
+    std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    out.insert(out.end(), header.begin(), header.end());
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float4 pixel = image->getPixel(x, y);
+
+            writeValue(out, pixel.x);
+            writeValue(out, pixel.y);
+            writeValue(out, pixel.z);
+        }
+    }
+}
+
+/**
+ * @brief Write an OpenEXR attribute header: name, type name, and value size
+ */
+static void writeEXRAttribute(std::vector<uint8_t> & out, const char *name, const char *type, int32_t size) {
+    writeString(out, name);
+    writeString(out, type);
+    writeValue(out, size);
+}
+
+/**
+ * @brief Encode a single part, scanline, uncompressed OpenEXR image with 32-bit float
+ * R, G, and B channels
+ */
+static void encodeEXR(const Image<float, 4> *image, std::vector<uint8_t> & out) {
+    int32_t width = image->getWidth();
+    int32_t height = image->getHeight();
+
+    // Magic number and version 2, single part scanline
+    writeValue(out, (int32_t)20000630);
+    writeValue(out, (int32_t)2);
+
+    // Channels must be listed in alphabetical order
+    const char *channels[3] = { "B", "G", "R" };
+
+    writeEXRAttribute(out, "channels", "chlist", 3 * 18 + 1);
+
+    for (int i = 0; i < 3; i++) {
+        writeString(out, channels[i]);
+        writeValue(out, (int32_t)2); // FLOAT
+        writeValue(out, (int32_t)0); // pLinear and reserved
+        writeValue(out, (int32_t)1); // xSampling
+        writeValue(out, (int32_t)1); // ySampling
+    }
+
+    out.push_back(0);
+
+    writeEXRAttribute(out, "compression", "compression", 1);
+    out.push_back(0); // NO_COMPRESSION
+
+    for (const char *window : { "dataWindow", "displayWindow" }) {
+        writeEXRAttribute(out, window, "box2i", 16);
+        writeValue(out, (int32_t)0);
+        writeValue(out, (int32_t)0);
+        writeValue(out, width - 1);
+        writeValue(out, height - 1);
+    }
+
+    writeEXRAttribute(out, "lineOrder", "lineOrder", 1);
+    out.push_back(0); // INCREASING_Y
+
+    writeEXRAttribute(out, "pixelAspectRatio", "float", 4);
+    writeValue(out, 1.0f);
+
+    writeEXRAttribute(out, "screenWindowCenter", "v2f", 8);
+    writeValue(out, 0.0f);
+    writeValue(out, 0.0f);
+
+    writeEXRAttribute(out, "screenWindowWidth", "float", 4);
+    writeValue(out, 1.0f);
+
+    out.push_back(0);
+
+    // Scanline offset table, followed by one block per scanline: Y coordinate, data size,
+    // and then each channel's values for the whole scanline. Scanlines run top to bottom, and
+    // the image's row 0 is the bottom of the frame.
+    int32_t lineSize = width * 3 * sizeof(float);
+    uint64_t offset = out.size() + height * sizeof(uint64_t);
+
+    for (int32_t y = 0; y < height; y++) {
+        writeValue(out, offset);
+        offset += 2 * sizeof(int32_t) + lineSize;
+    }
+
+    for (int32_t line = 0; line < height; line++) {
+        int32_t y = height - 1 - line;
+
+        writeValue(out, line);
+        writeValue(out, lineSize);
+
+        for (int c = 2; c >= 0; c--)
+            for (int32_t x = 0; x < width; x++)
+                writeValue(out, image->getPixel(x, y)[c]);
+    }
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static bool tableInitialized = false;
+
+    if (!tableInitialized) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+
+            table[i] = c;
+        }
+
+        tableInitialized = true;
+    }
+
+    crc = ~crc;
+
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static void writePNGChunk(std::vector<uint8_t> & out, const char *type, const std::vector<uint8_t> & data) {
+    writeBigEndian32(out, (uint32_t)data.size());
+
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+
+    writeBigEndian32(out, crc32(&out[start], out.size() - start));
+}
+
+/**
+ * @brief Convert a linear value to an 8-bit sRGB encoded value
+ */
+static uint8_t toSRGB8(float linear) {
+    linear = saturate(linear);
+
+    float srgb = linear <= 0.0031308f ?
+        12.92f * linear :
+        1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+
+    return (uint8_t)(srgb * 255.0f + 0.5f);
+}
+
+/**
+ * @brief Encode an 8-bit RGB PNG. The image data is stored with uncompressed deflate blocks,
+ * which avoids a dependency on zlib at the cost of larger files.
+ */
+static void encodePNG(const Image<float, 4> *image, std::vector<uint8_t> & out) {
+    int width = image->getWidth();
+    int height = image->getHeight();
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out.insert(out.end(), signature, signature + 8);
+
+    std::vector<uint8_t> header;
+    writeBigEndian32(header, width);
+    writeBigEndian32(header, height);
+    header.push_back(8); // Bit depth
+    header.push_back(2); // Color type: RGB
+    header.push_back(0); // Compression: deflate
+    header.push_back(0); // Filter: adaptive
+    header.push_back(0); // Interlace: none
+
+    writePNGChunk(out, "IHDR", header);
+
+    // Each scanline starts with a filter type byte. Scanlines run top to bottom, and the image's
+    // row 0 is the bottom of the frame.
+    std::vector<uint8_t> raw;
+    raw.reserve((size_t)height * (width * 3 + 1));
+
+    for (int y = height - 1; y >= 0; y--) {
+        raw.push_back(0);
+
+        for (int x = 0; x < width; x++) {
+            float4 pixel = image->getPixel(x, y);
+
+            raw.push_back(toSRGB8(pixel.x));
+            raw.push_back(toSRGB8(pixel.y));
+            raw.push_back(toSRGB8(pixel.z));
+        }
+    }
+
+    // zlib stream of stored deflate blocks, followed by an Adler-32 checksum
+    std::vector<uint8_t> zlib;
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+
+    size_t pos = 0;
+
+    do {
+        uint16_t len = (uint16_t)std::min(raw.size() - pos, (size_t)65535);
+        bool final = pos + len == raw.size();
+
+        zlib.push_back(final ? 1 : 0);
+        writeValue(zlib, len);
+        writeValue(zlib, (uint16_t)~len);
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+
+        pos += len;
+    } while (pos < raw.size());
+
+    uint32_t a = 1, b = 0;
+
+    for (uint8_t byte : raw) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+
+    writeBigEndian32(zlib, (b << 16) | a);
+
+    writePNGChunk(out, "IDAT", zlib);
+    writePNGChunk(out, "IEND", std::vector<uint8_t>());
+}
+
+bool write(std::string filename, const Image<float, 4> *image) {
+    std::string ext = getExtension(filename);
+    std::vector<uint8_t> data;
+
+    if (ext == "pfm")
+        encodePFM(image, data);
+    else if (ext == "exr")
+        encodeEXR(image, data);
+    else if (ext == "png")
+        encodePNG(image, data);
+    else {
+        std::cout << "Unknown image format '" << ext << "' for '" << filename << "'" << std::endl;
+        return false;
+    }
+
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+
+    if (!file) {
+        std::cout << "Error opening '" << filename << "'" << std::endl;
+        return false;
+    }
+
+    file.write((const char *)&data[0], data.size());
+
+    if (!file) {
+        std::cout << "Error writing '" << filename << "'" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+}
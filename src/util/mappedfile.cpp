@@ -0,0 +1,85 @@
+/**
+ * @file util/mappedfile.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <util/mappedfile.h>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #include <Windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+void *mapFile(const std::string & path, size_t & size) {
+    size = 0;
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER fileSize;
+
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+
+    if (!mapping)
+        return nullptr;
+
+    // The view keeps the mapping alive
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+
+    if (!data)
+        return nullptr;
+
+    size = (size_t)fileSize.QuadPart;
+    return data;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        return nullptr;
+
+    struct stat info;
+
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    // The mapping keeps the file open
+    void *data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    size = (size_t)info.st_size;
+    return data;
+#endif
+}
+
+void unmapFile(void *data, size_t size) {
+    if (!data)
+        return;
+
+#if defined(_WIN32)
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
@@ -0,0 +1,181 @@
+/**
+ * @file util/taskscheduler.cpp
+ *
+ * @author Sean James <seanjames777@gmail.com>
+ */
+
+#include <util/taskscheduler.h>
+
+#include <cassert>
+#include <new>
+
+// Index of the worker running on this thread
+static thread_local int workerIndex = -1;
+
+TaskScheduler::TaskScheduler(int numWorkers)
+    : numWorkers(numWorkers),
+      numQueued(0),
+      numSteals(0),
+      done(false)
+{
+    queues = (WorkerQueue *)aligned_alloc(sizeof(WorkerQueue) * numWorkers, CACHE_LINE);
+
+    for (int i = 0; i < numWorkers; i++)
+        new (&queues[i]) WorkerQueue();
+}
+
+TaskScheduler::~TaskScheduler() {
+    for (int i = 0; i < numWorkers; i++)
+        queues[i].~WorkerQueue();
+
+    aligned_free(queues);
+}
+
+int TaskScheduler::getWorkerIndex() {
+    return workerIndex;
+}
+
+bool TaskScheduler::take(int worker, Task & task) {
+    if (numQueued == 0)
+        return false;
+
+    WorkerQueue & queue = queues[worker];
+
+    queue.lock.lock();
+
+    if (!queue.tasks.empty()) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        queue.lock.unlock();
+
+        numQueued--;
+        return true;
+    }
+
+    queue.lock.unlock();
+
+    for (int i = 1; i < numWorkers; i++) {
+        WorkerQueue & victim = queues[(worker + i) % numWorkers];
+
+        victim.lock.lock();
+
+        if (victim.tasks.empty()) {
+            victim.lock.unlock();
+            continue;
+        }
+
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        victim.lock.unlock();
+
+        numQueued--;
+        numSteals++;
+        return true;
+    }
+
+    return false;
+}
+
+void TaskScheduler::execute(Task & task) {
+    task.func();
+
+    // Note: The group may be destroyed as soon as this reaches zero
+    task.group->pending--;
+}
+
+void TaskScheduler::worker(int worker) {
+    workerIndex = worker;
+
+    Task task;
+
+    while (true) {
+        if (take(worker, task)) {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepLock);
+
+        sleepCond.wait(lock, [this]() -> bool {
+            return done || numQueued > 0;
+        });
+
+        if (done)
+            break;
+    }
+
+    workerIndex = -1;
+}
+
+void TaskScheduler::run(const std::function<void()> & func) {
+    done = false;
+
+    for (int i = 1; i < numWorkers; i++)
+        threads.push_back(std::thread(std::bind(&TaskScheduler::worker, this, i)));
+
+    workerIndex = 0;
+    func();
+    workerIndex = -1;
+
+    sleepLock.lock();
+    done = true;
+    sleepLock.unlock();
+    sleepCond.notify_all();
+
+    for (auto & thread : threads)
+        thread.join();
+
+    threads.clear();
+}
+
+void TaskScheduler::spawn(TaskGroup & group, const std::function<void()> & func) {
+    int worker = workerIndex;
+    assert(worker >= 0);
+
+    group.pending++;
+
+    Task task;
+    task.func = func;
+    task.group = &group;
+
+    WorkerQueue & queue = queues[worker];
+
+    queue.lock.lock();
+    queue.tasks.push_back(std::move(task));
+    queue.lock.unlock();
+
+    // Take the sleep lock so that a worker can't miss the wakeup between checking numQueued
+    // and going to sleep
+    sleepLock.lock();
+    numQueued++;
+    sleepLock.unlock();
+    sleepCond.notify_one();
+}
+
+void TaskScheduler::wait(TaskGroup & group) {
+    int worker = workerIndex;
+    assert(worker >= 0);
+
+    Task task;
+
+    // The tasks we are waiting for may be running on other workers, which have nothing left
+    // for us to steal. Their subtasks can still show up, so keep looking instead of sleeping.
+    while (group.pending > 0) {
+        if (take(worker, task))
+            execute(task);
+        else
+            std::this_thread::yield();
+    }
+}
+
+void TaskScheduler::parallelFor(int count, const std::function<void(int)> & func) {
+    TaskGroup group;
+
+    for (int i = 1; i < count; i++)
+        spawn(group, [&func, i]() { func(i); });
+
+    if (count > 0)
+        func(0);
+
+    wait(group);
+}